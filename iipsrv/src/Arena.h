@@ -0,0 +1,92 @@
+// Monotonic allocator for per-request objects
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+
+#include <cstddef>
+#include <vector>
+
+
+/// Size of the memory block held within each arena
+#define ARENA_SIZE 4096
+
+/// Alignment of allocations - enough for any of our types
+#define ARENA_ALIGNMENT 16
+
+
+
+/// Memory for objects that live no longer than a single request
+/** Allocation simply advances a pointer through a block of memory held within the
+    arena itself, and reset() makes all of it available again for the next request.
+    Larger demands fall back to the heap. Nothing is freed individually: objects
+    placed in an arena must have their destructors called explicitly before reset().
+ */
+
+class Arena {
+
+ private:
+
+  alignas( ARENA_ALIGNMENT ) char block[ARENA_SIZE];
+  size_t used;
+
+  /// Heap allocations made once the block is full
+  std::vector<char*> overflow;
+
+  Arena( const Arena& );
+  Arena& operator=( const Arena& );
+
+
+ public:
+
+  /// Constructor
+  Arena() : used( 0 ) {};
+
+  /// Destructor
+  ~Arena(){ reset(); };
+
+  /// Allocate memory
+  /** @param size number of bytes
+      @return memory aligned to ARENA_ALIGNMENT
+   */
+  void* allocate( size_t size ){
+    size = ( size + ARENA_ALIGNMENT - 1 ) & ~( (size_t) ARENA_ALIGNMENT - 1 );
+    if( used + size <= ARENA_SIZE ){
+      void* p = block + used;
+      used += size;
+      return p;
+    }
+    char* p = new char[size];
+    overflow.push_back( p );
+    return p;
+  };
+
+  /// Release everything allocated so far
+  void reset(){
+    used = 0;
+    for( std::vector<char*>::iterator i = overflow.begin(); i != overflow.end(); i++ ) delete[] *i;
+    overflow.clear();
+  };
+
+};
+
+
+#endif
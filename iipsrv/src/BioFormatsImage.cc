@@ -1,7 +1,9 @@
 #include "BioFormatsImage.h"
 #include "Timer.h"
+#include "Trace.h"
 #include <cmath>
 #include <sstream>
+#include <mutex>
 
 #include <cstdlib>
 #include <cassert>
@@ -12,6 +14,7 @@
 using namespace std;
 
 extern std::ofstream logfile;
+extern std::mutex logfile_mutex;
 
 void BioFormatsImage::openImage() throw(file_error)
 {
@@ -39,6 +42,7 @@ void BioFormatsImage::openImage() throw(file_error)
   {
     string error = bfi.get_error();
 
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "ERROR: encountered error: " << error << " while opening " << filename << " with BioFormats: " << endl
             << flush;
     throw file_error(string("Error opening '" + filename + "' with BioFormats, error " + error));
@@ -112,6 +116,7 @@ void BioFormatsImage::loadImageInfo(int x, int y) throw(file_error)
   {
     string err = bfi.get_error();
 
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "ERROR: encountered error: " << err << " while getting level0 dim" << endl;
     throw file_error("Getting bioformats level0 dimensions: " + err);
   }
@@ -142,12 +147,14 @@ void BioFormatsImage::loadImageInfo(int x, int y) throw(file_error)
   {
     if (channels_internal > 0)
     {
+      lock_guard<mutex> lock( logfile_mutex );
       logfile << "Unimplemented: only support 3, 4 channels, not " << channels_internal << endl;
       throw file_error("Unimplemented: only support 3, 4 channels, not " + std::to_string(channels_internal));
     }
     else
     {
       string err = bfi.get_error();
+      lock_guard<mutex> lock( logfile_mutex );
       logfile << "Error while getting channel count: " << err << endl;
       throw file_error("Error while getting channel count: " + err);
     }
@@ -162,6 +169,7 @@ void BioFormatsImage::loadImageInfo(int x, int y) throw(file_error)
 
     /*To implement this, get8BitLookupTable() or get16BitLookupTable()
     and then read from there.*/
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "Unimplemented: False color image" << endl;
     throw file_error("Unimplemented: False color image");
   }
@@ -181,6 +189,7 @@ void BioFormatsImage::loadImageInfo(int x, int y) throw(file_error)
   if (bytespc_internal <= 0)
   {
     string err = bfi.get_error();
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "Error while getting bits per pixel: " << err << endl;
     throw file_error("Error while getting bits per pixel: " + err);
   }
@@ -203,6 +212,7 @@ void BioFormatsImage::loadImageInfo(int x, int y) throw(file_error)
   if (bioformats_levels <= 0)
   {
     string err = bfi.get_error();
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "ERROR: encountered error: " << err << " while getting level count" << endl;
     throw file_error("ERROR: encountered error: " + err + " while getting level count");
   }
@@ -225,6 +235,7 @@ void BioFormatsImage::loadImageInfo(int x, int y) throw(file_error)
 #endif
     if (ww <= 0 || hh <= 0)
     {
+      lock_guard<mutex> lock( logfile_mutex );
       logfile << "ERROR: encountered error: while getting level dims for level " << i << endl;
       throw file_error("error while getting level dims for level " + i);
     }
@@ -441,7 +452,8 @@ RawTilePtr BioFormatsImage::getCachedTile(const size_t tilex, const size_t tiley
   // check if cache has tile
   uint32_t osi_level = numResolutions - 1 - iipres;
   uint32_t tid = tiley * numTilesX[osi_level] + tilex;
-  RawTilePtr ttt = tileCache->getObject(TileCache::getIndex(getImagePath(), iipres, tid, 0, 0, UNCOMPRESSED, 0));
+  const TileKey key = TileCache::getIndex(getImageId(), iipres, tid, 0, 0, UNCOMPRESSED, 0);
+  RawTilePtr ttt = tileCache->getObject(key);
 
   // if cache has file, return it
   if (ttt)
@@ -459,20 +471,33 @@ RawTilePtr BioFormatsImage::getCachedTile(const size_t tilex, const size_t tiley
           << flush;
 #endif
 
-  // is this a native layer?
-  if (bioformats_downsample_in_level[osi_level] == 1)
+  // Concurrent requests for the same missing tile, such as the shared lower resolution
+  // tiles of neighbouring tiles being composed, wait for a single read or composition
+  return tileCache->getOrBuild(key, [&]() -> RawTilePtr
   {
-    // supported by native openslide layer
-    // tile manager will cache if needed
-    return getNativeTile(tilex, tiley, iipres);
-  }
-  else
-  {
-    // not supported by native openslide layer, so need to compose from next level up,
-    return halfsampleAndComposeTile(tilex, tiley, iipres);
+    // Time the read or composition, so that the cache can hold on to expensive tiles for longer
+    Timer build_timer;
+    build_timer.start();
+    RawTilePtr built;
 
-    // tile manager will cache this one.
-  }
+    // is this a native layer?
+    if (bioformats_downsample_in_level[osi_level] == 1)
+    {
+      // supported by native openslide layer
+      // tile manager will cache if needed
+      built = getNativeTile(tilex, tiley, iipres);
+    }
+    else
+    {
+      // not supported by native openslide layer, so need to compose from next level up,
+      built = halfsampleAndComposeTile(tilex, tiley, iipres);
+
+      // tile manager will cache this one.
+    }
+
+    if (built) built->cost = std::max(build_timer.getTime(), 1L);
+    return built;
+  });
 }
 
 #pragma GCC optimize("O3")
@@ -531,11 +556,13 @@ RawTilePtr BioFormatsImage::getNativeTile(const size_t tilex, const size_t tiley
   // compute the size, etc
   rt->dataLength = tw * th * channels * sizeof(unsigned char);
   rt->filename = getImagePath();
+  rt->imageId = getImageId();
   rt->timestamp = timestamp;
 
   if (bfi.set_current_resolution(bestLayer) < 0)
   {
     auto s = string("FATAL : bad resolution: " + std::to_string(bestLayer) + " rather than up to " + std::to_string(bfi.get_resolution_count() - 1));
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << s;
     throw file_error(s);
   }
@@ -631,6 +658,7 @@ RawTilePtr BioFormatsImage::getNativeTile(const size_t tilex, const size_t tiley
   if (bytes_received < 0)
   {
     string error = bfi.get_error();
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "ERROR: encountered error: " << error << " while reading region exact at  " << tx0 << "x" << ty0 << " dim " << tw << "x" << th << " with BioFormats: " << error << endl;
     throw file_error("ERROR: encountered error: " + error + " while reading region exact at " + std::to_string(tx0) + "x" + std::to_string(ty0) + " dim " + std::to_string(tw) + "x" + std::to_string(th) + " with BioFormats: " + error);
   }
@@ -841,6 +869,7 @@ RawTilePtr BioFormatsImage::getNativeTile(const size_t tilex, const size_t tiley
  */
 RawTilePtr BioFormatsImage::halfsampleAndComposeTile(const size_t tilex, const size_t tiley, const uint32_t iipres)
 {
+  TraceSpan span( "halfsample" );
   // not in cache and not a native tile, so create one from higher sampling.
 #ifdef DEBUG_OSI
   Timer timer;
@@ -882,6 +911,7 @@ RawTilePtr BioFormatsImage::halfsampleAndComposeTile(const size_t tilex, const s
   // compute the size, etc
   rt->dataLength = tw * th * 3;
   rt->filename = getImagePath();
+  rt->imageId = getImageId();
   rt->timestamp = timestamp;
 
   // new a block that is larger for openslide library to directly copy in.
@@ -1004,6 +1034,7 @@ void BioFormatsImage::halfsample_3(const uint8_t *in, const size_t in_w, const s
 
   if ((out_w == 0) || (out_h == 0))
   {
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "BioFormats :: halfsample_3() :: ERROR: zero output width or height " << endl
             << flush;
     return;
@@ -1011,6 +1042,7 @@ void BioFormatsImage::halfsample_3(const uint8_t *in, const size_t in_w, const s
 
   if (!(in))
   {
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "BioFormats :: halfsample_3() :: ERROR: null input " << endl
             << flush;
     return;
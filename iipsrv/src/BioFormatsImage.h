@@ -157,6 +157,14 @@ public:
 
   virtual void closeImage();
 
+  /// Return the memory held by the open image, including the buffer shared with the JVM
+  virtual size_t getMemorySize()
+  {
+    return IIPImage::getMemorySize() + bfi_communication_buffer_len +
+           (numTilesX.capacity() + numTilesY.capacity() + lastTileXDim.capacity() + lastTileYDim.capacity()) * sizeof(size_t) +
+           (bioformats_level_to_use.capacity() + bioformats_downsample_in_level.capacity()) * sizeof(int);
+  };
+
   /// Overloaded function for getting a particular tile
   /** \param x horizontal sequence angle
       \param y vertical sequence angle
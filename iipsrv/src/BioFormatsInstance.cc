@@ -4,6 +4,36 @@
 
 BioFormatsThread BioFormatsInstance::thread;
 
+// Worker thread attached to the JVM created by BioFormatsInstance::thread
+struct BioFormatsAttachedThread
+{
+  bfbridge_thread_t bfthread;
+
+  BioFormatsAttachedThread(bfbridge_vm_t *vm)
+  {
+    bfbridge_error_t *error = bfbridge_make_thread(&bfthread, vm);
+    if (error)
+    {
+      throw std::runtime_error("BioFormatsInstance.cc bfbridge_make_thread error: " + std::string(error->description));
+    }
+  }
+
+  ~BioFormatsAttachedThread()
+  {
+    bfbridge_free_thread(&bfthread);
+  }
+};
+
+bfbridge_thread_t *BioFormatsInstance::current_thread()
+{
+  if (std::this_thread::get_id() == thread.owner)
+  {
+    return &thread.bfthread;
+  }
+  static thread_local BioFormatsAttachedThread attached(&thread.bfvm);
+  return &attached.bfthread;
+}
+
 BioFormatsInstance::BioFormatsInstance()
 {
   // Expensive function being used from a header-only library.
@@ -11,7 +41,7 @@ BioFormatsInstance::BioFormatsInstance()
   bfbridge_error_t *error =
       bfbridge_make_instance(
           &bfinstance,
-          &thread.bfthread,
+          current_thread(),
           new char[bfi_communication_buffer_len],
           bfi_communication_buffer_len);
   if (error)
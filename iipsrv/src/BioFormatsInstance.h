@@ -34,6 +34,10 @@ public:
 
   bfbridge_instance_t bfinstance;
 
+  // JNI environment for the calling thread: the JVM's own thread,
+  // or one attached on first use by a worker thread
+  static bfbridge_thread_t *current_thread();
+
   BioFormatsInstance();
 
   // We want to keep alive 1 BioFormats instance
@@ -76,7 +80,7 @@ public:
       delete[] buffer;
     }
 
-    bfbridge_free_instance(&bfinstance, &thread.bfthread);
+    bfbridge_free_instance(&bfinstance, current_thread());
   }
 
   // changed ownership: user opened new file, etc.
@@ -86,7 +90,8 @@ public:
     cerr << "calling refresh\n";
 #endif
     // Here is an example of calling a method manually without the C wrapper
-    thread.bfthread.env->CallVoidMethod(bfinstance.bfbridge, thread.bfthread.BFClose);
+    bfbridge_thread_t *t = current_thread();
+    t->env->CallVoidMethod(bfinstance.bfbridge, t->BFClose);
 #ifdef OSI_DEBUG
     cerr << "called refresh\n";
 #endif
@@ -98,123 +103,123 @@ public:
     std::string err;
     char *buffer = communication_buffer();
     err.assign(communication_buffer(),
-               bf_get_error_length(&bfinstance, &thread.bfthread));
+               bf_get_error_length(&bfinstance, current_thread()));
     return err;
   }
 
   int is_compatible(std::string filepath)
   {
-    return bf_is_compatible(&bfinstance, &thread.bfthread, &filepath[0], filepath.length());
+    return bf_is_compatible(&bfinstance, current_thread(), &filepath[0], filepath.length());
   }
 
   int open(std::string filepath)
   {
-    return bf_open(&bfinstance, &thread.bfthread, &filepath[0], filepath.length());
+    return bf_open(&bfinstance, current_thread(), &filepath[0], filepath.length());
   }
 
   int close()
   {
-    return bf_close(&bfinstance, &thread.bfthread);
+    return bf_close(&bfinstance, current_thread());
   }
 
   int get_resolution_count()
   {
-    return bf_get_resolution_count(&bfinstance, &thread.bfthread);
+    return bf_get_resolution_count(&bfinstance, current_thread());
   }
 
   int set_current_resolution(int res)
   {
-    return bf_set_current_resolution(&bfinstance, &thread.bfthread, res);
+    return bf_set_current_resolution(&bfinstance, current_thread(), res);
   }
 
   int get_size_x()
   {
-    return bf_get_size_x(&bfinstance, &thread.bfthread);
+    return bf_get_size_x(&bfinstance, current_thread());
   }
 
   int get_size_y()
   {
-    return bf_get_size_y(&bfinstance, &thread.bfthread);
+    return bf_get_size_y(&bfinstance, current_thread());
   }
 
   int get_size_z()
   {
-    return bf_get_size_z(&bfinstance, &thread.bfthread);
+    return bf_get_size_z(&bfinstance, current_thread());
   }
 
   int get_size_c()
   {
-    return bf_get_size_c(&bfinstance, &thread.bfthread);
+    return bf_get_size_c(&bfinstance, current_thread());
   }
 
   int get_size_t()
   {
-    return bf_get_size_t(&bfinstance, &thread.bfthread);
+    return bf_get_size_t(&bfinstance, current_thread());
   }
 
   int get_effective_size_c()
   {
-    return bf_get_size_c(&bfinstance, &thread.bfthread);
+    return bf_get_size_c(&bfinstance, current_thread());
   }
 
   int get_optimal_tile_width()
   {
-    return bf_get_optimal_tile_width(&bfinstance, &thread.bfthread);
+    return bf_get_optimal_tile_width(&bfinstance, current_thread());
   }
 
   int get_optimal_tile_height()
   {
-    return bf_get_optimal_tile_height(&bfinstance, &thread.bfthread);
+    return bf_get_optimal_tile_height(&bfinstance, current_thread());
   }
 
   int get_pixel_type()
   {
-    return bf_get_pixel_type(&bfinstance, &thread.bfthread);
+    return bf_get_pixel_type(&bfinstance, current_thread());
   }
 
   int get_bytes_per_pixel()
   {
-    return bf_get_bytes_per_pixel(&bfinstance, &thread.bfthread);
+    return bf_get_bytes_per_pixel(&bfinstance, current_thread());
   }
 
   int get_rgb_channel_count()
   {
-    return bf_get_rgb_channel_count(&bfinstance, &thread.bfthread);
+    return bf_get_rgb_channel_count(&bfinstance, current_thread());
   }
 
   int get_image_count()
   {
-    return bf_get_rgb_channel_count(&bfinstance, &thread.bfthread);
+    return bf_get_rgb_channel_count(&bfinstance, current_thread());
   }
 
   int is_rgb()
   {
-    return bf_is_rgb(&bfinstance, &thread.bfthread);
+    return bf_is_rgb(&bfinstance, current_thread());
   }
 
   int is_interleaved()
   {
-    return bf_is_interleaved(&bfinstance, &thread.bfthread);
+    return bf_is_interleaved(&bfinstance, current_thread());
   }
 
   int is_little_endian()
   {
-    return bf_is_little_endian(&bfinstance, &thread.bfthread);
+    return bf_is_little_endian(&bfinstance, current_thread());
   }
 
   int is_false_color()
   {
-    return bf_is_false_color(&bfinstance, &thread.bfthread);
+    return bf_is_false_color(&bfinstance, current_thread());
   }
 
   int is_indexed_color()
   {
-    return bf_is_indexed_color(&bfinstance, &thread.bfthread);
+    return bf_is_indexed_color(&bfinstance, current_thread());
   }
 
   std::string get_dimension_order()
   {
-    int len = bf_get_dimension_order(&bfinstance, &thread.bfthread);
+    int len = bf_get_dimension_order(&bfinstance, current_thread());
     if (len < 0)
     {
       return "";
@@ -227,12 +232,12 @@ public:
 
   int is_order_certain()
   {
-    return bf_is_order_certain(&bfinstance, &thread.bfthread);
+    return bf_is_order_certain(&bfinstance, current_thread());
   }
 
   int open_bytes(int x, int y, int w, int h)
   {
-    return bf_open_bytes(&bfinstance, &thread.bfthread, 0, x, y, w, h);
+    return bf_open_bytes(&bfinstance, current_thread(), 0, x, y, w, h);
   }
 };
 
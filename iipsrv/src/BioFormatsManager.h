@@ -6,6 +6,7 @@
 #define BIOFORMATSMANAGER_H
 
 #include <vector>
+#include <mutex>
 #include "BioFormatsInstance.h"
 #include <stdio.h>
 
@@ -14,16 +15,22 @@ class BioFormatsManager
 private:
   static std::vector<BioFormatsInstance> free_list;
 
+  // Instances are taken and returned by several worker threads
+  static std::mutex free_list_mutex;
+
 public:
   // call me with std::move - I think?
   static void free(BioFormatsInstance &&graal_isolate)
   {
+    std::lock_guard<std::mutex> lock(free_list_mutex);
     free_list.push_back(std::move(graal_isolate));
     free_list.back().refresh();
   }
 
   static BioFormatsInstance get_new()
   {
+    std::lock_guard<std::mutex> lock(free_list_mutex);
+
     // Make a new one if needed
     if (free_list.size() == 0)
     {
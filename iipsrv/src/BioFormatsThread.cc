@@ -31,6 +31,8 @@ BioFormatsThread::BioFormatsThread()
     throw std::runtime_error("BioFormatsThread.cc bfbridge_make_vm error: \n" + std::string(error->description));
   }
 
+  owner = std::this_thread::get_id();
+
   // Expensive function being used from a header-only library.
   // Shouldn't be called from a header file
   error = bfbridge_make_thread(&bfthread, &bfvm);
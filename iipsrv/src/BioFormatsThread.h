@@ -15,6 +15,7 @@
 
 #include <jni.h>
 #include <string>
+#include <thread>
 #include <stdlib.h>
 #include "../../BFBridge/c/bfbridge_basiclib.h"
 
@@ -24,6 +25,10 @@ public:
   bfbridge_vm_t bfvm;
   bfbridge_thread_t bfthread;
 
+  // The thread that created the JVM and owns bfthread.
+  // JNI environments cannot be shared, so other threads attach their own
+  std::thread::id owner;
+
   BioFormatsThread();
 
   // Copying a BioFormatsThread means copying a JVM and this is not
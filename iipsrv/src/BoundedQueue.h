@@ -0,0 +1,117 @@
+// Bounded thread-safe queue
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _BOUNDEDQUEUE_H
+#define _BOUNDEDQUEUE_H
+
+
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+
+
+
+/// Queue of limited size for passing work between the stages of a pipeline
+/** Producers that must not block use tryPush() and retry later. Consumers block
+    in pop() until an item arrives or the queue is closed.
+ */
+
+template <class T> class BoundedQueue {
+
+ private:
+
+  std::deque<T> items;
+  size_t capacity;
+  bool closed;
+
+  std::mutex mutex;
+  std::condition_variable not_empty;
+  std::condition_variable not_full;
+
+
+ public:
+
+  /// Constructor
+  /** @param c maximum number of items the queue can hold */
+  BoundedQueue( size_t c ) : capacity( c > 0 ? c : 1 ), closed( false ) {};
+
+
+  /// Add an item if there is room
+  /** @return false if the queue is full or closed */
+  bool tryPush( const T& item ){
+    std::unique_lock<std::mutex> lock( mutex );
+    if( closed || items.size() >= capacity ) return false;
+    items.push_back( item );
+    lock.unlock();
+    not_empty.notify_one();
+    return true;
+  };
+
+
+  /// Add an item, waiting for room if necessary
+  /** @return false if the queue has been closed */
+  bool push( const T& item ){
+    std::unique_lock<std::mutex> lock( mutex );
+    while( !closed && items.size() >= capacity ) not_full.wait( lock );
+    if( closed ) return false;
+    items.push_back( item );
+    lock.unlock();
+    not_empty.notify_one();
+    return true;
+  };
+
+
+  /// Remove the oldest item, waiting for one if necessary
+  /** @return false once the queue has been closed and emptied */
+  bool pop( T& item ){
+    std::unique_lock<std::mutex> lock( mutex );
+    while( !closed && items.empty() ) not_empty.wait( lock );
+    if( items.empty() ) return false;
+    item = items.front();
+    items.pop_front();
+    lock.unlock();
+    not_full.notify_one();
+    return true;
+  };
+
+
+  /// Stop accepting items and wake up everyone waiting
+  void close(){
+    std::lock_guard<std::mutex> lock( mutex );
+    closed = true;
+    not_empty.notify_all();
+    not_full.notify_all();
+  };
+
+
+  /// Return the number of items waiting in the queue
+  size_t size(){
+    std::lock_guard<std::mutex> lock( mutex );
+    return items.size();
+  };
+
+
+  /// Return the maximum number of items
+  size_t getCapacity(){ return capacity; };
+
+};
+
+
+#endif
@@ -23,13 +23,286 @@
 #include "Environment.h"
 #include <cmath>
 #include <algorithm>
+#include <cstring>
 
 //#define CHUNKED 1
 
+// Number of lines of the output image encoded at a time
+#define CVT_STRIP_HEIGHT 128
+
 using namespace std;
 
 
 
+/// Apply the colour conversion and any float pipeline transforms requested, converting to 8 bits
+void CVT::applyTransforms( RawTilePtr& rawtile ){
+
+  // Convert CIELAB to sRGB
+  if( (session->image)->getColourSpace() == CIELAB ){
+    Timer cielab_timer;
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "CVT :: Converting from CIELAB->sRGB" << endl;
+      cielab_timer.start();
+    }
+    filter_LAB2sRGB( rawtile );
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "CVT :: CIELAB->sRGB conversion in " << cielab_timer.getTime()
+			  << " microseconds" << endl;
+    }
+  }
+
+
+
+  // Only use our float pipeline if necessary
+  if( rawtile->bpc > 8 || session->view->getContrast() != 1.0 || session->view->getGamma() != 1.0 ||
+      session->view->cmapped || session->view->shaded || session->view->inverted || session->view->ctw.size() ){
+
+	    // Apply normalization and float conversion
+	    if( session->loglevel >= 4 ){
+	      *(session->logfile) << "CVT :: Normalizing and converting to float";
+	    }
+
+    // Apply normalization and float conversion
+    filter_normalize( rawtile, (session->image)->max, (session->image)->min );
+
+
+    // Apply hill shading if requested
+    if( session->view->shaded ){
+      if( session->loglevel >= 3 ){
+	*(session->logfile) << "CVT :: Applying hill-shading" << endl;
+      }
+      filter_shade( rawtile, session->view->shade[0], session->view->shade[1] );
+    }
+
+
+    // Apply color twist if requested
+    if( session->view->ctw.size() ){
+      if( session->loglevel >= 3 ){
+	*(session->logfile) << "CVT :: Applying color twist" << endl;
+      }
+      filter_twist( rawtile, session->view->ctw );
+    }
+
+
+    // Apply any gamma correction
+    if( session->view->getGamma() != 1.0 ){
+      float gamma = session->view->getGamma();
+      if( session->loglevel >= 3 ){
+	*(session->logfile) << "CVT :: Applying gamma of " << gamma << endl; 
+      }
+      filter_gamma( rawtile, gamma );
+    }
+
+
+    // Apply inversion if requested
+    if( session->view->inverted ){
+      if( session->loglevel >= 3 ){
+	*(session->logfile) << "CVT :: Applying inversion" << endl;
+      }
+      filter_inv( rawtile );
+    }
+
+
+    // Apply color mapping if requested
+    if( session->view->cmapped ){
+      if( session->loglevel >= 3 ){
+	*(session->logfile) << "CVT :: Applying color map" << endl;
+      }
+      filter_cmap( rawtile, session->view->cmap );
+    }
+
+
+    // Apply any contrast adjustments and/or clipping to 8bit from 16bit or 32bit
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "CVT :: Applying contrast of " << session->view->getContrast() << endl;
+    }
+    filter_contrast( rawtile, session->view->getContrast() );
+
+  }
+
+}
+
+
+
+/// Reduce to 1 or 3 bands and convert to greyscale if requested
+void CVT::flatten( RawTilePtr& rawtile ){
+
+  // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image
+  if( rawtile->channels == 2 ){
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "CVT :: Flattening to 1 channel" << endl;
+    }
+    filter_flatten( rawtile, 1 );
+  }
+  else if( rawtile->channels > 3 ){
+    if( session->loglevel >= 3 ){
+      *(session->logfile) << "CVT :: Flattening to 3 channels" << endl;
+    }
+    filter_flatten( rawtile, 3 );
+  }
+
+
+
+  // Convert to greyscale if requested
+  if( (session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE ){
+
+    Timer greyscale_timer;
+    if( session->loglevel >= 5 ){
+      greyscale_timer.start();
+    }
+
+    filter_greyscale( rawtile );
+
+    if( session->loglevel >= 5 ){
+      *(session->logfile) << "CVT :: Converting to greyscale in "
+			  << greyscale_timer.getTime() << " microseconds" << endl;
+    }
+  }
+
+}
+
+
+
+/// Apply the requested flip
+void CVT::flip( RawTilePtr& rawtile ){
+
+  Timer flip_timer;
+  if( session->loglevel >= 5 ){
+    flip_timer.start();
+  }
+
+  filter_flip( rawtile, session->view->flip  );
+
+  if( session->loglevel >= 5 ){
+    string direction = session->view->flip==1 ? "horizontally" : "vertically";
+    *(session->logfile) << "JTL :: Flipping image " << direction << " in "
+			<< flip_timer.getTime() << " microseconds" << endl; 
+  }
+}
+
+
+
+/// Initialise our JPEG compression and send out the JPEG header
+void CVT::sendHeader( const RawTilePtr& rawtile, unsigned int strip_height ){
+
+  // Initialise our JPEG compression object
+  session->jpeg->InitCompression( rawtile, strip_height );
+
+  // Add XMP metadata if this exists
+  if( (session->image)->getMetadata("xmp").size() > 0 ){
+    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Adding XMP metadata" << endl;
+    session->jpeg->addMetadata( (session->image)->getMetadata("xmp") );
+  }
+
+  int len = session->jpeg->getHeaderSize();
+
+#ifdef CHUNKED
+  char str[1024];
+  snprintf( str, 1024, "%X\r\n", len );
+  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: JPEG Header Chunk : " << str;
+  session->out->printf( str );
+#endif
+
+  if( session->out->putStr( (const char*) session->jpeg->getHeader(), len ) != len ){
+    if( session->loglevel >= 1 ){
+      *(session->logfile) << "CVT :: Error writing jpeg header" << endl;
+    }
+  }
+
+#ifdef CHUNKED
+  session->out->printf( "\r\n" );
+#endif
+
+  // Flush our block of data
+  if( session->out->flush() == -1 ) {
+    if( session->loglevel >= 1 ){
+      *(session->logfile) << "CVT :: Error flushing jpeg data" << endl;
+    }
+  }
+}
+
+
+
+/// Compress a strip of our image and send it out to the client
+void CVT::sendStrip( unsigned char* input, unsigned char* output, unsigned int strip_height ){
+
+  if( session->loglevel >= 3 ){
+    *(session->logfile) << "CVT :: About to JPEG compress strip with height " << strip_height << endl;
+  }
+
+  // Compress the strip
+  TraceSpan encode( "encode" );
+  int len = session->jpeg->CompressStrip( input, output, strip_height );
+  encode.end();
+
+  if( session->loglevel >= 3 ){
+    *(session->logfile) << "CVT :: Compressed data strip length is " << len << endl;
+  }
+
+#ifdef CHUNKED
+  // Send chunk length in hex
+  char str[1024];
+  snprintf( str, 1024, "%X\r\n", len );
+  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Chunk : " << str;
+  session->out->printf( str );
+#endif
+
+  // Send this strip out to the client
+  TraceSpan write( "write" );
+  if( len != session->out->putStr( (const char*) output, len ) ){
+    if( session->loglevel >= 1 ){
+      *(session->logfile) << "CVT :: Error writing jpeg strip data: " << len << endl;
+    }
+  }
+
+#ifdef CHUNKED
+  // Send closing chunk CRLF
+  session->out->printf( "\r\n" );
+#endif
+
+  // Flush our block of data
+  if( session->out->flush() == -1 ) {
+    if( session->loglevel >= 1 ){
+      *(session->logfile) << "CVT :: Error flushing jpeg data" << endl;
+    }
+  }
+}
+
+
+
+/// Keep the lines of a band from a given line onwards and add further lines below them
+/** @param band lines of an 8 bit image, replaced by the result
+    @param top index within the image of the first line of band, updated
+    @param keep index of the first line to keep
+    @param lines the lines that follow those in band
+ */
+static void extend( RawTilePtr& band, unsigned int& top, unsigned int keep, const RawTilePtr& lines ){
+
+  unsigned int kept = 0;
+  if( band && keep < top + band->height ) kept = top + band->height - std::max( keep, top );
+
+  if( kept == 0 ){
+    band = lines;
+    top = keep;
+    return;
+  }
+
+  size_t line = band->width * band->channels;
+  unsigned char* data = new unsigned char[line * (kept + lines->height)];
+  memcpy( data, (unsigned char*) band->data + (band->height - kept) * line, kept * line );
+  memcpy( data + kept * line, lines->data, lines->height * line );
+
+  RawTilePtr extended( new RawTile( 0, band->resolution, band->hSequence, band->vSequence,
+				    band->width, kept + lines->height, band->channels, 8 ) );
+  extended->data = data;
+  extended->dataLength = line * (kept + lines->height);
+
+  top = top + band->height - kept;
+  band = extended;
+}
+
+
+
 void CVT::send( Session* session ){
 
   if( session->loglevel >= 2 ) *(session->logfile) << "CVT handler reached" << endl;
@@ -150,289 +423,200 @@ void CVT::send( Session* session ){
 
 
   // Get our requested region from our TileManager
-  TileManager tilemanager( session->tileCache, session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
-  RawTilePtr complete_image = tilemanager.getRegion( requested_res,
-						  session->view->xangle, session->view->yangle,
-						  session->view->getLayers(),
-						  view_left, view_top, view_width, view_height );
+  TileManager tilemanager( session->tileCache, session->image, session->watermark, session->jpeg, session->logfile, session->loglevel,
+			   session->threadPool );
 
+  // Send out the data per strip of fixed height.
+  // Allocate enough memory for this plus an extra 16k for instances where compressed
+  // data is greater than uncompressed
+  unsigned int strip_height = CVT_STRIP_HEIGHT;
+  unsigned char* output = NULL;
+  bool resize = (view_width!=resampled_width) || (view_height!=resampled_height);
+  unsigned int interpolation = Environment::getInterpolation();
 
 
-  // Convert CIELAB to sRGB
-  if( (session->image)->getColourSpace() == CIELAB ){
-    Timer cielab_timer;
+  // Rotations and vertical flips need the whole region at once. Otherwise render and encode the
+  // region a strip at a time, holding only the source lines each strip needs, so that memory use
+  // grows with the width of the region rather than with its area
+  if( session->view->getRotation() == 0.0 && session->view->flip != 2 ){
+
     if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: Converting from CIELAB->sRGB" << endl;
-      cielab_timer.start();
+      *(session->logfile) << "CVT :: Rendering region in strips of " << strip_height << " lines" << endl;
     }
-    filter_LAB2sRGB( complete_image );
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: CIELAB->sRGB conversion in " << cielab_timer.getTime()
-			  << " microseconds" << endl;
+
+    // Lines of the region read so far and converted to 8 bits
+    RawTilePtr band;
+    unsigned int band_top = 0;
+    unsigned int band_bottom = 0;
+    unsigned int tile_height = (session->image)->getTileHeight();
+
+    // Scale between the region and our output
+    float yscale = 1.0;
+    if( resize ){
+      if( interpolation == 1 ) yscale = (float)(view_height-1) / (float)resampled_height;
+      else yscale = (float)view_height / (float)resampled_height;
     }
-  }
 
+    int strips = (resampled_height/strip_height) + (resampled_height%strip_height == 0 ? 0 : 1);
 
+    for( int n=0; n<strips; n++ ){
 
-  // Only use our float pipeline if necessary
-  if( complete_image->bpc > 8 || session->view->getContrast() != 1.0 || session->view->getGamma() != 1.0 ||
-      session->view->cmapped || session->view->shaded || session->view->inverted || session->view->ctw.size() ){
+      unsigned int first = n*strip_height;
+      unsigned int rows = std::min( strip_height, resampled_height - first );
 
-	    // Apply normalization and float conversion
-	    if( session->loglevel >= 4 ){
-	      *(session->logfile) << "CVT :: Normalizing and converting to float";
-	    }
+      // The lines of the region this strip needs, allowing a line either side for rounding
+      unsigned int need_top = (unsigned int) floor( first*yscale );
+      unsigned int need_bottom = first + rows;
+      if( resize ){
+	need_top = ( need_top > 0 ) ? need_top - 1 : 0;
+	need_bottom = (unsigned int) ceil( (first+rows)*yscale ) + 1;
+      }
+      if( need_bottom > view_height ) need_bottom = view_height;
 
-    // Apply normalization and float conversion
-    filter_normalize( complete_image, (session->image)->max, (session->image)->min );
+      // Read any further lines we need, up to the end of a row of tiles, so that no tile is read twice
+      if( need_bottom > band_bottom ){
+	unsigned int top = std::max( band_bottom, need_top );
+	unsigned int bottom = ((view_top + need_bottom + tile_height - 1) / tile_height) * tile_height - view_top;
+	if( bottom > view_height ) bottom = view_height;
 
+	RawTilePtr lines = tilemanager.getRegion( requested_res,
+						  session->view->xangle, session->view->yangle,
+						  session->view->getLayers(),
+						  view_left, view_top + top, view_width, bottom - top );
+	TraceSpan span( "transform" );
+	applyTransforms( lines );
+	span.end();
 
-    // Apply hill shading if requested
-    if( session->view->shaded ){
-      if( session->loglevel >= 3 ){
-	*(session->logfile) << "CVT :: Applying hill-shading" << endl;
+	extend( band, band_top, need_top, lines );
+	band_bottom = bottom;
       }
-      filter_shade( complete_image, session->view->shade[0], session->view->shade[1] );
-    }
 
 
-    // Apply color twist if requested
-    if( session->view->ctw.size() ){
-      if( session->loglevel >= 3 ){
-	*(session->logfile) << "CVT :: Applying color twist" << endl;
-      }
-      filter_twist( complete_image, session->view->ctw );
-    }
+      // Resize or copy the lines of our strip
+      TraceSpan span( "transform" );
+      RawTilePtr strip( new RawTile( 0, requested_res, session->view->xangle, session->view->yangle,
+				     resampled_width, rows, band->channels, 8 ) );
+      strip->dataLength = resampled_width * rows * band->channels;
+      strip->data = new unsigned char[strip->dataLength];
 
-
-    // Apply any gamma correction
-    if( session->view->getGamma() != 1.0 ){
-      float gamma = session->view->getGamma();
-      if( session->loglevel >= 3 ){
-	*(session->logfile) << "CVT :: Applying gamma of " << gamma << endl; 
+      if( resize ){
+	if( interpolation == 0 ) filter_interpolate_nearestneighbour( band, band_top, view_height, strip, first, resampled_height );
+	else if( interpolation == 2 ) filter_interpolate_area( band, band_top, view_height, strip, first, resampled_height );
+	else filter_interpolate_bilinear( band, band_top, view_height, strip, first, resampled_height );
       }
-      filter_gamma( complete_image, gamma );
-    }
-
-
-    // Apply inversion if requested
-    if( session->view->inverted ){
-      if( session->loglevel >= 3 ){
-	*(session->logfile) << "CVT :: Applying inversion" << endl;
+      else{
+	memcpy( strip->data, (unsigned char*) band->data + (first - band_top) * view_width * band->channels,
+		strip->dataLength );
       }
-      filter_inv( complete_image );
-    }
 
+      flatten( strip );
+      if( session->view->flip != 0 ) flip( strip );
+      span.end();
 
-    // Apply color mapping if requested
-    if( session->view->cmapped ){
-      if( session->loglevel >= 3 ){
-	*(session->logfile) << "CVT :: Applying color map" << endl;
-      }
-      filter_cmap( complete_image, session->view->cmap );
-    }
 
+      // The number of channels of our output is only known once we have our first strip
+      if( n == 0 ){
+	RawTilePtr image( new RawTile( 0, requested_res, session->view->xangle, session->view->yangle,
+				       resampled_width, resampled_height, strip->channels, 8 ) );
+	sendHeader( image, strip_height );
+	output = new unsigned char[resampled_width*strip->channels*strip_height+16536];
+      }
 
-    // Apply any contrast adjustments and/or clipping to 8bit from 16bit or 32bit
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: Applying contrast of " << session->view->getContrast() << endl;
+      sendStrip( (unsigned char*) strip->data, output, rows );
     }
-    filter_contrast( complete_image, session->view->getContrast() );
 
   }
+  else{
 
+    RawTilePtr complete_image = tilemanager.getRegion( requested_res,
+						       session->view->xangle, session->view->yangle,
+						       session->view->getLayers(),
+						       view_left, view_top, view_width, view_height );
 
+    TraceSpan span( "transform" );
 
-  // Resize our image as requested. Use the interpolation method requested in the server configuration.
-  //  - Use bilinear interpolation by default
-  if( (view_width!=resampled_width) || (view_height!=resampled_height) ){
-    Timer interpolation_timer;
-    string interpolation_type;
-    if( session->loglevel >= 5 ){
-      interpolation_timer.start();
-    }
-    unsigned int interpolation = Environment::getInterpolation();
-    switch( interpolation ){
-     case 0:
-      interpolation_type = "nearest neighbour";
-      filter_interpolate_nearestneighbour( complete_image, resampled_width, resampled_height );
-      break;
-     default:
-      interpolation_type = "bilinear";
-      filter_interpolate_bilinear( complete_image, resampled_width, resampled_height );
-      break;
-    }
-    if( session->loglevel >= 5 ){
-      *(session->logfile) << "CVT :: Resizing using " << interpolation_type << " interpolation in "
-			  << interpolation_timer.getTime() << " microseconds" << endl;
-    }
-  }
+    applyTransforms( complete_image );
 
 
-  // Reduce to 1 or 3 bands if we have an alpha channel or a multi-band image
-  if( complete_image->channels == 2 ){
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: Flattening to 1 channel" << endl;
-    }
-    filter_flatten( complete_image, 1 );
-  }
-  else if( complete_image->channels > 3 ){
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: Flattening to 3 channels" << endl;
-    }
-    filter_flatten( complete_image, 3 );
-  }
-
-
-
-  // Convert to greyscale if requested
-  if( (session->image)->getColourSpace() == sRGB && session->view->colourspace == GREYSCALE ){
-
-    Timer greyscale_timer;
-    if( session->loglevel >= 5 ){
-      greyscale_timer.start();
+    // Resize our image as requested. Use the interpolation method requested in the server configuration.
+    //  - Use bilinear interpolation by default
+    if( resize ){
+      Timer interpolation_timer;
+      string interpolation_type;
+      if( session->loglevel >= 5 ){
+	interpolation_timer.start();
+      }
+      switch( interpolation ){
+       case 0:
+	interpolation_type = "nearest neighbour";
+	filter_interpolate_nearestneighbour( complete_image, resampled_width, resampled_height );
+	break;
+       case 2:
+	interpolation_type = "area average";
+	filter_interpolate_area( complete_image, resampled_width, resampled_height );
+	break;
+       default:
+	interpolation_type = "bilinear";
+	filter_interpolate_bilinear( complete_image, resampled_width, resampled_height );
+	break;
+      }
+      if( session->loglevel >= 5 ){
+	*(session->logfile) << "CVT :: Resizing using " << interpolation_type << " interpolation in "
+			    << interpolation_timer.getTime() << " microseconds" << endl;
+      }
     }
 
-    filter_greyscale( complete_image );
-
-    if( session->loglevel >= 5 ){
-      *(session->logfile) << "CVT :: Converting to greyscale in "
-			  << greyscale_timer.getTime() << " microseconds" << endl;
-    }
-  }
 
+    flatten( complete_image );
 
 
-  // Apply flip
-  if( session->view->flip != 0 ){
-    Timer flip_timer;
-    if( session->loglevel >= 5 ){
-      flip_timer.start();
-    }
+    // Apply flip
+    if( session->view->flip != 0 ) flip( complete_image );
 
-    filter_flip( complete_image, session->view->flip  );
 
-    if( session->loglevel >= 5 ){
-      string direction = session->view->flip==1 ? "horizontally" : "vertically";
-      *(session->logfile) << "JTL :: Flipping image " << direction << " in "
-			  << flip_timer.getTime() << " microseconds" << endl; 
-    }
-  }
+    // Apply rotation - can apply this safely after gamma and contrast adjustment
+    if( session->view->getRotation() != 0.0 ){
+      Timer rotation_timer;
+      if( session->loglevel >= 5 ){
+	rotation_timer.start();
+      }
 
+      float rotation = session->view->getRotation();
+      filter_rotate( complete_image, rotation );
 
+      // For 90 and 270 rotation swap width and height
+      resampled_width = complete_image->width;
+      resampled_height = complete_image->height;
 
-  // Apply rotation - can apply this safely after gamma and contrast adjustment
-  if( session->view->getRotation() != 0.0 ){
-    Timer rotation_timer;
-    if( session->loglevel >= 5 ){
-      rotation_timer.start();
+      if( session->loglevel >= 5 ){
+	*(session->logfile) << "CVT :: Rotating image by " << rotation << " degrees in "
+			    << rotation_timer.getTime() << " microseconds" << endl; 
+      }
     }
 
-    float rotation = session->view->getRotation();
-    filter_rotate( complete_image, rotation );
-
-    // For 90 and 270 rotation swap width and height
-    resampled_width = complete_image->width;
-    resampled_height = complete_image->height;
-
-    if( session->loglevel >= 5 ){
-      *(session->logfile) << "CVT :: Rotating image by " << rotation << " degrees in "
-			  << rotation_timer.getTime() << " microseconds" << endl; 
-    }
-  }
+    span.end();
 
 
+    sendHeader( complete_image, strip_height );
 
-  // Initialise our JPEG compression object
-  session->jpeg->InitCompression( complete_image, resampled_height );
+    unsigned int channels = complete_image->channels;
+    output = new unsigned char[resampled_width*channels*strip_height+16536];
+    int strips = (resampled_height/strip_height) + (resampled_height%strip_height == 0 ? 0 : 1);
 
-  // Add XMP metadata if this exists
-  if( (session->image)->getMetadata("xmp").size() > 0 ){
-    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Adding XMP metadata" << endl;
-    session->jpeg->addMetadata( (session->image)->getMetadata("xmp") );
-  }
+    for( int n=0; n<strips; n++ ){
 
-  len = session->jpeg->getHeaderSize();
+      // Get the starting index for this strip of data
+      unsigned char* input = &((unsigned char*)complete_image->data)[n*strip_height*resampled_width*channels];
 
-#ifdef CHUNKED
-  snprintf( str, 1024, "%X\r\n", len );
-  if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: JPEG Header Chunk : " << str;
-  session->out->printf( str );
-#endif
+      // The last strip may have a different height
+      if( (n==strips-1) && (resampled_height%strip_height!=0) ) strip_height = resampled_height % strip_height;
 
-  if( session->out->putStr( (const char*) session->jpeg->getHeader(), len ) != len ){
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error writing jpeg header" << endl;
+      sendStrip( input, output, strip_height );
     }
-  }
-
-#ifdef CHUNKED
-  session->out->printf( "\r\n" );
-#endif
 
-  // Flush our block of data
-  if( session->out->flush() == -1 ) {
-    if( session->loglevel >= 1 ){
-      *(session->logfile) << "CVT :: Error flushing jpeg data" << endl;
-    }
   }
 
 
-  // Send out the data per strip of fixed height.
-  // Allocate enough memory for this plus an extra 16k for instances where compressed
-  // data is greater than uncompressed
-  unsigned int strip_height = 128;
-  unsigned int channels = complete_image->channels;
-  unsigned char* output = new unsigned char[resampled_width*channels*strip_height+16536];
-  int strips = (resampled_height/strip_height) + (resampled_height%strip_height == 0 ? 0 : 1);
-
-  for( int n=0; n<strips; n++ ){
-
-    // Get the starting index for this strip of data
-    unsigned char* input = &((unsigned char*)complete_image->data)[n*strip_height*resampled_width*channels];
-
-    // The last strip may have a different height
-    if( (n==strips-1) && (resampled_height%strip_height!=0) ) strip_height = resampled_height % strip_height;
-
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: About to JPEG compress strip with height " << strip_height << endl;
-    }
-
-    // Compress the strip
-    len = session->jpeg->CompressStrip( input, output, strip_height );
-
-    if( session->loglevel >= 3 ){
-      *(session->logfile) << "CVT :: Compressed data strip length is " << len << endl;
-    }
-
-#ifdef CHUNKED
-    // Send chunk length in hex
-    snprintf( str, 1024, "%X\r\n", len );
-    if( session->loglevel >= 4 ) *(session->logfile) << "CVT :: Chunk : " << str;
-    session->out->printf( str );
-#endif
-
-    // Send this strip out to the client
-    if( len != session->out->putStr( (const char*) output, len ) ){
-      if( session->loglevel >= 1 ){
-	*(session->logfile) << "CVT :: Error writing jpeg strip data: " << len << endl;
-      }
-    }
-
-#ifdef CHUNKED
-    // Send closing chunk CRLF
-    session->out->printf( "\r\n" );
-#endif
-
-    // Flush our block of data
-    if( session->out->flush() == -1 ) {
-      if( session->loglevel >= 1 ){
-	*(session->logfile) << "CVT :: Error flushing jpeg data" << endl;
-      }
-    }
-
-  }
-
   // Finish off the image compression
   len = session->jpeg->Finish( output );
 
@@ -475,4 +659,4 @@ void CVT::send( Session* session ){
   }
 
 
-}  
+}
@@ -86,12 +86,75 @@ namespace __gnu_cxx {
 #include <iostream>
 #include <list>
 #include <string>
+#include <vector>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <exception>
 #include "RawTile.h"
 #include "IIPImage.h"
+#include "SharedTileCache.h"
+#include "DiskTileCache.h"
+#include "MemcachedTileCache.h"
+#include "TileKey.h"
+#include "RWLock.h"
+
+
+
+/// Maximum number of shards in the tile cache
+#define TILE_CACHE_SHARDS 16
+
+/// Minimum size in bytes of each shard of the tile cache
+#define TILE_CACHE_SHARD_SIZE 4194304
+
+/// Tile size assumed when estimating how many tiles the tile cache holds
+#define TILE_CACHE_MEAN_TILE_SIZE 16384
+
+/// Percentage of each shard reserved for the admission window of the TinyLFU policy
+#define CACHE_WINDOW_PERCENT 1
+
+/// Number of lookups per frequency counter after which the counters are halved
+#define CACHE_SKETCH_AGE 10
+
+/// Maximum number of extra passes of the clock hand that an expensive object survives
+#define CACHE_MAX_CREDIT 3
+
+/// Number of most looked up objects tracked by each shard, so that they can be listed without a scan
+#define CACHE_HOT_KEYS 32
+
+
+
+/// Eviction policies
+/** CACHE_CLOCK evicts objects that have not been used recently. CACHE_TINYLFU in addition
+    keeps an approximate count of how often each key has been looked up. Objects enter a
+    small window in which they are only evicted in turn, and on leaving it only replace
+    objects in the rest of the cache if they have been asked for more often. This stops
+    the many tiles read once by large exports from flushing out tiles that viewers keep
+    coming back to.
+ */
+enum CachePolicy { CACHE_CLOCK, CACHE_TINYLFU };
 
 
 
 /// Cache to store raw tile data
+/** The cache is split into a number of shards, each holding the objects whose keys
+    hash to it, with its own lock, share of the maximum size and eviction. Lookups
+    only take their shard's lock in shared mode: rather than moving the object to the
+    head of a list, a hit just sets the object's reference bit. Eviction follows the
+    CLOCK (second chance) algorithm: a hand sweeps round the objects of the shard in
+    the order in which they were added, clearing reference bits and evicting the first
+    object it finds that has not been used since it was last passed. With the TinyLFU
+    policy, new objects first pass through a first in, first out window (see CachePolicy).
+
+    Objects that took longer to build than others of the same size survive extra passes
+    of the hand, in the manner of GreedyDual-Size: each is given a credit of up to
+    CACHE_MAX_CREDIT passes according to its cost per byte relative to the average of
+    its shard, which the hand uses up before evicting it and which is restored when it
+    is used again.
+ */
 template <typename Key, typename Value>
 class Cache {
 
@@ -104,106 +167,413 @@ class Cache {
 #endif
 
 
-   /// Max memory size in bytes
-   const size_t maxSize;
-
-   /// Current memory running total
-   size_t currentSize;
-
-   /// Main cache storage typedef  Don't need to store key in list again.
- #ifdef HAVE_EXT_POOL_ALLOCATOR
- //  typedef std::list < std::pair<std::string, ValuePtr >,
- //    __gnu_cxx::__pool_alloc< std::pair<std::string, ValuePtr > > > ObjectList;
-   typedef std::list < ValuePtr ,
-     __gnu_cxx::__pool_alloc< ValuePtr > > ObjectList;
- #else
- //  typedef std::list < std::pair<std::string, ValuePtr > > ObjectList;
-   typedef std::list < ValuePtr > ObjectList;
- #endif
+   /// An object held in the cache
+   struct Entry {
+     Key key;
+     ValuePtr value;
+     size_t size;                            ///< size accounted for the object
+     std::atomic<bool> referenced;           ///< used since the clock hand last passed
+     std::atomic<unsigned long> hits;
+     time_t inserted;
+     std::atomic<time_t> used;               ///< when last looked up or added
+     bool windowed;                          ///< held in the admission window
+     std::atomic<bool> hot;                  ///< in its shard's list of most looked up objects
+     unsigned char weight;                   ///< passes of the hand earned by the object's cost
+     unsigned char credit;                   ///< passes left before eviction
+   };
+
+   /// Objects of a shard in clock order. List nodes never move, so iterators stay valid
+   typedef std::list < Entry > ObjectList;
 
    /// Main cache list iterator typedef
    typedef typename ObjectList::iterator List_Iter;
 
-   // can store list iterators in map because list iterators are not affected by insert/delete etc to list.
-
    /// Index typedef
  #ifdef HAVE_EXT_POOL_ALLOCATOR
-   typedef HASHMAP < std::string, List_Iter,
-     __gnu_cxx::hash< std::string >,
-     std::equal_to< std::string >,
-     __gnu_cxx::__pool_alloc< std::pair<std::string, List_Iter> >
+   typedef HASHMAP < Key, List_Iter,
+     __gnu_cxx::hash< Key >,
+     std::equal_to< Key >,
+     __gnu_cxx::__pool_alloc< std::pair<Key, List_Iter> >
      > ObjectMap;
  #else
-   typedef HASHMAP < std::string, List_Iter > ObjectMap;
+   typedef HASHMAP < Key, List_Iter > ObjectMap;
  #endif
 
 
-   /// Main cache storage object
-   ObjectList objList;
+   /// A part of the cache with its own lock
+   struct Shard {
+
+     /// Lock guarding everything below except the atomic counters. Lookups take it
+     /// in shared mode, everything that changes the shard takes it exclusively
+     RWLock lock;
+
+     ObjectList objList;
+     ObjectMap objMap;
+
+     /// Position of the clock hand in objList
+     List_Iter hand;
+
+     /// Max memory size and current memory running total
+     size_t maxSize;
+     size_t currentSize;
+
+     /// Moving average of the cost per byte of the objects added
+     double meanCost;
+
+     /// New objects not yet admitted to objList, oldest first, and their total size
+     ObjectList window;
+     size_t windowSize;
+     size_t windowMax;
+
+     /// Saturating 4 bit lookup counters indexed by key hash, and the number of lookups
+     /// recorded since they were last halved
+     std::unique_ptr< std::atomic<unsigned char>[] > sketch;
+     size_t sketchMask;
+     std::atomic<unsigned long> samples;
 
-   /// Main Cache storage index object
-   ObjectMap objMap;
+     /// Usage counters
+     std::atomic<unsigned long> hits, misses;
+     unsigned long insertions, evictions, removals;
 
+     /// The most looked up objects, in no particular order, guarded by hotMutex. Once the
+     /// list is full, hotMin is the fewest hits of any of them, which an object must beat to join
+     std::mutex hotMutex;
+     const Entry* hot[CACHE_HOT_KEYS];
+     unsigned int hotCount;
+     std::atomic<unsigned long> hotMin;
 
-   /// Internal touch function
-   /** Touches a key in the Cache and makes it the most recently used
-    *  @param key to be touched
-    *  @return a Map_Iter pointing to the key that was touched.
+     /// Keep shards on separate cache lines
+     char padding[64];
+   };
+
+
+   /// Max memory size in bytes or count
+   const size_t maxSize;
+
+   /// Our shards
+   const unsigned int shardCount;
+   std::unique_ptr<Shard[]> shards;
+
+   /// Eviction policy
+   const CachePolicy policy;
+
+
+   /// Return the shard holding a key
+   /** @param h hash of the key */
+   Shard& shard( size_t h ) {
+     if( shardCount == 1 ) return shards[0];
+     return shards[ h & ( shardCount - 1 ) ];
+   }
+
+
+   /// Return the index of one of the frequency counters of a key
+   /** @param s shard
+       @param h hash of the key
+       @param i which counter, 0 to 3
     */
-   typename ObjectMap::iterator _touch( const std::string &key ) {
-     typename ObjectMap::iterator miter = objMap.find( key );
-     if( miter == objMap.end() ) return miter;
-     // Move the found node to the head of the list.
-     objList.splice( objList.begin(), objList, miter->second );
-     return miter;
+   static size_t counter( const Shard& s, size_t h, unsigned int i ) {
+     // Shards are chosen by the low bits of the hash, so mix them all in
+     uint64_t x = (uint64_t) h * 0x9e3779b97f4a7c15ULL;
+     x ^= x >> 32;
+     return ( x + i * ( ( x >> 16 ) | 1 ) ) & s.sketchMask;
+   }
+
+
+   /// Count a lookup of a key
+   /** May be called with the shard locked in shared mode by several threads at once,
+       in which case an increment may occasionally be lost, which does not matter here
+       @param s shard
+       @param h hash of the key
+    */
+   static void record( Shard& s, size_t h ) {
+     for( unsigned int i = 0; i < 4; i++ ){
+       std::atomic<unsigned char>& c = s.sketch[ counter( s, h, i ) ];
+       unsigned char n = c.load( std::memory_order_relaxed );
+       if( n < 15 ) c.store( n + 1, std::memory_order_relaxed );
+     }
+     s.samples.fetch_add( 1, std::memory_order_relaxed );
+   }
+
+
+   /// Return an estimate of the number of recent lookups of a key
+   /** @param s shard
+       @param h hash of the key
+    */
+   static unsigned int frequency( const Shard& s, size_t h ) {
+     unsigned int f = 15;
+     for( unsigned int i = 0; i < 4; i++ ){
+       unsigned int n = s.sketch[ counter( s, h, i ) ].load( std::memory_order_relaxed );
+       if( n < f ) f = n;
+     }
+     return f;
+   }
+
+
+   /// Halve all the counters once enough lookups have been recorded, so that keys that
+   /// were popular long ago do not keep their place for ever
+   /** @param s shard, which must be locked exclusively */
+   static void age( Shard& s ) {
+     if( s.samples.load( std::memory_order_relaxed ) < CACHE_SKETCH_AGE * ( s.sketchMask + 1 ) ) return;
+     for( size_t i = 0; i <= s.sketchMask; i++ ){
+       s.sketch[i].store( s.sketch[i].load( std::memory_order_relaxed ) >> 1, std::memory_order_relaxed );
+     }
+     s.samples.store( 0, std::memory_order_relaxed );
+   }
+
+
+   /// Consider an object that has just been hit for the shard's list of most looked up objects
+   /** @param s shard, which must be locked in shared mode at least
+       @param e object
+    */
+   static void promote( Shard& s, Entry& e ) {
+     std::lock_guard<std::mutex> lock( s.hotMutex );
+     if( e.hot.load( std::memory_order_relaxed ) ) return;
+     if( s.hotCount < CACHE_HOT_KEYS ) s.hot[ s.hotCount++ ] = &e;
+     else{
+       // Replace the object with the fewest hits if we now have more
+       unsigned int m = 0;
+       for( unsigned int i = 1; i < s.hotCount; i++ ){
+	 if( s.hot[i]->hits.load( std::memory_order_relaxed ) < s.hot[m]->hits.load( std::memory_order_relaxed ) ) m = i;
+       }
+       if( s.hot[m]->hits.load( std::memory_order_relaxed ) >= e.hits.load( std::memory_order_relaxed ) ){
+	 s.hotMin.store( s.hot[m]->hits.load( std::memory_order_relaxed ), std::memory_order_relaxed );
+	 return;
+       }
+       const_cast<Entry*>( s.hot[m] )->hot.store( false, std::memory_order_relaxed );
+       s.hot[m] = &e;
+     }
+     e.hot.store( true, std::memory_order_relaxed );
+
+     // Hits only grow, so this is a lower bound even as other threads hit these objects
+     unsigned long least = 0;
+     if( s.hotCount == CACHE_HOT_KEYS ){
+       least = s.hot[0]->hits.load( std::memory_order_relaxed );
+       for( unsigned int i = 1; i < s.hotCount; i++ ){
+	 unsigned long n = s.hot[i]->hits.load( std::memory_order_relaxed );
+	 if( n < least ) least = n;
+       }
+     }
+     s.hotMin.store( least, std::memory_order_relaxed );
+   }
+
+
+   /// Called after each lookup with the shard locked in shared mode, to let subclasses keep their own statistics
+   /** @param key key looked up
+       @param hit whether it was found
+    */
+   virtual void lookedUp( const Key &key, bool hit ) {};
+
+   /// Called with the shard locked after an object has been added
+   /** @param key key of object
+       @param val object
+       @param size size accounted for the object
+    */
+   virtual void added( const Key &key, const ValuePtr val, size_t size ) {};
+
+   /// Called with the shard locked before an object is removed
+   /** @param key key of object
+       @param val object
+       @param size size accounted for the object
+    */
+   virtual void removed( const Key &key, const ValuePtr val, size_t size ) {};
+
+   /// Called after the cache has been cleared
+   virtual void cleared() {};
+
+
+   /// Look up an object
+   /** @param key key of object
+       @param count whether to count the lookup in our statistics
+       @return object or an empty pointer if not found
+    */
+   ValuePtr _lookup( const Key &key, bool count ) {
+
+     if( maxSize == 0 ) return ValuePtr();
+
+     size_t h = std::hash<Key>()( key );
+     Shard& s = shard( h );
+     SharedLock lock( s.lock );
+
+     if( count && policy == CACHE_TINYLFU ) record( s, h );
+
+     typename ObjectMap::iterator miter = s.objMap.find( key );
+     if( miter == s.objMap.end() ){
+       if( count ){
+	 s.misses.fetch_add( 1, std::memory_order_relaxed );
+	 lookedUp( key, false );
+       }
+       return ValuePtr();
+     }
+
+     Entry& e = *(miter->second);
+
+     // Give the object a second chance. Avoid writing to it if it already has one
+     if( !e.referenced.load( std::memory_order_relaxed ) ) e.referenced.store( true, std::memory_order_relaxed );
+
+     if( count ){
+       s.hits.fetch_add( 1, std::memory_order_relaxed );
+       unsigned long hits = e.hits.fetch_add( 1, std::memory_order_relaxed ) + 1;
+       if( !e.hot.load( std::memory_order_relaxed ) && hits > s.hotMin.load( std::memory_order_relaxed ) ) promote( s, e );
+       time_t now = time( NULL );
+       if( e.used.load( std::memory_order_relaxed ) != now ) e.used.store( now, std::memory_order_relaxed );
+       lookedUp( key, true );
+     }
+
+     return e.value;
    }
 
 
    /// Internal remove function
    /**
-    *  @param miter Map_Iter that points to the key to remove
-    *  @warning miter is no longer usable after being passed to this function.
+    *  @param s shard, which must be locked exclusively
+    *  @param liter object to remove
     */
-   void _remove( const typename ObjectMap::iterator &miter ) {
-     // Reduce our current size counter
-     currentSize -= getRecordSize(miter);
-     objList.erase( miter->second );
+   void _remove( Shard& s, List_Iter liter ) {
+
+     if( s.hand == liter ) ++s.hand;
+
+     s.currentSize -= liter->size;
+     if( liter->windowed ) s.windowSize -= liter->size;
+     removed( liter->key, liter->value, liter->size );
+
+     if( liter->hot ){
+       std::lock_guard<std::mutex> lock( s.hotMutex );
+       for( unsigned int i = 0; i < s.hotCount; i++ ){
+	 if( s.hot[i] == &(*liter) ){
+	   s.hot[i] = s.hot[ --s.hotCount ];
+	   break;
+	 }
+       }
+       s.hotMin.store( 0, std::memory_order_relaxed );
+     }
 
 #if !defined(HAS_SHARED_PTR)
-     delete *(miter->second);
+     delete liter->value;
 #endif
 
-     objMap.erase( miter );
+     s.objMap.erase( liter->key );
+     if( liter->windowed ) s.window.erase( liter );
+     else s.objList.erase( liter );
 
      // internal shared pointer should have reference count decremented automatically.
    }
 
-   /// Interal remove function
-   /** @param key to remove */
-   void _remove( const std::string &key ) {
-     typename ObjectMap::iterator miter = objMap.find( key );
-     this->_remove( miter );
+
+   /// Run the clock hand to the next object to be evicted
+   /** @param s shard, which must be locked exclusively and have objects outside the window
+       @return object, at the hand
+    */
+   List_Iter _victim( Shard& s ) {
+     while( true ){
+       if( s.hand == s.objList.end() ) s.hand = s.objList.begin();
+       if( s.hand->referenced.load( std::memory_order_relaxed ) ){
+	 s.hand->referenced.store( false, std::memory_order_relaxed );
+	 s.hand->credit = s.hand->weight;
+       }
+       else if( s.hand->credit > 0 ) s.hand->credit--;
+       else return s.hand;
+       ++s.hand;
+     }
    }
 
-   // remember to add objSize.
-   size_t getRecordSize( const typename ObjectMap::iterator &miter ) {
-     return getRecordSize(miter->first, *(miter->second));
+
+   /// Return the number of passes of the clock hand an object has earned by its cost
+   /** @param s shard, which must be locked exclusively
+       @param cost cost of building the object, or 0 if unknown
+       @param size size accounted for the object
+    */
+   static unsigned char weigh( Shard& s, unsigned long cost, size_t size ) {
+     if( cost == 0 || size == 0 ) return 0;
+     double c = (double) cost / size;
+     s.meanCost = ( s.meanCost == 0 ) ? c : s.meanCost + ( c - s.meanCost ) / 16;
+     double w = c / s.meanCost;
+     return ( w >= CACHE_MAX_CREDIT ) ? CACHE_MAX_CREDIT : (unsigned char) w;
    }
 
-   virtual size_t getRecordSize( const std::string &key, const ValuePtr val ) = 0;
 
-   virtual std::string getIndex( const ValuePtr r ) = 0;
+   /// Evict objects until the shard fits within its size
+   /** @param s shard, which must be locked exclusively */
+   void _evict( Shard& s ) {
+
+     // Move objects that have left the admission window behind the clock hand. Each
+     // one displaces the objects at the hand only while it has been looked up more
+     // often than they have, and is itself evicted as soon as it has not
+     while( s.windowSize > s.windowMax ){
+       List_Iter candidate = s.window.begin();
+       candidate->windowed = false;
+       s.windowSize -= candidate->size;
+       s.objList.splice( s.hand, s.window, candidate );
+       unsigned int f = frequency( s, std::hash<Key>()( candidate->key ) );
+       while( s.currentSize > s.maxSize ){
+	 List_Iter victim = this->_victim( s );
+	 bool admitted = ( victim != candidate && f > frequency( s, std::hash<Key>()( victim->key ) ) );
+	 this->_remove( s, admitted ? victim : candidate );
+	 s.evictions++;
+	 if( !admitted ) break;
+       }
+     }
+
+     while( s.currentSize > s.maxSize && !s.objList.empty() ){
+       this->_remove( s, this->_victim( s ) );
+       s.evictions++;
+     }
+
+     // Anything left over is in the window
+     while( s.currentSize > s.maxSize && !s.window.empty() ){
+       this->_remove( s, s.window.begin() );
+       s.evictions++;
+     }
+   }
+
+
+   virtual size_t getRecordSize( const Key &key, const ValuePtr val ) = 0;
+
+   virtual Key getIndex( const ValuePtr r ) = 0;
 
    virtual time_t getTimestamp ( const ValuePtr r ) = 0;
 
+   /// Return the cost of rebuilding an object, in arbitrary units, or 0 if unknown
+   virtual unsigned long getCost( const ValuePtr r ) { return 0; }
+
    /// Constructor
-   /** @param max Maximum cache size in bytes or count */
-   explicit Cache( const size_t max ) :
+   /** @param max Maximum cache size in bytes or count
+       @param n number of shards, a power of two, each of which gets an equal share of max
+       @param p eviction policy
+       @param objects number of objects the cache is expected to hold, used to size the
+       frequency counters of the TinyLFU policy
+    */
+   explicit Cache( const size_t max, unsigned int n = 1, CachePolicy p = CACHE_CLOCK, size_t objects = 0 ) :
        maxSize(max),
-       currentSize(0),
-       objList(),
-       objMap()
-   {};
+       shardCount( n > 0 && (n & (n-1)) == 0 ? n : 1 ),
+       shards( new Shard[ shardCount ] ),
+       policy( p )
+   {
+     // Keep at least one counter per expected object, rounded up to a power of two
+     size_t width = 64;
+     while( policy == CACHE_TINYLFU && width < objects / shardCount ) width *= 2;
+
+     for( unsigned int i = 0; i < shardCount; i++ ){
+       Shard& s = shards[i];
+       s.hand = s.objList.end();
+       s.maxSize = maxSize / shardCount;
+       s.currentSize = 0;
+       s.meanCost = 0;
+       s.windowSize = 0;
+       s.windowMax = ( policy == CACHE_TINYLFU ) ? s.maxSize * CACHE_WINDOW_PERCENT / 100 : 0;
+       s.hits = 0;
+       s.misses = 0;
+       s.insertions = s.evictions = s.removals = 0;
+       s.hotCount = 0;
+       s.hotMin = 0;
+       s.samples = 0;
+       s.sketchMask = 0;
+       if( policy == CACHE_TINYLFU ){
+	 s.sketch.reset( new std::atomic<unsigned char>[ width ] );
+	 for( size_t j = 0; j < width; j++ ) s.sketch[j] = 0;
+	 s.sketchMask = width - 1;
+       }
+     }
+   };
 
 
   public:
@@ -216,14 +586,27 @@ class Cache {
    }
 
    void clear() {
+     for( unsigned int i = 0; i < shardCount; i++ ){
+       Shard& s = shards[i];
+       std::lock_guard<RWLock> lock( s.lock );
 #if !defined(HAS_SHARED_PTR)
-     for (List_Iter it = objList.begin(); it != objList.end(); ++it) {
-       delete *it;
-     }
+       for (List_Iter it = s.objList.begin(); it != s.objList.end(); ++it) {
+	 delete it->value;
+       }
+       for (List_Iter it = s.window.begin(); it != s.window.end(); ++it) {
+	 delete it->value;
+       }
 #endif
-
-     objList.clear();
-     objMap.clear();
+       s.objList.clear();
+       s.window.clear();
+       s.objMap.clear();
+       s.hand = s.objList.end();
+       s.currentSize = 0;
+       s.windowSize = 0;
+       s.hotCount = 0;
+       s.hotMin = 0;
+     }
+     cleared();
 
      // shared pointers deleter called automatically.
    }
@@ -239,159 +622,537 @@ class Cache {
      // make a local copy of the POINTER
      ValuePtr r(rt);
 
-     std::string key = this->getIndex( r );
+     Key key = this->getIndex( r );
+
+     // Update our total current size variable BEFORE moving it
+     size_t size = getRecordSize(key, r);
 
-     // Touch the key, if it exists
-     typename ObjectMap::iterator miter = this->_touch( key );
+     Shard& s = shard( std::hash<Key>()( key ) );
+     std::lock_guard<RWLock> lock( s.lock );
 
      // Check whether this tile exists in our cache
-     if( miter != objMap.end() ){
+     typename ObjectMap::iterator miter = s.objMap.find( key );
+     if( miter != s.objMap.end() ){
        // Check the timestamp and delete if necessary
-       if( getTimestamp(*(miter->second)) < getTimestamp(r) ){
-         this->_remove( miter );  // old RawTile will be destroyed when no one else is using it.
+       if( getTimestamp( miter->second->value ) < getTimestamp(r) ){
+         this->_remove( s, miter->second );  // old RawTile will be destroyed when no one else is using it.
+         s.removals++;
        }
        // If this index already exists and it is up to date, do nothing
        else return;  // r will be destroyed properly, leaving miter.
      }
 
-     // Update our total current size variable BEFORE moving it. Use the string::capacity function
-     // rather than length() as std::string can allocate slightly more than necessary
-     // The +1 is for the terminating null byte
-     currentSize += getRecordSize(key, r);
-
-     // Store the key if it doesn't already exist in our cache
-     // Ok, do the actual insert at the head of the list
-     objList.push_front( r );
-
-     // And store this in our map
-     List_Iter liter = objList.begin();
-     objMap[ key ] = liter;
-
+     // Add the object to the end of the admission window or, with CLOCK, just behind
+     // the clock hand, so that it is the last the hand reaches
+     bool windowed = ( policy == CACHE_TINYLFU );
+     List_Iter liter = windowed ? s.window.emplace( s.window.end() ) : s.objList.emplace( s.hand );
+     liter->key = key;
+     liter->value = r;
+     liter->size = size;
+     liter->referenced = false;
+     liter->hits = 0;
+     liter->inserted = time( NULL );
+     liter->used = liter->inserted;
+     liter->windowed = windowed;
+     liter->hot = false;
+     liter->weight = liter->credit = weigh( s, getCost( r ), size );
+     s.objMap[ key ] = liter;
+     s.currentSize += size;
+     if( windowed ) s.windowSize += size;
+     s.insertions++;
+     added( key, r, size );
+
+     if( policy == CACHE_TINYLFU ) age( s );
+
+     // Evict objects if we now exceed our share of the maximum size
+     this->_evict( s );
+   }
 
 
-     // Check to see if we need to remove an element due to exceeding max_size
-     while( currentSize > maxSize ) {
-       // Remove the last element
-       liter = objList.end();
-       --liter;
-       key = this->getIndex( *liter );
-       this->_remove( key );
+   /// Return the number of tiles in the cache
+   unsigned int getNumElements() {
+     unsigned int n = 0;
+     for( unsigned int i = 0; i < shardCount; i++ ){
+       SharedLock lock( shards[i].lock );
+       n += shards[i].objMap.size();
      }
-
+     return n;
    }
 
 
-   /// Return the number of tiles in the cache
-   unsigned int getNumElements() { return objList.size(); }
+   /// Return the total size of the objects in the cache, in bytes or count
+   size_t getSize() {
+     size_t size = 0;
+     for( unsigned int i = 0; i < shardCount; i++ ){
+       SharedLock lock( shards[i].lock );
+       size += shards[i].currentSize;
+     }
+     return size;
+   }
 
 
    /// Get a tile from the cache
    /**
-    *  @param f filename
-    *  @param r resolution number
-    *  @param t tile number
-    *  @param h horizontal sequence number
-    *  @param v vertical sequence number
-    *  @param c compression type
-    *  @param q compression quality
+    *  @param key index of the tile
     *  @return pointer to data or NULL on error
     */
-   ValuePtr getObject( const std::string &key ) {
+   ValuePtr getObject( const Key &key ) {
+     return this->_lookup( key, true );
+   }
 
-     if( maxSize == 0 ) return NULL;
 
-     typename ObjectMap::iterator miter = objMap.find( key );
-     if( miter == objMap.end() ) return ValuePtr();
+   void evict( const ValuePtr rt ) {
+     Key key = this->getIndex( rt );
+     Shard& s = shard( std::hash<Key>()( key ) );
+     std::lock_guard<RWLock> lock( s.lock );
+     typename ObjectMap::iterator miter = s.objMap.find( key );
+     if( miter == s.objMap.end() ) return;
+     this->_remove( s, miter->second );
+     s.removals++;
+   }
 
-     this->_touch( key );
 
-     return ValuePtr(*(miter->second));
+   /// Remove the objects that have not been used for a while
+   /** @param seconds time since an object was last looked up or added
+       @return number of objects removed
+    */
+   unsigned int removeIdle( time_t seconds ) {
+     unsigned int n = 0;
+     time_t now = time( NULL );
+     for( unsigned int i = 0; i < shardCount; i++ ){
+       Shard& s = shards[i];
+       std::lock_guard<RWLock> lock( s.lock );
+       std::vector<List_Iter> idle;
+       for( typename ObjectMap::iterator m = s.objMap.begin(); m != s.objMap.end(); ++m ){
+	 if( now - m->second->used.load( std::memory_order_relaxed ) >= seconds ) idle.push_back( m->second );
+       }
+       for( typename std::vector<List_Iter>::iterator l = idle.begin(); l != idle.end(); ++l ){
+	 this->_remove( s, *l );
+	 s.removals++;
+       }
+       n += idle.size();
+     }
+     return n;
    }
 
 
-   void evict( const ValuePtr rt ) {
-     std::string key = this->getIndex( rt );
-     this->_remove( key );
+   /// Usage counters since startup
+   struct Statistics {
+     unsigned long hits;         ///< lookups that found an object
+     unsigned long misses;       ///< lookups that did not
+     unsigned long insertions;   ///< objects added
+     unsigned long evictions;    ///< objects removed to make room
+     unsigned long removals;     ///< objects removed as out of date or idle
+     unsigned long elements;     ///< objects currently held
+   };
+
+   /// Return our usage counters
+   Statistics getStatistics() {
+     Statistics t = { 0, 0, 0, 0, 0, 0 };
+     for( unsigned int i = 0; i < shardCount; i++ ){
+       Shard& s = shards[i];
+       SharedLock lock( s.lock );
+       t.hits += s.hits.load( std::memory_order_relaxed );
+       t.misses += s.misses.load( std::memory_order_relaxed );
+       t.insertions += s.insertions;
+       t.evictions += s.evictions;
+       t.removals += s.removals;
+       t.elements += s.objMap.size();
+     }
+     return t;
+   }
+
+
+   /// Usage of a single object
+   struct EntryStatistics {
+     Key key;
+     unsigned long hits;     ///< lookups that found the object since it was added
+     time_t age;             ///< seconds since it was added
+     time_t idle;            ///< seconds since it was last used
+     size_t size;            ///< size accounted for the object
+   };
+
+   /// Return the most used objects
+   /** Up to CACHE_HOT_KEYS objects are read from the list each shard keeps as objects are
+       hit, without a scan. Larger numbers walk every object
+       @param n maximum number of objects to return, or 0 for all of them
+       @return objects in order of decreasing hits
+    */
+   std::vector<EntryStatistics> getEntries( unsigned int n ) {
+     std::vector<EntryStatistics> entries;
+     time_t now = time( NULL );
+     for( unsigned int i = 0; i < shardCount; i++ ){
+       Shard& s = shards[i];
+       SharedLock lock( s.lock );
+       if( n > 0 && n <= CACHE_HOT_KEYS ){
+	 std::lock_guard<std::mutex> hot( s.hotMutex );
+	 for( unsigned int j = 0; j < s.hotCount; j++ ) entries.push_back( statistics( *s.hot[j], now ) );
+       }
+       else{
+	 for( typename ObjectMap::const_iterator m = s.objMap.begin(); m != s.objMap.end(); ++m ){
+	   entries.push_back( statistics( *(m->second), now ) );
+	 }
+       }
+     }
+     if( n == 0 || n > entries.size() ) n = entries.size();
+     std::partial_sort( entries.begin(), entries.begin() + n, entries.end(), moreHits );
+     entries.resize( n );
+     return entries;
+   }
+
+  private:
+
+   static EntryStatistics statistics( const Entry& e, time_t now ) {
+     EntryStatistics es;
+     es.key = e.key;
+     es.hits = e.hits.load( std::memory_order_relaxed );
+     es.age = now - e.inserted;
+     es.idle = now - e.used.load( std::memory_order_relaxed );
+     es.size = e.size;
+     return es;
    }
 
+   static bool moreHits( const EntryStatistics& a, const EntryStatistics& b ) {
+     return a.hits > b.hits;
+   }
+
+  public:
+
    /// Return the amount of cache used, in units defined by the subclass.
    virtual float getMemorySize() = 0;
 
 };
 
-class TileCache : public Cache<std::string, RawTile> {
+class TileCache : public Cache<TileKey, RawTile> {
 
   protected:
 
-   typedef Cache<std::string, RawTile> BaseCacheType;
+   typedef Cache<TileKey, RawTile> BaseCacheType;
 
-  /// Main cache storage typedef  Don't need to store key in list again.
+  /// Main cache storage typedef
   typedef BaseCacheType::ObjectList ObjectList;
   /// Main cache list iterator typedef
   typedef BaseCacheType::List_Iter List_Iter;
   /// Index typedef
   typedef BaseCacheType::ObjectMap ObjectMap;
+  /// Cache entry typedef
+  typedef BaseCacheType::Entry Entry;
 
 
   /// Basic object storage size
   const int objSize;
 
+  /// Optional cross-process shared memory cache behind this one
+  SharedTileCache* shared;
+
+  /// Optional persistent cache of encoded tiles on disk
+  DiskTileCache* disk;
+
+  /// Optional cache shared with other servers through memcached
+  MemcachedTileCache* memcached;
+
+  /// A tile being decoded or composed by one thread, for which others may be waiting
+  struct Flight {
+    bool done;
+    RawTilePtr tile;
+    std::exception_ptr error;
+    std::condition_variable finished;
+  };
+
+  /// Tiles currently being built, indexed by key
+  HASHMAP <TileKey, std::shared_ptr<Flight> > flights;
+  std::mutex flightMutex;
+
+ public:
+
+  /// Memory held by the tiles of a single image
+  struct ImageUsage {
+    size_t bytes;
+    size_t tiles;
+    std::map<int,size_t> resolutions;   ///< bytes held at each resolution
+    ImageUsage() : bytes(0), tiles(0) {};
+  };
+
+ protected:
+
+  /// Memory held per image path. The shards share this, so it has its own lock
+  std::map<std::string, ImageUsage> usage;
+  std::mutex usageMutex;
+
+  /// Lookups per compression type
+  std::atomic<unsigned long> compressionHits[PNG+1];
+  std::atomic<unsigned long> compressionMisses[PNG+1];
+
+
+  virtual void lookedUp( const TileKey &key, bool hit ) {
+    int c = key.compression;
+    if( c > PNG ) return;
+    if( hit ) compressionHits[c].fetch_add( 1, std::memory_order_relaxed );
+    else compressionMisses[c].fetch_add( 1, std::memory_order_relaxed );
+  }
+
+  virtual void added( const TileKey &key, const RawTilePtr val, size_t size ) {
+    std::lock_guard<std::mutex> lock( usageMutex );
+    ImageUsage& u = usage[val->filename];
+    u.bytes += size;
+    u.tiles++;
+    u.resolutions[val->resolution] += size;
+  }
+
+  virtual void removed( const TileKey &key, const RawTilePtr val, size_t size ) {
+    std::lock_guard<std::mutex> lock( usageMutex );
+    std::map<std::string, ImageUsage>::iterator i = usage.find( val->filename );
+    if( i == usage.end() ) return;
+    ImageUsage& u = i->second;
+    u.bytes -= size;
+    if( --u.tiles == 0 ){
+      usage.erase( i );
+      return;
+    }
+    std::map<int,size_t>::iterator r = u.resolutions.find( val->resolution );
+    if( r != u.resolutions.end() && (r->second -= size) == 0 ) u.resolutions.erase( r );
+  }
+
+  virtual void cleared() {
+    std::lock_guard<std::mutex> lock( usageMutex );
+    usage.clear();
+  }
+
+
+  /// Look up a tile, falling back to the shared memory cache if we have one
+  RawTilePtr find( const TileKey &key, bool count ) {
+    RawTilePtr tile = BaseCacheType::_lookup( key, count );
+    if( tile || !shared ) return tile;
+    tile = shared->getObject( key.str() );
+    // Keep a private copy so that repeated requests avoid the shared lock
+    if( tile ){
+      tile->imageId = key.image;
+      BaseCacheType::insert( tile );
+    }
+    return tile;
+  }
+
   // can store list iterators in map because list iterators are not affected by insert/delete etc to list.
 
-  // remember to add objSize.
-  virtual size_t getRecordSize( const std::string &key, const RawTilePtr val ) {
+  // remember to add objSize. The key is held within the entry, so only the tile's
+  // own copy of its file name is held outside of it
+  virtual size_t getRecordSize( const TileKey &key, const RawTilePtr val ) {
     return ( val->dataLength +
-            ( val->filename.capacity() + key.capacity() ) * sizeof(char) +
+            val->filename.capacity() * sizeof(char) +
         this->objSize );
   }
 
 
-  virtual std::string getIndex( const RawTilePtr r ) {
-    return TileCache::getIndex( r->filename, r->resolution, r->tileNum,
-                     r->hSequence, r->vSequence, r->compressionType, r->quality );
+  /// Tiles carry the id of their image from when it was opened, so this needs no look up of
+  /// the path. The path is only interned for a tile made without one
+  virtual TileKey getIndex( const RawTilePtr r ) {
+    return TileKey( r->imageId ? r->imageId : TileKey::intern( r->filename ), r->resolution, r->tileNum,
+                    r->hSequence, r->vSequence, r->compressionType, r->quality );
   }
 
   virtual time_t getTimestamp ( const RawTilePtr r ) {
     return r->timestamp;
   }
 
+  virtual unsigned long getCost( const RawTilePtr r ) {
+    return r->cost;
+  }
+
 
  public:
 
+  /// Number of shards to use for a cache size
+  /** Use up to TILE_CACHE_SHARDS, but keep at least TILE_CACHE_SHARD_SIZE bytes in each,
+      so that a small cache is not split into shards too small to hold a working set
+      @param max maximum cache size in bytes
+   */
+  static unsigned int shardsFor( size_t max ) {
+    unsigned int n = TILE_CACHE_SHARDS;
+    while( n > 1 && max / n < TILE_CACHE_SHARD_SIZE ) n /= 2;
+    return n;
+  }
+
   /// Constructor
-  /** @param max Maximum cache size in MBs */
-  explicit TileCache( float max ) :
+  /** @param max Maximum cache size in MBs
+      @param policy eviction policy
+   */
+  explicit TileCache( float max, CachePolicy policy = CACHE_CLOCK ) :
+   BaseCacheType( ceil(max * 1024.0 * 1024.0), shardsFor( ceil(max * 1024.0 * 1024.0) ), policy,
+		  ceil(max * 1024.0 * 1024.0) / TILE_CACHE_MEAN_TILE_SIZE ),
    objSize(sizeof( RawTile ) +
-           sizeof( RawTilePtr ) +
-           sizeof( List_Iter ) +
-           sizeof( std::pair<std::string, List_Iter> ) +
-           sizeof(char) * 64), BaseCacheType(ceil(max * 1024.0 * 1024.0)) {};
-  // 64 chars added at the end represents an average string length
+           sizeof( Entry ) +
+           sizeof( std::pair<TileKey, List_Iter> ) ), shared(NULL), disk(NULL), memcached(NULL) {
+    for( int i = 0; i <= PNG; i++ ) compressionHits[i] = compressionMisses[i] = 0;
+  };
 
 
   /// Destructor
   virtual ~TileCache() {}
 
 
+  /// Use a shared memory cache as a second tier
+  /** @param s attached shared memory cache, or NULL to disable */
+  void setSharedCache( SharedTileCache* s ) { shared = s; }
+
+
+  /// Return the shared memory cache, if any
+  SharedTileCache* getSharedCache() { return shared; }
+
+
+  /// Use a disk cache for encoded tiles
+  /** TileManager consults it on a miss for an encoded tile before decoding one, and
+      stores the tiles it encodes in it
+      @param d open disk cache, or NULL to disable
+   */
+  void setDiskCache( DiskTileCache* d ) { disk = d; }
+
+
+  /// Return the disk cache, if any
+  DiskTileCache* getDiskCache() { return disk; }
+
+
+  /// Use memcached as a cache behind this one
+  /** TileManager consults it on a miss before decoding a tile, and stores the tiles it
+      decodes and encodes in it
+      @param m connected memcached cache, or NULL to disable
+   */
+  void setMemcachedCache( MemcachedTileCache* m ) { memcached = m; }
+
+
+  /// Return the memcached cache, if any
+  MemcachedTileCache* getMemcachedCache() { return memcached; }
+
+
+  /// Check whether a tile is cached, without counting this as a lookup
+  /** @param key tile index (see getIndex)
+      @return whether the tile is held here or in the shared memory cache
+   */
+  bool contains( const TileKey &key ) {
+    return (bool) find( key, false );
+  }
+
+
+  /// Get a tile from the cache, falling back to the shared memory cache if we have one
+  /** @param key tile index (see getIndex)
+      @return tile or an empty pointer if not cached
+   */
+  RawTilePtr getObject( const TileKey &key ) {
+    return find( key, true );
+  }
+
+
+  /// Insert a tile into this cache and, if it is encoded, into the shared memory cache if we have one
+  /** Raw tiles are several times the size of their JPEG or DEFLATE encoding and are
+      cheap to recreate from an encoded tile, so copying them into the shared segment
+      would only crowd it and its locks
+      @param r tile to be inserted */
+  void insert( const RawTilePtr r ) {
+    BaseCacheType::insert( r );
+    if( shared && r && r->compressionType != UNCOMPRESSED ) shared->insert( getIndex( r ).str(), r );
+  }
+
+
+  /// Evict a tile from this cache and from the shared memory cache if we have one
+  /** @param r tile to be evicted */
+  void evict( const RawTilePtr r ) {
+    BaseCacheType::evict( r );
+    if( shared && r ) shared->evict( getIndex( r ).str() );
+  }
+
+
+  /// Build a tile that was not found in the cache, coalescing concurrent requests for it
+  /** The first thread to ask for a key builds the tile, while any others asking for the
+      same key in the meantime wait for and share its result or its exception. The build
+      function is responsible for inserting the tile into the cache. A thread asking again
+      for a key it is itself building, through recursion, builds it directly.
+      @param key tile index (see getIndex)
+      @param build function that decodes or composes the tile
+      @param timestamp minimum timestamp for a tile found in the cache to be accepted
+      @return tile
+   */
+  RawTilePtr getOrBuild( const TileKey& key, const std::function<RawTilePtr()>& build, time_t timestamp = 0 ) {
+
+    // Keys being built by this thread
+    static thread_local std::vector<TileKey> building;
+    if( std::find( building.begin(), building.end(), key ) != building.end() ) return build();
+
+    std::shared_ptr<Flight> flight;
+    {
+      std::unique_lock<std::mutex> lock( flightMutex );
+
+      HASHMAP <TileKey, std::shared_ptr<Flight> >::iterator i = flights.find( key );
+      if( i != flights.end() ){
+	flight = i->second;
+	while( !flight->done ) flight->finished.wait( lock );
+	if( flight->error ) std::rethrow_exception( flight->error );
+	return flight->tile;
+      }
+
+      // The tile may have been inserted by a build that finished since our caller looked
+      RawTilePtr tile = find( key, false );
+      if( tile && tile->timestamp >= timestamp ) return tile;
+
+      flight = std::make_shared<Flight>();
+      flight->done = false;
+      flights[key] = flight;
+    }
+
+    building.push_back( key );
+    try{
+      flight->tile = build();
+    }
+    catch( ... ){
+      flight->error = std::current_exception();
+    }
+    building.pop_back();
+
+    {
+      std::lock_guard<std::mutex> lock( flightMutex );
+      flight->done = true;
+      flights.erase( key );
+    }
+    flight->finished.notify_all();
+
+    if( flight->error ) std::rethrow_exception( flight->error );
+    return flight->tile;
+  }
+
+
   /// Create a hash index
   /** 
-   *  @param f filename
+   *  @param i image id (see IIPImage::getImageId)
    *  @param r resolution number
    *  @param t tile number
    *  @param h horizontal sequence number
    *  @param v vertical sequence number
    *  @param c compression type
    *  @param q compression quality
-   *  @return string
+   *  @return key
    */
-  static std::string getIndex( std::string f, int r, int t, int h, int v, CompressionType c, int q ) {
-    char tmp[1024];
-    snprintf( tmp, 1024, "%s:%d:%d:%d:%d:%d:%d", f.c_str(), r, t, h, v, c, q );
-    return std::string( tmp );
+  static TileKey getIndex( uint32_t i, int r, int t, int h, int v, CompressionType c, int q ) {
+    return TileKey( i, r, t, h, v, c, q );
   }
 
   virtual float getMemorySize() {
-    return currentSize / (1024.0 * 1024.0);
+    return getSize() / (1024.0 * 1024.0);
+  }
+
+
+  /// Return the memory held by the tiles of each image
+  std::map<std::string, ImageUsage> getUsage() {
+    std::lock_guard<std::mutex> lock( usageMutex );
+    return usage;
+  }
+
+
+  /// Return the number of hits and misses for a compression type
+  /** @param c compression type
+      @param h set to the number of hits
+      @param m set to the number of misses
+   */
+  void getCompressionStatistics( CompressionType c, unsigned long& h, unsigned long& m ) {
+    h = compressionHits[c].load( std::memory_order_relaxed );
+    m = compressionMisses[c].load( std::memory_order_relaxed );
   }
 
 
@@ -407,19 +1168,21 @@ class ImageCache : public Cache<std::string, IIPImage> {
    typedef Cache<std::string, IIPImage> BaseCacheType;
 
 
-  /// Main cache storage typedef  Don't need to store key in list again.
+  /// Main cache storage typedef
   typedef BaseCacheType::ObjectList ObjectList;
   /// Main cache list iterator typedef
   typedef BaseCacheType::List_Iter List_Iter;
   /// Index typedef
   typedef BaseCacheType::ObjectMap ObjectMap;
+  /// Cache entry typedef
+  typedef BaseCacheType::Entry Entry;
 
 
   // can store list iterators in map because list iterators are not affected by insert/delete etc to list.
 
-  // remember to add objSize.
+  /// Account for each image by the memory held by its decoder
   virtual size_t getRecordSize( const std::string &key, const IIPImagePtr val ) {
-    return 1;
+    return val->getMemorySize() + key.capacity() + sizeof( Entry );
   }
 
   virtual std::string getIndex( const IIPImagePtr r ) {
@@ -435,17 +1198,16 @@ class ImageCache : public Cache<std::string, IIPImage> {
  public:
 
   /// Constructor
-  /** @param max Maximum cache size in number of IIPImage Objects */
-  explicit ImageCache( int max ) : BaseCacheType(max) {};
-  // 64 chars added at the end represents an average string length
+  /** @param max Maximum cache size in MB */
+  explicit ImageCache( float max ) : BaseCacheType( (size_t) ( max * 1024.0 * 1024.0 ) ) {};
 
 
   /// Destructor
   virtual ~ImageCache() {}
 
-  // get number of image objects.
+  /// Return the approximate memory held by the open images in MB
   virtual float getMemorySize() {
-    return currentSize;
+    return getSize() / (1024.0 * 1024.0);
   }
 
 };
@@ -0,0 +1,465 @@
+// Member functions for DiskTileCache.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "DiskTileCache.h"
+
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+#include <cstdio>
+#include <algorithm>
+
+#ifndef WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/file.h>
+#endif
+
+
+using namespace std;
+
+
+// Identifies a record and its layout version
+#define DISK_MAGIC 0x49504454
+#define DISK_VERSION 1
+
+// Size at which we start a new segment
+#define DISK_SEGMENT_SIZE 67108864
+
+// Minimum number of segments the cache is split into, so that deleting one only loses a fraction of it
+#define DISK_MIN_SEGMENTS 8
+
+// File name suffix of segments
+#define DISK_SUFFIX ".seg"
+
+// Name of the lock file held by the process using the directory
+#define DISK_LOCK "lock"
+
+
+/// Followed by the file name and the tile data
+struct DiskTileCache::Record {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t length;
+  uint32_t filenameLength;
+  int32_t dataLength;
+  int32_t tileNum;
+  int32_t resolution;
+  int32_t hSequence;
+  int32_t vSequence;
+  int32_t compressionType;
+  int32_t quality;
+  uint32_t width;
+  uint32_t height;
+  int32_t channels;
+  int32_t bpc;
+  int32_t sampleType;
+  int32_t padded;
+  int32_t reserved;
+  int64_t timestamp;
+};
+
+
+
+#ifndef WIN32
+
+
+DiskTileCache::Segment::~Segment()
+{
+  if( fd >= 0 ) close( fd );
+}
+
+
+
+DiskTileCache::DiskTileCache( const string& directory, float size ) :
+  _directory( directory ),
+  _lock( -1 ),
+  _maxSize( (uint64_t) ceil( size * 1024.0 * 1024.0 ) ),
+  _size( 0 ),
+  _open( false )
+{
+  _hits = 0;
+  _misses = 0;
+
+  _segmentSize = std::min( (uint64_t) DISK_SEGMENT_SIZE, _maxSize / DISK_MIN_SEGMENTS );
+  if( _maxSize == 0 || _segmentSize == 0 ){
+    _error = "disk tile cache size is too small";
+    return;
+  }
+
+  if( _directory.empty() ){
+    _error = "no directory given";
+    return;
+  }
+  if( _directory[_directory.size()-1] != '/' ) _directory += '/';
+
+  if( mkdir( _directory.c_str(), 0700 ) != 0 && errno != EEXIST ){
+    _error = "unable to create directory '" + _directory + "': " + strerror( errno );
+    return;
+  }
+
+  // Only one process may use the directory. The lock goes when we close the file or exit
+  string lockfile = _directory + DISK_LOCK;
+  _lock = open( lockfile.c_str(), O_RDWR | O_CREAT, 0600 );
+  if( _lock < 0 ){
+    _error = "unable to open lock file '" + lockfile + "': " + strerror( errno );
+    return;
+  }
+  if( flock( _lock, LOCK_EX | LOCK_NB ) != 0 ){
+    _error = ( errno == EWOULDBLOCK ) ? "directory '" + _directory + "' is in use by another process" :
+      "unable to lock '" + lockfile + "': " + strerror( errno );
+    close( _lock );
+    _lock = -1;
+    return;
+  }
+
+  DIR* dir = opendir( _directory.c_str() );
+  if( !dir ){
+    _error = "unable to open directory '" + _directory + "': " + strerror( errno );
+    return;
+  }
+
+  // Segments are named after the time at which they were created, so that sorting
+  // their names puts them in age order
+  vector<string> names;
+  struct dirent* entry;
+  while( (entry = readdir( dir )) ){
+    string name = entry->d_name;
+    if( name.size() > strlen(DISK_SUFFIX) &&
+	name.compare( name.size() - strlen(DISK_SUFFIX), string::npos, DISK_SUFFIX ) == 0 ){
+      names.push_back( name );
+    }
+  }
+  closedir( dir );
+  sort( names.begin(), names.end() );
+
+  for( vector<string>::const_iterator i = names.begin(); i != names.end(); i++ ){
+    SegmentPtr segment( new Segment );
+    segment->id = strtoull( i->c_str(), NULL, 16 );
+    segment->path = _directory + *i;
+    segment->fd = open( segment->path.c_str(), O_RDONLY );
+    segment->size = 0;
+    if( segment->fd < 0 ) continue;
+    load( segment );
+    _segments.push_back( segment );
+    _size += segment->size;
+  }
+
+  lock_guard<mutex> lock( _mutex );
+  trim();
+  _open = true;
+}
+
+
+
+DiskTileCache::~DiskTileCache()
+{
+  // Segments are closed once the last reference to them goes
+  if( _lock >= 0 ) close( _lock );
+}
+
+
+
+void DiskTileCache::load( const SegmentPtr& segment )
+{
+  struct stat sb;
+  if( fstat( segment->fd, &sb ) != 0 ) return;
+  uint64_t file_size = sb.st_size;
+
+  // Read the headers in turn, stopping at the first that is incomplete or damaged,
+  // such as a tile that was being written when its process died
+  uint64_t offset = 0;
+  Record record;
+  vector<char> filename;
+
+  while( offset + sizeof(Record) <= file_size ){
+
+    if( pread( segment->fd, &record, sizeof(Record), offset ) != (ssize_t) sizeof(Record) ) break;
+    if( record.magic != DISK_MAGIC || record.version != DISK_VERSION ) break;
+    if( record.length != sizeof(Record) + record.filenameLength + (uint64_t) record.dataLength ) break;
+    if( offset + record.length > file_size ) break;
+
+    filename.resize( record.filenameLength );
+    if( record.filenameLength > 0 &&
+	pread( segment->fd, &filename[0], record.filenameLength, offset + sizeof(Record) ) != (ssize_t) record.filenameLength ) break;
+
+    TileKey key( TileKey::intern( string( filename.begin(), filename.end() ) ), record.resolution,
+		 record.tileNum, record.hSequence, record.vSequence,
+		 (CompressionType) record.compressionType, record.quality );
+    index( key, segment, offset, record.length, record.timestamp );
+
+    offset += record.length;
+  }
+
+  segment->size = offset;
+}
+
+
+
+void DiskTileCache::index( const TileKey& key, const SegmentPtr& segment, uint64_t offset, uint32_t length, time_t timestamp )
+{
+  // Later records replace earlier ones
+  Location& location = _index[key];
+  location.segment = segment;
+  location.offset = offset;
+  location.length = length;
+  location.timestamp = timestamp;
+  segment->keys.push_back( key );
+}
+
+
+
+bool DiskTileCache::create()
+{
+  struct timeval tv;
+  gettimeofday( &tv, NULL );
+  uint64_t id = (uint64_t) tv.tv_sec * 1000000 + tv.tv_usec;
+  if( !_segments.empty() && id <= _segments.back()->id ) id = _segments.back()->id + 1;
+
+  // Never write over an existing segment
+  for( int n = 0; n < 100; n++, id++ ){
+    char name[64];
+    snprintf( name, 64, "%016llx%s", (unsigned long long) id, DISK_SUFFIX );
+    string path = _directory + name;
+    int fd = open( path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600 );
+    if( fd >= 0 ){
+      _current = SegmentPtr( new Segment );
+      _current->id = id;
+      _current->path = path;
+      _current->fd = fd;
+      _current->size = 0;
+      _segments.push_back( _current );
+      return true;
+    }
+    if( errno != EEXIST ) break;
+  }
+
+  _current.reset();
+  return false;
+}
+
+
+
+void DiskTileCache::trim()
+{
+  while( _size > _maxSize && !_segments.empty() ){
+
+    SegmentPtr oldest = _segments.front();
+    _segments.pop_front();
+    _size -= oldest->size;
+    if( oldest == _current ) _current.reset();
+
+    // Drop the tiles that are still indexed to this segment
+    for( vector<TileKey>::const_iterator k = oldest->keys.begin(); k != oldest->keys.end(); k++ ){
+      DISK_INDEX <TileKey, Location>::iterator i = _index.find( *k );
+      if( i != _index.end() && i->second.segment == oldest ) _index.erase( i );
+    }
+
+    // Readers still holding the segment can carry on, as the file is only closed once they are done
+    unlink( oldest->path.c_str() );
+  }
+}
+
+
+
+void DiskTileCache::insert( const RawTilePtr tile )
+{
+  if( !_open || !tile || !tile->data || tile->dataLength <= 0 ) return;
+
+  uint64_t length = sizeof(Record) + tile->filename.size() + tile->dataLength;
+
+  // Don't let a single large tile or region take up a whole segment
+  if( length > _segmentSize / 4 ) return;
+
+  Record record;
+  memset( &record, 0, sizeof(Record) );
+  record.magic = DISK_MAGIC;
+  record.version = DISK_VERSION;
+  record.length = length;
+  record.filenameLength = tile->filename.size();
+  record.dataLength = tile->dataLength;
+  record.tileNum = tile->tileNum;
+  record.resolution = tile->resolution;
+  record.hSequence = tile->hSequence;
+  record.vSequence = tile->vSequence;
+  record.compressionType = tile->compressionType;
+  record.quality = tile->quality;
+  record.width = tile->width;
+  record.height = tile->height;
+  record.channels = tile->channels;
+  record.bpc = tile->bpc;
+  record.sampleType = tile->sampleType;
+  record.padded = tile->padded;
+  record.timestamp = tile->timestamp;
+
+  // Write the whole record at once
+  vector<char> buffer( length );
+  memcpy( &buffer[0], &record, sizeof(Record) );
+  memcpy( &buffer[sizeof(Record)], tile->filename.data(), tile->filename.size() );
+  memcpy( &buffer[sizeof(Record) + tile->filename.size()], tile->data, tile->dataLength );
+
+  TileKey key( tile->imageId ? tile->imageId : TileKey::intern( tile->filename ), tile->resolution, tile->tileNum,
+	       tile->hSequence, tile->vSequence, tile->compressionType, tile->quality );
+
+  lock_guard<mutex> lock( _mutex );
+
+  if( !_current || _current->size + length > _segmentSize ){
+    if( !create() ) return;
+  }
+
+  uint64_t offset = _current->size;
+  if( pwrite( _current->fd, &buffer[0], length, offset ) != (ssize_t) length ){
+    // Most likely the disk is full: stop writing to this segment
+    _current.reset();
+    return;
+  }
+
+  _current->size += length;
+  _size += length;
+  index( key, _current, offset, length, tile->timestamp );
+
+  trim();
+}
+
+
+
+RawTilePtr DiskTileCache::getObject( const TileKey& key, time_t timestamp )
+{
+  if( !_open ) return RawTilePtr();
+
+  Location location;
+  {
+    lock_guard<mutex> lock( _mutex );
+    DISK_INDEX <TileKey, Location>::const_iterator i = _index.find( key );
+    if( i == _index.end() || i->second.timestamp < timestamp ){
+      _misses.fetch_add( 1, memory_order_relaxed );
+      return RawTilePtr();
+    }
+    location = i->second;
+  }
+
+  // Read without holding the lock, so that lookups proceed in parallel. The header and
+  // file name come first, so that the tile data can then be read straight into the tile
+  string filename = TileKey::path( key.image );
+  uint64_t header = sizeof(Record) + filename.size();
+  vector<char> buffer( header );
+  Record record;
+  if( header > location.length ||
+      pread( location.segment->fd, &buffer[0], header, location.offset ) != (ssize_t) header ){
+    _misses.fetch_add( 1, memory_order_relaxed );
+    return RawTilePtr();
+  }
+  memcpy( &record, &buffer[0], sizeof(Record) );
+
+  // Check that this really is our tile
+  if( record.magic != DISK_MAGIC || record.length != location.length ||
+      record.filenameLength != filename.size() || record.dataLength < 0 ||
+      record.length != header + (uint64_t) record.dataLength ||
+      record.tileNum != key.tile || record.resolution != key.resolution ||
+      record.hSequence != key.hSequence || record.vSequence != key.vSequence ||
+      record.compressionType != key.compression || record.quality != key.quality ||
+      filename.compare( 0, string::npos, &buffer[sizeof(Record)], record.filenameLength ) != 0 ){
+    _misses.fetch_add( 1, memory_order_relaxed );
+    return RawTilePtr();
+  }
+
+  RawTilePtr tile( new RawTile( record.tileNum, record.resolution, record.hSequence, record.vSequence,
+				record.width, record.height, record.channels, record.bpc ) );
+  tile->compressionType = (CompressionType) record.compressionType;
+  tile->quality = record.quality;
+  tile->sampleType = (SampleType) record.sampleType;
+  tile->padded = record.padded;
+  tile->timestamp = record.timestamp;
+  tile->filename = filename;
+  tile->imageId = key.image;
+  tile->dataLength = record.dataLength;
+
+  // Allocate in the same way as RawTile so that its destructor frees correctly
+  switch( tile->bpc ){
+    case 32:
+      if( tile->sampleType == FLOATINGPOINT ) tile->data = new float[(tile->dataLength+3)/4];
+      else tile->data = new unsigned int[(tile->dataLength+3)/4];
+      break;
+    case 16:
+      tile->data = new unsigned short[(tile->dataLength+1)/2];
+      break;
+    default:
+      tile->data = new unsigned char[tile->dataLength];
+      break;
+  }
+  tile->memoryManaged = 1;
+
+  if( pread( location.segment->fd, tile->data, tile->dataLength, location.offset + header ) != (ssize_t) tile->dataLength ){
+    _misses.fetch_add( 1, memory_order_relaxed );
+    return RawTilePtr();
+  }
+
+  _hits.fetch_add( 1, memory_order_relaxed );
+  return tile;
+}
+
+
+
+size_t DiskTileCache::getNumElements()
+{
+  lock_guard<mutex> lock( _mutex );
+  return _index.size();
+}
+
+
+
+uint64_t DiskTileCache::getSize()
+{
+  lock_guard<mutex> lock( _mutex );
+  return _size;
+}
+
+
+
+#else
+
+
+// Not yet available on Windows
+
+DiskTileCache::Segment::~Segment(){}
+
+DiskTileCache::DiskTileCache( const string& directory, float size ) :
+  _directory( directory ), _lock( -1 ), _maxSize( 0 ), _segmentSize( 0 ), _size( 0 ), _open( false )
+{
+  _hits = 0;
+  _misses = 0;
+  _error = "the disk tile cache is not supported on this platform";
+}
+
+DiskTileCache::~DiskTileCache(){}
+
+void DiskTileCache::insert( const RawTilePtr tile ){}
+
+RawTilePtr DiskTileCache::getObject( const TileKey& key, time_t timestamp ){ return RawTilePtr(); }
+
+size_t DiskTileCache::getNumElements(){ return 0; }
+
+uint64_t DiskTileCache::getSize(){ return 0; }
+
+
+#endif
@@ -0,0 +1,178 @@
+// Persistent tile cache held on disk
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _DISKTILECACHE_H
+#define _DISKTILECACHE_H
+
+
+#include <string>
+#include <deque>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <stdint.h>
+#include "RawTile.h"
+#include "TileKey.h"
+
+#if defined(HAVE_UNORDERED_MAP)
+#include <unordered_map>
+#define DISK_INDEX std::unordered_map
+#elif defined(HAVE_TR1_UNORDERED_MAP)
+#include <tr1/unordered_map>
+#define DISK_INDEX std::tr1::unordered_map
+#else
+#include <map>
+#define DISK_INDEX std::map
+#endif
+
+
+
+/// Tile cache held in files on disk, to survive process restarts
+/** Intended for encoded tiles, which are small and expensive to recreate for slow
+    formats. Tiles are appended to segment files within a directory and are found
+    through an index held in memory, which is rebuilt by reading the segments back
+    when the cache is opened. Once the segments exceed the maximum size, the oldest
+    segment is deleted as a whole. A directory belongs to a single process, which holds
+    an exclusive lock on its lock file for as long as the cache is open, as neither the
+    size limit nor the deletion of segments could otherwise take account of the others.
+    A second process using the same directory fails to open the cache.
+ */
+
+class DiskTileCache {
+
+ private:
+
+  /// Header preceding each tile in a segment
+  struct Record;
+
+  /// A segment file. Closed when the last reader has finished with it
+  struct Segment {
+    uint64_t id;
+    std::string path;
+    int fd;
+    uint64_t size;
+    std::vector<TileKey> keys;   ///< tiles indexed in this segment
+    ~Segment();
+  };
+
+  typedef std::shared_ptr<Segment> SegmentPtr;
+
+  /// Position of a tile
+  struct Location {
+    SegmentPtr segment;
+    uint64_t offset;
+    uint32_t length;
+    time_t timestamp;
+  };
+
+  /// Directory holding the segments
+  std::string _directory;
+
+  /// Lock file giving us sole use of the directory
+  int _lock;
+
+  /// Maximum total size of the segments and the size at which we start a new one
+  uint64_t _maxSize;
+  uint64_t _segmentSize;
+
+  /// Current total size of the segments
+  uint64_t _size;
+
+  /// Segments, oldest first. The last is the one we are writing to, if we created it
+  std::deque<SegmentPtr> _segments;
+  SegmentPtr _current;
+
+  /// Index of all tiles
+  DISK_INDEX <TileKey, Location> _index;
+
+  /// Lock guarding all of the above. Tiles are read without holding it
+  std::mutex _mutex;
+
+  /// Usage counters
+  std::atomic<unsigned long> _hits, _misses;
+
+  /// Error message if we were unable to open the directory
+  std::string _error;
+
+  /// Whether we are usable
+  bool _open;
+
+
+  /// Read in the tiles of an existing segment
+  void load( const SegmentPtr& segment );
+
+  /// Add a tile to the index. Must hold the lock
+  void index( const TileKey& key, const SegmentPtr& segment, uint64_t offset, uint32_t length, time_t timestamp );
+
+  /// Start a new segment to write to. Must hold the lock
+  bool create();
+
+  /// Delete the oldest segments until we fit within our maximum size. Must hold the lock
+  void trim();
+
+
+ public:
+
+  /// Constructor
+  /** @param directory directory in which to keep the cache, which is created if necessary
+      @param size maximum size in MB
+   */
+  DiskTileCache( const std::string& directory, float size );
+
+  /// Destructor - closes, but does not remove, the segments and gives up the directory
+  ~DiskTileCache();
+
+  /// Whether the cache is usable
+  bool connected(){ return _open; };
+
+  /// Error message if not connected
+  const std::string& error(){ return _error; };
+
+  /// Append a tile to the cache
+  /** @param tile tile to store */
+  void insert( const RawTilePtr tile );
+
+  /// Retrieve a copy of a tile
+  /** @param key tile key
+      @param timestamp modification time of the image: older tiles are ignored
+      @return tile or an empty pointer if not cached
+   */
+  RawTilePtr getObject( const TileKey& key, time_t timestamp );
+
+  /// Return the number of tiles held
+  size_t getNumElements();
+
+  /// Return the number of bytes held
+  uint64_t getSize();
+
+  /// Return the maximum number of bytes held
+  uint64_t getMaxSize(){ return _maxSize; };
+
+  /// Return the number of lookups that found a tile
+  unsigned long getHits(){ return _hits.load( std::memory_order_relaxed ); };
+
+  /// Return the number of lookups that did not
+  unsigned long getMisses(){ return _misses.load( std::memory_order_relaxed ); };
+
+};
+
+
+#endif
@@ -26,7 +26,9 @@
  */ 
 #define VERBOSITY 1
 #define LOGFILE "/tmp/iipsrv.log"
-#define MAX_IMAGE_CACHE_SIZE 100
+#define MAX_IMAGE_CACHE_SIZE 1024
+#define MAX_IMAGE_CACHE_IDLE 3600
+#define REVALIDATE_INTERVAL 0
 #define MAX_TILE_CACHE_SIZE 10
 #define FILENAME_PATTERN "_pyr_"
 #define JPEG_QUALITY 75
@@ -41,6 +43,22 @@
 #define INTERPOLATION 1
 #define CORS "";
 #define BASE_URL "";
+#define WORKER_THREADS 1
+#define SHARED_TILE_CACHE_SIZE 0
+#define SHARED_TILE_CACHE_NAME "/iipsrv"
+#define DISK_TILE_CACHE_DIR ""
+#define DISK_TILE_CACHE_SIZE 1024
+#define MEMCACHED_TILE_CACHE 0
+#define PREFETCH_TILES 0
+#define PREFETCH_PREDICT 0
+#define REGION_THREADS 0
+#define DECODE_THREADS 0
+#define CPU_THREADS 0
+#define CACHE_REGION_TILES 0
+#define HTTP_THREADS 1
+#define REQUEST_QUEUE_SIZE 64
+#define TRACE_BUFFER_SIZE 0
+#define TILE_CACHE_POLICY "clock"
 
 
 #include <string>
@@ -71,15 +89,38 @@ class Environment {
   }
 
 
-  static size_t getMaxImageCacheSize(){
-    int max_image_cache_size = MAX_IMAGE_CACHE_SIZE;
+  static float getMaxImageCacheSize(){
+    float max_image_cache_size = MAX_IMAGE_CACHE_SIZE;
     char* envpara = getenv( "MAX_IMAGE_CACHE_SIZE" );
     if( envpara ){
-      max_image_cache_size = atoi( envpara );
+      max_image_cache_size = atof( envpara );
     }
     return max_image_cache_size;
   }
 
+
+  static unsigned int getMaxImageCacheIdle(){
+    int max_image_cache_idle = MAX_IMAGE_CACHE_IDLE;
+    char* envpara = getenv( "MAX_IMAGE_CACHE_IDLE" );
+    if( envpara ){
+      max_image_cache_idle = atoi( envpara );
+      if( max_image_cache_idle < 0 ) max_image_cache_idle = 0;
+    }
+    return max_image_cache_idle;
+  }
+
+
+  static unsigned int getRevalidateInterval(){
+    int revalidate_interval = REVALIDATE_INTERVAL;
+    char* envpara = getenv( "REVALIDATE_INTERVAL" );
+    if( envpara ){
+      revalidate_interval = atoi( envpara );
+      if( revalidate_interval < 0 ) revalidate_interval = 0;
+    }
+    return revalidate_interval;
+  }
+
+
   static float getMaxTileCacheSize(){
     float max_tile_cache_size = MAX_TILE_CACHE_SIZE;
     char* envpara = getenv( "MAX_TILE_CACHE_SIZE" );
@@ -241,6 +282,164 @@ class Environment {
     return base_url;
   }
 
+
+  static unsigned int getWorkerThreads(){
+    char* envpara = getenv( "WORKER_THREADS" );
+    int threads;
+    if( envpara ) threads = atoi( envpara );
+    else threads = WORKER_THREADS;
+    if( threads < 1 ) threads = 1;
+    return threads;
+  }
+
+
+  static float getSharedTileCacheSize(){
+    float shared_tile_cache_size = SHARED_TILE_CACHE_SIZE;
+    char* envpara = getenv( "SHARED_TILE_CACHE_SIZE" );
+    if( envpara ){
+      shared_tile_cache_size = atof( envpara );
+      if( shared_tile_cache_size < 0 ) shared_tile_cache_size = 0;
+    }
+    return shared_tile_cache_size;
+  }
+
+
+  static std::string getSharedTileCacheName(){
+    char* envpara = getenv( "SHARED_TILE_CACHE_NAME" );
+    std::string name;
+    if( envpara ) name = std::string( envpara );
+    else name = SHARED_TILE_CACHE_NAME;
+    // POSIX shared memory object names must start with a slash
+    if( name.empty() || name[0] != '/' ) name = "/" + name;
+    return name;
+  }
+
+
+  static std::string getDiskTileCacheDir(){
+    char* envpara = getenv( "DISK_TILE_CACHE_DIR" );
+    std::string dir;
+    if( envpara ) dir = std::string( envpara );
+    else dir = DISK_TILE_CACHE_DIR;
+    return dir;
+  }
+
+
+  static float getDiskTileCacheSize(){
+    float disk_tile_cache_size = DISK_TILE_CACHE_SIZE;
+    char* envpara = getenv( "DISK_TILE_CACHE_SIZE" );
+    if( envpara ){
+      disk_tile_cache_size = atof( envpara );
+      if( disk_tile_cache_size < 0 ) disk_tile_cache_size = 0;
+    }
+    return disk_tile_cache_size;
+  }
+
+
+  static bool getMemcachedTileCache(){
+    char* envpara = getenv( "MEMCACHED_TILE_CACHE" );
+    int memcached_tile_cache;
+    if( envpara ) memcached_tile_cache = atoi( envpara );
+    else memcached_tile_cache = MEMCACHED_TILE_CACHE;
+    return memcached_tile_cache > 0;
+  }
+
+
+  static unsigned int getPrefetchTiles(){
+    char* envpara = getenv( "PREFETCH_TILES" );
+    int prefetch_tiles;
+    if( envpara ) prefetch_tiles = atoi( envpara );
+    else prefetch_tiles = PREFETCH_TILES;
+    if( prefetch_tiles < 0 ) prefetch_tiles = 0;
+    return prefetch_tiles;
+  }
+
+
+  static bool getPrefetchPredict(){
+    char* envpara = getenv( "PREFETCH_PREDICT" );
+    int prefetch_predict;
+    if( envpara ) prefetch_predict = atoi( envpara );
+    else prefetch_predict = PREFETCH_PREDICT;
+    return prefetch_predict > 0;
+  }
+
+
+  static unsigned int getRegionThreads(){
+    char* envpara = getenv( "REGION_THREADS" );
+    int threads;
+    if( envpara ) threads = atoi( envpara );
+    else threads = REGION_THREADS;
+    if( threads < 0 ) threads = 0;
+    return threads;
+  }
+
+
+  static unsigned int getDecodeThreads(){
+    char* envpara = getenv( "DECODE_THREADS" );
+    int threads;
+    if( envpara ) threads = atoi( envpara );
+    else threads = DECODE_THREADS;
+    if( threads < 0 ) threads = 0;
+    return threads;
+  }
+
+
+  static unsigned int getCPUThreads(){
+    char* envpara = getenv( "CPU_THREADS" );
+    int threads;
+    if( envpara ) threads = atoi( envpara );
+    else threads = CPU_THREADS;
+    if( threads < 0 ) threads = 0;
+    return threads;
+  }
+
+
+  static bool getCacheRegionTiles(){
+    char* envpara = getenv( "CACHE_REGION_TILES" );
+    int cache_region_tiles;
+    if( envpara ) cache_region_tiles = atoi( envpara );
+    else cache_region_tiles = CACHE_REGION_TILES;
+    return cache_region_tiles > 0;
+  }
+
+
+  static unsigned int getHTTPThreads(){
+    char* envpara = getenv( "HTTP_THREADS" );
+    int threads;
+    if( envpara ) threads = atoi( envpara );
+    else threads = HTTP_THREADS;
+    if( threads < 1 ) threads = 1;
+    return threads;
+  }
+
+
+  static unsigned int getRequestQueueSize(){
+    char* envpara = getenv( "REQUEST_QUEUE_SIZE" );
+    int size;
+    if( envpara ) size = atoi( envpara );
+    else size = REQUEST_QUEUE_SIZE;
+    if( size < 1 ) size = 1;
+    return size;
+  }
+
+
+  static unsigned int getTraceBufferSize(){
+    char* envpara = getenv( "TRACE_BUFFER_SIZE" );
+    int size;
+    if( envpara ) size = atoi( envpara );
+    else size = TRACE_BUFFER_SIZE;
+    if( size < 0 ) size = 0;
+    return size;
+  }
+
+
+  static std::string getTileCachePolicy(){
+    char* envpara = getenv( "TILE_CACHE_POLICY" );
+    std::string policy;
+    if( envpara ) policy = std::string( envpara );
+    else policy = TILE_CACHE_POLICY;
+    return policy;
+  }
+
 };
 
 
@@ -77,9 +77,14 @@ void FIF::run( Session* session, const string& src ){
   // Get our image pattern variable
   string filename_pattern = Environment::getFileNamePattern();
 
+  // How long we trust a cached image without checking its file for modification
+  unsigned int revalidate_interval = Environment::getRevalidateInterval();
+
   // Put the image setup into a try block as object creation can throw an exception
   try{
 
+    TraceSpan span( "open" );
+
     auto temp = session->imageCache->getObject(argument);
     // Cache Hit
     if(  temp ){
@@ -87,21 +92,24 @@ void FIF::run( Session* session, const string& src ){
         *(session->logfile) << "FIF :: Image cache hit. Number of elements: " << session->imageCache->getNumElements() << endl;
       }
 
-      // get the image, then check it's timestamp.
-      if (difftime(IIPImage::getFileTimestamp(temp->getFileName(temp->currentX, temp->currentY)),
+      // get the image, then check it's timestamp, unless this was done recently.
+      // On network file systems every check is a round trip to the server.
+      if (temp->revalidate(revalidate_interval) &&
+          difftime(IIPImage::getFileTimestamp(temp->getFileName(temp->currentX, temp->currentY)),
                    temp->timestamp)  >
           std::numeric_limits<double>::round_error()) {
         // file on filesystem newer. so reopen it.
+        // Other threads may still be reading from the cached object, so rather than
+        // reopening it in place, create a new one which replaces it in the cache.
 
           if( session->loglevel >= 2 ){
             *(session->logfile) << "FIF :: Newer file on FS.  reloading " << endl;
           }
-        temp->closeImage();
-        temp->openImage();
+        temp.reset();
       }
     }
     // Cache Miss
-    else{
+    if( !temp ){
       if( session->loglevel >= 2 ) *(session->logfile) << "FIF :: Image cache miss" << endl;
       // eviction handled by ImageCache.
 
@@ -145,8 +153,12 @@ void FIF::run( Session* session, const string& src ){
 
         // Open image, and add it to our cache
         temp->openImage();
+        temp->revalidate(revalidate_interval);  // timestamp was just gathered, so start the interval now
         session->imageCache->insert(temp);    // insert into cache.
 
+        // Fill the tile cache with the lowest resolutions in the background
+        if( session->prefetcher ) session->prefetcher->schedule( temp );
+
         if( session->loglevel >= 3 ){
           *(session->logfile) << "FIF :: Created and cached image object with key = \"" << argument << "\"" << endl;
         }
@@ -0,0 +1,765 @@
+// Embedded HTTP/1.1 server
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "HTTPServer.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <cerrno>
+#include <cctype>
+#include <deque>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+
+using namespace std;
+
+
+
+/// Part of a response: the data from offset onwards is still to be sent
+struct Segment {
+  string data;
+  size_t offset;
+};
+
+
+/// State of a client connection
+struct HTTPServer::Connection {
+
+  /// Client socket
+  int fd;
+
+  /// Serial number of the connection
+  unsigned long serial;
+
+  /// Data received but not yet handled
+  string in;
+
+  /// Response data waiting to be sent, as a list of buffers that are passed to the
+  /// kernel together, and the number of bytes still to send
+  deque<Segment> out;
+  size_t unsent;
+
+  /// Number of request body bytes still to be discarded
+  size_t skip;
+
+  /// Whether the connection should be kept open after the current request
+  bool keep_alive;
+
+  /// Whether the current request is HTTP/1.0
+  bool http10;
+
+  /// Whether the client has closed its side of the connection
+  bool eof;
+
+  /// Whether to close once all output has been sent
+  bool closing;
+
+  /// Whether a request is with the workers
+  bool busy;
+
+  /// Request waiting for room in the queue
+  Job* pending;
+
+  /// Time of last activity
+  time_t last;
+
+  /// Events we are currently waiting for
+  unsigned int events;
+
+};
+
+
+
+/// Case insensitive comparison of the start of a string
+static bool startsWith( const string& s, const char* prefix ){
+  return strncasecmp( s.c_str(), prefix, strlen(prefix) ) == 0;
+}
+
+
+/// Remove leading and trailing white space
+static string trim( const string& s ){
+  size_t start = s.find_first_not_of( " \t" );
+  if( start == string::npos ) return string();
+  size_t end = s.find_last_not_of( " \t\r" );
+  return s.substr( start, end - start + 1 );
+}
+
+
+/// Make a socket non-blocking
+static bool setNonBlocking( int fd ){
+  int flags = fcntl( fd, F_GETFL, 0 );
+  return ( flags >= 0 && fcntl( fd, F_SETFL, flags | O_NONBLOCK ) == 0 );
+}
+
+
+
+int HTTPServer::openSocket( const string& address ){
+
+  size_t colon = address.rfind( ':' );
+  if( colon == string::npos ) return -1;
+
+  string host = address.substr( 0, colon );
+  string port = address.substr( colon + 1 );
+  if( port.empty() ) return -1;
+
+  // Allow IPv6 addresses in brackets, eg. [::1]:8080
+  if( host.length() > 1 && host[0] == '[' && host[host.length()-1] == ']' ){
+    host = host.substr( 1, host.length() - 2 );
+  }
+
+  struct addrinfo hints;
+  memset( &hints, 0, sizeof(hints) );
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+
+  struct addrinfo *result = NULL;
+  if( getaddrinfo( host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &result ) != 0 ) return -1;
+
+  int fd = -1;
+  for( struct addrinfo *a = result; a; a = a->ai_next ){
+
+    fd = socket( a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol );
+    if( fd < 0 ) continue;
+
+    int on = 1;
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on) );
+
+    if( bind( fd, a->ai_addr, a->ai_addrlen ) == 0 &&
+	listen( fd, SOMAXCONN ) == 0 &&
+	setNonBlocking( fd ) ) break;
+
+    ::close( fd );
+    fd = -1;
+  }
+
+  freeaddrinfo( result );
+  return fd;
+}
+
+
+
+HTTPServer::HTTPServer( int socket, JobQueue* q, Depths* d ) : listen_socket( socket ), next_serial( 0 ), queue( q ), depths( d ){
+
+  event_fd = -1;
+  epoll_fd = epoll_create1( EPOLL_CLOEXEC );
+  if( epoll_fd < 0 ) return;
+
+  // With several worker threads, only wake one of them for each new connection
+  struct epoll_event event;
+  memset( &event, 0, sizeof(event) );
+  event.events = EPOLLIN;
+#ifdef EPOLLEXCLUSIVE
+  event.events |= EPOLLEXCLUSIVE;
+#endif
+  event.data.fd = listen_socket;
+
+  // The workers wake us through this when they have finished a request
+  struct epoll_event wakeup;
+  memset( &wakeup, 0, sizeof(wakeup) );
+  wakeup.events = EPOLLIN;
+  event_fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+  wakeup.data.fd = event_fd;
+
+  if( event_fd < 0 ||
+      epoll_ctl( epoll_fd, EPOLL_CTL_ADD, listen_socket, &event ) != 0 ||
+      epoll_ctl( epoll_fd, EPOLL_CTL_ADD, event_fd, &wakeup ) != 0 ){
+    ::close( epoll_fd );
+    epoll_fd = -1;
+  }
+}
+
+
+
+HTTPServer::~HTTPServer(){
+  while( !connections.empty() ) close( connections.begin()->second );
+  depths->completed -= completed.size();
+  for( vector<Job*>::iterator j = completed.begin(); j != completed.end(); ++j ) delete *j;
+  if( epoll_fd >= 0 ) ::close( epoll_fd );
+  if( event_fd >= 0 ) ::close( event_fd );
+}
+
+
+
+void HTTPServer::run(){
+
+  if( epoll_fd < 0 ) return;
+
+  const int max_events = 64;
+  struct epoll_event events[max_events];
+  time_t last_expiry = time( NULL );
+
+  while( true ){
+
+    // Poll more often while requests are waiting for room in the queue
+    int n = epoll_wait( epoll_fd, events, max_events, stalled.empty() ? 1000 : 10 );
+    if( n < 0 ){
+      if( errno == EINTR ) continue;
+      return;
+    }
+
+    for( int i = 0; i < n; i++ ){
+
+      int fd = events[i].data.fd;
+
+      if( fd == listen_socket ){
+	accept();
+	continue;
+      }
+
+      if( fd == event_fd ){
+	collect();
+	continue;
+      }
+
+      // The connection may already have been closed while handling an earlier event
+      map<int,Connection*>::iterator it = connections.find( fd );
+      if( it == connections.end() ) continue;
+      Connection* c = it->second;
+
+      // A client that has gone away completely cannot receive the response to any request in progress
+      if( c->eof && (events[i].events & (EPOLLHUP | EPOLLERR)) ){
+	close( c );
+	continue;
+      }
+
+      if( events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR) ){
+	if( !read( c ) ) continue;
+      }
+      else if( events[i].events & EPOLLOUT ){
+	if( !write( c ) ) continue;
+      }
+
+      process( c );
+    }
+
+    if( !stalled.empty() ) unstall();
+
+    time_t now = time( NULL );
+    if( now != last_expiry ){
+      expire();
+      last_expiry = now;
+    }
+  }
+}
+
+
+
+void HTTPServer::accept(){
+
+  while( true ){
+
+    int fd = accept4( listen_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC );
+    if( fd < 0 ){
+      if( errno == EINTR || errno == ECONNABORTED ) continue;
+      // EAGAIN, or a resource limit, in which case we try again on the next event
+      return;
+    }
+
+    // Responses are sent in one go, so don't let Nagle delay the last segment
+    int on = 1;
+    setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on) );
+
+    Connection* c = new Connection;
+    c->fd = fd;
+    c->serial = next_serial++;
+    c->unsent = 0;
+    c->skip = 0;
+    c->keep_alive = true;
+    c->http10 = false;
+    c->eof = false;
+    c->closing = false;
+    c->busy = false;
+    c->pending = NULL;
+    c->last = time( NULL );
+    c->events = EPOLLIN;
+
+    struct epoll_event event;
+    memset( &event, 0, sizeof(event) );
+    event.events = c->events;
+    event.data.fd = fd;
+    if( epoll_ctl( epoll_fd, EPOLL_CTL_ADD, fd, &event ) != 0 ){
+      ::close( fd );
+      delete c;
+      continue;
+    }
+
+    connections[fd] = c;
+    depths->connections = connections.size();
+  }
+}
+
+
+
+void HTTPServer::close( Connection* c ){
+  // A request with the workers is discarded when it comes back
+  if( c->pending ){
+    stalled.remove( c );
+    depths->stalled = stalled.size();
+    delete c->pending;
+  }
+  epoll_ctl( epoll_fd, EPOLL_CTL_DEL, c->fd, NULL );
+  ::close( c->fd );
+  connections.erase( c->fd );
+  depths->connections = connections.size();
+  depths->unsent -= c->unsent;
+  delete c;
+}
+
+
+
+bool HTTPServer::read( Connection* c ){
+
+  char buffer[16384];
+
+  // Don't buffer without limit if the client sends faster than we can respond
+  while( c->in.size() < HTTP_MAX_PENDING_OUTPUT ){
+
+    ssize_t n = recv( c->fd, buffer, sizeof(buffer), 0 );
+
+    if( n > 0 ){
+      c->in.append( buffer, n );
+      continue;
+    }
+    if( n == 0 ){
+      c->eof = true;
+      break;
+    }
+    if( errno == EINTR ) continue;
+    if( errno == EAGAIN || errno == EWOULDBLOCK ) break;
+
+    close( c );
+    return false;
+  }
+
+  c->last = time( NULL );
+  return true;
+}
+
+
+
+bool HTTPServer::write( Connection* c ){
+
+  while( c->unsent ){
+
+    // Gather the headers and bodies of the waiting responses into a single call
+    struct iovec iov[HTTP_MAX_SEGMENTS];
+    int count = 0;
+    for( deque<Segment>::iterator s = c->out.begin(); s != c->out.end() && count < HTTP_MAX_SEGMENTS; ++s ){
+      iov[count].iov_base = (void*)( s->data.data() + s->offset );
+      iov[count].iov_len = s->data.size() - s->offset;
+      count++;
+    }
+
+    struct msghdr message;
+    memset( &message, 0, sizeof(message) );
+    message.msg_iov = iov;
+    message.msg_iovlen = count;
+
+    ssize_t n = sendmsg( c->fd, &message, MSG_NOSIGNAL );
+
+    if( n > 0 ){
+      c->unsent -= n;
+      depths->unsent -= n;
+      size_t sent = n;
+      while( sent ){
+	Segment& s = c->out.front();
+	size_t left = s.data.size() - s.offset;
+	if( sent < left ){
+	  s.offset += sent;
+	  break;
+	}
+	sent -= left;
+	c->out.pop_front();
+      }
+      continue;
+    }
+    if( n < 0 && errno == EINTR ) continue;
+    if( n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ) break;
+
+    close( c );
+    return false;
+  }
+
+  if( !c->unsent ){
+    if( c->closing && !c->busy ){
+      close( c );
+      return false;
+    }
+  }
+
+  c->last = time( NULL );
+  watch( c );
+  return true;
+}
+
+
+
+void HTTPServer::watch( Connection* c ){
+
+  unsigned int events = 0;
+
+  // Stop reading once we have enough to do, so that pipelining clients wait for us
+  if( !c->closing && !c->eof && c->unsent < HTTP_MAX_PENDING_OUTPUT &&
+      c->in.size() < HTTP_MAX_PENDING_OUTPUT ) events |= EPOLLIN;
+  if( c->unsent ) events |= EPOLLOUT;
+
+  if( events == c->events ) return;
+
+  struct epoll_event event;
+  memset( &event, 0, sizeof(event) );
+  event.events = events;
+  event.data.fd = c->fd;
+  epoll_ctl( epoll_fd, EPOLL_CTL_MOD, c->fd, &event );
+  c->events = events;
+}
+
+
+
+void HTTPServer::process( Connection* c ){
+
+  while( !c->closing && !c->busy && c->unsent < HTTP_MAX_PENDING_OUTPUT ){
+
+    // Discard any request body
+    if( c->skip ){
+      size_t n = ( c->skip < c->in.size() ) ? c->skip : c->in.size();
+      c->in.erase( 0, n );
+      c->skip -= n;
+      if( c->skip ) break;
+    }
+
+    // Ignore empty lines between requests
+    size_t start = c->in.find_first_not_of( "\r\n" );
+    if( start == string::npos ){
+      c->in.clear();
+      break;
+    }
+    if( start ) c->in.erase( 0, start );
+
+    size_t end = c->in.find( "\r\n\r\n" );
+    if( end == string::npos ){
+      if( c->in.size() > HTTP_MAX_HEADER_SIZE ) error( c, "431 Request Header Fields Too Large" );
+      break;
+    }
+    if( end > HTTP_MAX_HEADER_SIZE ){
+      error( c, "431 Request Header Fields Too Large" );
+      break;
+    }
+
+    string header = c->in.substr( 0, end );
+    c->in.erase( 0, end + 4 );
+    handle( c, header );
+  }
+
+  // Close once we have answered everything the client sent before closing its side
+  if( c->eof && !c->busy && c->unsent < HTTP_MAX_PENDING_OUTPUT ) c->closing = true;
+
+  write( c );
+}
+
+
+
+void HTTPServer::handle( Connection* c, const string& header ){
+
+  // Split the request line into method, target and protocol version
+  size_t eol = header.find( "\r\n" );
+  string request_line = header.substr( 0, eol );
+
+  size_t s1 = request_line.find( ' ' );
+  size_t s2 = ( s1 == string::npos ) ? string::npos : request_line.find( ' ', s1 + 1 );
+  if( s2 == string::npos ){
+    error( c, "400 Bad Request" );
+    return;
+  }
+
+  string method = request_line.substr( 0, s1 );
+  string target = request_line.substr( s1 + 1, s2 - s1 - 1 );
+  string protocol = request_line.substr( s2 + 1 );
+
+  if( protocol == "HTTP/1.1" ){
+    c->http10 = false;
+    c->keep_alive = true;
+  }
+  else if( protocol == "HTTP/1.0" ){
+    c->http10 = true;
+    c->keep_alive = false;
+  }
+  else{
+    error( c, "505 HTTP Version Not Supported" );
+    return;
+  }
+
+  map<const string,string> headers;
+
+  // Parse the header fields we need
+  size_t pos = ( eol == string::npos ) ? header.size() : eol + 2;
+  while( pos < header.size() ){
+
+    size_t next = header.find( "\r\n", pos );
+    if( next == string::npos ) next = header.size();
+    string line = header.substr( pos, next - pos );
+    pos = next + 2;
+
+    size_t colon = line.find( ':' );
+    if( colon == string::npos ) continue;
+    string value = trim( line.substr( colon + 1 ) );
+
+    if( startsWith( line, "Host:" ) ) headers["HTTP_HOST"] = value;
+    else if( startsWith( line, "If-Modified-Since:" ) ) headers["HTTP_IF_MODIFIED_SINCE"] = value;
+    else if( startsWith( line, "Connection:" ) ){
+      string v = value;
+      for( size_t i = 0; i < v.size(); i++ ) v[i] = tolower( v[i] );
+      if( v.find( "close" ) != string::npos ) c->keep_alive = false;
+      else if( v.find( "keep-alive" ) != string::npos ) c->keep_alive = true;
+    }
+    else if( startsWith( line, "Content-Length:" ) ){
+      char* e = NULL;
+      c->skip = strtoul( value.c_str(), &e, 10 );
+      if( value.empty() || *e ){
+	error( c, "400 Bad Request" );
+	return;
+      }
+    }
+    else if( startsWith( line, "Transfer-Encoding:" ) ){
+      // We have no use for request bodies and cannot find the end of a chunked one
+      error( c, "501 Not Implemented" );
+      return;
+    }
+  }
+
+  bool head = ( method == "HEAD" );
+  if( method != "GET" && !head ){
+    error( c, "405 Method Not Allowed" );
+    return;
+  }
+
+  // Reduce an absolute URI to its path and query
+  if( startsWith( target, "http://" ) || startsWith( target, "https://" ) ){
+    size_t path = target.find( '/', target.find( "//" ) + 2 );
+    target = ( path == string::npos ) ? "/" : target.substr( path );
+  }
+
+  size_t query = target.find( '?' );
+  headers["QUERY_STRING"] = ( query == string::npos ) ? string() : target.substr( query + 1 );
+  headers["REQUEST_URI"] = target;
+  headers["SERVER_PROTOCOL"] = protocol;
+
+  Job* job = new Job;
+  job->server = this;
+  job->fd = c->fd;
+  job->serial = c->serial;
+  job->head = head;
+  job->headers.swap( headers );
+  dispatch( c, job );
+}
+
+
+
+void HTTPServer::dispatch( Connection* c, Job* job ){
+  c->busy = true;
+  if( !queue->tryPush( job ) ){
+    c->pending = job;
+    stalled.push_back( c );
+    depths->stalled = stalled.size();
+  }
+  else depths->working++;
+}
+
+
+
+void HTTPServer::unstall(){
+  while( !stalled.empty() ){
+    Connection* c = stalled.front();
+    if( !queue->tryPush( c->pending ) ) return;
+    c->pending = NULL;
+    stalled.pop_front();
+    depths->stalled = stalled.size();
+    depths->working++;
+  }
+}
+
+
+
+void HTTPServer::complete( Job* job ){
+  // Count the job before collect() can see it
+  depths->working--;
+  depths->completed++;
+  {
+    lock_guard<mutex> lock( completed_mutex );
+    completed.push_back( job );
+  }
+  uint64_t one = 1;
+  ssize_t n = ::write( event_fd, &one, sizeof(one) );
+  (void) n;
+}
+
+
+
+void HTTPServer::collect(){
+
+  uint64_t count;
+  ssize_t n = ::read( event_fd, &count, sizeof(count) );
+  (void) n;
+
+  vector<Job*> jobs;
+  {
+    lock_guard<mutex> lock( completed_mutex );
+    jobs.swap( completed );
+  }
+  depths->completed -= jobs.size();
+
+  for( vector<Job*>::iterator j = jobs.begin(); j != jobs.end(); ++j ){
+
+    Job* job = *j;
+
+    // The connection may have been closed while the request was being handled
+    map<int,Connection*>::iterator it = connections.find( job->fd );
+    if( it != connections.end() && it->second->serial == job->serial ){
+      Connection* c = it->second;
+      c->busy = false;
+      respond( c, job->writer.buffer, job->head );
+      if( !c->keep_alive ) c->closing = true;
+      // Carry on with any pipelined requests
+      process( c );
+    }
+
+    delete job;
+  }
+}
+
+
+
+void HTTPServer::work( JobQueue& q, Handler handler ){
+  Job* job;
+  while( q.pop( job ) ){
+    handler( job->headers, job->writer );
+    job->server->complete( job );
+  }
+}
+
+
+
+void HTTPServer::append( Connection* c, string& data, size_t offset ){
+  if( offset >= data.size() ) return;
+  c->out.push_back( Segment() );
+  c->out.back().data.swap( data );
+  c->out.back().offset = offset;
+  c->unsent += c->out.back().data.size() - offset;
+  depths->unsent += c->out.back().data.size() - offset;
+}
+
+
+
+void HTTPServer::respond( Connection* c, string& cgi, bool head ){
+
+  string status = "200 OK";
+  string fields;
+  bool length = false;
+  bool chunked = false;
+
+  // Split off the CGI header block
+  size_t end = cgi.find( "\r\n\r\n" );
+  size_t body = ( end == string::npos ) ? cgi.size() : end + 4;
+  if( end == string::npos ){
+    status = "500 Internal Server Error";
+    end = 0;
+  }
+
+  size_t pos = 0;
+  while( pos < end ){
+    size_t next = cgi.find( "\r\n", pos );
+    if( next == string::npos || next > end ) next = end;
+    string line = cgi.substr( pos, next - pos );
+    pos = next + 2;
+
+    if( line.empty() ) continue;
+    if( startsWith( line, "Status:" ) ){
+      status = trim( line.substr( 7 ) );
+      continue;
+    }
+    if( startsWith( line, "Content-Length:" ) ) length = true;
+    else if( startsWith( line, "Transfer-Encoding:" ) ) chunked = true;
+    fields += line + "\r\n";
+  }
+
+  // HTTP/1.0 clients do not understand chunked responses, so we can only mark their end by closing
+  if( chunked && c->http10 ) c->keep_alive = false;
+
+  int code = atoi( status.c_str() );
+
+  char date[64];
+  time_t now = time( NULL );
+  struct tm t;
+  gmtime_r( &now, &t );
+  strftime( date, sizeof(date), "%a, %d %b %Y %H:%M:%S GMT", &t );
+
+  string header = "HTTP/1.1 " + status + "\r\nDate: " + date + "\r\n" + fields;
+
+  if( !length && !chunked && code >= 200 && code != 204 && code != 304 ){
+    char tmp[64];
+    snprintf( tmp, sizeof(tmp), "Content-Length: %lu\r\n", (unsigned long)( cgi.size() - body ) );
+    header += tmp;
+  }
+
+  if( !c->keep_alive ) header += "Connection: close\r\n";
+  else if( c->http10 ) header += "Connection: keep-alive\r\n";
+  header += "\r\n";
+
+  // Send the body straight from the worker's buffer after our new header
+  append( c, header, 0 );
+  if( !head ) append( c, cgi, body );
+}
+
+
+
+void HTTPServer::error( Connection* c, const string& status ){
+  string response = "HTTP/1.1 " + status + "\r\n"
+    "Server: iipsrv/" VERSION "\r\n"
+    "Content-Length: 0\r\n"
+    "Connection: close\r\n\r\n";
+  append( c, response, 0 );
+  c->in.clear();
+  c->skip = 0;
+  c->closing = true;
+}
+
+
+
+void HTTPServer::expire(){
+
+  time_t now = time( NULL );
+  for( map<int,Connection*>::iterator it = connections.begin(); it != connections.end(); ){
+    Connection* c = it->second;
+    ++it;
+    if( !c->busy && now - c->last > HTTP_KEEPALIVE_TIMEOUT ) close( c );
+  }
+}
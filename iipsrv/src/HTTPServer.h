@@ -0,0 +1,228 @@
+// Embedded HTTP/1.1 server
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _HTTPSERVER_H
+#define _HTTPSERVER_H
+
+
+#include <string>
+#include <map>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include "Writer.h"
+#include "BoundedQueue.h"
+
+
+/// Maximum size of a request line and its headers
+#define HTTP_MAX_HEADER_SIZE 16384
+
+/// Stop reading pipelined requests once this many response bytes are waiting to be sent
+#define HTTP_MAX_PENDING_OUTPUT 4194304
+
+/// Seconds after which an idle keep-alive connection is closed
+#define HTTP_KEEPALIVE_TIMEOUT 30
+
+/// Maximum number of buffers passed to the kernel in one send
+#define HTTP_MAX_SEGMENTS 16
+
+
+
+/// Minimal epoll based HTTP/1.1 server
+/** Allows iipsrv to be used directly by a client without a web server and FastCGI
+    in between. Supports persistent connections and pipelined GET and HEAD requests.
+
+    Requests pass through a two stage pipeline. One or more I/O threads each run an
+    event loop on a shared listening socket: they accept connections, parse requests
+    and send responses. Parsed requests are handed through a bounded queue to a pool
+    of worker threads, which decode, transform and encode the image by calling the
+    handler function. The handler writes a CGI style response (an optional Status
+    header, the other headers, a blank line and the body) that the worker passes back
+    to the I/O thread owning the connection, to be sent with an HTTP/1.1 status line.
+    A slow client therefore never holds up a worker, and a slow decode never holds up
+    other connections. The requests on a connection are handled one after the other.
+    Within the workers, decoding and the CPU work of transforms and encoding can be
+    limited to their own numbers of threads (see Stage).
+ */
+
+class HTTPServer {
+
+ public:
+
+  /// Request handler
+  /** @param headers CGI style request variables: QUERY_STRING, REQUEST_URI,
+             SERVER_PROTOCOL, HTTP_HOST and, if sent, HTTP_IF_MODIFIED_SINCE
+      @param writer writer for the response
+   */
+  typedef std::function<void( std::map<const std::string, std::string>& headers, HTTPWriter& writer )> Handler;
+
+
+  /// A request passed from an I/O thread to the workers and back
+  struct Job {
+    HTTPServer* server;
+    int fd;
+    unsigned long serial;
+    bool head;
+    std::map<const std::string, std::string> headers;
+    HTTPWriter writer;
+  };
+
+  /// Queue of requests waiting for a worker
+  typedef BoundedQueue<Job*> JobQueue;
+
+  /// Depths of the stages of an I/O thread, which other threads may read at any time
+  struct Depths {
+    std::atomic<unsigned int> connections;  // Open connections
+    std::atomic<unsigned int> stalled;      // Requests waiting for room in the queue
+    std::atomic<unsigned int> working;      // Requests in the queue or being handled by a worker
+    std::atomic<unsigned int> completed;    // Responses handled by the workers waiting to be collected
+    std::atomic<size_t> unsent;             // Response bytes waiting to be sent
+    Depths() : connections( 0 ), stalled( 0 ), working( 0 ), completed( 0 ), unsent( 0 ) {};
+  };
+
+
+ private:
+
+  /// State of a client connection
+  struct Connection;
+
+  /// Listening socket
+  int listen_socket;
+
+  /// Our epoll instance
+  int epoll_fd;
+
+  /// Open connections indexed by socket
+  std::map<int, Connection*> connections;
+
+  /// Serial number of the next connection, so that late responses cannot reach a new connection reusing a socket
+  unsigned long next_serial;
+
+  /// Queue of requests for the workers
+  JobQueue* queue;
+
+  /// Where we report the depths of our stages
+  Depths* depths;
+
+  /// Connections whose request is waiting for room in the queue
+  std::list<Connection*> stalled;
+
+  /// Requests handled by the workers waiting to be sent, and the eventfd used to wake us up for them
+  std::vector<Job*> completed;
+  std::mutex completed_mutex;
+  int event_fd;
+
+
+  /// Accept all pending connections
+  void accept();
+
+  /// Close a connection
+  void close( Connection* c );
+
+  /// Read whatever is available on a connection
+  /** @return false if the connection has been closed */
+  bool read( Connection* c );
+
+  /// Send as much pending output as the socket will accept
+  /** @return false if the connection has been closed */
+  bool write( Connection* c );
+
+  /// Handle the complete requests we have received on a connection
+  void process( Connection* c );
+
+  /// Parse a single request and pass it to the workers
+  /** @param c connection
+      @param header the request line and headers without the terminating blank line
+   */
+  void handle( Connection* c, const std::string& header );
+
+  /// Queue an error response and close the connection once it has been sent
+  void error( Connection* c, const std::string& status );
+
+  /// Add data to the output of a connection
+  /** @param c connection
+      @param data data to send - its contents are taken over, rather than copied
+      @param offset offset within data from which to send
+   */
+  void append( Connection* c, std::string& data, size_t offset );
+
+  /// Convert a CGI style response to an HTTP/1.1 response and queue it
+  /** @param c connection
+      @param cgi response written by the handler - its contents are taken over
+      @param head whether this is a HEAD request, for which no body is sent
+   */
+  void respond( Connection* c, std::string& cgi, bool head );
+
+  /// Update which events we wait for on a connection
+  void watch( Connection* c );
+
+  /// Pass a request to the workers or stall the connection if they are all busy
+  void dispatch( Connection* c, Job* job );
+
+  /// Retry stalled requests
+  void unstall();
+
+  /// Queue the responses the workers have finished
+  void collect();
+
+  /// Called by a worker when it has handled a request
+  void complete( Job* job );
+
+  /// Close connections that have been idle for too long
+  void expire();
+
+
+ public:
+
+  /// Open a listening socket
+  /** @param address address to listen on as host:port or :port
+      @return socket or -1 on error
+   */
+  static int openSocket( const std::string& address );
+
+  /// Constructor
+  /** @param socket listening socket created by openSocket()
+      @param q queue on which to pass requests to the workers
+      @param d where to report the depths of our stages
+   */
+  HTTPServer( int socket, JobQueue* q, Depths* d );
+
+  /// Destructor - closes all our client connections
+  ~HTTPServer();
+
+  /// Run the I/O event loop in the calling thread
+  /** The server must outlive the workers, which may still complete requests for it
+      after this has returned
+      @return only on a fatal error */
+  void run();
+
+  /// Run a worker in the calling thread
+  /** @param q queue from which to take requests
+      @param handler function called to handle each request
+      @return when the queue is closed
+   */
+  static void work( JobQueue& q, Handler handler );
+
+};
+
+
+#endif
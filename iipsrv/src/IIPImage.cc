@@ -52,6 +52,7 @@ void IIPImage::swap( IIPImage& first, IIPImage& second ) // nothrow
 {
   // Swap the members of the two objects
   std::swap( first.imagePath, second.imagePath );
+  std::swap( first.imageId, second.imageId );
   std::swap( first.isFile, second.isFile );
   std::swap( first.suffix, second.suffix );
   std::swap( first.virtual_levels, second.virtual_levels );
@@ -574,6 +575,49 @@ const string IIPImage::getFileName( int seq, int ang )
 
 
 
+size_t IIPImage::getMemorySize()
+{
+  size_t size = sizeof( IIPImage ) + imagePath.capacity() + fileSystemPrefix.capacity() +
+    fileNamePattern.capacity() + suffix.capacity() +
+    ( image_widths.capacity() + image_heights.capacity() ) * sizeof( unsigned int ) +
+    ( min.capacity() + max.capacity() ) * sizeof( float ) +
+    ( horizontalAnglesList.size() + verticalAnglesList.size() ) * ( sizeof( int ) + 2*sizeof( void* ) );
+
+  for( map<const string, string>::const_iterator i = metadata.begin(); i != metadata.end(); i++ ){
+    size += i->first.capacity() + i->second.capacity() + sizeof( *i ) + 4*sizeof( void* );
+  }
+
+  return size;
+}
+
+
+
+void IIPImage::decodeTile( int h, int v, unsigned int r, int l, unsigned int t,
+			   unsigned int x, unsigned int y, unsigned int w, unsigned int height,
+			   void* buffer, size_t stride )
+{
+  RawTilePtr rawtile = getTile( h, v, r, l, t );
+  if( !rawtile ) throw file_error( "IIPImage :: Unable to decode tile" );
+
+  // Padded tiles keep the full tile width for each line
+  size_t pixel = rawtile->channels * rawtile->bpc/8;
+  size_t line = ( rawtile->padded ? tile_width : rawtile->width ) * pixel;
+
+  if( x + w > rawtile->width || y + height > rawtile->height ){
+    throw file_error( "IIPImage :: Part requested lies outside tile" );
+  }
+
+  const unsigned char* src = (const unsigned char*) rawtile->data + ( y * line ) + ( x * pixel );
+  unsigned char* dst = (unsigned char*) buffer;
+  for( unsigned int k = 0; k < height; k++ ){
+    memcpy( dst, src, w * pixel );
+    src += line;
+    dst += stride;
+  }
+}
+
+
+
 int operator == ( const IIPImage& A, const IIPImage& B )
 {
   if( A.imagePath == B.imagePath ) return( 1 );
@@ -35,8 +35,12 @@
 #include <vector>
 #include <map>
 #include <stdexcept>
+#include <mutex>
+#include <atomic>
+#include <ctime>
 
 #include "RawTile.h"
+#include "TileKey.h"
 
 
 /// Define our own derived exception class for file errors
@@ -65,6 +69,9 @@ class IIPImage {
   /// Image path supplied
   std::string imagePath; 
 
+  /// Interned image path, which identifies our tiles in the tile cache
+  uint32_t imageId;
+
   /// Prefix to add to paths
   std::string fileSystemPrefix;
 
@@ -140,12 +147,20 @@ class IIPImage {
   /// Image modification timestamp
   time_t timestamp;
 
+  /// Serialises tile and region decoding for image types that are not thread safe.
+  /// Not copied by the copy constructor
+  std::mutex decoderMutex;
+
+  /// When the file was last checked for modification. Not copied by the copy constructor
+  std::atomic<time_t> validated;
+
 
  public:
 
   /// Default Constructor
   IIPImage()
-   : isFile( false ),
+   : imageId( 0 ),
+    isFile( false ),
     tile_width( 0 ),
     tile_height( 0 ),
     bpc( 0 ),
@@ -154,13 +169,15 @@ class IIPImage {
     isSet( false ),
     currentX( 0 ),
     currentY( 90 ),
-    timestamp( 0 ) {};
+    timestamp( 0 ),
+    validated( 0 ) {};
 
   /// Constructer taking the image path as parameter
   /** @param s image path
    */
   IIPImage( const std::string& s )
    : imagePath( s ),
+    imageId( TileKey::intern( s ) ),
     isFile( false ),
     virtual_levels( 0 ),
     tile_width( 0 ),
@@ -171,13 +188,15 @@ class IIPImage {
     isSet( false ),
     currentX( 0 ),
     currentY( 90 ),
-    timestamp( 0 ) {};
+    timestamp( 0 ),
+    validated( 0 ) {};
 
   /// Copy Constructor taking reference to another IIPImage object
   /** @param im IIPImage object
    */
   IIPImage( const IIPImage& image )
    : imagePath( image.imagePath ),
+    imageId( image.imageId ),
     fileSystemPrefix( image.fileSystemPrefix ),
     fileNamePattern( image.fileNamePattern ),
     isFile( image.isFile ),
@@ -202,7 +221,8 @@ class IIPImage {
     currentX( image.currentX ),
     currentY( image.currentY ),
     metadata( image.metadata ),
-    timestamp( image.timestamp ) {};
+    timestamp( image.timestamp ),
+    validated( 0 ) {};
 
   /// Virtual Destructor
   virtual ~IIPImage() { ; };
@@ -225,6 +245,9 @@ class IIPImage {
   /// Return the image path
   const std::string& getImagePath() { return imagePath; };
 
+  /// Return the id of the image path for use in tile cache keys
+  uint32_t getImageId() { return imageId; };
+
   /// Return the full file path for a particular horizontal and vertical angle
   /** @param x horizontal sequence angle
       @param y vertical sequence angle
@@ -301,12 +324,31 @@ class IIPImage {
   /// Return image metadata
   /** @param index metadata field name */
   const std::string& getMetadata( const std::string& index ) {
-    return metadata[index];
+    // Avoid operator[] as it would insert into a map shared between threads
+    static const std::string empty;
+    std::map <const std::string, std::string>::const_iterator it = metadata.find( index );
+    return ( it != metadata.end() ) ? it->second : empty;
+  };
+
+  /// Return whether the file should be checked again for modification
+  /** Once one caller has been told to check, others are not until the interval has passed again
+      @param interval seconds for which a check holds, or 0 to check every time
+   */
+  bool revalidate( unsigned int interval ){
+    if( interval == 0 ) return true;
+    time_t now = time( NULL );
+    time_t last = validated.load( std::memory_order_relaxed );
+    if( now - last < (time_t) interval ) return false;
+    return validated.compare_exchange_strong( last, now );
   };
 
   /// Return whether this image type directly handles region decoding
   virtual bool regionDecoding(){ return false; };
 
+  /// Return whether tiles can be decoded concurrently from several threads
+  /** If not, callers must hold decoderMutex around getTile() and getRegion() */
+  virtual bool threadSafe(){ return false; };
+
   /// Load the appropriate codec module for this image type
   /** Used only for dynamically loading codec modules. Overloaded by DSOImage class.
       @param module the codec module path
@@ -328,6 +370,12 @@ class IIPImage {
   /// Close the image: Overloaded by child class.
   virtual void closeImage() {;};
 
+  /// Return the approximate memory in bytes held by this image while open
+  /** Used by the image cache to account for open images. Overloaded by child classes
+      to add the memory held by their decoders
+   */
+  virtual size_t getMemorySize();
+
 
   /// Return an individual tile for a given angle and resolution
   /** Return a RawTile object: Overloaded by child class.
@@ -340,6 +388,27 @@ class IIPImage {
   virtual RawTilePtr getTile( int h, int v, unsigned int r, int l, unsigned int t ) { return RawTilePtr(); };
 
 
+  /// Decode part of a tile straight into a caller's buffer
+  /** This avoids allocating, cropping and caching a tile of its own. The default decodes
+      the tile with getTile() and copies the part requested once: overloaded by child classes
+      that can decode into the buffer directly.
+      @param h horizontal angle
+      @param v vertical angle
+      @param r resolution
+      @param l quality layers
+      @param t tile number
+      @param x left offset of the part within the tile
+      @param y top offset of the part within the tile
+      @param w width of the part
+      @param height height of the part
+      @param buffer destination of the first pixel of the part
+      @param stride bytes from the start of one line of the buffer to the next
+   */
+  virtual void decodeTile( int h, int v, unsigned int r, int l, unsigned int t,
+			   unsigned int x, unsigned int y, unsigned int w, unsigned int height,
+			   void* buffer, size_t stride );
+
+
   /// Return a region for a given angle and resolution
   /** Return a RawTile object: Overloaded by child class.
       @param ha horizontal angle
@@ -52,6 +52,7 @@ class IIPResponse{
   std::string error;               // Error message
   std::string cors;                // CORS (Cross-Origin Resource Sharing) setting
   bool sent;                       // Indicate whether a response has been sent
+  bool cacheable;                  // Indicate whether the response may be stored in memcached
 
 
  public:
@@ -144,6 +145,14 @@ class IIPResponse{
   bool imageSent() { return sent; };
 
 
+  /// Prevent the response from being stored in memcached, for content that changes from one request to the next
+  void setUncacheable() { cacheable = false; };
+
+
+  /// Indicate whether the response may be stored in memcached
+  bool isCacheable() { return cacheable; };
+
+
   /// Display our advertising banner ;-)
   /** @param version server version */
   std::string getAdvert( const std::string& version );
@@ -289,7 +289,7 @@ unsigned int JPEGCompressor::Finish( unsigned char* output ) throw (string)
 
   // Tidy up and de-allocate memory
   dest->pub.next_output_byte = dest->buffer;
-  cinfo.next_scanline = dest->strip_height;
+  cinfo.next_scanline = cinfo.image_height;
   jpeg_finish_compress( &cinfo );
 
   size_t datacount = dest->size;
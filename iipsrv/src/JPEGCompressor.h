@@ -107,8 +107,9 @@ class JPEGCompressor{
   /** If we are doing a strip based encoding, we need to first initialise
       with InitCompression, then compress a single strip at a time using
       CompressStrip and finally clean up using Finish
-      @param rawtile tile containing the image to be compressed
-      @param strip_height pixel height of the strip we want to compress
+      @param rawtile tile with the width, height and channels of the whole image. Its
+      data is not used, so the image can be produced a strip at a time
+      @param strip_height maximum pixel height of the strips we will compress
       @return header size
    */
   void InitCompression( const RawTilePtr rawtile, unsigned int strip_height ) throw (std::string);
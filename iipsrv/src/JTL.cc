@@ -78,6 +78,12 @@ void JTL::send( Session* session, int resolution, int tile ){
   RawTilePtr rawtile = tilemanager.getTile( resolution, tile, session->view->xangle,
 					 session->view->yangle, session->view->getLayers(), ct );
 
+  // Let the prefetcher predict the tiles this client is likely to request next
+  if( session->prefetcher && ct == JPEG ){
+    session->prefetcher->observe( session->image, resolution, tile, session->view->xangle,
+				  session->view->yangle, session->view->getLayers() );
+  }
+
 
   int len = rawtile->dataLength;
 
@@ -263,6 +269,7 @@ void JTL::send( Session* session, int resolution, int tile ){
       *(session->logfile) << "JTL :: Compressing UNCOMPRESSED to JPEG";
       function_timer.start();
     }
+    unshare( rawtile );
     len = session->jpeg->Compress( rawtile );
     if( session->loglevel >= 4 ){
       *(session->logfile) << " in " << function_timer.getTime() << " microseconds" << endl;
@@ -270,6 +277,8 @@ void JTL::send( Session* session, int resolution, int tile ){
   }
 
 
+  TraceSpan span( "write" );
+
 #ifndef DEBUG
   char str[1024];
 
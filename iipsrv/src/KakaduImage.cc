@@ -338,6 +338,7 @@ RawTilePtr KakaduImage::getTile( int seq, int ang, unsigned int res, int layers,
 
   rawtile->dataLength = tw*th*channels*obpc/8;
   rawtile->filename = getImagePath();
+  rawtile->imageId = getImageId();
   rawtile->timestamp = timestamp;
 
   // Process the tile
@@ -375,6 +376,7 @@ RawTilePtr KakaduImage::getRegion( int seq, int ang, unsigned int res, int layer
 
   rawtile->dataLength = w*h*channels*obpc/8;
   rawtile->filename = getImagePath();
+  rawtile->imageId = getImageId();
   rawtile->timestamp = timestamp;
 
   process( res, layers, x, y, w, h, rawtile->data );
@@ -38,6 +38,7 @@
 #include <jp2.h>
 #include <kdu_stripe_decompressor.h>
 #include <fstream>
+#include <mutex>
 
 #define TILESIZE 256
 
@@ -47,6 +48,7 @@ using namespace kdu_supp; // Also includes the `kdu_core' namespace
 #endif
 
 extern std::ofstream logfile;
+extern std::mutex logfile_mutex;
 
 
 /// Wrapper class to handle error messages from Kakadu
@@ -59,9 +61,12 @@ class kdu_stream_message : public kdu_message {
   kdu_stream_message(std::ostream *stream)
     { this->stream = stream; }
   void put_text(const char *string)
-  { logfile << string; }
+  { std::lock_guard<std::mutex> lock( logfile_mutex ); logfile << string; }
   void flush(bool end_of_message=false){
-    logfile << message;
+    {
+      std::lock_guard<std::mutex> lock( logfile_mutex );
+      logfile << message;
+    }
     if( end_of_message ) throw 1;
   }
 };
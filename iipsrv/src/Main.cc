@@ -30,8 +30,16 @@
 #include <iostream>
 #include <fstream>
 #include <string>
+#include <cstring>
+#include <algorithm>
 #include <utility>
 #include <map>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 #include "TPTImage.h"
 #include "JPEGCompressor.h"
@@ -43,6 +51,7 @@
 #include "Task.h"
 #include "Environment.h"
 #include "Writer.h"
+#include "HTTPServer.h"
 
 #ifndef DEBUG
 
@@ -90,7 +99,8 @@ using namespace std;
 */
 int loglevel;
 ofstream logfile;
-unsigned long IIPcount;
+mutex logfile_mutex;   // Serialises writes to logfile from image readers in worker threads
+atomic<unsigned long> IIPcount;
 char *tz = NULL;
 
 
@@ -134,7 +144,6 @@ int main( int argc, char *argv[] )
 {
 
   IIPcount = 0;
-  int i;
 
 
   // Define ourselves a version
@@ -192,7 +201,6 @@ int main( int argc, char *argv[] )
 
 #ifndef DEBUG
 
-  FCGX_Request request;
   int listen_socket = 0;
   bool standalone = false;
 
@@ -211,7 +219,26 @@ int main( int argc, char *argv[] )
     logfile << "Running in standalone mode on socket: " << socket << endl << endl;
   }
 
-  if( FCGX_InitRequest( &request, listen_socket, 0 ) ) return(1);
+  // Or run as an HTTP server ourselves
+  int http_socket = -1;
+
+  if( argv[1] && (string(argv[1]) == "--http") ){
+    string address = argv[2] ? argv[2] : "";
+    if( !address.length() ){
+      logfile << "No HTTP address specified" << endl << endl;
+      exit(1);
+    }
+    http_socket = HTTPServer::openSocket( address );
+    if( http_socket < 0 ){
+      logfile << "Unable to open HTTP socket '" << address << "'" << endl << endl;
+      exit(1);
+    }
+    standalone = true;
+    logfile << "Running as HTTP server on: " << address << endl << endl;
+  }
+
+  // Initialise the FCGI library before any worker thread creates its request
+  if( FCGX_Init() ) return(1);
 
   // Check whether we are really in FCGI mode - only if we are not in standalone mode
   if( FCGX_IsCGI() ){
@@ -228,9 +255,16 @@ int main( int argc, char *argv[] )
 
 
   // Set our maximum image cache size
-	int max_image_cache_size = Environment::getMaxImageCacheSize();
+	float max_image_cache_size = Environment::getMaxImageCacheSize();
+  unsigned int max_image_cache_idle = Environment::getMaxImageCacheIdle();
+  unsigned int revalidate_interval = Environment::getRevalidateInterval();
   float max_tile_cache_size = Environment::getMaxTileCacheSize();
 
+  // Get our tile cache eviction policy
+  string tile_cache_policy = Environment::getTileCachePolicy();
+  transform( tile_cache_policy.begin(), tile_cache_policy.end(), tile_cache_policy.begin(), ::tolower );
+  if( tile_cache_policy != "tinylfu" ) tile_cache_policy = "clock";
+
 
 	imageCacheMapType imageCache(max_image_cache_size);
 
@@ -269,16 +303,48 @@ int main( int argc, char *argv[] )
   string base_url = Environment::getBaseURL();
 
 
+  // Get the number of worker threads - only a single thread in debug mode
+#ifdef DEBUG
+  unsigned int worker_threads = 1;
+#else
+  unsigned int worker_threads = Environment::getWorkerThreads();
+
+  // In HTTP mode, the HTTP I/O threads pass requests to the worker threads through a bounded queue
+  unsigned int http_threads = Environment::getHTTPThreads();
+  HTTPServer::JobQueue request_queue( Environment::getRequestQueueSize() );
+  vector<HTTPServer::Depths> http_depths( http_threads );
+#endif
+
+  // Record timing spans if requested
+  unsigned int trace_buffer_size = Environment::getTraceBufferSize();
+  Trace::enable( trace_buffer_size );
+
+
   // Print out some information
   if( loglevel >= 1 ){
-		logfile << "Setting maximum image cache size to " << max_image_cache_size << endl;
+		logfile << "Setting maximum image cache size to " << max_image_cache_size << "MB" << endl;
+    if( max_image_cache_idle > 0 ){
+      logfile << "Closing images unused for " << max_image_cache_idle << " seconds" << endl;
+    }
+    if( revalidate_interval > 0 ){
+      logfile << "Checking open images for modification every " << revalidate_interval << " seconds" << endl;
+    }
     logfile << "Setting maximum tile cache size to " << max_tile_cache_size << "MB" << endl;
+    logfile << "Setting tile cache eviction policy to " << tile_cache_policy << endl;
     logfile << "Setting filesystem prefix to '" << filesystem_prefix << "'" << endl;
     logfile << "Setting default JPEG quality to " << jpeg_quality << endl;
     logfile << "Setting maximum CVT size to " << max_CVT << endl;
     logfile << "Setting 3D file sequence name pattern to '" << filename_pattern << "'" << endl;
     if( !cors.empty() ) logfile << "Setting Cross Origin Resource Sharing to '" << cors << "'" << endl;
     if( !base_url.empty() ) logfile << "Setting base URL to '" << base_url << "'" << endl;
+    logfile << "Setting number of worker threads to " << worker_threads << endl;
+    if( trace_buffer_size > 0 ) logfile << "Setting trace buffer size to " << trace_buffer_size << " spans per thread" << endl;
+#ifndef DEBUG
+    if( http_socket >= 0 ){
+      logfile << "Setting number of HTTP I/O threads to " << http_threads << endl;
+      logfile << "Setting request queue size to " << request_queue.getCapacity() << endl;
+    }
+#endif
     if( max_layers != 0 ){
       logfile << "Setting max quality layers (for supported file formats) to ";
       if( max_layers < 0 ) logfile << "all layers" << endl;
@@ -312,9 +378,9 @@ int main( int argc, char *argv[] )
   string memcached_servers = Environment::getMemcachedServers();
   unsigned int memcached_timeout = Environment::getMemcachedTimeout();
 
-  // Create our memcached object
-  Memcache memcached( memcached_servers, memcached_timeout );
+  // Check our memcached connection - each worker thread creates its own memcached object
   if( loglevel >= 1 ){
+    Memcache memcached( memcached_servers, memcached_timeout );
     if( memcached.connected() ){
       logfile << "Memcached support enabled. Connected to servers: '" << memcached_servers
 	      << "' with timeout " << memcached_timeout << endl;
@@ -326,6 +392,83 @@ int main( int argc, char *argv[] )
 #endif
 
 
+  // Attach to a shared memory tile cache if one has been requested. This is shared
+  // by all iipsrv processes on this host and is kept when they exit
+  SharedTileCache* shared_tile_cache = NULL;
+  float shared_tile_cache_size = Environment::getSharedTileCacheSize();
+  if( shared_tile_cache_size > 0 ){
+    string shared_tile_cache_name = Environment::getSharedTileCacheName();
+    shared_tile_cache = new SharedTileCache( shared_tile_cache_name, shared_tile_cache_size );
+    if( loglevel >= 1 ){
+      if( shared_tile_cache->connected() ){
+	logfile << "Shared memory tile cache enabled. Attached to '" << shared_tile_cache_name
+		<< "' with size " << shared_tile_cache_size << "MB" << endl;
+      }
+      else logfile << "Unable to attach shared memory tile cache: " << shared_tile_cache->error() << endl;
+    }
+  }
+
+
+  // Open a disk cache of encoded tiles if one has been requested. This keeps its
+  // tiles across restarts
+  DiskTileCache* disk_tile_cache = NULL;
+  string disk_tile_cache_dir = Environment::getDiskTileCacheDir();
+  if( !disk_tile_cache_dir.empty() ){
+    float disk_tile_cache_size = Environment::getDiskTileCacheSize();
+    disk_tile_cache = new DiskTileCache( disk_tile_cache_dir, disk_tile_cache_size );
+    if( loglevel >= 1 ){
+      if( disk_tile_cache->connected() ){
+	logfile << "Disk tile cache enabled in '" << disk_tile_cache_dir << "' with size "
+		<< disk_tile_cache_size << "MB. " << disk_tile_cache->getNumElements()
+		<< " tiles loaded" << endl;
+      }
+      else logfile << "Unable to open disk tile cache: " << disk_tile_cache->error() << endl;
+    }
+  }
+
+
+  // Use memcached as a tile cache shared between servers if requested. Unlike the
+  // response cache, tiles are keyed by what they are, so are shared between protocols
+  MemcachedTileCache* memcached_tile_cache = NULL;
+  if( Environment::getMemcachedTileCache() ){
+    string memcached_servers = Environment::getMemcachedServers();
+    unsigned int memcached_timeout = Environment::getMemcachedTimeout();
+    memcached_tile_cache = new MemcachedTileCache( memcached_servers, memcached_timeout );
+    if( loglevel >= 1 ){
+      if( memcached_tile_cache->connected() ){
+	logfile << "Memcached tile cache enabled. Using servers: '" << memcached_servers
+		<< "' with timeout " << memcached_timeout << endl;
+      }
+      else logfile << "Unable to use Memcached tile cache: " << memcached_tile_cache->error() << endl;
+    }
+  }
+
+
+  // Number of tiles of each newly opened image to prefetch in the background
+  unsigned int prefetch_tiles = Environment::getPrefetchTiles();
+  if( prefetch_tiles > 0 && loglevel >= 1 ){
+    logfile << "Prefetching up to " << prefetch_tiles << " tiles of the lowest resolutions of newly opened images" << endl;
+  }
+
+  // Whether to prefetch the tiles that clients are likely to request next
+  bool prefetch_predict = Environment::getPrefetchPredict();
+  if( prefetch_predict && loglevel >= 1 ) logfile << "Prefetching predicted tiles while idle" << endl;
+
+  // Number of threads that help to decode and compose the tiles of large regions
+  unsigned int region_threads = Environment::getRegionThreads();
+  if( region_threads > 0 && loglevel >= 1 ){
+    logfile << "Composing regions with the help of " << region_threads << " threads" << endl;
+  }
+
+  // Number of threads that may decode from images and that may transform and encode at once
+  unsigned int decode_threads = Environment::getDecodeThreads();
+  unsigned int cpu_threads = Environment::getCPUThreads();
+  if( loglevel >= 1 ){
+    if( decode_threads > 0 ) logfile << "Decoding on up to " << decode_threads << " threads at once" << endl;
+    if( cpu_threads > 0 ) logfile << "Transforming and encoding on up to " << cpu_threads << " threads at once" << endl;
+  }
+
+
   // Add a new line
   if( loglevel >= 1 ) logfile << endl;
 
@@ -399,39 +542,79 @@ int main( int argc, char *argv[] )
   }
 
 
-  // Set up our request timers and seed our random number generator with the millisecond count from it
-  Timer request_timer;
-  srand( request_timer.getTime() );
+  // Seed our random number generator with the millisecond count from a timer
+  Timer seed_timer;
+  srand( seed_timer.getTime() );
 
   // Create our tile cache
-	TileCache tileCache( max_tile_cache_size );
-  Task* task = NULL;
+	TileCache tileCache( max_tile_cache_size,
+			     ( tile_cache_policy == "tinylfu" ) ? CACHE_TINYLFU : CACHE_CLOCK );
+  if( shared_tile_cache && shared_tile_cache->connected() ) tileCache.setSharedCache( shared_tile_cache );
+  if( disk_tile_cache && disk_tile_cache->connected() ) tileCache.setDiskCache( disk_tile_cache );
+  if( memcached_tile_cache && memcached_tile_cache->connected() ) tileCache.setMemcachedCache( memcached_tile_cache );
+
+  // Close images that have not been used for a while, so that idle decoders do not
+  // hold on to their memory until the image cache fills up
+  mutex idle_mutex;
+  condition_variable idle_condition;
+  bool idle_stop = false;
+  thread idle_thread;
+  if( max_image_cache_idle > 0 ){
+    idle_thread = thread( [&](){
+      chrono::seconds period( max( 1u, min( max_image_cache_idle / 4, 60u ) ) );
+      unique_lock<mutex> lock( idle_mutex );
+      while( !idle_condition.wait_for( lock, period, [&](){ return idle_stop; } ) ){
+	imageCache.removeIdle( max_image_cache_idle );
+      }
+    } );
+  }
 
 
+  // Fill the tile cache in the background with the lowest resolutions of newly opened
+  // images and with the tiles clients are likely to request next
+  Prefetcher* prefetcher = NULL;
+  if( prefetch_tiles > 0 || prefetch_predict ){
+    prefetcher = new Prefetcher( &tileCache, &watermark, jpeg_quality, prefetch_tiles, prefetch_predict,
+				 Environment::getLogFile(), loglevel );
+  }
 
-  /****************
-    Main FCGI loop
-  ****************/
+  // Threads shared by all requests to decode and compose the tiles of CVT, IIIF and PFL regions
+  ThreadPool* thread_pool = NULL;
+  if( region_threads > 0 ) thread_pool = new ThreadPool( region_threads );
 
-#ifdef DEBUG
-    for (int ii = 0; ii < 1000; ++ii) {
+  // Limit the threads in the decode and CPU stages of request handling
+  if( decode_threads > 0 ) Stage::decode = new Stage( decode_threads );
+  if( cpu_threads > 0 ) Stage::cpu = new Stage( cpu_threads );
 
-            tileCache.clear();
 
-    FILE *f = fopen( "test.jpg", "w" );
-    FileWriter writer( f );
-
-#else
 
-  while( FCGX_Accept_r( &request ) >= 0 ){
-
-    FCGIWriter writer( request.out );
+  /****************
+    Main FCGI loop
+  ****************/
 
+  // Handle a single request, whether it arrived through FCGI or HTTP, for one of the worker threads.
+  // The headers contain the query string and the HTTP headers we use, and the worker supplies its
+  // own log stream, memory for its tasks and memcached connection.
+  // Returns whether the response written may be stored in memcached
+  auto process = [&]( Writer& writer, map<const string, string>& headers, ofstream& logfile, Arena& arena
+#ifndef DEBUG
+#ifdef HAVE_MEMCACHED
+		      , Memcache& memcached
 #endif
+#endif
+		      ) -> bool {
+
+    // Set up our request timer
+    Timer request_timer;
+    Task* task = NULL;
 
 
     // Time each request
     if( loglevel >= 2 ) request_timer.start();
+    TraceSpan span( "request" );
+
+    // Predictive prefetching waits while we are busy
+    Prefetcher::Foreground foreground( prefetcher );
 
 
     // Declare our image pointer here outside of the try scope
@@ -453,14 +636,16 @@ int main( int argc, char *argv[] )
     IIPResponse response;
     response.setCORS( cors );
 
+    // Take the headers supplied by our caller, swapping rather than copying them,
+    // and hand them back once we are done
+    session.headers.swap( headers );
+
+    bool cacheable = false;
+
     try{
       
-      // Get the query into a string
-#ifdef DEBUG
-      const string request_string = argv[1];
-#else
-      const string request_string = FCGX_GetParam( "QUERY_STRING", request.envp );
-#endif
+      // Get the query string
+      const string& request_string = session.headers["QUERY_STRING"];
 
       // Check that we actually have a request string
       if( request_string.length() == 0 ) {
@@ -482,28 +667,23 @@ int main( int argc, char *argv[] )
       session.logfile = &logfile;
       session.imageCache = &imageCache;
       session.tileCache = &tileCache;
+      session.prefetcher = prefetcher;
+      session.threadPool = thread_pool;
+#ifndef DEBUG
+      session.requestQueue = ( http_socket >= 0 ) ? &request_queue : NULL;
+      session.httpDepths = ( http_socket >= 0 ) ? &http_depths : NULL;
+#else
+      session.requestQueue = NULL;
+      session.httpDepths = NULL;
+#endif
       session.out = &writer;
       session.watermark = &watermark;
-      session.headers.empty();
 
-      // Get certain HTTP headers, such as if_modified_since and the query_string
-#ifndef DEBUG
-
-      char* header = NULL;
-      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", request.envp)) ){
-	session.headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
-	if( loglevel >= 2 ){
-	  logfile << "HTTP Header: If-Modified-Since: " << session.headers["HTTP_IF_MODIFIED_SINCE"] << endl;
-	}
+      // Use the HTTP headers, such as if_modified_since and the query_string, supplied by our caller
+      bool if_modified_since = ( session.headers.find("HTTP_IF_MODIFIED_SINCE") != session.headers.end() );
+      if( if_modified_since && loglevel >= 2 ){
+	logfile << "HTTP Header: If-Modified-Since: " << session.headers["HTTP_IF_MODIFIED_SINCE"] << endl;
       }
-#endif
-      session.headers["QUERY_STRING"] = request_string;
-
-#ifndef DEBUG
-      session.headers["SERVER_PROTOCOL"] =  FCGX_GetParam("SERVER_PROTOCOL", request.envp);
-      session.headers["HTTP_HOST"] = FCGX_GetParam("HTTP_HOST", request.envp);
-      session.headers["REQUEST_URI"] = FCGX_GetParam("REQUEST_URI", request.envp);
-#endif
       session.headers["BASE_URL"] = base_url;
 
 
@@ -512,7 +692,7 @@ int main( int argc, char *argv[] )
 #ifdef HAVE_MEMCACHED
       // Check whether this exists in memcached, but only if we haven't had an if_modified_since
       // request, which should always be faster to send
-      if( !header ){
+      if( !if_modified_since ){
 	char* memcached_response = NULL;
 	if( (memcached_response = memcached.retrieve( request_string )) ){
 	  writer.putStr( memcached_response, memcached.length() );
@@ -524,40 +704,57 @@ int main( int argc, char *argv[] )
 #endif
 #endif
 
-      // Parse up the command list
-
-      list < pair<string,string> > requests;
-      list < pair<string,string> > :: const_iterator commands;
-
-      Tokenizer izer( request_string, "&" );
-      while( izer.hasMoreTokens() ){
-	pair <string,string> p;
-	string token = izer.nextToken();
-	int n = token.find_first_of( "=" );
-	p.first = token.substr( 0, n );
-	p.second = token.substr( n+1, token.length() );
-	if( p.first.length() && p.second.length() ) requests.push_back( p );
+      // Split the query string into its command=argument pairs in place rather than into copies.
+      // A pair without an argument is ignored and one without an = is taken as both command and argument
+
+      struct Pair {
+	const char* command;
+	size_t length;
+	const char* argument;
+	size_t argument_length;
+      };
+
+      const char* query = request_string.data();
+      const char* end = query + request_string.length();
+      Pair* pairs = static_cast<Pair*>( arena.allocate( ( count( query, end, '&' ) + 1 ) * sizeof(Pair) ) );
+      size_t requests = 0;
+
+      for( const char* p = query; p < end; ){
+	const char* next = static_cast<const char*>( memchr( p, '&', end - p ) );
+	if( !next ) next = end;
+	const char* eq = static_cast<const char*>( memchr( p, '=', next - p ) );
+	Pair& pair = pairs[requests];
+	pair.command = p;
+	pair.length = ( eq ? eq : next ) - p;
+	pair.argument = eq ? eq + 1 : p;
+	pair.argument_length = next - pair.argument;
+	if( pair.length && pair.argument_length ) requests++;
+	p = next + 1;
       }
 
 
-      i = 0;
-      for( commands = requests.begin(); commands != requests.end(); commands++ ){
+      string argument;
+      for( size_t n = 0; n < requests; n++ ){
 
-	string command = (*commands).first;
-	string argument = (*commands).second;
+	const char* command = pairs[n].command;
+	size_t length = pairs[n].length;
+	argument.assign( pairs[n].argument, pairs[n].argument_length );
 
 	if( loglevel >= 2 ){
-	  logfile << "[" << i+1 << "/" << requests.size() << "]: Command / Argument is " << command << " : " << argument << endl;
-	  i++;
+	  logfile << "[" << n+1 << "/" << requests << "]: Command / Argument is " << string( command, length ) << " : " << argument << endl;
 	}
 
-	task = Task::factory( command );
-	if( task ) task->run( &session, argument );
+	task = Task::factory( command, length, arena );
+	if( task ){
+	  // Transforms and encoding hold a slot of the CPU stage, which is given up while decoding
+	  Stage::Slot slot( Stage::cpu );
+	  task->run( &session, argument );
+	}
 
 	if( !task ){
-	  if( loglevel >= 1 ) logfile << "Unsupported command: " << command << endl;
+	  if( loglevel >= 1 ) logfile << "Unsupported command: " << string( command, length ) << endl;
 	  // Unsupported command error code is 2 2
-	  response.setError( "2 2", command );
+	  response.setError( "2 2", string( command, length ) );
 	}
 
 
@@ -599,25 +796,9 @@ int main( int argc, char *argv[] )
       }
 
 
-      ////////////////////////////////////////////////////////
-      ////////// Insert the result into Memcached  ///////////
-      ////////// - Note that we never store errors ///////////
-      //////////   or 304 replies                  ///////////
-      ////////////////////////////////////////////////////////
-#ifndef DEBUG
-
-#ifdef HAVE_MEMCACHED
-      if( memcached.connected() ){
-	Timer memcached_timer;
-	memcached_timer.start();
-	memcached.store( session.headers["QUERY_STRING"], writer.buffer, writer.sz );
-	if( loglevel >= 3 ){
-	  logfile << "Memcached :: stored " << writer.sz << " bytes in "
-		  << memcached_timer.getTime() << " microseconds" << endl;
-	}
-      }
-#endif
-#endif
+      // The result can be inserted into Memcached by our caller
+      // - Note that we never store errors, 304 replies or responses that change between requests
+      cacheable = response.isCacheable();
 
 
       //////////////////////////////////////////////////////
@@ -723,14 +904,14 @@ int main( int argc, char *argv[] )
       delete task;
       task = NULL;
     }
+    arena.reset();
+
+    // Hand the headers back to our caller
+    session.headers.swap( headers );
 			//delete image;  // TODO: don't delete this.  delete via imageCache cleanup.
 			//image = NULL;
     IIPcount ++;
 
-#ifdef DEBUG
-    fclose( f );
-#endif
-
 
 
     // How long did this request take?
@@ -745,14 +926,181 @@ int main( int argc, char *argv[] )
       
     }
 
+    return cacheable;
+
+  };
+
+
+  // Each worker thread runs its own accept loop with its own FCGI request or its own
+  // HTTP event loop, while sharing the image and tile caches
+  auto worker = [&](){
+
+    // Give each thread its own stream onto the log file as ofstream is not thread safe.
+    // This deliberately shadows the global logfile for the rest of the loop
+    ofstream thread_logfile;
+    if( worker_threads > 1 && loglevel >= 1 ) thread_logfile.open( Environment::getLogFile().c_str(), ios::app );
+    ofstream& logfile = thread_logfile.is_open() ? thread_logfile : ::logfile;
+
+    // Memory for the tasks of each request
+    Arena arena;
+
+#ifndef DEBUG
+#ifdef HAVE_MEMCACHED
+    // libmemcached connections cannot be shared between threads
+    Memcache memcached( memcached_servers, memcached_timeout );
+#endif
+#endif
+
+
+    // Store a complete response in memcached
+    auto store = [&]( const string& key, const char* data, size_t length ){
+#ifndef DEBUG
+#ifdef HAVE_MEMCACHED
+      if( memcached.connected() ){
+	Timer memcached_timer;
+	memcached_timer.start();
+	memcached.store( key, data, length );
+	if( loglevel >= 3 ){
+	  logfile << "Memcached :: stored " << length << " bytes in "
+		  << memcached_timer.getTime() << " microseconds" << endl;
+	}
+      }
+#endif
+#endif
+    };
+
+
+    // Handle a request with this thread's log stream, task memory and memcached connection
+    auto handle = [&]( Writer& writer, map<const string, string>& headers ) -> bool {
+      return process( writer, headers, logfile, arena
+#ifndef DEBUG
+#ifdef HAVE_MEMCACHED
+		      , memcached
+#endif
+#endif
+		      );
+    };
+
+
+#ifndef DEBUG
+
+    // In HTTP mode, handle the requests passed to us by the HTTP I/O threads instead of accepting FCGI requests
+    if( http_socket >= 0 ){
+      HTTPServer::work( request_queue, [&]( map<const string, string>& headers, HTTPWriter& writer ){
+	if( loglevel >= 2 ){
+	  logfile << "Request queue depth: " << request_queue.size() << "/" << request_queue.getCapacity() << endl;
+	}
+	if( handle( writer, headers ) ) store( headers["QUERY_STRING"], writer.buffer.data(), writer.buffer.size() );
+      });
+      return;
+    }
+
+    FCGX_Request request;
+    if( FCGX_InitRequest( &request, listen_socket, 0 ) ){
+      if( loglevel >= 1 ) logfile << "Unable to initialise FCGI request" << endl;
+      return;
+    }
+
+#endif
+
+#ifdef DEBUG
+    for (int ii = 0; ii < 1000; ++ii) {
+
+            tileCache.clear();
+
+    FILE *f = fopen( "test.jpg", "w" );
+    FileWriter writer( f );
+
+    map<const string, string> headers;
+    headers["QUERY_STRING"] = argv[1];
+
+    handle( writer, headers );
+    fclose( f );
+
+#else
+
+    while( FCGX_Accept_r( &request ) >= 0 ){
+
+      // Only keep a copy of the response if we can store it in memcached
+      bool keep = false;
+#ifdef HAVE_MEMCACHED
+      keep = memcached.connected();
+#endif
+      FCGIWriter writer( request.out, keep );
+
+      // Get the query string and certain HTTP headers, such as if_modified_since
+      map<const string, string> headers;
+      char* header = NULL;
+      if( (header = FCGX_GetParam("HTTP_IF_MODIFIED_SINCE", request.envp)) ) headers["HTTP_IF_MODIFIED_SINCE"] = string(header);
+      headers["QUERY_STRING"] = (header = FCGX_GetParam("QUERY_STRING", request.envp)) ? header : "";
+      headers["SERVER_PROTOCOL"] = (header = FCGX_GetParam("SERVER_PROTOCOL", request.envp)) ? header : "";
+      headers["HTTP_HOST"] = (header = FCGX_GetParam("HTTP_HOST", request.envp)) ? header : "";
+      headers["REQUEST_URI"] = (header = FCGX_GetParam("REQUEST_URI", request.envp)) ? header : "";
+
+      if( handle( writer, headers ) && writer.buffer ) store( headers["QUERY_STRING"], writer.buffer, writer.sz );
+
+#endif
+
+      ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
+    }
+
+  };
 
 
-    ///////// End of FCGI_ACCEPT while loop or for loop in debug mode //////////
+
+  // Start our worker threads. The main thread also acts as a worker
+#ifdef DEBUG
+  worker();
+#else
+  // In HTTP mode, create the servers for the I/O threads up front. A worker may still be
+  // handing a finished request back to a server after its I/O thread has stopped, so they
+  // are only destroyed once all the workers have finished
+  vector<HTTPServer*> http_servers;
+  if( http_socket >= 0 ){
+    for( unsigned int n = 0; n < http_threads; n++ ){
+      http_servers.push_back( new HTTPServer( http_socket, &request_queue, &http_depths[n] ) );
+    }
+  }
+  atomic<unsigned int> http_running( http_servers.size() );
+
+  vector<thread> workers;
+  for( unsigned int n = 1; n < worker_threads; n++ ) workers.push_back( thread( worker ) );
+
+  // Start the I/O threads, which accept connections, parse requests and send responses
+  for( unsigned int n = 0; n < http_servers.size(); n++ ){
+    workers.push_back( thread( [&,n](){
+      http_servers[n]->run();
+      // We only get here on a fatal error. Once no I/O thread is left, let the workers
+      // finish the requests already queued and stop
+      if( --http_running == 0 ) request_queue.close();
+    } ) );
   }
+  worker();
+  for( vector<thread>::iterator t = workers.begin(); t != workers.end(); ++t ) t->join();
+  for( vector<HTTPServer*>::iterator s = http_servers.begin(); s != http_servers.end(); ++s ) delete *s;
+#endif
 
 
 		// cleanup.
 		// ImageCache should clean up automatically.
+  if( prefetcher ) delete prefetcher;
+  if( thread_pool ) delete thread_pool;
+  if( Stage::decode ) delete Stage::decode;
+  if( Stage::cpu ) delete Stage::cpu;
+  if( idle_thread.joinable() ){
+    {
+      lock_guard<mutex> lock( idle_mutex );
+      idle_stop = true;
+    }
+    idle_condition.notify_one();
+    idle_thread.join();
+  }
+  tileCache.setSharedCache( NULL );
+  tileCache.setDiskCache( NULL );
+  tileCache.setMemcachedCache( NULL );
+  if( shared_tile_cache ) delete shared_tile_cache;
+  if( disk_tile_cache ) delete disk_tile_cache;
+  if( memcached_tile_cache ) delete memcached_tile_cache;
 
   if( loglevel >= 1 ){
     logfile << endl << "Terminating after " << IIPcount << " iterations" << endl;
@@ -102,13 +102,13 @@ class Memcache {
       @param data pointer to the data to be stored
       @param length length of data to be stored
   */
-  void store( const std::string& key, void* data, unsigned int length ){
+  void store( const std::string& key, const void* data, unsigned int length ){
 
     if( !_connected ) return;
  
     std::string k = "iipsrv::" + key;
     _rc = memcached_set( _memc, k.c_str(), k.length(),
-                        (char*) data, length,
+                        (const char*) data, length,
                         _timeout, 0 );
   }
 
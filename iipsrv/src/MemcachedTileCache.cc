@@ -0,0 +1,373 @@
+// Member functions for MemcachedTileCache.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "MemcachedTileCache.h"
+
+#include <cstring>
+#include <cstdio>
+
+
+using namespace std;
+
+
+// Identifies a value and its layout version
+#define MEMCACHED_TILE_MAGIC 0x49504d54
+#define MEMCACHED_TILE_VERSION 1
+
+// Largest value we store: memcached's default item size limit, leaving room for its own header
+#define MEMCACHED_TILE_ITEM_SIZE 1047552
+
+// Maximum number of tiles waiting to be stored
+#define MEMCACHED_TILE_QUEUE 256
+
+// Time in milliseconds after which a lookup gives up on a server, so that a server
+// that is down cannot hold up requests for long
+#define MEMCACHED_TILE_POLL_TIMEOUT 100
+
+
+/// Followed by the file name and the tile data
+struct MemcachedTileCache::Record {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t filenameLength;
+  int32_t dataLength;
+  int32_t tileNum;
+  int32_t resolution;
+  int32_t hSequence;
+  int32_t vSequence;
+  int32_t compressionType;
+  int32_t quality;
+  uint32_t width;
+  uint32_t height;
+  int32_t channels;
+  int32_t bpc;
+  int32_t sampleType;
+  int32_t padded;
+  int64_t timestamp;
+};
+
+
+
+string MemcachedTileCache::name( const string& path, int resolution, int tile, int h, int v, int c, int q )
+{
+  // Keys are limited to 250 characters, so use a 64 bit FNV-1a hash of the path.
+  // The path is held within the value, so a collision is detected on retrieval
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for( string::const_iterator i = path.begin(); i != path.end(); i++ ){
+    hash ^= (unsigned char) *i;
+    hash *= 0x100000001b3ULL;
+  }
+
+  char key[128];
+  snprintf( key, 128, "iipsrv::tile::%016llx:%d:%d:%d:%d:%d:%d",
+	    (unsigned long long) hash, resolution, tile, h, v, c, q );
+  return string( key );
+}
+
+
+
+RawTilePtr MemcachedTileCache::decode( const char* value, size_t length, const TileKey& key, time_t timestamp )
+{
+  Record record;
+  if( length < sizeof(Record) ) return RawTilePtr();
+  memcpy( &record, value, sizeof(Record) );
+
+  if( record.magic != MEMCACHED_TILE_MAGIC || record.version != MEMCACHED_TILE_VERSION ||
+      record.dataLength < 0 || length != sizeof(Record) + record.filenameLength + (uint64_t) record.dataLength ||
+      record.timestamp < timestamp ) return RawTilePtr();
+
+  // Check that this really is our tile
+  string filename( value + sizeof(Record), record.filenameLength );
+  if( record.tileNum != key.tile || record.resolution != key.resolution ||
+      record.hSequence != key.hSequence || record.vSequence != key.vSequence ||
+      record.compressionType != key.compression || record.quality != key.quality ||
+      filename != TileKey::path( key.image ) ) return RawTilePtr();
+
+  RawTilePtr tile( new RawTile( record.tileNum, record.resolution, record.hSequence, record.vSequence,
+				record.width, record.height, record.channels, record.bpc ) );
+  tile->compressionType = (CompressionType) record.compressionType;
+  tile->quality = record.quality;
+  tile->sampleType = (SampleType) record.sampleType;
+  tile->padded = record.padded;
+  tile->timestamp = record.timestamp;
+  tile->filename = filename;
+  tile->imageId = key.image;
+  tile->dataLength = record.dataLength;
+
+  // Allocate in the same way as RawTile so that its destructor frees correctly
+  switch( tile->bpc ){
+    case 32:
+      if( tile->sampleType == FLOATINGPOINT ) tile->data = new float[tile->dataLength/4];
+      else tile->data = new unsigned int[tile->dataLength/4];
+      break;
+    case 16:
+      tile->data = new unsigned short[tile->dataLength/2];
+      break;
+    default:
+      tile->data = new unsigned char[tile->dataLength];
+      break;
+  }
+  tile->memoryManaged = 1;
+  memcpy( tile->data, value + sizeof(Record) + record.filenameLength, tile->dataLength );
+
+  return tile;
+}
+
+
+
+#if defined(HAVE_MEMCACHED) && !defined(WIN32)
+
+
+MemcachedTileCache::MemcachedTileCache( const string& servers, unsigned int timeout ) :
+  _master( NULL ), _servers( NULL ), _timeout( timeout ), _stop( false ), _open( false )
+{
+  _hits = 0;
+  _misses = 0;
+  _stores = 0;
+  _dropped = 0;
+
+  _master = memcached_create( NULL );
+  _servers = memcached_servers_parse( servers.c_str() );
+  if( !_master || !_servers ){
+    _error = "unable to parse server list '" + servers + "'";
+    return;
+  }
+
+  memcached_behavior_set( _master, MEMCACHED_BEHAVIOR_BINARY_PROTOCOL, 1 );
+  memcached_behavior_set( _master, MEMCACHED_BEHAVIOR_NO_BLOCK, 1 );
+  memcached_behavior_set( _master, MEMCACHED_BEHAVIOR_TCP_NODELAY, 1 );
+  memcached_behavior_set( _master, MEMCACHED_BEHAVIOR_POLL_TIMEOUT, MEMCACHED_TILE_POLL_TIMEOUT );
+  memcached_behavior_set( _master, MEMCACHED_BEHAVIOR_CONNECT_TIMEOUT, MEMCACHED_TILE_POLL_TIMEOUT );
+
+  memcached_return_t rc = memcached_server_push( _master, _servers );
+  if( rc != MEMCACHED_SUCCESS || memcached_server_count( _master ) == 0 ){
+    _error = memcached_strerror( _master, rc );
+    return;
+  }
+
+  _open = true;
+  _writer = thread( &MemcachedTileCache::write, this );
+}
+
+
+
+MemcachedTileCache::~MemcachedTileCache()
+{
+  if( _writer.joinable() ){
+    {
+      lock_guard<mutex> lock( _queueMutex );
+      _stop = true;
+    }
+    _queueCondition.notify_one();
+    _writer.join();
+  }
+
+  for( vector<memcached_st*>::iterator i = _pool.begin(); i != _pool.end(); i++ ) memcached_free( *i );
+  if( _servers ) memcached_server_free( _servers );
+  if( _master ) memcached_free( _master );
+}
+
+
+
+memcached_st* MemcachedTileCache::acquire()
+{
+  {
+    lock_guard<mutex> lock( _poolMutex );
+    if( !_pool.empty() ){
+      memcached_st* memc = _pool.back();
+      _pool.pop_back();
+      return memc;
+    }
+  }
+  return memcached_clone( NULL, _master );
+}
+
+
+
+void MemcachedTileCache::release( memcached_st* memc )
+{
+  lock_guard<mutex> lock( _poolMutex );
+  _pool.push_back( memc );
+}
+
+
+
+void MemcachedTileCache::insert( const RawTilePtr tile )
+{
+  if( !_open || !tile || !tile->data || tile->dataLength <= 0 ) return;
+  if( sizeof(Record) + tile->filename.size() + tile->dataLength > MEMCACHED_TILE_ITEM_SIZE ) return;
+
+  {
+    lock_guard<mutex> lock( _queueMutex );
+    if( _queue.size() >= MEMCACHED_TILE_QUEUE ){
+      _dropped.fetch_add( 1, memory_order_relaxed );
+      return;
+    }
+    _queue.push_back( tile );
+  }
+  _queueCondition.notify_one();
+}
+
+
+
+void MemcachedTileCache::write()
+{
+  // Stores need no reply, so that we can send them as fast as memcached takes them
+  memcached_st* memc = memcached_clone( NULL, _master );
+  if( !memc ) return;
+  memcached_behavior_set( memc, MEMCACHED_BEHAVIOR_NOREPLY, 1 );
+
+  vector<char> buffer;
+
+  while( true ){
+
+    RawTilePtr tile;
+    {
+      unique_lock<mutex> lock( _queueMutex );
+      while( _queue.empty() && !_stop ) _queueCondition.wait( lock );
+      if( _queue.empty() ) break;
+      tile = _queue.front();
+      _queue.pop_front();
+    }
+
+    Record record;
+    memset( &record, 0, sizeof(Record) );
+    record.magic = MEMCACHED_TILE_MAGIC;
+    record.version = MEMCACHED_TILE_VERSION;
+    record.filenameLength = tile->filename.size();
+    record.dataLength = tile->dataLength;
+    record.tileNum = tile->tileNum;
+    record.resolution = tile->resolution;
+    record.hSequence = tile->hSequence;
+    record.vSequence = tile->vSequence;
+    record.compressionType = tile->compressionType;
+    record.quality = tile->quality;
+    record.width = tile->width;
+    record.height = tile->height;
+    record.channels = tile->channels;
+    record.bpc = tile->bpc;
+    record.sampleType = tile->sampleType;
+    record.padded = tile->padded;
+    record.timestamp = tile->timestamp;
+
+    buffer.resize( sizeof(Record) + tile->filename.size() + tile->dataLength );
+    memcpy( &buffer[0], &record, sizeof(Record) );
+    memcpy( &buffer[sizeof(Record)], tile->filename.data(), tile->filename.size() );
+    memcpy( &buffer[sizeof(Record) + tile->filename.size()], tile->data, tile->dataLength );
+
+    string key = name( tile->filename, tile->resolution, tile->tileNum, tile->hSequence,
+		       tile->vSequence, tile->compressionType, tile->quality );
+
+    // Let go of the tile before we wait on the network
+    tile.reset();
+
+    if( memcached_set( memc, key.data(), key.size(), &buffer[0], buffer.size(), _timeout, 0 ) == MEMCACHED_SUCCESS ){
+      _stores.fetch_add( 1, memory_order_relaxed );
+    }
+  }
+
+  memcached_free( memc );
+}
+
+
+
+vector<RawTilePtr> MemcachedTileCache::getObjects( const vector<TileKey>& keys, time_t timestamp )
+{
+  vector<RawTilePtr> tiles( keys.size() );
+  if( !_open || keys.empty() ) return tiles;
+
+  vector<string> names;
+  vector<const char*> k;
+  vector<size_t> lengths;
+  names.reserve( keys.size() );
+  for( vector<TileKey>::const_iterator i = keys.begin(); i != keys.end(); i++ ){
+    names.push_back( name( TileKey::path( i->image ), i->resolution, i->tile, i->hSequence,
+			   i->vSequence, i->compression, i->quality ) );
+    k.push_back( names.back().data() );
+    lengths.push_back( names.back().size() );
+  }
+
+  memcached_st* memc = acquire();
+  if( !memc ){
+    _misses.fetch_add( keys.size(), memory_order_relaxed );
+    return tiles;
+  }
+
+  unsigned long hits = 0;
+  memcached_return_t rc = memcached_mget( memc, &k[0], &lengths[0], keys.size() );
+  if( rc == MEMCACHED_SUCCESS ){
+    // Results arrive in no particular order, and we must read all of them to leave
+    // the connection ready for the next request
+    memcached_result_st* result;
+    while( (result = memcached_fetch_result( memc, NULL, &rc )) ){
+      string key( memcached_result_key_value( result ), memcached_result_key_length( result ) );
+      for( size_t n = 0; n < names.size(); n++ ){
+	if( !tiles[n] && names[n] == key ){
+	  tiles[n] = decode( memcached_result_value( result ), memcached_result_length( result ), keys[n], timestamp );
+	  if( tiles[n] ) hits++;
+	  break;
+	}
+      }
+      memcached_result_free( result );
+    }
+  }
+
+  // Drop the connection if we were unable to read everything
+  if( rc != MEMCACHED_SUCCESS && rc != MEMCACHED_END && rc != MEMCACHED_NOTFOUND ) memcached_quit( memc );
+  release( memc );
+
+  _hits.fetch_add( hits, memory_order_relaxed );
+  _misses.fetch_add( keys.size() - hits, memory_order_relaxed );
+  return tiles;
+}
+
+
+
+#else
+
+
+// libmemcached is not available
+
+MemcachedTileCache::MemcachedTileCache( const string& servers, unsigned int timeout ) :
+  _master( NULL ), _servers( NULL ), _timeout( timeout ), _stop( false ), _open( false )
+{
+  _hits = 0;
+  _misses = 0;
+  _stores = 0;
+  _dropped = 0;
+  _error = "memcached support is not available";
+}
+
+MemcachedTileCache::~MemcachedTileCache(){}
+
+memcached_st* MemcachedTileCache::acquire(){ return NULL; }
+
+void MemcachedTileCache::release( memcached_st* memc ){}
+
+void MemcachedTileCache::write(){}
+
+void MemcachedTileCache::insert( const RawTilePtr tile ){}
+
+vector<RawTilePtr> MemcachedTileCache::getObjects( const vector<TileKey>& keys, time_t timestamp ){
+  return vector<RawTilePtr>( keys.size() );
+}
+
+
+#endif
@@ -0,0 +1,154 @@
+// Tile cache held in memcached
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _MEMCACHEDTILECACHE_H
+#define _MEMCACHEDTILECACHE_H
+
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <stdint.h>
+#include "RawTile.h"
+#include "TileKey.h"
+
+#if defined(HAVE_MEMCACHED) && !defined(WIN32)
+#include <libmemcached/memcached.h>
+#else
+typedef struct memcached_st memcached_st;
+typedef struct memcached_server_st memcached_server_st;
+#endif
+
+
+
+/// Tile cache shared between servers through memcached
+/** Unlike the response cache in Memcached.h, which is keyed by query string, tiles are
+    keyed by what they are: image path, resolution, tile, sequence, compression and
+    quality. A tile is therefore shared between all the protocols and all the servers
+    that request it. Several tiles can be fetched in a single round trip, and tiles are
+    stored by a background thread so that requests never wait on memcached to store.
+    libmemcached connections cannot be shared between threads, so lookups take one
+    from a pool, which grows to the number of threads doing lookups at the same time.
+ */
+
+class MemcachedTileCache {
+
+  /// memcachedtest checks values stored under our keys
+  friend class MemcachedTileCacheTest;
+
+ private:
+
+  /// Header preceding each tile within its value
+  struct Record;
+
+  /// Connection from which all others are cloned
+  memcached_st* _master;
+  memcached_server_st* _servers;
+
+  /// Expiry time in seconds
+  time_t _timeout;
+
+  /// Idle lookup connections
+  std::vector<memcached_st*> _pool;
+  std::mutex _poolMutex;
+
+  /// Tiles waiting to be stored, and the thread that stores them
+  std::deque<RawTilePtr> _queue;
+  std::mutex _queueMutex;
+  std::condition_variable _queueCondition;
+  std::thread _writer;
+  bool _stop;
+
+  /// Usage counters
+  std::atomic<unsigned long> _hits, _misses, _stores, _dropped;
+
+  /// Error message if we were unable to connect
+  std::string _error;
+
+  /// Whether we are usable
+  bool _open;
+
+
+  /// Take a lookup connection from the pool, creating one if none are idle
+  memcached_st* acquire();
+
+  /// Return a lookup connection to the pool
+  void release( memcached_st* memc );
+
+  /// Store queued tiles until we are stopped
+  void write();
+
+  /// Return the memcached key of a tile
+  static std::string name( const std::string& path, int resolution, int tile, int h, int v, int c, int q );
+
+  /// Unpack a value fetched for a key, checking that it really is the tile we want
+  static RawTilePtr decode( const char* value, size_t length, const TileKey& key, time_t timestamp );
+
+
+ public:
+
+  /// Constructor
+  /** @param servers comma separated list of memcached servers
+      @param timeout expiry time in seconds
+   */
+  MemcachedTileCache( const std::string& servers, unsigned int timeout );
+
+  /// Destructor - stores any tiles still queued first
+  ~MemcachedTileCache();
+
+  /// Whether the cache is usable
+  bool connected(){ return _open; };
+
+  /// Error message if not connected
+  const std::string& error(){ return _error; };
+
+  /// Queue a tile to be stored
+  /** Tiles that arrive while the queue is full or that are too large for memcached are dropped
+      @param tile tile to store
+   */
+  void insert( const RawTilePtr tile );
+
+  /// Retrieve several tiles in a single round trip
+  /** @param keys tile keys
+      @param timestamp modification time of the image: older tiles are ignored
+      @return tiles in the same order as the keys, with empty pointers for those not cached
+   */
+  std::vector<RawTilePtr> getObjects( const std::vector<TileKey>& keys, time_t timestamp );
+
+  /// Return the number of tiles found
+  unsigned long getHits(){ return _hits.load( std::memory_order_relaxed ); };
+
+  /// Return the number of tiles not found
+  unsigned long getMisses(){ return _misses.load( std::memory_order_relaxed ); };
+
+  /// Return the number of tiles stored
+  unsigned long getStores(){ return _stores.load( std::memory_order_relaxed ); };
+
+  /// Return the number of tiles not stored because the queue was full
+  unsigned long getDropped(){ return _dropped.load( std::memory_order_relaxed ); };
+
+};
+
+
+#endif
@@ -1,9 +1,12 @@
 #include "OpenSlideImage.h"
 #include "Timer.h"
+#include "Trace.h"
+#include "Environment.h"
 #include <tiff.h>
 #include <tiffio.h>
 #include <cmath>
 #include <sstream>
+#include <mutex>
 
 #include <cstdlib>
 #include <cassert>
@@ -13,6 +16,7 @@
 using namespace std;
 
 extern std::ofstream logfile;
+extern std::mutex logfile_mutex;
 
 /// Overloaded function for opening a TIFF image
 void OpenSlideImage::openImage() throw (file_error) {
@@ -41,6 +45,7 @@ void OpenSlideImage::openImage() throw (file_error) {
 #endif
 
   if (error) {
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "ERROR: encountered error: " << error << " while opening " << filename << " with OpenSlide: " << endl << flush;
     throw file_error(string("Error opening '" + filename + "' with OpenSlide, error " + error));
   }
@@ -53,6 +58,7 @@ void OpenSlideImage::openImage() throw (file_error) {
   logfile << "OpenSlide :: openImage() :: completed " << filename << endl << flush;
 #endif
   if (osr == NULL) {
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "ERROR: can't open " << filename << " with OpenSlide" << endl << flush;
     throw file_error(string("Error opening '" + filename + "' with OpenSlide"));
   }
@@ -137,6 +143,7 @@ void OpenSlideImage::loadImageInfo(int x, int y) throw (file_error) {
   openslide_get_level0_dimensions(osr, &w, &h);
   error = openslide_get_error(osr);
   if (error) {
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "ERROR: encountered error: " << error << " while getting level0 dim: " << error << endl;
   }
 
@@ -164,6 +171,7 @@ void OpenSlideImage::loadImageInfo(int x, int y) throw (file_error) {
   int32_t openslide_levels = openslide_get_level_count(osr);
   error = openslide_get_error(osr);
   if (error) {
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "ERROR: encountered error: " << error << " while getting level count: " << error << endl;
   }
 
@@ -176,6 +184,7 @@ void OpenSlideImage::loadImageInfo(int x, int y) throw (file_error) {
     openslide_get_level_dimensions(osr, i, &ww, &hh);
     error = openslide_get_error(osr);
     if (error) {
+      lock_guard<mutex> lock( logfile_mutex );
       logfile << "ERROR: encountered error: " << error << " while getting level dims: " << error << endl;
     }
 
@@ -291,97 +300,222 @@ void OpenSlideImage::closeImage() {
 
 
 
-//
-//// TCP: support get region (internally, already doing it.
-///// Overloaded function for returning a region for a given angle and resolution
-///** Return a RawTile object: Overloaded by child class.
-//      \param ha horizontal angle
-//      \param va vertical angle
-//      \param res resolution
-//      \param layers number of quality layers to decode
-//      \param x x coordinate   at resolution r
-//      \param y y coordinate   at resolution r
-//      \param w width of region   at resolution r
-//      \param h height of region  at resolution r
-// */
-//RawTile OpenSlideImage::getRegion( int ha, int va, unsigned int res, int layers, int x, int y, unsigned int w, unsigned int h ) {
-//  // ignore ha, va, layers.  important things are r, x, y, w, and h.
-//
-//
-//#ifdef DEBUG_OSI
-//  Timer timer;
-//  timer.start();
-//#endif
-//
-//  if (res > (numResolutions-1)) {
-//    ostringstream tile_no;
-//    tile_no << "OpenSlide :: Asked for non-existant resolution: " << res;
-//    throw tile_no.str();
-//    return 0;
-//  }
-//
-//  // convert r to zoom
-//
-//  // res is specified in opposite order from image levels: image level 0 has highest res,
-//  // image level nRes-1 has res of 0.
-//  uint32_t openslide_zoom = this->numResolutions - 1 - res;
-//
-//#ifdef DEBUG_OSI
-//  logfile << "OpenSlide :: getRegion() :: res=" << res << " pos " << x << "x" << y << " size " << w << "x" << h << " is_zoom= " << openslide_zoom << endl;
-//
-//#endif
-//
-//
-//
-//  uint32_t lw, lh;
-//  int32_t lx, ly;
-//
-//  unsigned int res_width = image_widths[openslide_zoom];
-//  unsigned int res_height = image_heights[openslide_zoom];
-//
-//  // bound the x,y position
-//  lx = std::max(0, x);  lx = std::min(lx, static_cast<int32_t>(res_width));
-//  ly = std::max(0, y);  ly = std::min(ly, static_cast<int32_t>(res_height));
-//
-//  // next bound the w and height.
-//  lw = std::min(w, res_width - lx);
-//  lh = std::min(h, res_height - ly);
-//
-//
-//
-//  // convert x ,y, to the right coordinate system
-//  if (lw == 0 || lh == 0) {
-//    ostringstream tile_no;
-//    tile_no << "OpenSlideImage :: Asked for zero-sized region " << x << "x" << y << ", size " << w << "x" << h << ", res dim=" << res_width << "x" << res_height;
-//    throw tile_no.str();
-//  }
-//
-//  // Create our raw tile buffer and initialize some values
-//  RawTile region(0, res, ha, va, w, h, channels, bpp);
-//  region.dataLength = w * h * channels * sizeof(unsigned char);
-//  region.filename = getImagePath();
-//  region.timestamp = timestamp;
-//  // new a block that is larger for openslide library to directly copy in.
-//  // then shuffle from BGRA to RGB.  relying on delete [] to do the right thing.
-//  region.data = new unsigned char[w * h * 4 * sizeof(unsigned char)];  // TODO: avoid reallocation?
-//  region.memoryManaged = 1;                 // allocated data, so use this flag to indicate that it needs to be cleared on destruction
-//  //rawtile->padded = false;
-//#ifdef DEBUG_OSI
-//  logfile << "Allocating tw * th * channels * sizeof(char) : " << w << " * " << h << " * " << channels << " * sizeof(char) " << endl << flush;
-//#endif
-//
-//  // call read
-//  read(openslide_zoom, w, h, x, y, region.data);
-//
-//
-//#ifdef DEBUG_OSI
-//  logfile << "OpenSlide :: getRegion() :: " << timer.getTime() << " microseconds" << endl << flush;
-//  logfile << "REGION RENDERED" << std::endl;
-//#endif
-//
-//  return ( region );
-//
-//}
+/// Overloaded function for returning a region for a given angle and resolution
+/** Tiles already in the tile cache are copied straight into the region. Runs of missing tiles
+    in each row are merged with identical runs in the rows below into rectangles, which are
+    read by readTiles() with a few large reads. Virtual levels far below their native level
+    are still composed tile by tile from the cached tiles of the levels above.
+      \param ha horizontal angle (ignored)
+      \param va vertical angle (ignored)
+      \param iipres resolution
+      \param layers number of quality layers to decode (ignored)
+      \param x x coordinate   at resolution iipres
+      \param y y coordinate   at resolution iipres
+      \param w width of region   at resolution iipres
+      \param h height of region  at resolution iipres
+ */
+RawTilePtr OpenSlideImage::getRegion(int ha, int va, unsigned int iipres, int layers, int x, int y, unsigned int w, unsigned int h) throw (file_error) {
+
+#ifdef DEBUG_OSI
+  Timer timer;
+  timer.start();
+#endif
+
+  if (iipres > (numResolutions-1)) {
+    ostringstream tile_no;
+    tile_no << "OpenSlide :: Asked for non-existant resolution: " << iipres;
+    throw file_error(tile_no.str());
+  }
+
+  uint32_t osi_level = numResolutions - 1 - iipres;
+
+  if (x < 0 || y < 0 || w == 0 || h == 0 ||
+      x + w > image_widths[osi_level] || y + h > image_heights[osi_level]) {
+    ostringstream tile_no;
+    tile_no << "OpenSlideImage :: Asked for region outside image " << x << "x" << y << ", size " << w << "x" << h
+            << ", res dim=" << image_widths[osi_level] << "x" << image_heights[osi_level];
+    throw file_error(tile_no.str());
+  }
+
+#ifdef DEBUG_OSI
+  logfile << "OpenSlide :: getRegion() :: res=" << iipres << " pos " << x << "x" << y << " size " << w << "x" << h << " is_zoom= " << osi_level << endl;
+#endif
+
+  // Create our raw tile buffer and initialize some values
+  RawTilePtr region(new RawTile(0, iipres, ha, va, w, h, channels, bpc));
+  region->dataLength = w * h * channels * sizeof(unsigned char);
+  region->filename = getImagePath();
+  region->imageId = getImageId();
+  region->timestamp = timestamp;
+  region->data = new unsigned char[region->dataLength];
+  uint8_t* out = reinterpret_cast<uint8_t*>(region->data);
+
+  size_t ntlx = numTilesX[osi_level];
+  size_t startx = x / tile_width, endx = (x + w + tile_width - 1) / tile_width;
+  size_t starty = y / tile_height, endy = (y + h + tile_height - 1) / tile_height;
+
+  bool compose_tiles = openslide_downsample_in_level[osi_level] > OPENSLIDE_REGION_MAX_DOWNSAMPLE;
+
+  // Copy out the tiles we hold, and gather the rectangles of tiles we do not
+  std::vector<size_t> missing;   // tx0, ty0, tx1, ty1 of each rectangle
+  for (size_t ty = starty; ty < endy; ++ty) {
+    size_t run = 0;
+    bool in_run = false;
+
+    for (size_t tx = startx; tx <= endx; ++tx) {
+
+      if (tx < endx) {
+        const TileKey key = TileCache::getIndex(getImageId(), iipres, ty * ntlx + tx, 0, 0, UNCOMPRESSED, 0);
+        RawTilePtr tile = tileCache->getObject(key);
+        if (tile && tile->timestamp < timestamp) tile.reset();
+        if (!tile && compose_tiles) tile = getCachedTile(tx, ty, iipres);
+
+        if (tile) {
+          copyOverlap(reinterpret_cast<uint8_t*>(tile->data), tx * tile_width, ty * tile_height, tile->width, tile->height,
+                      out, x, y, w, h);
+        }
+        else {
+          if (!in_run) run = tx;
+          in_run = true;
+          continue;
+        }
+      }
+
+      if (!in_run) continue;
+      in_run = false;
+
+      // extend the rectangle ending in the row above if it spans the same tiles
+      size_t r = 0;
+      while (r < missing.size() && !(missing[r] == run && missing[r+2] == tx && missing[r+3] == ty)) r += 4;
+      if (r < missing.size()) {
+        missing[r+3] = ty + 1;
+      }
+      else {
+        missing.push_back(run);
+        missing.push_back(ty);
+        missing.push_back(tx);
+        missing.push_back(ty + 1);
+      }
+    }
+  }
+
+  // Read the rest, adding the tiles to the cache only if asked, as for other image types
+  bool backfill = Environment::getCacheRegionTiles();
+  for (size_t r = 0; r < missing.size(); r += 4) {
+    readTiles(missing[r], missing[r+1], missing[r+2], missing[r+3], iipres, out, x, y, w, h, backfill);
+  }
+
+#ifdef DEBUG_OSI
+  logfile << "OpenSlide :: getRegion() :: " << (missing.size() / 4) << " reads :: " << timer.getTime() << " microseconds" << endl << flush;
+#endif
+
+  return region;
+}
+
+
+/**
+ * read a rectangle of whole tiles from the native layer, color convert and downsample it,
+ * copy the part within the region into out and, if asked, cache the tiles.
+ * @details the rectangle is read in bands of rows, so that the buffer at the native layer
+ *          stays within OPENSLIDE_REGION_BUFFER.  the native layer is halfsampled the same way
+ *          as halfsampleAndComposeTile() does, so that tiles read here match those composed
+ *          and cached tile by tile.
+ *
+ * @param tx0, ty0   first tile
+ * @param tx1, ty1   tile beyond the last
+ * @param iipres     iipsrv's resolution id.  openslide's level is inverted from this.
+ * @param out        region, placed at out_x, out_y with size out_w x out_h
+ * @param backfill   whether to add the tiles to the tile cache
+ */
+void OpenSlideImage::readTiles(const size_t tx0, const size_t ty0, const size_t tx1, const size_t ty1, const uint32_t iipres,
+                               uint8_t* out, const size_t out_x, const size_t out_y, const size_t out_w, const size_t out_h,
+                               const bool backfill) {
+  TraceSpan span( "read_region" );
+
+  Timer timer;
+  timer.start();
+
+  uint32_t osi_level = numResolutions - 1 - iipres;
+  uint32_t bestLayer = openslide_level_to_use[osi_level];
+  size_t downsample = openslide_downsample_in_level[osi_level];
+  size_t ntlx = numTilesX[osi_level];
+
+  // pixel bounds of the tiles at this resolution
+  size_t px = tx0 * tile_width;
+  size_t py = ty0 * tile_height;
+  size_t pw = std::min(tx1 * tile_width, static_cast<size_t>(image_widths[osi_level])) - px;
+  size_t ph = std::min(ty1 * tile_height, static_cast<size_t>(image_heights[osi_level])) - py;
+
+  // tiles to fill in as the bands are read
+  std::vector<RawTilePtr> tiles;
+  if (backfill) {
+    for (size_t ty = ty0; ty < ty1; ++ty) {
+      for (size_t tx = tx0; tx < tx1; ++tx) {
+        size_t tw = std::min(static_cast<size_t>(tile_width), image_widths[osi_level] - tx * tile_width);
+        size_t th = std::min(static_cast<size_t>(tile_height), image_heights[osi_level] - ty * tile_height);
+        RawTilePtr rt(new RawTile(ty * ntlx + tx, iipres, 0, 0, tw, th, channels, bpc));
+        rt->dataLength = tw * th * channels;
+        rt->filename = getImagePath();
+        rt->imageId = getImageId();
+        rt->timestamp = timestamp;
+        rt->data = new unsigned char[rt->dataLength];
+        tiles.push_back(rt);
+      }
+    }
+  }
+
+  // rows per band.  bgra2rgb and halfsample_3 work in place, and read a little beyond the
+  // rgb data, which the 4 bytes per pixel that openslide writes leave room for
+  size_t band = OPENSLIDE_REGION_BUFFER / (pw * downsample * downsample * 4);
+  if (band == 0) band = 1;
+  if (band > ph) band = ph;
+  uint8_t *buf = new uint8_t[pw * downsample * band * downsample * 4];
+
+  for (size_t by = 0; by < ph; by += band) {
+    size_t bh = std::min(band, ph - by);
+    size_t nw = pw * downsample;
+    size_t nh = bh * downsample;
+
+    // x and y in level 0 coordinates, as expected by openslide_read_region
+    int64_t x0 = static_cast<int64_t>(px) << osi_level;
+    int64_t y0 = static_cast<int64_t>(py + by) << osi_level;
+
+    openslide_read_region(osr, reinterpret_cast<uint32_t*>(buf), x0, y0, bestLayer, nw, nh);
+    const char* error = openslide_get_error(osr);
+    if (error) {
+      lock_guard<mutex> lock( logfile_mutex );
+      logfile << "ERROR: encountered error: " << error << " while reading region at " << x0 << "x" << y0 << " dim " << nw << "x" << nh << " with OpenSlide: " << error << endl;
+    }
+
+    this->bgra2rgb(buf, nw, nh);
+
+    // halve down to the virtual level.  both dims stay even until the last step
+    while (nw > pw) halfsample_3(buf, nw, nh, buf, nw, nh);
+
+    copyOverlap(buf, px, py + by, pw, bh, out, out_x, out_y, out_w, out_h);
+
+    for (size_t t = 0; t < tiles.size(); ++t) {
+      size_t tx = tiles[t]->tileNum % ntlx;
+      size_t ty = tiles[t]->tileNum / ntlx;
+      copyOverlap(buf, px, py + by, pw, bh, reinterpret_cast<uint8_t*>(tiles[t]->data),
+                  tx * tile_width, ty * tile_height, tiles[t]->width, tiles[t]->height);
+    }
+  }
+  delete [] buf;
+
+#ifdef DEBUG_OSI
+  logfile << "OpenSlide :: readTiles() :: " << tx0 << "x" << ty0 << " to " << tx1 << "x" << ty1 << "@" << iipres << " " << timer.getTime() << " microseconds" << endl << flush;
+#endif
+
+  // share the time taken between the tiles, so that the cache weighs them like tiles read one by one
+  if (!tiles.empty()) {
+    long cost = std::max(timer.getTime() / static_cast<long>(tiles.size()), 1L);
+    for (size_t t = 0; t < tiles.size(); ++t) {
+      tiles[t]->cost = cost;
+      tileCache->insert(tiles[t]);
+    }
+  }
+}
 
 
 /// Overloaded function for getting a particular tile
@@ -464,7 +598,8 @@ RawTilePtr OpenSlideImage::getCachedTile(const size_t tilex, const size_t tiley,
   // check if cache has tile
   uint32_t osi_level = numResolutions - 1 - iipres;
   uint32_t tid = tiley * numTilesX[osi_level] + tilex;
-  RawTilePtr ttt = tileCache->getObject(TileCache::getIndex(getImagePath(), iipres, tid, 0, 0, UNCOMPRESSED, 0));
+  const TileKey key = TileCache::getIndex(getImageId(), iipres, tid, 0, 0, UNCOMPRESSED, 0);
+  RawTilePtr ttt = tileCache->getObject(key);
 
   // if cache has file, return it
   if (ttt) {
@@ -479,19 +614,32 @@ RawTilePtr OpenSlideImage::getCachedTile(const size_t tilex, const size_t tiley,
   logfile << "OpenSlide :: getCachedTile() :: Cache Miss " << tilex << "x" << tiley << "@" << iipres << " osi tile bounds: " << numTilesX[osi_level] << "x" << numTilesY[osi_level] << " " << timer.getTime() << " microseconds" << endl << flush;
 #endif
 
-  // is this a native layer?
-  if (openslide_downsample_in_level[osi_level] == 1) {
-    // supported by native openslide layer
+  // Concurrent requests for the same missing tile, such as the shared lower resolution
+  // tiles of neighbouring tiles being composed, wait for a single read or composition
+  return tileCache->getOrBuild(key, [&]() -> RawTilePtr {
+
+    // Time the read or composition, so that the cache can hold on to expensive tiles for longer
+    Timer build_timer;
+    build_timer.start();
+    RawTilePtr built;
+
+    // is this a native layer?
+    if (openslide_downsample_in_level[osi_level] == 1) {
+      // supported by native openslide layer
 	// tile manager will cache if needed
-    return getNativeTile(tilex, tiley, iipres);
+      built = getNativeTile(tilex, tiley, iipres);
 
 
-  } else {
-    // not supported by native openslide layer, so need to compose from next level up,
-    return halfsampleAndComposeTile(tilex, tiley, iipres);
+    } else {
+      // not supported by native openslide layer, so need to compose from next level up,
+      built = halfsampleAndComposeTile(tilex, tiley, iipres);
 
 	// tile manager will cache this one.
-  }
+    }
+
+    if (built) built->cost = std::max(build_timer.getTime(), 1L);
+    return built;
+  });
 
 }
 
@@ -510,6 +658,7 @@ RawTilePtr OpenSlideImage::getNativeTile(const size_t tilex, const size_t tiley,
 #endif
 
   if (!osr) {
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "openslide image not yet loaded " << endl;
   }
 
@@ -550,6 +699,7 @@ RawTilePtr OpenSlideImage::getNativeTile(const size_t tilex, const size_t tiley,
   // compute the size, etc
   rt->dataLength = tw * th * channels * sizeof(unsigned char);
   rt->filename = getImagePath();
+  rt->imageId = getImageId();
   rt->timestamp = timestamp;
 
   // new a block that is larger for openslide library to directly copy in.
@@ -572,6 +722,7 @@ RawTilePtr OpenSlideImage::getNativeTile(const size_t tilex, const size_t tiley,
   openslide_read_region(osr, reinterpret_cast<uint32_t*>(rt->data), tx0, ty0, bestLayer, tw, th);
   const char* error = openslide_get_error(osr);
   if (error) {
+    lock_guard<mutex> lock( logfile_mutex );
     logfile << "ERROR: encountered error: " << error << " while reading region exact at  " << tx0 << "x" << ty0 << " dim " << tw << "x" << th << " with OpenSlide: " << error << endl;
   }
 
@@ -625,6 +776,7 @@ RawTilePtr OpenSlideImage::getNativeTile(const size_t tilex, const size_t tiley,
  * store in cache, and return tile.  (causes recursion, stops at native layer or in cache.)
  */
 RawTilePtr OpenSlideImage::halfsampleAndComposeTile(const size_t tilex, const size_t tiley, const uint32_t iipres) {
+  TraceSpan span( "halfsample" );
   // not in cache and not a native tile, so create one from higher sampling.
 #ifdef DEBUG_OSI
   Timer timer;
@@ -669,6 +821,7 @@ RawTilePtr OpenSlideImage::halfsampleAndComposeTile(const size_t tilex, const si
   // compute the size, etc
   rt->dataLength = tw * th * channels;
   rt->filename = getImagePath();
+  rt->imageId = getImageId();
   rt->timestamp = timestamp;
 
   // new a block that is larger for openslide library to directly copy in.
@@ -882,6 +1035,30 @@ void OpenSlideImage::halfsample_3(const uint8_t* in, const size_t in_w, const si
 
 }
 
+// both images are contiguous.  positions and sizes are in pixels at the same resolution.
+void OpenSlideImage::copyOverlap(const uint8_t *in, const size_t in_x, const size_t in_y, const size_t in_w, const size_t in_h,
+                                 uint8_t* out, const size_t out_x, const size_t out_y, const size_t out_w, const size_t out_h) {
+
+  size_t x0 = std::max(in_x, out_x);
+  size_t x1 = std::min(in_x + in_w, out_x + out_w);
+  size_t y0 = std::max(in_y, out_y);
+  size_t y1 = std::min(in_y + in_h, out_y + out_h);
+
+  if ((x0 >= x1) || (y0 >= y1)) return;
+
+  size_t src_stride = in_w * channels;
+  size_t dest_stride = out_w * channels;
+
+  uint8_t const *src = in + (y0 - in_y) * src_stride + (x0 - in_x) * channels;
+  uint8_t *dest = out + (y0 - out_y) * dest_stride + (x0 - out_x) * channels;
+
+  for (size_t k = y0; k < y1; ++k) {
+    memcpy(dest, src, (x1 - x0) * channels);
+    dest += dest_stride;
+    src += src_stride;
+  }
+}
+
 // in is contiguous, out will be when done.
 void OpenSlideImage::compose(const uint8_t *in, const size_t in_w, const size_t in_h,
                              const size_t& xoffset, const size_t& yoffset,
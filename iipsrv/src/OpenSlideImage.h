@@ -32,6 +32,15 @@ extern "C" {
 #define OPENSLIDE_TILESIZE 256
 #define OPENSLIDE_TILE_CACHE_SIZE 32
 
+// Size in bytes of the buffer used to read regions from a native level, a band of rows at a time
+#define OPENSLIDE_REGION_BUFFER 16777216
+
+// Virtual levels further below their native level than this are composed from cached tiles instead
+#define OPENSLIDE_REGION_MAX_DOWNSAMPLE 4
+
+// Approximate memory held by an open openslide_t, mostly its own 32MB tile cache
+#define OPENSLIDE_HANDLE_SIZE 33554432
+
 /// Image class for OpenSlide supported Images: Inherits from IIPImage. Uses the OpenSlide library.
 
 class OpenSlideImage : public IIPImage {
@@ -108,6 +117,15 @@ private:
                      uint8_t* out, size_t& out_w, size_t& out_h);
 
 
+    /// read a rectangle of whole tiles from the native level into the region, optionally caching the tiles
+    void readTiles(const size_t tx0, const size_t ty0, const size_t tx1, const size_t ty1, const uint32_t iipres,
+                   uint8_t* out, const size_t out_x, const size_t out_y, const size_t out_w, const size_t out_h,
+                   const bool backfill);
+
+    /// copy the part of an image placed at in_x, in_y that overlaps another placed at out_x, out_y
+    void copyOverlap(const uint8_t *in, const size_t in_x, const size_t in_y, const size_t in_w, const size_t in_h,
+                     uint8_t* out, const size_t out_x, const size_t out_y, const size_t out_w, const size_t out_h);
+
     void compose(const uint8_t *in, const size_t in_w, const size_t in_h,
     		const size_t& xoffset, const size_t& yoffset,
     		uint8_t* out, const size_t& out_w, const size_t& out_h);
@@ -170,6 +188,13 @@ public:
     /// Overloaded function for closing a TIFF image
     virtual void closeImage();
 
+    /// Return the memory held by the open image, including OpenSlide's own tile cache
+    virtual size_t getMemorySize(){
+      return IIPImage::getMemorySize() + ( osr ? OPENSLIDE_HANDLE_SIZE : 0 ) +
+        ( numTilesX.capacity() + numTilesY.capacity() + lastTileXDim.capacity() + lastTileYDim.capacity() ) * sizeof( size_t ) +
+        ( openslide_level_to_use.capacity() + openslide_downsample_in_level.capacity() ) * sizeof( uint32_t );
+    };
+
 
     /// Overloaded function for getting a particular tile
     /** \param x horizontal sequence angle
@@ -180,22 +205,27 @@ public:
      */
 	virtual RawTilePtr getTile(int x, int y, unsigned int r, int l, unsigned int t) throw (file_error);
 
-//    // TCP: turn on region decoding.  problem is that this bypasses tile caching, so overall it's not faster.
-//    /// Return whether this image type directly handles region decoding
-//    virtual bool regionDecoding(){ return false; };
-//	// TCP: support getGegion (internally, openslide already is composing regions.  however, this bypasses tile caching so is slower)
-//    /// Overloaded function for returning a region for a given angle and resolution
-//    /** Return a RawTile object: Overloaded by child class.
-//        \param ha horizontal angle
-//        \param va vertical angle
-//        \param r resolution
-//        \param layers number of quality layers to decode
-//        \param x x coordinate
-//        \param y y coordinate
-//        \param w width of region
-//        \param h height of region
-//     */
-//	virtual RawTile getRegion( int ha, int va, unsigned int r, int layers, int x, int y, unsigned int w, unsigned int h );
+    /// openslide_read_region() may be called concurrently on the same handle
+    /// and virtual levels are composed through the (locked) tile cache
+    virtual bool threadSafe(){ return true; };
+
+    /// Regions are composed from the tiles already in the tile cache and large reads of the rest
+    virtual bool regionDecoding(){ return true; };
+
+    /// Overloaded function for returning a region for a given angle and resolution
+    /** Tiles of the region held by the tile cache are copied out of it. The rest are grouped
+        into rectangles of whole tiles, each read with a few large openslide_read_region() calls
+        at the native level rather than one call per tile.
+        \param ha horizontal angle
+        \param va vertical angle
+        \param r resolution
+        \param layers number of quality layers to decode
+        \param x x coordinate
+        \param y y coordinate
+        \param w width of region
+        \param h height of region
+     */
+    virtual RawTilePtr getRegion( int ha, int va, unsigned int r, int layers, int x, int y, unsigned int w, unsigned int h ) throw (file_error);
 
 
 
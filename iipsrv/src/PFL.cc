@@ -112,7 +112,8 @@ void PFL::run( Session* session, const std::string& argument ){
 
 
   // Create our tilemanager object
-  TileManager tilemanager( session->tileCache, session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
+  TileManager tilemanager( session->tileCache, session->image, session->watermark, session->jpeg, session->logfile, session->loglevel,
+			   session->threadPool );
 
 
   // Use our horizontal views function to get a list of available spectral images
@@ -0,0 +1,387 @@
+// Member functions for Prefetcher.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Prefetcher.h"
+#include "TileManager.h"
+#include "Trace.h"
+#include "Timer.h"
+
+#include <vector>
+
+
+using namespace std;
+
+
+// Maximum number of images waiting to be prefetched
+#define PREFETCH_QUEUE 16
+
+// Maximum number of tiles in a prediction
+#define PREFETCH_PREDICT_TILES 16
+
+// Maximum number of images whose requests we track
+#define PREFETCH_IMAGES 256
+
+// Maximum number of predicted tiles we remember in order to count those requested
+#define PREFETCH_PREDICTED 4096
+
+
+
+/// Return the number of tiles across and down a resolution
+static void grid( IIPImage* image, int resolution, int& ntlx, int& ntly )
+{
+  unsigned int n = image->getNumResolutions() - resolution - 1;
+  unsigned int tw = image->getTileWidth();
+  unsigned int th = image->getTileHeight();
+  ntlx = ( image->getImageWidth(n) + tw - 1 ) / tw;
+  ntly = ( image->getImageHeight(n) + th - 1 ) / th;
+}
+
+
+
+Prefetcher::Prefetcher( TileCache* tc, Watermark* w, int q, unsigned int b, bool p, const string& f, int l ) :
+  tileCache( tc ), watermark( w ), quality( q ), budget( b ), predict( p ),
+  logfileName( f ), loglevel( l ), active( 0 )
+{
+  stopping = false;
+  scheduled = 0;
+  dropped = 0;
+  tiles = 0;
+  predictedTiles = 0;
+  predictedUsed = 0;
+  cancelled = 0;
+  thread = std::thread( &Prefetcher::run, this );
+}
+
+
+
+Prefetcher::~Prefetcher()
+{
+  {
+    lock_guard<std::mutex> lock( mutex );
+    stopping = true;
+  }
+  condition.notify_all();
+  if( thread.joinable() ) thread.join();
+}
+
+
+
+void Prefetcher::begin()
+{
+  lock_guard<std::mutex> lock( mutex );
+  active++;
+}
+
+
+
+void Prefetcher::end()
+{
+  bool idle;
+  {
+    lock_guard<std::mutex> lock( mutex );
+    idle = ( --active == 0 );
+  }
+  if( idle && predict ) condition.notify_one();
+}
+
+
+
+void Prefetcher::schedule( IIPImagePtr image )
+{
+  if( !image || budget == 0 ) return;
+  {
+    lock_guard<std::mutex> lock( mutex );
+    if( images.size() >= PREFETCH_QUEUE ){
+      dropped.fetch_add( 1, memory_order_relaxed );
+      return;
+    }
+    images.push_back( image );
+  }
+  scheduled.fetch_add( 1, memory_order_relaxed );
+  condition.notify_one();
+}
+
+
+
+void Prefetcher::run()
+{
+  // Like the worker threads, use our own stream onto the log file as ofstream is not thread safe
+  ofstream logfile;
+  if( loglevel >= 1 ) logfile.open( logfileName.c_str(), ios::app );
+
+  // Our own compressor, as these hold per-tile state
+  JPEGCompressor jpeg( quality );
+
+  unique_lock<std::mutex> lock( mutex );
+  while( !stopping ){
+
+    // Predictions are small and soon out of date, so take them first, but only while idle
+    if( !pending.empty() && active == 0 ){
+      Prediction prediction = pending.begin()->second;
+      pending.erase( pending.begin() );
+      lock.unlock();
+      prefetch( prediction, jpeg, logfile );
+      prediction.image.reset();
+      lock.lock();
+    }
+    else if( !images.empty() ){
+      IIPImagePtr image = images.front();
+      images.pop_front();
+      lock.unlock();
+      prefetch( image, jpeg, logfile );
+      image.reset();
+      lock.lock();
+    }
+    else condition.wait( lock );
+  }
+}
+
+
+
+void Prefetcher::prefetch( IIPImagePtr image, JPEGCompressor& jpeg, ofstream& logfile )
+{
+  TraceSpan span( "prefetch" );
+  Timer prefetch_timer;
+  if( loglevel >= 2 ) prefetch_timer.start();
+
+  unsigned int num_res = image->getNumResolutions();
+  unsigned int tw = image->getTileWidth();
+  unsigned int th = image->getTileHeight();
+  if( num_res == 0 || tw == 0 || th == 0 ) return;
+
+  // Take as many of the lowest resolutions as fit entirely within our budget
+  unsigned int levels = 0, total = 0;
+  for( unsigned int r = 0; r < num_res; r++ ){
+    unsigned int n = num_res - r - 1;
+    unsigned int ntlx = ( image->getImageWidth(n) + tw - 1 ) / tw;
+    unsigned int ntly = ( image->getImageHeight(n) + th - 1 ) / th;
+    if( total + ntlx*ntly > budget ) break;
+    total += ntlx*ntly;
+    levels++;
+  }
+
+  // Tiles are requested with the angles and layers set by FIF and View by default
+  const int xangle = 0, yangle = 90, layers = 0;
+  uint32_t id = image->getImageId();
+  unsigned int count = 0;
+
+  TileManager tilemanager( tileCache, image, watermark, &jpeg, &logfile, loglevel );
+
+  try{
+    for( unsigned int r = 0; r < levels && !stopping; r++ ){
+
+      unsigned int n = num_res - r - 1;
+      unsigned int ntlx = ( image->getImageWidth(n) + tw - 1 ) / tw;
+      unsigned int ntly = ( image->getImageHeight(n) + th - 1 ) / th;
+
+      // Check the tile cache directly rather than through lookups, so as not to
+      // distort its hit statistics or the frequency of these tiles
+      vector<int> missing;
+      for( unsigned int t = 0; t < ntlx*ntly; t++ ){
+	if( !tileCache->contains( TileCache::getIndex( id, r, t, xangle, yangle, JPEG, quality ) ) ){
+	  missing.push_back( t );
+	}
+      }
+
+      tilemanager.preload( r, missing, xangle, yangle, JPEG );
+
+      for( vector<int>::const_iterator t = missing.begin(); t != missing.end() && !stopping; t++ ){
+	tilemanager.getTile( r, *t, xangle, yangle, layers, JPEG );
+	count++;
+      }
+    }
+  }
+  catch( const file_error& error ){
+    if( loglevel >= 1 ) logfile << "Prefetcher :: " << error.what() << endl;
+  }
+  catch( const string& error ){
+    if( loglevel >= 1 ) logfile << "Prefetcher :: " << error << endl;
+  }
+
+  tiles.fetch_add( count, memory_order_relaxed );
+
+  if( loglevel >= 2 ){
+    logfile << "Prefetcher :: Prefetched " << count << " tiles of the lowest " << levels
+	    << " resolutions of " << image->getImagePath() << " in "
+	    << prefetch_timer.getTime() << " microseconds" << endl;
+  }
+}
+
+
+
+void Prefetcher::observe( IIPImagePtr image, int resolution, int tile, int xangle, int yangle, int layers )
+{
+  if( !predict || !image ) return;
+
+  int num_res = image->getNumResolutions();
+  if( resolution < 0 || resolution >= num_res || tile < 0 ||
+      image->getTileWidth() == 0 || image->getTileHeight() == 0 ) return;
+
+  int ntlx, ntly;
+  grid( image.get(), resolution, ntlx, ntly );
+  int x = tile % ntlx;
+  int y = tile / ntlx;
+
+  uint32_t id = image->getImageId();
+  Prediction prediction;
+  prediction.image = image;
+  prediction.xangle = xangle;
+  prediction.yangle = yangle;
+  prediction.layers = layers;
+
+  lock_guard<std::mutex> lock( mutex );
+
+  // Count the requests for tiles we predicted
+  set<TileKey>::iterator p = predicted.find( TileCache::getIndex( id, resolution, tile, xangle, yangle, JPEG, quality ) );
+  if( p != predicted.end() ){
+    predicted.erase( p );
+    predictedUsed.fetch_add( 1, memory_order_relaxed );
+  }
+
+  // Forget the images no longer being viewed once we are tracking too many
+  if( motions.size() >= PREFETCH_IMAGES && motions.find( id ) == motions.end() ) motions.clear();
+
+  // Start again on a change of resolution, noting which way we zoomed
+  Motion& m = motions[id];
+  if( m.count == 0 || m.resolution != resolution ){
+    m.zoom = ( m.count == 0 ) ? 0 : ( resolution > m.resolution ? 1 : -1 );
+    m.resolution = resolution;
+    m.count = 0;
+  }
+  m.x[m.count % PREFETCH_HISTORY] = x;
+  m.y[m.count % PREFETCH_HISTORY] = y;
+  m.count++;
+
+  // Any earlier prediction for this image is now out of date
+  prediction.generation = ++m.generation;
+
+  // The recent requests outline the view. Compare the centre of the older half with
+  // that of the newer half to find which way it is moving
+  unsigned int n = ( m.count < PREFETCH_HISTORY ) ? m.count : PREFETCH_HISTORY;
+  int minx = x, maxx = x, miny = y, maxy = y;
+  float dx = 0, dy = 0;
+  for( unsigned int i = 0; i < n; i++ ){
+    unsigned int k = ( m.count - n + i ) % PREFETCH_HISTORY;
+    if( m.x[k] < minx ) minx = m.x[k];
+    if( m.x[k] > maxx ) maxx = m.x[k];
+    if( m.y[k] < miny ) miny = m.y[k];
+    if( m.y[k] > maxy ) maxy = m.y[k];
+    float w = ( i < n/2 ) ? -1.0f / (n/2) : 1.0f / (n - n/2);
+    dx += w * m.x[k];
+    dy += w * m.y[k];
+  }
+
+  // The column or row of tiles beyond the view in the direction of panning
+  if( n >= 4 ){
+    int column = ( dx >= 0.5 ) ? maxx + 1 : ( dx <= -0.5 ) ? minx - 1 : -1;
+    int row = ( dy >= 0.5 ) ? maxy + 1 : ( dy <= -0.5 ) ? miny - 1 : -1;
+    if( column >= 0 && column < ntlx ){
+      for( int j = miny; j <= maxy; j++ ) prediction.targets.push_back( Target( resolution, column + j*ntlx ) );
+    }
+    if( row >= 0 && row < ntly ){
+      for( int i = minx; i <= maxx; i++ ) prediction.targets.push_back( Target( resolution, i + row*ntlx ) );
+    }
+  }
+
+  // After zooming in, the tiles below this one at the next resolution. After zooming
+  // out, the tiles around the one above it
+  if( m.zoom > 0 && resolution + 1 < num_res ){
+    int cx, cy;
+    grid( image.get(), resolution + 1, cx, cy );
+    for( int j = 2*y; j <= 2*y + 1 && j < cy; j++ ){
+      for( int i = 2*x; i <= 2*x + 1 && i < cx; i++ ) prediction.targets.push_back( Target( resolution + 1, i + j*cx ) );
+    }
+  }
+  else if( m.zoom < 0 && resolution > 0 ){
+    int px, py;
+    grid( image.get(), resolution - 1, px, py );
+    for( int j = y/2 - 1; j <= y/2 + 1; j++ ){
+      for( int i = x/2 - 1; i <= x/2 + 1; i++ ){
+	if( i >= 0 && i < px && j >= 0 && j < py ) prediction.targets.push_back( Target( resolution - 1, i + j*px ) );
+      }
+    }
+  }
+
+  if( prediction.targets.size() > PREFETCH_PREDICT_TILES ){
+    prediction.targets.erase( prediction.targets.begin() + PREFETCH_PREDICT_TILES, prediction.targets.end() );
+  }
+
+  if( prediction.targets.empty() ) pending.erase( id );
+  else{
+    pending[id] = prediction;
+    condition.notify_one();
+  }
+}
+
+
+
+bool Prefetcher::cancel( uint32_t id, unsigned long generation )
+{
+  lock_guard<std::mutex> lock( mutex );
+  if( stopping || active > 0 ) return true;
+  map<uint32_t, Motion>::const_iterator m = motions.find( id );
+  return m == motions.end() || m->second.generation != generation;
+}
+
+
+
+void Prefetcher::prefetch( const Prediction& prediction, JPEGCompressor& jpeg, ofstream& logfile )
+{
+  TraceSpan span( "predict" );
+
+  uint32_t id = prediction.image->getImageId();
+  unsigned int count = 0;
+
+  TileManager tilemanager( tileCache, prediction.image, watermark, &jpeg, &logfile, loglevel );
+
+  try{
+    for( vector<Target>::const_iterator t = prediction.targets.begin(); t != prediction.targets.end(); t++ ){
+
+      // Give way to newer predictions and to any request
+      if( cancel( id, prediction.generation ) ){
+	cancelled.fetch_add( 1, memory_order_relaxed );
+	break;
+      }
+
+      TileKey key = TileCache::getIndex( id, t->resolution, t->tile, prediction.xangle, prediction.yangle, JPEG, quality );
+      if( tileCache->contains( key ) ) continue;
+
+      tilemanager.getTile( t->resolution, t->tile, prediction.xangle, prediction.yangle, prediction.layers, JPEG );
+      count++;
+
+      lock_guard<std::mutex> lock( mutex );
+      if( predicted.size() >= PREFETCH_PREDICTED ) predicted.clear();
+      predicted.insert( key );
+    }
+  }
+  catch( const file_error& error ){
+    if( loglevel >= 1 ) logfile << "Prefetcher :: " << error.what() << endl;
+  }
+  catch( const string& error ){
+    if( loglevel >= 1 ) logfile << "Prefetcher :: " << error << endl;
+  }
+
+  predictedTiles.fetch_add( count, memory_order_relaxed );
+
+  if( loglevel >= 3 ){
+    logfile << "Prefetcher :: Prefetched " << count << " of " << prediction.targets.size()
+	    << " predicted tiles of " << prediction.image->getImagePath() << endl;
+  }
+}
@@ -0,0 +1,210 @@
+// Background prefetch of tiles that are likely to be requested
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _PREFETCHER_H
+#define _PREFETCHER_H
+
+
+#include <string>
+#include <fstream>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <set>
+#include <vector>
+
+#include "IIPImage.h"
+#include "Cache.h"
+#include "JPEGCompressor.h"
+#include "Watermark.h"
+
+
+// Number of recent tile requests per image from which we infer panning
+#define PREFETCH_HISTORY 16
+
+
+
+/// Fills the tile cache with tiles that are likely to be requested soon
+/** Viewers start with the smallest resolutions, which for formats with virtual levels,
+    such as those read through OpenSlide or BioFormats, must each be composed from the
+    level below. When an image is first opened, a job is queued to encode every tile of
+    as many of its lowest resolutions as fit within a tile budget.
+
+    Viewers then pan and zoom, so that the next tiles requested tend to lie next to the
+    current view or below it at the next resolution. If prediction is enabled, the tiles
+    requested for each image are tracked to infer the direction of panning and zooming,
+    and the tiles just beyond the view in that direction are predicted. Only the latest
+    prediction for each image is kept: a newer one cancels any older one, even part way
+    through. Predictions only run while no request is being handled, and are abandoned
+    as soon as one arrives, so that they never hold up a client.
+
+    A single background thread does all this work. Jobs for newly opened images that
+    arrive while the queue is full are dropped.
+ */
+
+class Prefetcher {
+
+ public:
+
+  /// Marks a request as being handled for as long as it exists
+  /** Predictions wait until there are none of these */
+  class Foreground {
+    Prefetcher* prefetcher;
+  public:
+    Foreground( Prefetcher* p ) : prefetcher( p ) { if( prefetcher ) prefetcher->begin(); };
+    ~Foreground() { if( prefetcher ) prefetcher->end(); };
+  };
+
+
+ private:
+
+  /// A tile to predict
+  struct Target {
+    int resolution;
+    int tile;
+    Target( int r, int t ) : resolution( r ), tile( t ) {};
+  };
+
+  /// The latest prediction for an image
+  struct Prediction {
+    IIPImagePtr image;
+    int xangle, yangle, layers;
+    std::vector<Target> targets;
+    unsigned long generation;
+  };
+
+  /// The recent requests for an image at its current resolution
+  struct Motion {
+    int resolution;
+    int zoom;                           // +1 after zooming in, -1 after zooming out
+    int x[PREFETCH_HISTORY];
+    int y[PREFETCH_HISTORY];
+    unsigned int count;
+    unsigned long generation;
+  };
+
+  /// Caches and settings shared with the worker threads
+  TileCache* tileCache;
+  Watermark* watermark;
+  int quality;
+
+  /// Maximum number of tiles to prefetch per image when it is opened
+  unsigned int budget;
+
+  /// Whether to predict tiles from the requests made
+  bool predict;
+
+  /// Logging
+  std::string logfileName;
+  int loglevel;
+
+  /// Work waiting for our thread and the state used to predict it, all guarded by mutex
+  std::mutex mutex;
+  std::condition_variable condition;
+  std::deque<IIPImagePtr> images;
+  std::map<uint32_t, Prediction> pending;
+  std::map<uint32_t, Motion> motions;
+  std::set<TileKey> predicted;
+
+  /// Number of requests being handled
+  unsigned int active;
+
+  /// Set once we are shutting down, so that a job in progress stops early
+  std::atomic<bool> stopping;
+
+  /// Usage counters
+  std::atomic<unsigned long> scheduled, dropped, tiles, predictedTiles, predictedUsed, cancelled;
+
+  /// The thread that runs the jobs
+  std::thread thread;
+
+
+  /// Note the start and end of a request
+  void begin();
+  void end();
+
+  /// Run jobs until we are stopped
+  void run();
+
+  /// Prefetch the lowest resolutions of an image
+  void prefetch( IIPImagePtr image, JPEGCompressor& jpeg, std::ofstream& logfile );
+
+  /// Prefetch predicted tiles until done or cancelled
+  void prefetch( const Prediction& prediction, JPEGCompressor& jpeg, std::ofstream& logfile );
+
+  /// Whether a prediction has been superseded or must give way to a request
+  bool cancel( uint32_t id, unsigned long generation );
+
+
+ public:
+
+  /// Constructor
+  /** @param tc tile cache to fill
+      @param w watermark applied to tiles, or NULL
+      @param q JPEG quality of the tiles
+      @param b maximum number of tiles to prefetch per image when it is opened
+      @param p whether to predict tiles from the requests made
+      @param f log file name
+      @param l log level
+   */
+  Prefetcher( TileCache* tc, Watermark* w, int q, unsigned int b, bool p, const std::string& f, int l );
+
+  /// Destructor - abandons any jobs still queued
+  ~Prefetcher();
+
+  /// Queue an image to be prefetched without waiting
+  /** @param image newly opened image */
+  void schedule( IIPImagePtr image );
+
+  /// Note a tile requested by a client and predict the next ones
+  /** @param image image
+      @param resolution resolution number
+      @param tile tile number
+      @param xangle horizontal sequence number
+      @param yangle vertical sequence number
+      @param layers number of quality layers
+   */
+  void observe( IIPImagePtr image, int resolution, int tile, int xangle, int yangle, int layers );
+
+  /// Return the number of images queued
+  unsigned long getScheduled(){ return scheduled.load( std::memory_order_relaxed ); };
+
+  /// Return the number of images not queued because the queue was full
+  unsigned long getDropped(){ return dropped.load( std::memory_order_relaxed ); };
+
+  /// Return the number of tiles prefetched for newly opened images
+  unsigned long getTiles(){ return tiles.load( std::memory_order_relaxed ); };
+
+  /// Return the number of predicted tiles prefetched
+  unsigned long getPredicted(){ return predictedTiles.load( std::memory_order_relaxed ); };
+
+  /// Return the number of predicted tiles that were then requested
+  unsigned long getPredictedUsed(){ return predictedUsed.load( std::memory_order_relaxed ); };
+
+  /// Return the number of predictions cancelled before they were complete
+  unsigned long getCancelled(){ return cancelled.load( std::memory_order_relaxed ); };
+
+};
+
+
+#endif
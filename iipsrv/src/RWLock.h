@@ -0,0 +1,107 @@
+// Reader-writer lock
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _RWLOCK_H
+#define _RWLOCK_H
+
+
+#ifdef WIN32
+#include <mutex>
+#else
+#include <pthread.h>
+#endif
+
+
+
+/// Lock that can be held by many readers or a single writer
+/** Provides lock() and unlock() for exclusive access, so that it can be used with
+    std::lock_guard, and lock_shared() and unlock_shared() for shared access, for use
+    with SharedLock. Writers are preferred so that a steady stream of readers cannot
+    starve them. Where POSIX reader-writer locks are not available, all access is
+    exclusive.
+ */
+
+class RWLock {
+
+ private:
+
+#ifdef WIN32
+  std::mutex mutex;
+#else
+  pthread_rwlock_t rwlock;
+#endif
+
+  RWLock( const RWLock& );
+  RWLock& operator=( const RWLock& );
+
+
+ public:
+
+#ifdef WIN32
+
+  RWLock() {};
+  void lock(){ mutex.lock(); };
+  void unlock(){ mutex.unlock(); };
+  void lock_shared(){ mutex.lock(); };
+  void unlock_shared(){ mutex.unlock(); };
+
+#else
+
+  RWLock(){
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init( &attr );
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np( &attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP );
+#endif
+    pthread_rwlock_init( &rwlock, &attr );
+    pthread_rwlockattr_destroy( &attr );
+  };
+  ~RWLock(){ pthread_rwlock_destroy( &rwlock ); };
+
+  void lock(){ pthread_rwlock_wrlock( &rwlock ); };
+  void unlock(){ pthread_rwlock_unlock( &rwlock ); };
+  void lock_shared(){ pthread_rwlock_rdlock( &rwlock ); };
+  void unlock_shared(){ pthread_rwlock_unlock( &rwlock ); };
+
+#endif
+
+};
+
+
+
+/// Holds an RWLock in shared mode for its lifetime
+class SharedLock {
+
+ private:
+
+  RWLock& rwlock;
+
+  SharedLock( const SharedLock& );
+  SharedLock& operator=( const SharedLock& );
+
+ public:
+
+  explicit SharedLock( RWLock& l ) : rwlock( l ) { rwlock.lock_shared(); };
+  ~SharedLock(){ rwlock.unlock_shared(); };
+
+};
+
+
+#endif
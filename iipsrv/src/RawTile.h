@@ -37,6 +37,7 @@
 #include <cstring>
 #include <string>
 #include <cstdlib>
+#include <stdint.h>
 #include <ctime>
 #include "Timer.h"
 
@@ -88,9 +89,15 @@ class RawTile{
   /// Name of the file from which this tile comes
   std::string filename;
 
+  /// Id of the file name within the tile cache (see TileKey::intern), or 0 if not set
+  uint32_t imageId;
+
   /// Tile timestamp
   time_t timestamp;
 
+  /// Time in microseconds taken to decode or compose this tile, or 0 if unknown
+  unsigned long cost;
+
   /// Pointer to the image data
   void *data;
 
@@ -136,7 +143,7 @@ class RawTile{
     width = w; height = h; bpc = b; dataLength = 0; data = NULL;
     tileNum = tn; resolution = res; hSequence = hs ; vSequence = vs;
     memoryManaged = 1; channels = c; compressionType = UNCOMPRESSED; quality = 0;
-    timestamp = 0; sampleType = FIXEDPOINT; padded = false;
+    timestamp = 0; cost = 0; sampleType = FIXEDPOINT; padded = false; imageId = 0;
   };
 
 
@@ -174,7 +181,9 @@ class RawTile{
     compressionType = tile.compressionType;
     quality = tile.quality;
     filename = tile.filename;
+    imageId = tile.imageId;
     timestamp = tile.timestamp;
+    cost = tile.cost;
     sampleType = tile.sampleType;
     padded = tile.padded;
 
@@ -223,7 +232,9 @@ class RawTile{
     compressionType = tile.compressionType;
     quality = tile.quality;
     filename = tile.filename;
+    imageId = tile.imageId;
     timestamp = tile.timestamp;
+    cost = tile.cost;
     sampleType = tile.sampleType;
     padded = tile.padded;
 
@@ -301,4 +312,21 @@ class RawTile{
 #endif
 
 
+/// Make a tile safe to modify in place
+/** Tiles returned by the tile cache are shared with it and with other requests,
+    so they are treated as immutable: anything that changes a tile's data must first
+    call this, which replaces the tile with a private copy unless we hold the only
+    reference to it. Nobody else can obtain a new reference to a tile that is not
+    in the cache, so an unshared tile stays unshared.
+    @param tile tile to be modified
+ */
+#if defined(HAS_SHARED_PTR)
+inline void unshare( RawTilePtr& tile ){
+  if( tile && tile.use_count() != 1 ) tile = RawTilePtr( new RawTile( *tile ) );
+}
+#else
+inline void unshare( RawTilePtr& tile ){}
+#endif
+
+
 #endif
@@ -0,0 +1,282 @@
+/*
+    IIP Server Statistics Command Handler Class Member Function
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+#include "Task.h"
+#include <cstdio>
+#include <sstream>
+#include <algorithm>
+
+using namespace std;
+
+
+/// Number of most frequently used tiles to list
+#define STATS_HOT_KEYS 20
+
+
+/// Quote a string for inclusion in JSON
+static string quote( const string& s ){
+  string q = "\"";
+  for( string::const_iterator i = s.begin(); i != s.end(); i++ ){
+    unsigned char c = *i;
+    if( c == '"' ) q += "\\\"";
+    else if( c == '\\' ) q += "\\\\";
+    else if( c < 0x20 ){
+      char tmp[8];
+      snprintf( tmp, 8, "\\u%04x", c );
+      q += tmp;
+    }
+    else q += c;
+  }
+  q += "\"";
+  return q;
+}
+
+
+/// Output the usage counters of a cache
+template <class S> static void counters( ostringstream& json, const S& s ){
+  json << "\t\t\"hits\": " << s.hits << ",\n"
+       << "\t\t\"misses\": " << s.misses << ",\n"
+       << "\t\t\"insertions\": " << s.insertions << ",\n"
+       << "\t\t\"evictions\": " << s.evictions << ",\n"
+       << "\t\t\"removals\": " << s.removals << ",\n"
+       << "\t\t\"elements\": " << s.elements << ",\n";
+}
+
+
+/// Describe the state of our caches
+static void cache( Session* session, ostringstream& json ){
+
+  TileCache* tileCache = session->tileCache;
+  imageCacheMapType* imageCache = session->imageCache;
+
+  json << "{\n";
+
+
+  // Tile cache usage
+  TileCache::Statistics s = tileCache->getStatistics();
+  json << "\t\"tile_cache\": {\n";
+  counters( json, s );
+  json << "\t\t\"megabytes\": " << tileCache->getMemorySize() << ",\n";
+
+  // Hits and misses for each compression type
+  const char* names[] = { "raw", "jpeg", "deflate", "png" };
+  json << "\t\t\"compression\": {\n";
+  for( int c = UNCOMPRESSED; c <= PNG; c++ ){
+    unsigned long h, m;
+    tileCache->getCompressionStatistics( (CompressionType) c, h, m );
+    json << "\t\t\t\"" << names[c] << "\": { \"hits\": " << h << ", \"misses\": " << m << " }"
+	 << ( c < PNG ? ",\n" : "\n" );
+  }
+  json << "\t\t},\n";
+
+  // Memory held per image and per resolution
+  map<string, TileCache::ImageUsage> usage = tileCache->getUsage();
+  map<int,size_t> resolutions;
+  json << "\t\t\"images\": {";
+  for( map<string, TileCache::ImageUsage>::const_iterator i = usage.begin(); i != usage.end(); i++ ){
+    json << ( i == usage.begin() ? "\n" : ",\n" )
+	 << "\t\t\t" << quote( i->first ) << ": { \"bytes\": " << i->second.bytes
+	 << ", \"tiles\": " << i->second.tiles << ", \"resolutions\": {";
+    for( map<int,size_t>::const_iterator r = i->second.resolutions.begin(); r != i->second.resolutions.end(); r++ ){
+      json << ( r == i->second.resolutions.begin() ? " " : ", " ) << "\"" << r->first << "\": " << r->second;
+      resolutions[r->first] += r->second;
+    }
+    json << " } }";
+  }
+  json << ( usage.empty() ? "},\n" : "\n\t\t},\n" );
+
+  json << "\t\t\"resolutions\": {";
+  for( map<int,size_t>::const_iterator r = resolutions.begin(); r != resolutions.end(); r++ ){
+    json << ( r == resolutions.begin() ? " " : ", " ) << "\"" << r->first << "\": " << r->second;
+  }
+  json << " },\n";
+
+  // Most frequently used tiles
+  vector<TileCache::EntryStatistics> hot = tileCache->getEntries( STATS_HOT_KEYS );
+  json << "\t\t\"hot\": [";
+  for( vector<TileCache::EntryStatistics>::const_iterator i = hot.begin(); i != hot.end(); i++ ){
+    json << ( i == hot.begin() ? "\n" : ",\n" )
+	 << "\t\t\t{ \"key\": " << quote( i->key.str() ) << ", \"hits\": " << i->hits << ", \"age\": " << i->age << " }";
+  }
+  json << ( hot.empty() ? "]\n" : "\n\t\t]\n" );
+  json << "\t},\n";
+
+
+  // Shared memory tile cache, if any
+  SharedTileCache* shared = tileCache->getSharedCache();
+  if( shared ){
+    json << "\t\"shared_cache\": {\n"
+	 << "\t\t\"hits\": " << shared->getHits() << ",\n"
+	 << "\t\t\"misses\": " << shared->getMisses() << ",\n"
+	 << "\t\t\"bytes\": " << shared->getDataSize() << "\n"
+	 << "\t},\n";
+  }
+
+
+  // Disk tile cache, if any
+  DiskTileCache* disk = tileCache->getDiskCache();
+  if( disk ){
+    json << "\t\"disk_cache\": {\n"
+	 << "\t\t\"hits\": " << disk->getHits() << ",\n"
+	 << "\t\t\"misses\": " << disk->getMisses() << ",\n"
+	 << "\t\t\"elements\": " << disk->getNumElements() << ",\n"
+	 << "\t\t\"bytes\": " << disk->getSize() << ",\n"
+	 << "\t\t\"max_bytes\": " << disk->getMaxSize() << "\n"
+	 << "\t},\n";
+  }
+
+
+  // Memcached tile cache, if any
+  MemcachedTileCache* memcached = tileCache->getMemcachedCache();
+  if( memcached ){
+    json << "\t\"memcached_cache\": {\n"
+	 << "\t\t\"hits\": " << memcached->getHits() << ",\n"
+	 << "\t\t\"misses\": " << memcached->getMisses() << ",\n"
+	 << "\t\t\"stores\": " << memcached->getStores() << ",\n"
+	 << "\t\t\"dropped\": " << memcached->getDropped() << "\n"
+	 << "\t},\n";
+  }
+
+
+  // Background prefetching, if enabled
+  Prefetcher* prefetcher = session->prefetcher;
+  if( prefetcher ){
+    // The share of predicted tiles that a client then requested shows whether prediction pays off
+    unsigned long predicted = prefetcher->getPredicted();
+    unsigned long used = prefetcher->getPredictedUsed();
+    json << "\t\"prefetch\": {\n"
+	 << "\t\t\"images\": " << prefetcher->getScheduled() << ",\n"
+	 << "\t\t\"dropped\": " << prefetcher->getDropped() << ",\n"
+	 << "\t\t\"tiles\": " << prefetcher->getTiles() << ",\n"
+	 << "\t\t\"predicted\": " << predicted << ",\n"
+	 << "\t\t\"predicted_used\": " << used << ",\n"
+	 << "\t\t\"predicted_hit_rate\": " << ( predicted ? (double) used / predicted : 0.0 ) << ",\n"
+	 << "\t\t\"cancelled\": " << prefetcher->getCancelled() << "\n"
+	 << "\t},\n";
+  }
+
+
+  // Threads in and waiting for the decode and CPU stages, if limited
+  if( Stage::decode || Stage::cpu ){
+    Stage* stages[2] = { Stage::decode, Stage::cpu };
+    const char* names[2] = { "decode", "cpu" };
+    json << "\t\"stages\": {";
+    bool first = true;
+    for( int n = 0; n < 2; n++ ){
+      if( !stages[n] ) continue;
+      json << ( first ? "\n" : ",\n" )
+	   << "\t\t\"" << names[n] << "\": { \"threads\": " << stages[n]->getSlots()
+	   << ", \"active\": " << stages[n]->getActive() << ", \"waiting\": " << stages[n]->getWaiting() << " }";
+      first = false;
+    }
+    json << "\n\t},\n";
+  }
+
+
+  // Depth of each stage of the HTTP pipeline, if in HTTP mode
+  if( session->requestQueue && session->httpDepths ){
+    vector<HTTPServer::Depths>& depths = *session->httpDepths;
+    json << "\t\"http\": {\n"
+	 << "\t\t\"request_queue\": " << session->requestQueue->size() << ",\n"
+	 << "\t\t\"request_queue_capacity\": " << session->requestQueue->getCapacity() << ",\n"
+	 << "\t\t\"io_threads\": [";
+    for( unsigned int n = 0; n < depths.size(); n++ ){
+      json << ( n == 0 ? "\n" : ",\n" )
+	   << "\t\t\t{ \"connections\": " << depths[n].connections << ", \"stalled\": " << depths[n].stalled
+	   << ", \"working\": " << depths[n].working << ", \"completed\": " << depths[n].completed
+	   << ", \"unsent_bytes\": " << depths[n].unsent << " }";
+    }
+    json << ( depths.empty() ? "]\n" : "\n\t\t]\n" );
+    json << "\t},\n";
+  }
+
+
+  // Open image handles and how long they have been open
+  imageCacheMapType::Statistics t = imageCache->getStatistics();
+  vector<imageCacheMapType::EntryStatistics> images = imageCache->getEntries( 0 );
+  json << "\t\"image_cache\": {\n";
+  counters( json, t );
+  json << "\t\t\"megabytes\": " << imageCache->getMemorySize() << ",\n";
+  json << "\t\t\"images\": [";
+  for( vector<imageCacheMapType::EntryStatistics>::const_iterator i = images.begin(); i != images.end(); i++ ){
+    json << ( i == images.begin() ? "\n" : ",\n" )
+	 << "\t\t\t{ \"path\": " << quote( i->key ) << ", \"hits\": " << i->hits << ", \"age\": " << i->age
+	 << ", \"idle\": " << i->idle << ", \"bytes\": " << i->size << " }";
+  }
+  json << ( images.empty() ? "]\n" : "\n\t\t]\n" );
+  json << "\t}\n";
+
+  json << "}";
+
+}
+
+
+
+/// Return the state of our caches or our recorded timing spans in JSON format
+void STATS::run( Session* session, const std::string& argument ){
+
+  if( session->loglevel >= 3 ) (*session->logfile) << "STATS handler reached" << endl;
+
+  // Time this command
+  if( session->loglevel >= 2 ) command_timer.start();
+
+  string arg = argument;
+  transform( arg.begin(), arg.end(), arg.begin(), ::tolower );
+
+  ostringstream json;
+
+  if( arg == "trace" ) Trace::dump( json );
+  else if( arg == "cache" ) cache( session, json );
+  else{
+    session->response->setError( "2 2", "STATS=" + argument );
+    return;
+  }
+
+
+  // Send out our JSON header
+#ifndef DEBUG
+  char str[1024];
+  snprintf( str, 1024,
+	    "Server: iipsrv/%s\r\n"
+	    "Content-Type: application/json\r\n"
+	    "Cache-Control: no-cache\r\n"
+	    "\r\n",
+	    VERSION );
+
+  session->out->printf( (const char*) str );
+  session->out->flush();
+#endif
+
+  // Send the data itself
+  session->out->printf( json.str().c_str() );
+
+  if( session->out->flush() == -1 ) {
+    if( session->loglevel >= 1 ){
+      *(session->logfile) << "STATS :: Error flushing JSON" << endl;
+    }
+  }
+
+  // Inform our response object that we have sent something to the client and that it must not be cached
+  session->response->setImageSent();
+  session->response->setUncacheable();
+
+  if( session->loglevel >= 2 ){
+    *(session->logfile) << "STATS :: Total command time " << command_timer.getTime() << " microseconds" << endl;
+  }
+
+}
@@ -0,0 +1,552 @@
+// Member functions for SharedTileCache.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "SharedTileCache.h"
+
+#include <cmath>
+#include <cerrno>
+#include <cstring>
+
+#ifdef HAVE_SHARED_MEMORY
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+
+using namespace std;
+
+
+// Identifies an initialised segment and its layout version
+#define SHM_MAGIC 0x49495053
+#define SHM_VERSION 2
+
+// Number of index slots per hash bucket
+#define SHM_WAYS 8
+
+// Expected average number of bytes per cached tile, used to size the index
+#define SHM_BYTES_PER_TILE 16384
+
+// Tiles larger than this fraction of a stripe's data area are not stored
+#define SHM_MAX_TILE_FRACTION 8
+
+// Maximum number of independently locked stripes and the minimum data size of each
+#define SHM_STRIPES 16
+#define SHM_MIN_STRIPE_SIZE (4*1024*1024)
+
+
+/// Segment layout: the header, the stripes, the index and then the data area.
+/// Stripe s owns buckets [s*bucketsPerStripe, (s+1)*bucketsPerStripe) of the
+/// index and bytes [s*stripeSize, (s+1)*stripeSize) of the data area
+struct SharedTileCache::Header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t dataSize;
+  uint64_t numBuckets;
+  uint32_t numStripes;
+  uint32_t reserved;
+  uint64_t stripeSize;
+  uint64_t bucketsPerStripe;
+};
+
+/// All positions in a stripe's data area are logical: they increase monotonically
+/// and the physical offset is the position modulo the stripe size. A tile at logical
+/// position p is intact as long as the write cursor has not passed p + stripe size
+struct SharedTileCache::Stripe {
+  uint64_t cursor;
+  uint64_t hits;
+  uint64_t misses;
+#ifdef HAVE_SHARED_MEMORY
+  pthread_mutex_t mutex;
+#endif
+};
+
+struct SharedTileCache::Slot {
+  uint64_t hash;
+  uint64_t position;  // 0 if empty
+};
+
+/// Followed by the key, the file name and the tile data, each block padded to 8 bytes
+struct SharedTileCache::Entry {
+  uint64_t hash;
+  uint32_t length;
+  uint32_t keyLength;
+  uint32_t filenameLength;
+  int32_t dataLength;
+  int32_t tileNum;
+  int32_t resolution;
+  int32_t hSequence;
+  int32_t vSequence;
+  int32_t compressionType;
+  int32_t quality;
+  uint32_t width;
+  uint32_t height;
+  int32_t channels;
+  int32_t bpc;
+  int32_t sampleType;
+  int32_t padded;
+  int64_t timestamp;
+};
+
+
+// Round up to a multiple of 8 bytes
+static inline size_t align8( size_t n ){ return (n + 7) & ~((size_t)7); }
+
+// Round up to a multiple of 64 bytes to keep each stripe on its own cache lines
+static inline size_t align64( size_t n ){ return (n + 63) & ~((size_t)63); }
+
+
+
+SharedTileCache::SharedTileCache( const string& name, float size ) :
+  _name( name ),
+  _segment( NULL ),
+  _size( 0 ),
+  _header( NULL ),
+  _stripes( NULL ),
+  _index( NULL ),
+  _data( NULL )
+{
+  size_t data_size = align8( (size_t) ceil( size * 1024.0 * 1024.0 ) );
+  if( data_size == 0 ){
+    _error = "shared tile cache size is zero";
+    return;
+  }
+  attach( data_size );
+}
+
+
+
+SharedTileCache::~SharedTileCache()
+{
+#ifdef HAVE_SHARED_MEMORY
+  // The segment is deliberately left in place for other and future processes
+  if( _segment ) munmap( _segment, _size );
+#endif
+}
+
+
+
+uint64_t SharedTileCache::hash( const string& key )
+{
+  // 64 bit FNV-1a
+  uint64_t h = 14695981039346656037ULL;
+  for( string::const_iterator c = key.begin(); c != key.end(); ++c ){
+    h ^= (unsigned char) *c;
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+
+
+#ifdef HAVE_SHARED_MEMORY
+
+
+void SharedTileCache::initialise( unsigned char* segment, size_t data_size, uint64_t num_buckets, unsigned int num_stripes )
+{
+  // The segment has just been zero filled, so all index slots are empty
+  Header* header = (Header*) segment;
+  header->version = SHM_VERSION;
+  header->dataSize = data_size;
+  header->numBuckets = num_buckets;
+  header->numStripes = num_stripes;
+  header->stripeSize = data_size / num_stripes;
+  header->bucketsPerStripe = num_buckets / num_stripes;
+
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init( &attr );
+  pthread_mutexattr_setpshared( &attr, PTHREAD_PROCESS_SHARED );
+  pthread_mutexattr_setrobust( &attr, PTHREAD_MUTEX_ROBUST );
+
+  Stripe* stripes = (Stripe*) ( segment + align64( sizeof(Header) ) );
+  for( unsigned int s = 0; s < num_stripes; s++ ){
+    Stripe* stripe = (Stripe*) ( (unsigned char*) stripes + s * align64( sizeof(Stripe) ) );
+    stripe->cursor = header->stripeSize;
+    stripe->hits = 0;
+    stripe->misses = 0;
+    pthread_mutex_init( &stripe->mutex, &attr );
+  }
+  pthread_mutexattr_destroy( &attr );
+
+  // Publish the segment
+  __atomic_store_n( &header->magic, (uint32_t) SHM_MAGIC, __ATOMIC_RELEASE );
+}
+
+
+
+bool SharedTileCache::attach( size_t data_size )
+{
+  // Use as many stripes as the size allows, each a multiple of 8 bytes
+  unsigned int num_stripes = SHM_STRIPES;
+  while( num_stripes > 1 && data_size / num_stripes < SHM_MIN_STRIPE_SIZE ) num_stripes /= 2;
+  size_t stripe_size = align8( data_size / num_stripes );
+  data_size = stripe_size * num_stripes;
+
+  uint64_t buckets_per_stripe = stripe_size / ( SHM_WAYS * SHM_BYTES_PER_TILE );
+  if( buckets_per_stripe < 64 ) buckets_per_stripe = 64;
+  uint64_t num_buckets = buckets_per_stripe * num_stripes;
+
+  size_t header_size = align64( sizeof(Header) );
+  size_t stripes_size = num_stripes * align64( sizeof(Stripe) );
+  size_t index_size = num_buckets * SHM_WAYS * sizeof(Slot);
+  size_t size = header_size + stripes_size + index_size + data_size;
+
+  int fd = shm_open( _name.c_str(), O_RDWR | O_CREAT, 0600 );
+  if( fd < 0 ){
+    _error = "unable to open shared memory segment '" + _name + "': " + strerror( errno );
+    return false;
+  }
+
+  // Serialise attaching processes. The lock is released automatically if we die,
+  // so a segment is never left half initialised behind a held lock
+  if( flock( fd, LOCK_EX ) != 0 ){
+    _error = "unable to lock shared memory segment '" + _name + "': " + strerror( errno );
+    close( fd );
+    return false;
+  }
+
+  struct stat sb;
+  if( fstat( fd, &sb ) != 0 ){
+    _error = "unable to stat shared memory segment '" + _name + "': " + strerror( errno );
+    close( fd );
+    return false;
+  }
+
+  // An existing segment is only in use once its magic has been published
+  bool initialised = false;
+  if( (size_t) sb.st_size >= sizeof(Header) ){
+    Header* header = (Header*) mmap( NULL, sizeof(Header), PROT_READ, MAP_SHARED, fd, 0 );
+    if( header != MAP_FAILED ){
+      initialised = ( __atomic_load_n( &header->magic, __ATOMIC_ACQUIRE ) == SHM_MAGIC );
+      if( initialised && ( (size_t) sb.st_size != size || header->version != SHM_VERSION ||
+			   header->dataSize != data_size || header->numBuckets != num_buckets ||
+			   header->numStripes != num_stripes ) ){
+	_error = "shared memory segment '" + _name + "' exists with a different size or layout. Remove it from /dev/shm to resize";
+	munmap( header, sizeof(Header) );
+	close( fd );
+	return false;
+      }
+      munmap( header, sizeof(Header) );
+    }
+  }
+
+  if( !initialised ){
+    // Either a new segment or one left empty or short by a creator that died
+    // before publishing it: (re)allocate it from scratch. Reserve the memory now
+    // so that we fail cleanly rather than with a SIGBUS later if /dev/shm is too small
+    int rc = ( ftruncate( fd, 0 ) == 0 ) ? posix_fallocate( fd, 0, size ) : errno;
+    if( rc != 0 ){
+      _error = "unable to allocate shared memory segment '" + _name + "': " + strerror( rc );
+      shm_unlink( _name.c_str() );
+      close( fd );
+      return false;
+    }
+  }
+
+  void* segment = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0 );
+  if( segment == MAP_FAILED ){
+    _error = "unable to map shared memory segment '" + _name + "': " + strerror( errno );
+    close( fd );
+    return false;
+  }
+
+  if( !initialised ) initialise( (unsigned char*) segment, data_size, num_buckets, num_stripes );
+
+  // Unlock explicitly: the mapping keeps the open file, and with it the lock, alive after close
+  flock( fd, LOCK_UN );
+  close( fd );
+
+  _segment = (unsigned char*) segment;
+  _size = size;
+  _header = (Header*) segment;
+  _stripes = (Stripe*) ( _segment + header_size );
+  _index = (Slot*) ( _segment + header_size + stripes_size );
+  _data = _segment + header_size + stripes_size + index_size;
+
+  return true;
+}
+
+
+
+unsigned int SharedTileCache::stripe( uint64_t h )
+{
+  // Each stripe owns a contiguous range of buckets. Only the low bits of FNV-1a
+  // are well mixed for short keys, so select the bucket first
+  return (unsigned int) ( ( h % _header->numBuckets ) / _header->bucketsPerStripe );
+}
+
+
+
+// Stripes are padded to whole cache lines, so they cannot be indexed as a plain array
+#define STRIPE(s) ( (Stripe*) ( (unsigned char*) _stripes + (s) * align64( sizeof(Stripe) ) ) )
+
+
+
+void SharedTileCache::lock( unsigned int s )
+{
+  // If a process died while holding the lock, the stripe is still consistent:
+  // a tile is only indexed once it has been completely written
+  Stripe* stripe = STRIPE(s);
+  if( pthread_mutex_lock( &stripe->mutex ) == EOWNERDEAD ){
+    pthread_mutex_consistent( &stripe->mutex );
+  }
+}
+
+
+
+void SharedTileCache::unlock( unsigned int s )
+{
+  pthread_mutex_unlock( &STRIPE(s)->mutex );
+}
+
+
+
+bool SharedTileCache::valid( unsigned int s, uint64_t position )
+{
+  return ( position != 0 ) && ( STRIPE(s)->cursor <= position + _header->stripeSize );
+}
+
+
+
+SharedTileCache::Slot* SharedTileCache::find( unsigned int s, const string& key, uint64_t h )
+{
+  Slot* bucket = &_index[ ( h % _header->numBuckets ) * SHM_WAYS ];
+  unsigned char* data = &_data[ s * _header->stripeSize ];
+
+  for( int i = 0; i < SHM_WAYS; i++ ){
+    Slot* slot = &bucket[i];
+    if( slot->hash != h || !valid( s, slot->position ) ) continue;
+    Entry* entry = (Entry*) &data[ slot->position % _header->stripeSize ];
+    if( entry->hash == h && entry->keyLength == key.size() &&
+	memcmp( (char*) entry + sizeof(Entry), key.data(), key.size() ) == 0 ){
+      return slot;
+    }
+  }
+
+  return NULL;
+}
+
+
+
+void SharedTileCache::insert( const string& key, const RawTilePtr tile )
+{
+  if( !_segment || !tile || !tile->data || tile->dataLength <= 0 ) return;
+
+  size_t meta_length = align8( sizeof(Entry) + key.size() + tile->filename.size() );
+  size_t length = meta_length + align8( tile->dataLength );
+
+  // Don't let a single large tile or region flush the whole stripe
+  uint64_t stripe_size = _header->stripeSize;
+  if( length > stripe_size / SHM_MAX_TILE_FRACTION ) return;
+
+  uint64_t h = hash( key );
+  unsigned int s = stripe( h );
+  Stripe* st = STRIPE(s);
+  unsigned char* data = &_data[ s * stripe_size ];
+
+  lock( s );
+
+  // Entries are contiguous, so skip to the start of the data area if this one would straddle the end
+  uint64_t position = st->cursor;
+  uint64_t offset = position % stripe_size;
+  if( offset + length > stripe_size ){
+    position += stripe_size - offset;
+    offset = 0;
+  }
+  st->cursor = position + length;
+
+  Entry* entry = (Entry*) &data[offset];
+  entry->hash = h;
+  entry->length = length;
+  entry->keyLength = key.size();
+  entry->filenameLength = tile->filename.size();
+  entry->dataLength = tile->dataLength;
+  entry->tileNum = tile->tileNum;
+  entry->resolution = tile->resolution;
+  entry->hSequence = tile->hSequence;
+  entry->vSequence = tile->vSequence;
+  entry->compressionType = tile->compressionType;
+  entry->quality = tile->quality;
+  entry->width = tile->width;
+  entry->height = tile->height;
+  entry->channels = tile->channels;
+  entry->bpc = tile->bpc;
+  entry->sampleType = tile->sampleType;
+  entry->padded = tile->padded;
+  entry->timestamp = tile->timestamp;
+
+  unsigned char* ptr = (unsigned char*) entry + sizeof(Entry);
+  memcpy( ptr, key.data(), key.size() );
+  memcpy( ptr + key.size(), tile->filename.data(), tile->filename.size() );
+  memcpy( (unsigned char*) entry + meta_length, tile->data, tile->dataLength );
+
+  // Only index the tile once it has been fully written. Replace any existing
+  // entry for this key, then an empty or overwritten slot, then the oldest one
+  Slot* slot = this->find( s, key, h );
+  if( !slot ){
+    Slot* bucket = &_index[ ( h % _header->numBuckets ) * SHM_WAYS ];
+    slot = &bucket[0];
+    for( int i = 0; i < SHM_WAYS; i++ ){
+      if( !valid( s, bucket[i].position ) ){
+	slot = &bucket[i];
+	break;
+      }
+      if( bucket[i].position < slot->position ) slot = &bucket[i];
+    }
+  }
+  slot->hash = h;
+  slot->position = position;
+
+  unlock( s );
+}
+
+
+
+RawTilePtr SharedTileCache::getObject( const string& key )
+{
+  if( !_segment ) return RawTilePtr();
+
+  uint64_t h = hash( key );
+  unsigned int s = stripe( h );
+  RawTilePtr tile;
+
+  lock( s );
+
+  Slot* slot = this->find( s, key, h );
+  if( slot ){
+
+    Entry* entry = (Entry*) &_data[ s * _header->stripeSize + slot->position % _header->stripeSize ];
+    unsigned char* ptr = (unsigned char*) entry + sizeof(Entry);
+    size_t meta_length = align8( sizeof(Entry) + entry->keyLength + entry->filenameLength );
+
+    tile = RawTilePtr( new RawTile( entry->tileNum, entry->resolution, entry->hSequence, entry->vSequence,
+				    entry->width, entry->height, entry->channels, entry->bpc ) );
+    tile->compressionType = (CompressionType) entry->compressionType;
+    tile->quality = entry->quality;
+    tile->sampleType = (SampleType) entry->sampleType;
+    tile->padded = entry->padded;
+    tile->timestamp = entry->timestamp;
+    tile->filename.assign( (char*) ptr + entry->keyLength, entry->filenameLength );
+    tile->dataLength = entry->dataLength;
+
+    // Allocate in the same way as RawTile so that its destructor frees correctly
+    switch( tile->bpc ){
+      case 32:
+	if( tile->sampleType == FLOATINGPOINT ) tile->data = new float[tile->dataLength/4];
+	else tile->data = new unsigned int[tile->dataLength/4];
+	break;
+      case 16:
+	tile->data = new unsigned short[tile->dataLength/2];
+	break;
+      default:
+	tile->data = new unsigned char[tile->dataLength];
+	break;
+    }
+    tile->memoryManaged = 1;
+    memcpy( tile->data, (unsigned char*) entry + meta_length, tile->dataLength );
+
+    STRIPE(s)->hits++;
+  }
+  else STRIPE(s)->misses++;
+
+  unlock( s );
+
+  return tile;
+}
+
+
+
+void SharedTileCache::evict( const string& key )
+{
+  if( !_segment ) return;
+
+  uint64_t h = hash( key );
+  unsigned int s = stripe( h );
+  lock( s );
+  Slot* slot = this->find( s, key, h );
+  if( slot ) slot->position = 0;
+  unlock( s );
+}
+
+
+
+size_t SharedTileCache::getDataSize()
+{
+  return _segment ? _header->dataSize : 0;
+}
+
+
+
+uint64_t SharedTileCache::getHits()
+{
+  if( !_segment ) return 0;
+  uint64_t hits = 0;
+  for( unsigned int s = 0; s < _header->numStripes; s++ ){
+    lock( s );
+    hits += STRIPE(s)->hits;
+    unlock( s );
+  }
+  return hits;
+}
+
+
+
+uint64_t SharedTileCache::getMisses()
+{
+  if( !_segment ) return 0;
+  uint64_t misses = 0;
+  for( unsigned int s = 0; s < _header->numStripes; s++ ){
+    lock( s );
+    misses += STRIPE(s)->misses;
+    unlock( s );
+  }
+  return misses;
+}
+
+
+
+#else
+
+
+// Shared memory is not available on this platform
+
+bool SharedTileCache::attach( size_t data_size )
+{
+  _error = "shared memory is not supported on this platform";
+  return false;
+}
+
+void SharedTileCache::insert( const string& key, const RawTilePtr tile ){}
+
+RawTilePtr SharedTileCache::getObject( const string& key ){ return RawTilePtr(); }
+
+void SharedTileCache::evict( const string& key ){}
+
+size_t SharedTileCache::getDataSize(){ return 0; }
+
+uint64_t SharedTileCache::getHits(){ return 0; }
+
+uint64_t SharedTileCache::getMisses(){ return 0; }
+
+
+#endif
@@ -0,0 +1,145 @@
+// Cross-process shared memory tile cache
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _SHAREDTILECACHE_H
+#define _SHAREDTILECACHE_H
+
+
+#include <string>
+#include <stdint.h>
+#include "RawTile.h"
+
+
+
+/// Tile cache held in a POSIX shared memory segment
+/** The segment can be attached to by every iipsrv process on the host, so that a
+    tile decoded by one process is available to all the others. It also survives
+    process restarts. The segment is split into stripes chosen by key hash, each with
+    its own circular data area, share of a set-associative hash index and process-shared
+    robust mutex, so that processes only contend for the same stripe. Tiles are appended
+    to their stripe's data area, so the oldest tiles are evicted first.
+ */
+
+class SharedTileCache {
+
+ private:
+
+  /// Layout of the start of the segment
+  struct Header;
+
+  /// Lock, write cursor and counters of one stripe
+  struct Stripe;
+
+  /// Index slot pointing to a tile in the data area
+  struct Slot;
+
+  /// Header preceding each tile in the data area
+  struct Entry;
+
+  /// Segment name
+  std::string _name;
+
+  /// Start of our mapping
+  unsigned char* _segment;
+
+  /// Size of our mapping in bytes
+  size_t _size;
+
+  /// Pointers into the segment
+  Header* _header;
+  Stripe* _stripes;
+  Slot* _index;
+  unsigned char* _data;
+
+  /// Error message if we were unable to attach
+  std::string _error;
+
+
+  /// Compute the hash of a key
+  static uint64_t hash( const std::string& key );
+
+  /// Return the stripe for a key hash
+  unsigned int stripe( uint64_t h );
+
+  /// Lock a stripe, recovering its mutex if its owner died
+  void lock( unsigned int s );
+
+  /// Unlock a stripe
+  void unlock( unsigned int s );
+
+  /// Return the index slot holding a key or NULL. Must hold the stripe's lock
+  Slot* find( unsigned int s, const std::string& key, uint64_t h );
+
+  /// Whether the tile at a logical position in a stripe has not been overwritten. Must hold the lock
+  bool valid( unsigned int s, uint64_t position );
+
+  /// Attach to an existing or create a new segment
+  bool attach( size_t data_size );
+
+  /// Lay out a new segment. Must hold the segment file lock
+  static void initialise( unsigned char* segment, size_t data_size, uint64_t num_buckets, unsigned int num_stripes );
+
+
+ public:
+
+  /// Constructor
+  /** @param name name of the shared memory object, eg. "/iipsrv"
+      @param size size of the tile data area in MB
+   */
+  SharedTileCache( const std::string& name, float size );
+
+  /// Destructor - unmaps, but does not remove, the segment
+  ~SharedTileCache();
+
+  /// Whether we are attached to a usable segment
+  bool connected(){ return _segment != NULL; };
+
+  /// Error message if not connected
+  const std::string& error(){ return _error; };
+
+  /// Copy a tile into the segment
+  /** @param key tile cache key (see TileKey::str)
+      @param tile tile to store
+   */
+  void insert( const std::string& key, const RawTilePtr tile );
+
+  /// Retrieve a copy of a tile from the segment
+  /** @param key tile cache key (see TileKey::str)
+      @return tile or an empty pointer if not cached
+   */
+  RawTilePtr getObject( const std::string& key );
+
+  /// Remove a tile from the segment
+  /** @param key tile cache key (see TileKey::str) */
+  void evict( const std::string& key );
+
+  /// Return the number of bytes of tile data the segment can hold
+  size_t getDataSize();
+
+  /// Return the number of hits recorded by all processes
+  uint64_t getHits();
+
+  /// Return the number of misses recorded by all processes
+  uint64_t getMisses();
+
+};
+
+
+#endif
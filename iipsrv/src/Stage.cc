@@ -0,0 +1,78 @@
+// Member functions for Stage.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Stage.h"
+
+using namespace std;
+
+
+thread_local Stage* Stage::current = NULL;
+Stage* Stage::decode = NULL;
+Stage* Stage::cpu = NULL;
+
+
+
+void Stage::enter()
+{
+  unique_lock<std::mutex> lock( mutex );
+  unsigned long ticket = next++;
+  if( ticket != serving || used >= slots ){
+    waiting++;
+    while( ticket != serving || used >= slots ) available.wait( lock );
+    waiting--;
+  }
+  serving++;
+  used++;
+  // The next in line may also find a free slot
+  lock.unlock();
+  available.notify_all();
+}
+
+
+
+void Stage::leave()
+{
+  {
+    lock_guard<std::mutex> lock( mutex );
+    used--;
+  }
+  available.notify_all();
+}
+
+
+
+Stage::Slot::Slot( Stage* s ) : stage( NULL ), previous( current )
+{
+  if( !s || s == current ) return;
+  stage = s;
+  if( previous ) previous->leave();
+  stage->enter();
+  current = stage;
+}
+
+
+
+Stage::Slot::~Slot()
+{
+  if( !stage ) return;
+  stage->leave();
+  current = previous;
+  if( previous ) previous->enter();
+}
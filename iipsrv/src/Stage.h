@@ -0,0 +1,110 @@
+// Limits on the number of threads doing each kind of work at once
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _STAGE_H
+#define _STAGE_H
+
+
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+
+
+/// A stage of request handling with its own number of threads
+/** Requests are handled from start to finish by a worker thread, but a worker only holds
+    a slot of a stage while doing that stage's work. The CPU stage covers the transforms
+    and encoding of a request, and the decode stage the reading and decoding of tiles and
+    regions from the image. A worker that needs to decode gives up its CPU slot while it
+    waits for and holds a decode slot, so that a request blocked on slow storage leaves
+    its core to another request. With more worker threads than CPU slots, the cores are
+    therefore kept busy while other requests wait on I/O. Threads waiting for a slot
+    queue up in the order they arrive. As they are worker, region or prefetch threads,
+    the queue of each stage is bounded by the number of those threads.
+ */
+
+class Stage {
+
+ private:
+
+  /// Number of slots and the number in use, guarded by mutex
+  unsigned int slots;
+  unsigned int used;
+
+  /// Number of threads waiting for a slot
+  std::atomic<unsigned int> waiting;
+
+  /// Ticket dispenser so that slots are granted in the order requested, guarded by mutex
+  unsigned long next;
+  unsigned long serving;
+
+  std::mutex mutex;
+  std::condition_variable available;
+
+  /// The stage whose slot the calling thread holds, if any
+  static thread_local Stage* current;
+
+  /// Wait for and take a slot
+  void enter();
+
+  /// Give back a slot
+  void leave();
+
+
+ public:
+
+  /// The decode and CPU stages shared by all threads, or NULL if not limited
+  static Stage* decode;
+  static Stage* cpu;
+
+
+  /// Holds a slot of a stage for as long as it exists
+  /** Any slot the thread holds in another stage is given up meanwhile and taken back
+      afterwards. Nothing is done if the stage is NULL or the thread is already in it
+   */
+  class Slot {
+    Stage* stage;
+    Stage* previous;
+  public:
+    Slot( Stage* s );
+    ~Slot();
+  };
+
+
+  /// Constructor
+  /** @param n number of threads that may be in the stage at once */
+  Stage( unsigned int n ) : slots( n > 0 ? n : 1 ), used( 0 ), waiting( 0 ), next( 0 ), serving( 0 ) {};
+
+  /// Return the number of slots
+  unsigned int getSlots(){ return slots; };
+
+  /// Return the number of threads in the stage
+  unsigned int getActive(){
+    std::lock_guard<std::mutex> lock( mutex );
+    return used;
+  };
+
+  /// Return the number of threads waiting to enter the stage
+  unsigned int getWaiting(){ return waiting; };
+
+};
+
+
+#endif
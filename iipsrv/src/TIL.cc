@@ -122,13 +122,21 @@ void TIL::run( Session* session, const std::string& a ){
   }
 
 
+  // Fetch any tiles held by memcached in a single round trip rather than one per tile
+  TileManager tilemanager( session->tileCache, session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
+  vector<int> tiles;
+  for( int i = startx; i <= endx; i++ ){
+    for( int j = starty; j <= endy; j++ ) tiles.push_back( i + (j*ntlx) );
+  }
+  tilemanager.preload( resolution, tiles, session->view->xangle, session->view->yangle, JPEG );
+
+
   for( int i = startx; i <= endx; i++ ){
     for( int j = starty; j <= endy; j++ ){
 
       int n = i + (j*ntlx);
 
       // Get our tile using our tile manager
-      TileManager tilemanager( session->tileCache, session->image, session->watermark, session->jpeg, session->logfile, session->loglevel );
       RawTilePtr rawtile = tilemanager.getTile( resolution, n, session->view->xangle,
 					     session->view->yangle, session->view->getLayers(), JPEG );
 
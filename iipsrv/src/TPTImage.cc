@@ -185,6 +185,15 @@ void TPTImage::closeImage()
 }
 
 
+size_t TPTImage::getMemorySize()
+{
+  size_t size = IIPImage::getMemorySize();
+  if( tiff ) size += TPTIMAGE_HANDLE_SIZE;
+  if( tiff && tile_buf ) size += TIFFTileSize( tiff );
+  return size;
+}
+
+
 RawTilePtr TPTImage::getTile( int seq, int ang, unsigned int res, int layers, unsigned int tile ) throw (file_error)
 {
   uint32 im_width, im_height, tw, th, ntlx, ntly;
@@ -314,6 +323,7 @@ RawTilePtr TPTImage::getTile( int seq, int ang, unsigned int res, int layers, un
   rawtile->data = tile_buf;
   rawtile->dataLength = length;
   rawtile->filename = getImagePath();
+  rawtile->imageId = getImageId();
   rawtile->timestamp = timestamp;
   rawtile->memoryManaged = 0;
   rawtile->padded = true;
@@ -31,6 +31,10 @@
 
 
 
+/// Approximate memory held by libtiff for an open file, mostly its directory
+#define TPTIMAGE_HANDLE_SIZE 65536
+
+
 /// Image class for Tiled Pyramidal Images: Inherits from IIPImage. Uses libtiff
 class TPTImage : public IIPImage {
 
@@ -93,6 +97,9 @@ class TPTImage : public IIPImage {
   /// Overloaded function for closing a TIFF image
   void closeImage();
 
+  /// Return the memory held by the open image, including libtiff's tile buffer
+  size_t getMemorySize();
+
   /// Overloaded function for getting a particular tile
   /** @param x horizontal sequence angle
       @param y vertical sequence angle
@@ -22,6 +22,7 @@
 #include "Task.h"
 #include "Tokenizer.h"
 #include <cstdlib>
+#include <cctype>
 #include <algorithm>
 
 
@@ -29,42 +30,81 @@ using namespace std;
 
 
 
-Task* Task::factory( const string& t ){
-
-  // Convert the command string to lower case to handle incorrect
-  // viewer implementations
-
-  string type = t;
-  transform( type.begin(), type.end(), type.begin(), ::tolower );
-
-  if( type == "obj" ) return new OBJ;
-  else if( type == "fif" ) return new FIF;
-  else if( type == "qlt" ) return new QLT;
-  else if( type == "sds" ) return new SDS;
-  else if( type == "minmax" ) return new MINMAX;
-  else if( type == "cnt" ) return new CNT;
-  else if( type == "gam" ) return new GAM;
-  else if( type == "wid" ) return new WID;
-  else if( type == "hei" ) return new HEI;
-  else if( type == "rgn" ) return new RGN;
-  else if( type == "rot" ) return new ROT;
-  else if( type == "til" ) return new TIL;
-//  else if( type == "ptl" ) return new PTL;
-  else if( type == "jtl" ) return new JTL;
-  else if( type == "jtls" ) return new JTLS;
-  else if( type == "icc" ) return new ICC;
-  else if( type == "cvt" ) return new CVT;
-  else if( type == "shd" ) return new SHD;
-  else if( type == "cmp" ) return new CMP;
-  else if( type == "inv" ) return new INV;
-  else if( type == "zoomify" ) return new Zoomify;
-  else if( type == "spectra" ) return new SPECTRA;
-  else if( type == "pfl" ) return new PFL;
-  else if( type == "lyr" ) return new LYR;
-  else if( type == "deepzoom" ) return new DeepZoom;
-  else if( type == "ctw" ) return new CTW;
-  else if( type == "iiif" ) return new IIIF;
-  else return NULL;
+/// Compare a command case insensitively with a lower case name of the same length
+static inline bool matches( const char* type, const char* name, size_t length ){
+  for( size_t i = 0; i < length; i++ ){
+    if( tolower( (unsigned char) type[i] ) != name[i] ) return false;
+  }
+  return true;
+}
+
+
+/// Pack a three letter lower case command name into an integer
+#define COMMAND3( a, b, c ) ( ((a) << 16) | ((b) << 8) | (c) )
+
+
+
+Task* Task::factory( const char* type, size_t length, Arena& arena ){
+
+  // Commands are matched case insensitively to handle incorrect viewer implementations.
+  // Dispatch on the length of the name and then on the name itself rather than trying
+  // each command in turn. Most commands have three letters, which fit into an integer
+
+  switch( length ){
+
+  case 3:
+    switch( COMMAND3( tolower( (unsigned char) type[0] ),
+		      tolower( (unsigned char) type[1] ),
+		      tolower( (unsigned char) type[2] ) ) ){
+      case COMMAND3( 'o', 'b', 'j' ): return new (arena) OBJ;
+      case COMMAND3( 'f', 'i', 'f' ): return new (arena) FIF;
+      case COMMAND3( 'q', 'l', 't' ): return new (arena) QLT;
+      case COMMAND3( 's', 'd', 's' ): return new (arena) SDS;
+      case COMMAND3( 'c', 'n', 't' ): return new (arena) CNT;
+      case COMMAND3( 'g', 'a', 'm' ): return new (arena) GAM;
+      case COMMAND3( 'w', 'i', 'd' ): return new (arena) WID;
+      case COMMAND3( 'h', 'e', 'i' ): return new (arena) HEI;
+      case COMMAND3( 'r', 'g', 'n' ): return new (arena) RGN;
+      case COMMAND3( 'r', 'o', 't' ): return new (arena) ROT;
+      case COMMAND3( 't', 'i', 'l' ): return new (arena) TIL;
+//      case COMMAND3( 'p', 't', 'l' ): return new (arena) PTL;
+      case COMMAND3( 'j', 't', 'l' ): return new (arena) JTL;
+      case COMMAND3( 'i', 'c', 'c' ): return new (arena) ICC;
+      case COMMAND3( 'c', 'v', 't' ): return new (arena) CVT;
+      case COMMAND3( 's', 'h', 'd' ): return new (arena) SHD;
+      case COMMAND3( 'c', 'm', 'p' ): return new (arena) CMP;
+      case COMMAND3( 'i', 'n', 'v' ): return new (arena) INV;
+      case COMMAND3( 'p', 'f', 'l' ): return new (arena) PFL;
+      case COMMAND3( 'l', 'y', 'r' ): return new (arena) LYR;
+      case COMMAND3( 'c', 't', 'w' ): return new (arena) CTW;
+      default: return NULL;
+    }
+
+  case 4:
+    if( matches( type, "jtls", 4 ) ) return new (arena) JTLS;
+    if( matches( type, "iiif", 4 ) ) return new (arena) IIIF;
+    return NULL;
+
+  case 5:
+    if( matches( type, "stats", 5 ) ) return new (arena) STATS;
+    return NULL;
+
+  case 6:
+    if( matches( type, "minmax", 6 ) ) return new (arena) MINMAX;
+    return NULL;
+
+  case 7:
+    if( matches( type, "zoomify", 7 ) ) return new (arena) Zoomify;
+    if( matches( type, "spectra", 7 ) ) return new (arena) SPECTRA;
+    return NULL;
+
+  case 8:
+    if( matches( type, "deepzoom", 8 ) ) return new (arena) DeepZoom;
+    return NULL;
+
+  default:
+    return NULL;
+  }
 
 }
 
@@ -35,6 +35,12 @@
 #include "Writer.h"
 #include "Cache.h"
 #include "Watermark.h"
+#include "Trace.h"
+#include "Arena.h"
+#include "Prefetcher.h"
+#include "ThreadPool.h"
+#include "Stage.h"
+#include "HTTPServer.h"
 #ifdef HAVE_PNG
 #include "PNGCompressor.h"
 #endif
@@ -78,12 +84,14 @@ struct Session {
 
   imageCacheMapType *imageCache;
   TileCache* tileCache;
+  Prefetcher* prefetcher;
+  ThreadPool* threadPool;
 
-#ifdef DEBUG
-  FileWriter* out;
-#else
-  FCGIWriter* out;
-#endif
+  /// In HTTP mode, the queue of requests for the workers and the stages of each I/O thread, otherwise NULL
+  HTTPServer::JobQueue* requestQueue;
+  std::vector<HTTPServer::Depths>* httpDepths;
+
+  Writer* out;
 
 };
 
@@ -110,12 +118,23 @@ class Task {
   /// Virtual destructor
   virtual ~Task() {;};   
 
+  /// Tasks are allocated within the arena of the request
+  static void* operator new( size_t size, Arena& arena ){ return arena.allocate( size ); };
+
+  /// Deleting a task only destroys it, as its memory is released with the arena
+  static void operator delete( void* ){};
+  static void operator delete( void*, Arena& ){};
+
   /// Main public function
   virtual void run( Session* session, const std::string& argument ) {;};
 
   /// Factory function
-  /** @param type command type */
-  static Task* factory( const std::string& type );
+  /** @param type command type, which need not be null terminated
+      @param length length of the command type
+      @param arena arena in which to allocate the task
+      @return task, to be deleted before the arena is reset, or NULL if the command is unknown
+   */
+  static Task* factory( const char* type, size_t length, Arena& arena );
 
   /// Check image
   void checkImage();
@@ -254,6 +273,34 @@ class TIL : public Task {
 
 /// CVT Region Export Command
 class CVT : public Task {
+
+ private:
+
+  /// Apply the colour conversion and any transforms requested, converting to 8 bits
+  /** @param rawtile image or lines of image to transform */
+  void applyTransforms( RawTilePtr& rawtile );
+
+  /// Reduce to 1 or 3 channels and convert to greyscale if requested
+  /** @param rawtile image or lines of image to flatten */
+  void flatten( RawTilePtr& rawtile );
+
+  /// Apply the flip requested
+  /** @param rawtile image, or lines of image for a horizontal flip */
+  void flip( RawTilePtr& rawtile );
+
+  /// Initialise our JPEG compression and send the JPEG header
+  /** @param rawtile tile with the width, height and channels of the whole output image
+      @param strip_height maximum height of the strips we will send
+   */
+  void sendHeader( const RawTilePtr& rawtile, unsigned int strip_height );
+
+  /// Compress a strip of lines and send it
+  /** @param input lines of the output image
+      @param output buffer for the compressed data
+      @param strip_height number of lines
+   */
+  void sendStrip( unsigned char* input, unsigned char* output, unsigned int strip_height );
+
  public:
   void run( Session* session, const std::string& argument );
 
@@ -337,5 +384,12 @@ class CTW : public Task {
 };
 
 
+/// Server Statistics Command
+class STATS : public Task {
+ public:
+  void run( Session* session, const std::string& argument );
+};
+
+
 
 #endif
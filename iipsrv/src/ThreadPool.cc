@@ -0,0 +1,111 @@
+// Member functions for ThreadPool.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "ThreadPool.h"
+
+
+using namespace std;
+
+
+// Number of jobs per thread that can wait to be joined
+#define THREADPOOL_QUEUE 4
+
+
+
+ThreadPool::ThreadPool( unsigned int n ) : queue( n * THREADPOOL_QUEUE )
+{
+  for( unsigned int i = 0; i < n; i++ ) threads.push_back( std::thread( &ThreadPool::serve, this ) );
+}
+
+
+
+ThreadPool::~ThreadPool()
+{
+  queue.close();
+  for( vector<std::thread>::iterator t = threads.begin(); t != threads.end(); t++ ) t->join();
+}
+
+
+
+void ThreadPool::serve()
+{
+  JobPtr job;
+  while( queue.pop( job ) ){
+    work( *job, job->participants++ );
+    job.reset();
+  }
+}
+
+
+
+void ThreadPool::work( Job& job, unsigned int participant )
+{
+  unsigned int item;
+  while( ( item = job.next++ ) < job.items ){
+
+    // Skip the rest once an item has failed
+    bool failed;
+    {
+      lock_guard<std::mutex> lock( job.mutex );
+      failed = (bool) job.error;
+    }
+
+    if( !failed ){
+      try{
+	job.function( item, participant );
+      }
+      catch( ... ){
+	lock_guard<std::mutex> lock( job.mutex );
+	if( !job.error ) job.error = current_exception();
+      }
+    }
+
+    lock_guard<std::mutex> lock( job.mutex );
+    if( ++job.done == job.items ) job.finished.notify_all();
+  }
+}
+
+
+
+void ThreadPool::run( unsigned int items, const std::function<void(unsigned int,unsigned int)>& function )
+{
+  if( items == 0 ) return;
+
+  JobPtr job( new Job );
+  job->function = function;
+  job->items = items;
+  job->next = 0;
+  job->participants = 1;
+  job->done = 0;
+
+  // Offer the job to as many threads as could usefully join in. Threads that are
+  // busy join later, if there are still items left by then
+  unsigned int helpers = getParticipants( items ) - 1;
+  for( unsigned int i = 0; i < helpers; i++ ){
+    if( !queue.tryPush( job ) ) break;
+  }
+
+  // Work on it ourselves, then wait for items still running elsewhere
+  work( *job, 0 );
+
+  unique_lock<std::mutex> lock( job->mutex );
+  while( job->done < job->items ) job->finished.wait( lock );
+  if( job->error ) rethrow_exception( job->error );
+}
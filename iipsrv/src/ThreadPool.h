@@ -0,0 +1,111 @@
+// Pool of threads that help requests with work that can be split up
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _THREADPOOL_H
+#define _THREADPOOL_H
+
+
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <memory>
+
+#include "BoundedQueue.h"
+
+
+
+/// Runs the independent items of a job on several threads at once
+/** The thread that submits a job works through its items itself, and any idle threads
+    of the pool join in. A job therefore never waits for the pool: if every thread is busy
+    with other jobs, the items are simply run one after the other as before. Items must
+    not submit jobs of their own.
+ */
+
+class ThreadPool {
+
+ private:
+
+  /// Items of a job that remain to be run, shared by the threads working on it
+  struct Job {
+    std::function<void(unsigned int,unsigned int)> function;
+    unsigned int items;
+    std::atomic<unsigned int> next;          // Next item to run
+    std::atomic<unsigned int> participants;  // Threads that have joined in so far
+    unsigned int done;                       // Items finished, guarded by mutex
+    std::exception_ptr error;                // First exception thrown, guarded by mutex
+    std::mutex mutex;
+    std::condition_variable finished;
+  };
+
+  typedef std::shared_ptr<Job> JobPtr;
+
+  /// Jobs that our threads can join
+  BoundedQueue<JobPtr> queue;
+
+  /// Our threads
+  std::vector<std::thread> threads;
+
+
+  /// Run the items of a job until there are none left
+  /** @param job job
+      @param participant number of this thread within the job
+   */
+  static void work( Job& job, unsigned int participant );
+
+  /// Join jobs until we are stopped
+  void serve();
+
+
+ public:
+
+  /// Constructor
+  /** @param n number of threads */
+  ThreadPool( unsigned int n );
+
+  /// Destructor - waits for jobs in progress
+  ~ThreadPool();
+
+  /// Run the items of a job and wait until all are done
+  /** Any exception thrown by an item is rethrown once the others have finished, and
+      items not yet started are then skipped.
+      @param items number of items
+      @param function called with the number of each item and that of the thread running
+      it, which is less than getParticipants( items ). Calls on the same thread are never
+      concurrent, so per-thread state can be indexed by it without locking
+   */
+  void run( unsigned int items, const std::function<void(unsigned int,unsigned int)>& function );
+
+  /// Return the maximum number of threads that can work on a job at once
+  /** @param items number of items in the job */
+  unsigned int getParticipants( unsigned int items ){
+    return ( items > threads.size() ? threads.size() : ( items > 0 ? items - 1 : 0 ) ) + 1;
+  };
+
+  /// Return the number of threads in the pool
+  unsigned int getThreads(){ return threads.size(); };
+
+};
+
+
+#endif
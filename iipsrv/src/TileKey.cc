@@ -0,0 +1,69 @@
+// Member functions for TileKey.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "TileKey.h"
+#include <cstdio>
+#include <map>
+#include <vector>
+#include <mutex>
+
+// Fix missing snprintf in Windows
+#if _MSC_VER
+#define snprintf _snprintf
+#endif
+
+
+using namespace std;
+
+
+// The interned paths. Function statics so that they are ready for images created during
+// static initialisation. Id 0 is the empty path, which default constructed images have
+static mutex& internMutex(){ static mutex m; return m; }
+static map<string,uint32_t>& internIds(){ static map<string,uint32_t> ids; return ids; }
+static vector<string>& internPaths(){ static vector<string> paths( 1 ); return paths; }
+
+
+
+uint32_t TileKey::intern( const string& path ){
+  if( path.empty() ) return 0;
+  lock_guard<mutex> lock( internMutex() );
+  map<string,uint32_t>::const_iterator i = internIds().find( path );
+  if( i != internIds().end() ) return i->second;
+  uint32_t id = internPaths().size();
+  internPaths().push_back( path );
+  internIds()[path] = id;
+  return id;
+}
+
+
+
+string TileKey::path( uint32_t id ){
+  lock_guard<mutex> lock( internMutex() );
+  if( id >= internPaths().size() ) return string();
+  return internPaths()[id];
+}
+
+
+
+string TileKey::str() const {
+  char tmp[64];
+  snprintf( tmp, 64, ":%d:%d:%d:%d:%d:%d", resolution, tile, hSequence, vSequence, compression, quality );
+  return path( image ) + tmp;
+}
@@ -0,0 +1,162 @@
+// Tile cache key
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TILEKEY_H
+#define _TILEKEY_H
+
+
+#include <string>
+#include <functional>
+#include <stdint.h>
+#include "RawTile.h"
+
+#if defined(HAVE_TR1_UNORDERED_MAP) && !defined(HAVE_UNORDERED_MAP)
+#include <tr1/functional>
+#elif defined(HAVE_EXT_HASH_MAP) && !defined(HAVE_UNORDERED_MAP)
+#include <ext/hash_map>
+#endif
+
+
+
+/// Fixed size key identifying a tile in the tile cache
+/** Images are identified by a small integer rather than by their path: paths are interned
+    once, when an image object is created, so that building, hashing and comparing a key
+    involves no allocation or string handling. The hash is computed once on construction.
+ */
+
+struct TileKey {
+
+  uint64_t hash;
+  uint32_t image;
+  int32_t tile;
+  int16_t resolution;
+  int16_t hSequence;
+  int16_t vSequence;
+  int16_t quality;
+  uint8_t compression;
+
+
+  /// Default constructor
+  TileKey() : hash( 0 ), image( 0 ), tile( 0 ), resolution( 0 ),
+    hSequence( 0 ), vSequence( 0 ), quality( 0 ), compression( UNCOMPRESSED ) {};
+
+
+  /// Constructor
+  /** @param i image id (see intern())
+      @param r resolution number
+      @param t tile number
+      @param h horizontal sequence number
+      @param v vertical sequence number
+      @param c compression type
+      @param q compression quality
+   */
+  TileKey( uint32_t i, int r, int t, int h, int v, CompressionType c, int q ) :
+    image( i ), tile( t ), resolution( r ), hSequence( h ), vSequence( v ), quality( q ), compression( c )
+  {
+    // Pack the fields into two words and mix them
+    uint64_t a = ( (uint64_t) image << 32 ) | (uint32_t) tile;
+    uint64_t b = ( (uint64_t)(uint16_t) resolution << 48 ) | ( (uint64_t)(uint16_t) hSequence << 32 ) |
+      ( (uint64_t)(uint16_t) vSequence << 16 ) | ( (uint64_t)(uint8_t) quality << 8 ) | compression;
+    hash = mix( a ^ mix( b ) );
+  };
+
+
+  bool operator==( const TileKey& k ) const {
+    return hash == k.hash && image == k.image && tile == k.tile && resolution == k.resolution &&
+      hSequence == k.hSequence && vSequence == k.vSequence && quality == k.quality &&
+      compression == k.compression;
+  };
+
+  bool operator!=( const TileKey& k ) const { return !( *this == k ); };
+
+  /// Ordering for use where no hashed map is available
+  bool operator<( const TileKey& k ) const {
+    if( image != k.image ) return image < k.image;
+    if( resolution != k.resolution ) return resolution < k.resolution;
+    if( tile != k.tile ) return tile < k.tile;
+    if( hSequence != k.hSequence ) return hSequence < k.hSequence;
+    if( vSequence != k.vSequence ) return vSequence < k.vSequence;
+    if( compression != k.compression ) return compression < k.compression;
+    return quality < k.quality;
+  };
+
+
+  /// Return the key in the form "path:resolution:tile:h:v:compression:quality"
+  /** This is the form used by the shared memory cache, whose keys must mean the same
+      thing in every process, and for display
+   */
+  std::string str() const;
+
+
+  /// Return the id of an image path, allocating one if we have not seen it before
+  /** Ids are never reused, so that a key can never refer to a different image
+      @param path image path
+      @return id
+   */
+  static uint32_t intern( const std::string& path );
+
+  /// Return the path of an image id
+  /** @param id id from intern()
+      @return path or an empty string if unknown
+   */
+  static std::string path( uint32_t id );
+
+
+ private:
+
+  /// 64 bit finaliser from MurmurHash3
+  static uint64_t mix( uint64_t k ){
+    k ^= k >> 33;
+    k *= 0xff51afd7ed558ccdULL;
+    k ^= k >> 33;
+    k *= 0xc4ceb9fe1a85ec53ULL;
+    k ^= k >> 33;
+    return k;
+  };
+
+};
+
+
+
+// Hash functions returning our precomputed hash for the different map types
+
+namespace std {
+  template <> struct hash<TileKey> {
+    size_t operator()( const TileKey& k ) const { return (size_t) k.hash; }
+  };
+#if defined(HAVE_TR1_UNORDERED_MAP) && !defined(HAVE_UNORDERED_MAP)
+  namespace tr1 {
+    template <> struct hash<TileKey> {
+      size_t operator()( const TileKey& k ) const { return (size_t) k.hash; }
+    };
+  }
+#endif
+}
+
+#if defined(HAVE_EXT_HASH_MAP) && !defined(HAVE_UNORDERED_MAP) && !defined(HAVE_TR1_UNORDERED_MAP)
+namespace __gnu_cxx {
+  template <> struct hash<TileKey> {
+    size_t operator()( const TileKey& k ) const { return (size_t) k.hash; }
+  };
+}
+#endif
+
+
+#endif
@@ -24,7 +24,10 @@
 
 
 #include <cmath>
+#include <sstream>
 #include "TileManager.h"
+#include "Environment.h"
+#include "Stage.h"
 
 
 using namespace std;
@@ -38,10 +41,17 @@ RawTilePtr TileManager::getNewTile( int resolution, int tile, int xangle, int ya
 			       << " tiles, " << tileCache->getMemorySize() << " MB" << endl;
 
 
-  RawTilePtr ttt;
+  // Get our raw tile from the IIPImage image object. Decoders that are not
+  // thread safe are locked by our caller
+  TraceSpan decode( "decode" );
+  Timer decode_timer;
+  decode_timer.start();
+  RawTilePtr ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+  decode.end();
 
-  // Get our raw tile from the IIPImage image object
-  ttt = image->getTile( xangle, yangle, resolution, layers, tile );
+  // Record how long the tile took to get, so that the cache can hold on to expensive tiles
+  // for longer. Tiles composed by the image itself have already been timed
+  if( ttt->cost == 0 ) ttt->cost = std::max( decode_timer.getTime(), 1L );
 
 
   // Apply the watermark if we have one.
@@ -70,6 +80,10 @@ RawTilePtr TileManager::getNewTile( int resolution, int tile, int xangle, int ya
   if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache uncompressed insertion time: " << insert_timer.getTime()
 			       << " microseconds" << endl;
 
+  // Share it with other servers. This is queued and stored in the background
+  MemcachedTileCache* remote = tileCache->getMemcachedCache();
+  if( remote ) remote->insert( ttt );
+
 
   return ttt;
 
@@ -129,22 +143,50 @@ RawTilePtr TileManager::getTileInternal( int resolution, int tile, int xangle, i
   /* Try to get this tile from our cache first as a JPEG, then uncompressed
      Otherwise decode one from the source image and add it to the cache
    */
+  TraceSpan lookup( "cache" );
   switch( c )
     {
     // TCP: automatically fall through to the next case if not break.
     case JPEG:
-      if( (rawtile = tileCache->getObject( TileCache::getIndex(image->getImagePath(), resolution, tile,
+      if( (rawtile = tileCache->getObject( TileCache::getIndex(image->getImageId(), resolution, tile,
                                          xangle, yangle, JPEG, jpeg->getQuality() ) ) ) ) break;
     case DEFLATE:
-      if( (rawtile = tileCache->getObject( TileCache::getIndex(image->getImagePath(), resolution, tile,
+      if( (rawtile = tileCache->getObject( TileCache::getIndex(image->getImageId(), resolution, tile,
                                          xangle, yangle, DEFLATE, 0 ) ) ) ) break;
     case UNCOMPRESSED:
-      if( (rawtile = tileCache->getObject( TileCache::getIndex(image->getImagePath(), resolution, tile,
+      if( (rawtile = tileCache->getObject( TileCache::getIndex(image->getImageId(), resolution, tile,
                                          xangle, yangle, UNCOMPRESSED, 0 ) ) ) ) break;
     default: 
       break;
 
     }
+  lookup.end();
+
+  // On a complete miss for an encoded tile, try our disk cache before decoding one
+  DiskTileCache* disk = tileCache->getDiskCache();
+  if( !rawtile && c == JPEG && disk ){
+    TraceSpan span( "disk" );
+    rawtile = disk->getObject( TileCache::getIndex( image->getImageId(), resolution, tile,
+						    xangle, yangle, JPEG, jpeg->getQuality() ),
+			       image->timestamp );
+    if( rawtile ){
+      if( loglevel >= 3 ) *logfile << "TileManager :: Disk cache hit" << endl;
+      tileCache->insert( rawtile );
+    }
+  }
+
+  // Then try memcached, which other servers may have filled. An uncompressed tile
+  // will do for an encoded one, as it still saves decoding
+  MemcachedTileCache* remote = tileCache->getMemcachedCache();
+  if( !rawtile && remote && ( c == JPEG || c == UNCOMPRESSED ) ){
+    vector<TileKey> keys;
+    if( c == JPEG ) keys.push_back( TileCache::getIndex( image->getImageId(), resolution, tile,
+							 xangle, yangle, JPEG, jpeg->getQuality() ) );
+    keys.push_back( TileCache::getIndex( image->getImageId(), resolution, tile, xangle, yangle, UNCOMPRESSED, 0 ) );
+    vector<RawTilePtr> found = fetch( keys );
+    for( vector<RawTilePtr>::const_iterator i = found.begin(); i != found.end() && !rawtile; i++ ) rawtile = *i;
+    if( rawtile && loglevel >= 3 ) *logfile << "TileManager :: Memcached hit" << endl;
+  }
 //  if( loglevel >= 3 ) *logfile << "TileManager :: getTileInternal :: retrieved from cache " << endl;
   if (!rawtile)
 	if (loglevel >= 3) *logfile << "TileManager :: getTileInternal :: cache miss." << endl;
@@ -164,7 +206,23 @@ RawTilePtr TileManager::getTileInternal( int resolution, int tile, int xangle, i
 
     // get uncompressed tile
 //  if( loglevel >= 3 ) *logfile << "TileManager :: getTileInternal :: retrieved from file " << endl;
-    rawtile = this->getNewTile( resolution, tile, xangle, yangle, layers );
+    // Move to the decode stage, so that our CPU slot is free while we wait on the image.
+    // This comes before any decoder lock, so that a thread never waits for a decode slot
+    // while holding a lock that a decoding thread may need
+    Stage::Slot slot( Stage::decode );
+
+    // Decoders that are not thread safe are shared between worker threads via the image cache,
+    // so lock them. Do this before joining any concurrent decode of this tile, as composing
+    // a tile may wait on tiles of other resolutions being decoded by another thread
+    std::unique_lock<std::mutex> lock( image->decoderMutex, std::defer_lock );
+    if( !image->threadSafe() ) lock.lock();
+
+    // Concurrent requests for this tile wait for a single decode
+    rawtile = tileCache->getOrBuild( TileCache::getIndex( image->getImageId(), resolution, tile,
+							  xangle, yangle, UNCOMPRESSED, 0 ),
+				     [&](){ return this->getNewTile( resolution, tile, xangle, yangle, layers ); },
+				     image->timestamp );
+    if( lock.owns_lock() ) lock.unlock();
 
     if( loglevel >= 2 ) *logfile << "TileManager :: Total Tile Access Time: "
 				 << tile_timer.getTime() << " microseconds" << endl;
@@ -206,7 +264,9 @@ RawTilePtr TileManager::getTileInternal( int resolution, int tile, int xangle, i
 
       if( loglevel >=2 ) compression_timer.start();
       unsigned int oldlen = rawtile->dataLength;
+      TraceSpan encode( "encode" );
       unsigned int newlen = jpeg->Compress( ttt );
+      encode.end();
       if( loglevel >= 2 ) *logfile << "TileManager :: JPEG requested, but UNCOMPRESSED compression found in cache." << endl
 				   << "TileManager :: JPEG Compression Time: "
 				   << compression_timer.getTime() << " microseconds" << endl
@@ -216,6 +276,8 @@ RawTilePtr TileManager::getTileInternal( int resolution, int tile, int xangle, i
       // Add our compressed tile to the cache
       if( loglevel >= 2 ) insert_timer.start();
       tileCache->insert( ttt );
+      if( disk ) disk->insert( ttt );
+      if( remote ) remote->insert( ttt );
       if( loglevel >= 2 ) *logfile << "TileManager :: Tile cache insertion time: " << insert_timer.getTime()
 				   << " microseconds" << endl;
 
@@ -239,11 +301,107 @@ RawTilePtr TileManager::getTile( int resolution, int tile, int xangle, int yangl
 //if( loglevel >= 2 ) *logfile << "TileManager :: getTile :: got it " << endl;
 
 
-  return RawTilePtr(new RawTile(*rawtile));  // returns copy of cache instance
+  // Return the cache's instance itself: callers that modify it make their own copy with unshare()
+  return rawtile;
+
+}
+
+
+void TileManager::copyTile( int resolution, int tile, int xangle, int yangle, int layers,
+			    unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+			    unsigned char* buffer, size_t stride, bool cache ){
+
+  RawTilePtr rawtile;
+
+  // Watermarks are applied to whole tiles, so watermarked tiles always go through the tile cache
+  if( cache || ( watermark && watermark->isSet() ) ){
+    rawtile = this->getTile( resolution, tile, xangle, yangle, layers, UNCOMPRESSED );
+  }
+  else{
+    rawtile = tileCache->getObject( TileCache::getIndex( image->getImageId(), resolution, tile,
+							 xangle, yangle, UNCOMPRESSED, 0 ) );
+    if( rawtile && rawtile->timestamp < image->timestamp ) rawtile.reset();
+  }
+
+  // Copy the part we need from a tile we hold
+  if( rawtile ){
+    size_t pixel = rawtile->channels * rawtile->bpc/8;
+    const unsigned char* src = (const unsigned char*) rawtile->data + ((y*rawtile->width) + x)*pixel;
+    for( unsigned int k=0; k<h; k++ ){
+      memcpy( buffer, src, w*pixel );
+      src += rawtile->width*pixel;
+      buffer += stride;
+    }
+    return;
+  }
+
+  // Otherwise decode it straight into the buffer without caching it
+  if( loglevel >= 3 ) *logfile << "TileManager :: Decoding tile " << tile << " at resolution " << resolution
+			       << " directly into region" << endl;
 
+  Stage::Slot slot( Stage::decode );
+  TraceSpan decode( "decode" );
+  std::unique_lock<std::mutex> lock( image->decoderMutex, std::defer_lock );
+  if( !image->threadSafe() ) lock.lock();
+  image->decodeTile( xangle, yangle, resolution, layers, tile, x, y, w, h, buffer, stride );
 }
 
 
+
+void TileManager::preload( int resolution, const vector<int>& tiles, int xangle, int yangle, CompressionType c ){
+
+  if( !tileCache->getMemcachedCache() || tiles.empty() ) return;
+
+  uint32_t id = image->getImageId();
+  vector<TileKey> keys;
+
+  for( vector<int>::const_iterator t = tiles.begin(); t != tiles.end(); t++ ){
+    TileKey raw = TileCache::getIndex( id, resolution, *t, xangle, yangle, UNCOMPRESSED, 0 );
+    if( tileCache->contains( raw ) ) continue;
+    if( c == JPEG ){
+      TileKey encoded = TileCache::getIndex( id, resolution, *t, xangle, yangle, JPEG, jpeg->getQuality() );
+      if( tileCache->contains( encoded ) ) continue;
+      keys.push_back( encoded );
+    }
+    keys.push_back( raw );
+  }
+
+  fetch( keys );
+}
+
+
+
+vector<RawTilePtr> TileManager::fetch( vector<TileKey>& keys ){
+
+  vector<TileKey>::iterator last = keys.begin();
+  for( vector<TileKey>::const_iterator k = keys.begin(); k != keys.end(); k++ ){
+    if( fetched.insert( *k ).second ) *last++ = *k;
+  }
+  keys.erase( last, keys.end() );
+  if( keys.empty() ) return vector<RawTilePtr>();
+
+  TraceSpan span( "memcached" );
+  Timer fetch_timer;
+  if( loglevel >= 2 ) fetch_timer.start();
+
+  vector<RawTilePtr> found = tileCache->getMemcachedCache()->getObjects( keys, image->timestamp );
+
+  unsigned int hits = 0;
+  for( vector<RawTilePtr>::const_iterator i = found.begin(); i != found.end(); i++ ){
+    if( *i ){
+      tileCache->insert( *i );
+      hits++;
+    }
+  }
+
+  if( loglevel >= 2 ) *logfile << "TileManager :: Memcached: found " << hits << " of " << keys.size()
+			       << " tiles in " << fetch_timer.getTime() << " microseconds" << endl;
+
+  return found;
+}
+
+
+
 RawTilePtr TileManager::getRegion( unsigned int res, int seq, int ang, int layers, unsigned int x, unsigned int y, unsigned int width, unsigned int height ){
 
   // If our image type can directly handle region compositing, simply return that
@@ -251,19 +409,20 @@ RawTilePtr TileManager::getRegion( unsigned int res, int seq, int ang, int layer
     if( loglevel >= 3 ){
       *logfile << "TileManager getRegion :: requesting region directly from image" << endl;
     }
+    Stage::Slot slot( Stage::decode );
+    TraceSpan span( "decode" );
+    if( image->threadSafe() ) return image->getRegion( seq, ang, res, layers, x, y, width, height );
+    std::lock_guard<std::mutex> lock( image->decoderMutex );
     return image->getRegion( seq, ang, res, layers, x, y, width, height );
   }
 
   // Otherwise do the compositing ourselves
+  TraceSpan span( "compose" );
 
   // The tile size of the source tile
   unsigned int src_tile_width = image->getTileWidth();
   unsigned int src_tile_height = image->getTileHeight();
 
-  // The tile size of the destination tile
-  unsigned int dst_tile_width = src_tile_width;
-  unsigned int dst_tile_height = src_tile_height;
-
   // The basic tile size ie. not the current tile
   unsigned int basic_tile_width = src_tile_width;
   unsigned int basic_tile_height = src_tile_height;
@@ -322,125 +481,132 @@ RawTilePtr TileManager::getRegion( unsigned int res, int seq, int ang, int layer
   else if( bpc == 32 && sampleType == FIXEDPOINT ) region->data = new int[width*height*channels];
   else if( bpc == 32 && sampleType == FLOATINGPOINT ) region->data = new float[width*height*channels];
 
-  unsigned int current_height = 0;
-
-  // Decode the image strip by strip
+  // Fetch any of the tiles we need that are held by memcached in a single round trip
+  vector<int> tiles;
   for( unsigned int i=starty; i<endy; i++ ){
+    for( unsigned int j=startx; j<endx; j++ ) tiles.push_back( (i*ntlx) + j );
+  }
+  this->preload( res, tiles, seq, ang, UNCOMPRESSED );
+
+  // Each tile is copied into its own rectangle of the region, so tiles can be decoded and
+  // composited on several threads at once without locking. The tile cache and the decoder
+  // locks are shared as for separate requests
+  unsigned int columns = endx - startx;
+  unsigned int ntiles = columns * (endy - starty);
 
-    unsigned int buffer_index = 0;
+  // Tiles that are not in the tile cache are decoded straight into the region, and only
+  // added to the cache if asked, as the tiles of large regions are rarely requested again
+  bool cache = Environment::getCacheRegionTiles();
 
-    // Keep track of the current pixel boundary horizontally. ie. only up
-    //  to the beginning of the current tile boundary.
-    unsigned int current_width = 0;
+  auto compose = [&]( TileManager& manager, unsigned int n ){
 
-    for( unsigned int j=startx; j<endx; j++ ){
+    unsigned int i = starty + (n / columns);
+    unsigned int j = startx + (n % columns);
 
-      // Time the tile retrieval
-      if( loglevel >= 2 ) tile_timer.start();
+    // Only print this out once per image
+    if( (loglevel >= 4) && (i==starty) && (j==startx) ){
+      *manager.logfile << "TileManager getRegion :: Tile data is " << channels << " channels, "
+	       << bpc << " bits per channel" << endl;
+    }
 
-      // Get an uncompressed tile
-      RawTilePtr rawtile = this->getTile( res, (i*ntlx) + j, seq, ang, layers, UNCOMPRESSED );
+    // The width and height of this tile, which are smaller in the last column and row
+    unsigned int src_tile_width = ( j == ntlx-1 && rem_x != 0 ) ? rem_x : basic_tile_width;
+    unsigned int src_tile_height = ( i == ntly-1 && rem_y != 0 ) ? rem_y : basic_tile_height;
+    unsigned int dst_tile_width = src_tile_width;
+    unsigned int dst_tile_height = src_tile_height;
 
-      if( loglevel >= 2 ){
-	*logfile << "TileManager getRegion :: Tile access time " << tile_timer.getTime() << " microseconds for tile "
-		 << (i*ntlx) + j << " at resolution " << res << endl;
-      }
+    // Variables for the pixel offset within the current tile
+    unsigned int xf = 0;
+    unsigned int yf = 0;
 
+    // If our viewport has been set, we need to modify our start
+    // and end points on the source image
+    if( !( x==0 && y==0 && width==im_width && height==im_height ) ){
 
-      // Only print this out once per image
-      if( (loglevel >= 4) && (i==starty) && (j==starty) ){
-	*logfile << "TileManager getRegion :: Tile data is " << rawtile->channels << " channels, "
-		 << rawtile->bpc << " bits per channel" << endl;
-      }
+      unsigned int remainder;  // Remaining pixels in the final row or column
 
-      // Set the tile width and height to be that of the source tile - Use the rawtile data
-      // because if we take a tile from cache the image pointer will not necessarily be pointing
-      // to the the current tile
-      src_tile_width = rawtile->width;
-      src_tile_height = rawtile->height;
-      dst_tile_width = src_tile_width;
-      dst_tile_height = src_tile_height;
-
-      // Variables for the pixel offset within the current tile
-      unsigned int xf = 0;
-      unsigned int yf = 0;
-
-      // If our viewport has been set, we need to modify our start
-      // and end points on the source image
-      if( !( x==0 && y==0 && width==im_width && height==im_height ) ){
-
-	unsigned int remainder;  // Remaining pixels in the final row or column
-
-	if( j == startx ){
-	  // Calculate the width used in the current tile
-	  // If there is only 1 tile, the width is just the view width
-	  if( j < endx - 1 ) dst_tile_width = src_tile_width - xoffset;
-	  else dst_tile_width = width;
-	  xf = xoffset;
-	}
-	else if( j == endx-1 ){
-	  // If this is the final row, calculate the remaining number of pixels
-	  remainder = (width+x) % basic_tile_width;
-	  if( remainder != 0 ) dst_tile_width = remainder;
-	}
-
-	if( i == starty ){
-	  // Calculate the height used in the current row of tiles
-	  // If there is only 1 row the height is just the view height
-	  if( i < endy - 1 ) dst_tile_height = src_tile_height - yoffset;
-	  else dst_tile_height = height;
-	  yf = yoffset;
-	}
-	else if( i == endy-1 ){
-	  // If this is the final row, calculate the remaining number of pixels
-	  remainder = (height+y) % basic_tile_height;
-	  if( remainder != 0 ) dst_tile_height = remainder;
-	}
-
-	if( loglevel >= 4 ){
-	  *logfile << "TileManager getRegion :: destination tile width: " << dst_tile_width
-		   << ", tile height: " << dst_tile_height << endl;
-	}
+      if( j == startx ){
+	// Calculate the width used in the current tile
+	// If there is only 1 tile, the width is just the view width
+	if( j < endx - 1 ) dst_tile_width = src_tile_width - xoffset;
+	else dst_tile_width = width;
+	xf = xoffset;
+      }
+      else if( j == endx-1 ){
+	// If this is the final row, calculate the remaining number of pixels
+	remainder = (width+x) % basic_tile_width;
+	if( remainder != 0 ) dst_tile_width = remainder;
       }
 
+      if( i == starty ){
+	// Calculate the height used in the current row of tiles
+	// If there is only 1 row the height is just the view height
+	if( i < endy - 1 ) dst_tile_height = src_tile_height - yoffset;
+	else dst_tile_height = height;
+	yf = yoffset;
+      }
+      else if( i == endy-1 ){
+	// If this is the final row, calculate the remaining number of pixels
+	remainder = (height+y) % basic_tile_height;
+	if( remainder != 0 ) dst_tile_height = remainder;
+      }
 
-      // Copy our tile data into the appropriate part of the strip memory
-      // one whole tile width at a time
-      for( unsigned int k=0; k<dst_tile_height; k++ ){
-
-	buffer_index = (current_width*channels) + (k*width*channels) + (current_height*width*channels);
-	unsigned int inx = ((k+yf)*rawtile->width*channels) + (xf*channels);
-
-	// Simply copy the line of data across
-	if( bpc == 8 ){
-	  unsigned char* ptr = (unsigned char*) rawtile->data;
-	  unsigned char* buf = (unsigned char*) region->data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels );
-	}
-	else if( bpc ==  16 ){
-	  unsigned short* ptr = (unsigned short*) rawtile->data;
-	  unsigned short* buf = (unsigned short*) region->data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*2 );
-	}
-	else if( bpc == 32 && sampleType == FIXEDPOINT ){
-	  unsigned int* ptr = (unsigned int*) rawtile->data;
-	  unsigned int* buf = (unsigned int*) region->data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
-	else if( bpc == 32 && sampleType == FLOATINGPOINT ){
-	  float* ptr = (float*) rawtile->data;
-	  float* buf = (float*) region->data;
-	  memcpy( &buf[buffer_index], &ptr[inx], dst_tile_width*channels*4 );
-	}
+      if( loglevel >= 4 ){
+	*manager.logfile << "TileManager getRegion :: destination tile width: " << dst_tile_width
+		 << ", tile height: " << dst_tile_height << endl;
       }
+    }
+
+    // The position of this tile within the region. Only the first row and column are cut short
+    unsigned int current_width = ( j == startx ) ? 0 : (j*basic_tile_width) - x;
+    unsigned int current_height = ( i == starty ) ? 0 : (i*basic_tile_height) - y;
+
+
+    // Time the tile retrieval
+    Timer tile_timer;
+    if( loglevel >= 2 ) tile_timer.start();
+
+    // Copy or decode the part of the tile we need straight into the region
+    size_t pixel = channels * bpc/8;
+    unsigned char* buf = (unsigned char*) region->data + ((current_height*width) + current_width)*pixel;
+    manager.copyTile( res, (i*ntlx) + j, seq, ang, layers, xf, yf, dst_tile_width, dst_tile_height,
+		      buf, width*pixel, cache );
+
+    if( loglevel >= 2 ){
+      *manager.logfile << "TileManager getRegion :: Tile access time " << tile_timer.getTime() << " microseconds for tile "
+	       << (i*ntlx) + j << " at resolution " << res << endl;
+    }
+  };
+
 
-      current_width += dst_tile_width;
+  if( pool && ntiles > 1 ){
+    // Each thread fetches its tiles through its own copy of us, which carries over the
+    // tiles already looked up in memcached, as our timers and lookups are not thread safe
+    vector<TileManager> managers( pool->getParticipants( ntiles ), *this );
+    if( loglevel >= 3 ){
+      *logfile << "TileManager getRegion :: Composing " << ntiles << " tiles on up to "
+	       << managers.size() << " threads" << endl;
     }
 
-    current_height += dst_tile_height;
+    // Our log stream is not thread safe either, so each copy logs to its own buffer,
+    // which we write out once all the tiles are done
+    vector<ostringstream> logs( managers.size() );
+    for( unsigned int t=0; t<managers.size(); t++ ) managers[t].logfile = &logs[t];
 
+    try{
+      pool->run( ntiles, [&]( unsigned int n, unsigned int t ){ compose( managers[t], n ); } );
+    }
+    catch( ... ){
+      for( unsigned int t=0; t<logs.size(); t++ ) *logfile << logs[t].str();
+      throw;
+    }
+    for( unsigned int t=0; t<logs.size(); t++ ) *logfile << logs[t].str();
+  }
+  else{
+    for( unsigned int n=0; n<ntiles; n++ ) compose( *this, n );
   }
 
+
   return region;
 
 }
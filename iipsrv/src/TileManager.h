@@ -25,6 +25,8 @@
 
 
 #include <fstream>
+#include <vector>
+#include <set>
 
 #include "RawTile.h"
 #include "IIPImage.h"
@@ -32,6 +34,8 @@
 #include "Cache.h"
 #include "Timer.h"
 #include "Watermark.h"
+#include "Trace.h"
+#include "ThreadPool.h"
 
 
 
@@ -46,10 +50,16 @@ class TileManager{
   JPEGCompressor* jpeg;
   IIPImagePtr image;
   Watermark* watermark;
-  std::ofstream* logfile;
+  std::ostream* logfile;
   int loglevel;
   Timer compression_timer, tile_timer, insert_timer;
 
+  /// Threads that help to compose regions, or NULL to compose them on the calling thread alone
+  ThreadPool* pool;
+
+  /// Keys already looked up in memcached, so that we never ask twice for a missing tile
+  std::set<TileKey> fetched;
+
   /// Get a new tile from the image file
   /**
    *  If the JPEG tile already exists in the cache, use that, otherwise check for
@@ -71,6 +81,36 @@ class TileManager{
   void crop( RawTilePtr t );
 
 
+  /// Look up tiles in memcached in a single round trip and add those found to the tile cache
+  /** @param keys tile keys, from which any we have already looked up are removed
+      @return tiles in the same order as the remaining keys, with empty pointers for those not found
+   */
+  std::vector<RawTilePtr> fetch( std::vector<TileKey>& keys );
+
+
+  /// Copy part of an uncompressed tile into a buffer
+  /**
+   *  Copies from the tile cache if the tile is there. Otherwise the image decodes the part
+   *  straight into the buffer, without the tile being cropped or cached, unless we are asked
+   *  to cache it or must apply a watermark, in which case it is fetched with getTile().
+   *  @param resolution resolution number
+   *  @param tile tile number
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param layers number of quality layers within image to decode
+   *  @param x left offset of the part within the tile
+   *  @param y top offset of the part within the tile
+   *  @param w width of the part
+   *  @param h height of the part
+   *  @param buffer destination of the first pixel of the part
+   *  @param stride bytes from the start of one line of the buffer to the next
+   *  @param cache whether to add a newly decoded tile to the tile cache
+   */
+  void copyTile( int resolution, int tile, int xangle, int yangle, int layers,
+		 unsigned int x, unsigned int y, unsigned int w, unsigned int h,
+		 unsigned char* buffer, size_t stride, bool cache );
+
+
  public:
 
 
@@ -82,14 +122,16 @@ class TileManager{
    * @param j  pointer to JPEGCompressor object
    * @param s  pointer to output file stream
    * @param l  logging level
+   * @param p  pointer to thread pool used to compose regions, or NULL
    */
-  TileManager( TileCache* tc, IIPImagePtr im, Watermark* w, JPEGCompressor* j, std::ofstream* s, int l ){
+  TileManager( TileCache* tc, IIPImagePtr im, Watermark* w, JPEGCompressor* j, std::ofstream* s, int l, ThreadPool* p = NULL ){
     tileCache = tc; 
     image = im;
     watermark = w;
     jpeg = j;
     logfile = s ;
     loglevel = l;
+    pool = p;
   };
 
 
@@ -121,14 +163,32 @@ class TileManager{
    *  @param yangle vertical sequence number
    *  @param layers number of quality layers within image to decode
    *  @param c CompressionType
-   *  @return RawTile pointer.  A COPY of what's in TileCache
+   *  @return RawTile pointer, which may be shared with the tile cache and other requests.
+   *  Call unshare() on it before modifying it
    */
   RawTilePtr getTile( int resolution, int tile, int xangle, int yangle, int layers, CompressionType c );
 
 
+  /// Load tiles that are about to be requested from memcached into the tile cache
+  /**
+   *  Any that are not already in the tile cache are fetched together, so that a request
+   *  for several tiles needs a single round trip rather than one per tile. Does nothing
+   *  if we have no memcached cache.
+   *  @param resolution resolution number
+   *  @param tiles tile numbers
+   *  @param xangle horizontal sequence number
+   *  @param yangle vertical sequence number
+   *  @param c CompressionType in which the tiles will be requested
+   */
+  void preload( int resolution, const std::vector<int>& tiles, int xangle, int yangle, CompressionType c );
+
+
   /// Generate a complete region
   /**
    *  Build up an arbitrary region by extracting tiles from the cache by using getTile function.
+   *  If we have a thread pool, tiles are decoded and copied into the region in parallel.
+   *  Tiles not in the cache are decoded directly into the region and are only cached if
+   *  CACHE_REGION_TILES is set.
    *  Data returned as uncompressed data.
    *  @param res resolution number
    *  @param xangle horizontal sequence number
@@ -0,0 +1,131 @@
+// Member functions for Trace.h
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#include "Trace.h"
+#include <cstdio>
+
+#ifdef WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+
+using namespace std;
+
+
+size_t Trace::capacity = 0;
+atomic<bool> Trace::enabled( false );
+vector<Trace::Ring*> Trace::rings;
+mutex Trace::ringsMutex;
+
+
+
+void Trace::enable( size_t spans ){
+  if( spans == 0 ) return;
+  // The capacity cannot change once threads have created their buffers
+  lock_guard<mutex> lock( ringsMutex );
+  if( rings.empty() ) capacity = spans;
+  enabled = true;
+}
+
+
+
+Trace::Ring* Trace::ring(){
+
+  static thread_local Ring* r = NULL;
+  if( r ) return r;
+
+  r = new Ring;
+  r->slots = new Slot[capacity];
+  r->head = 0;
+
+  lock_guard<mutex> lock( ringsMutex );
+  r->thread = rings.size() + 1;
+  rings.push_back( r );
+  return r;
+}
+
+
+
+void Trace::record( const char* name, uint64_t start, uint64_t end ){
+
+  Ring* r = ring();
+
+  // Only this thread writes to its buffer, so the head needs no read-modify-write
+  unsigned long h = r->head.load( memory_order_relaxed );
+  // Keep our writes to the slot from becoming visible before the previous head
+  atomic_thread_fence( memory_order_release );
+  Slot& s = r->slots[ h % capacity ];
+  s.name.store( name, memory_order_relaxed );
+  s.start.store( start, memory_order_relaxed );
+  s.duration.store( end - start, memory_order_relaxed );
+  r->head.store( h + 1, memory_order_release );
+}
+
+
+
+void Trace::dump( ostream& out ){
+
+  vector<Ring*> all;
+  {
+    lock_guard<mutex> lock( ringsMutex );
+    all = rings;
+  }
+
+  int pid = getpid();
+  bool first = true;
+  char str[1024];
+
+  out << "{\"traceEvents\":[";
+
+  for( vector<Ring*>::const_iterator i = all.begin(); i != all.end(); i++ ){
+
+    Ring* r = *i;
+
+    // Copy the buffer, then drop anything its owner may have overwritten in the meantime
+    unsigned long end = r->head.load( memory_order_acquire );
+    unsigned long begin = ( end > capacity ) ? end - capacity : 0;
+
+    vector<const char*> names;
+    vector<uint64_t> starts, durations;
+    for( unsigned long n = begin; n < end; n++ ){
+      const Slot& s = r->slots[ n % capacity ];
+      names.push_back( s.name.load( memory_order_relaxed ) );
+      starts.push_back( s.start.load( memory_order_relaxed ) );
+      durations.push_back( s.duration.load( memory_order_relaxed ) );
+    }
+
+    atomic_thread_fence( memory_order_acquire );
+    unsigned long now = r->head.load( memory_order_relaxed );
+    if( now >= begin + capacity ) begin = now - capacity + 1;
+
+    for( unsigned long n = begin; n < end; n++ ){
+      size_t k = n - ( end > capacity ? end - capacity : 0 );
+      snprintf( str, 1024, "%s\n{\"name\":\"%s\",\"cat\":\"iipsrv\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%u}",
+		first ? "" : ",", names[k], starts[k] / 1000.0, durations[k] / 1000.0, pid, r->thread );
+      out << str;
+      first = false;
+    }
+  }
+
+  out << "\n],\"displayTimeUnit\":\"ms\"}";
+}
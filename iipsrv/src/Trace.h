@@ -0,0 +1,135 @@
+// Low overhead recording of timed spans
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+#ifndef _TRACE_H
+#define _TRACE_H
+
+
+#include <ostream>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+
+
+/// Records timed spans into a ring buffer per thread, to be dumped in Chrome trace format
+/** Recording a span is a few relaxed atomic stores into a buffer owned by the calling
+    thread: there are no locks, allocations or I/O. Each thread keeps only its most
+    recent spans. The buffers can be read at any time by another thread while they
+    are being written to, in which case spans overwritten during the read are left out.
+ */
+
+class Trace {
+
+ private:
+
+  /// A recorded span
+  struct Slot {
+    std::atomic<const char*> name;
+    std::atomic<uint64_t> start;
+    std::atomic<uint64_t> duration;
+  };
+
+  /// Buffer of spans belonging to a single thread
+  struct Ring {
+    Slot* slots;
+    std::atomic<unsigned long> head;   ///< number of spans ever recorded
+    unsigned int thread;
+  };
+
+  /// Number of spans kept per thread, or 0 if tracing is disabled
+  static size_t capacity;
+
+  /// Whether we are recording
+  static std::atomic<bool> enabled;
+
+  /// The buffers of all threads that have recorded something, which are never freed
+  static std::vector<Ring*> rings;
+  static std::mutex ringsMutex;
+
+  /// Return the buffer of the calling thread, creating it if necessary
+  static Ring* ring();
+
+
+ public:
+
+  /// Start recording
+  /** @param spans number of spans to keep per thread */
+  static void enable( size_t spans );
+
+  /// Whether we are recording
+  static bool isEnabled(){ return enabled.load( std::memory_order_relaxed ); };
+
+  /// Monotonic time in nanoseconds
+  static uint64_t now(){
+    return std::chrono::duration_cast<std::chrono::nanoseconds>
+      ( std::chrono::steady_clock::now().time_since_epoch() ).count();
+  };
+
+  /// Record a span for the calling thread
+  /** @param name name of the span - must be a string literal or otherwise outlive us
+      @param start start time from now()
+      @param end end time from now()
+   */
+  static void record( const char* name, uint64_t start, uint64_t end );
+
+  /// Write out the spans of all threads as a Chrome trace JSON object
+  /** @param out stream to write to */
+  static void dump( std::ostream& out );
+
+};
+
+
+
+/// Records a span covering its own lifetime
+/** Create one on the stack at the start of the work to be measured:
+    TraceSpan span( "decode" );
+ */
+
+class TraceSpan {
+
+ private:
+
+  const char* name;
+  uint64_t start;
+
+ public:
+
+  /// Constructor
+  /** @param n name of the span - must be a string literal */
+  explicit TraceSpan( const char* n ) :
+    name( Trace::isEnabled() ? n : NULL ),
+    start( name ? Trace::now() : 0 ) {};
+
+  /// Destructor - records the span unless end() has already done so
+  ~TraceSpan(){ end(); };
+
+  /// Record the span now, for work that does not end with a scope
+  void end(){
+    if( name ) Trace::record( name, start, Trace::now() );
+    name = NULL;
+  };
+
+};
+
+
+#endif
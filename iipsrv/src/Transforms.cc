@@ -21,6 +21,7 @@
 
 
 #include <cmath>
+#include <algorithm>
 #include "Transforms.h"
 
 
@@ -55,7 +56,10 @@ using namespace std;
 
 
 // Normalization function
-void filter_normalize( RawTilePtr in, vector<float>& max, vector<float>& min ) {
+void filter_normalize( RawTilePtr& in, vector<float>& max, vector<float>& min ) {
+
+  unshare( in );
+
 
   float *normdata;
   unsigned int np = in->dataLength * 8 / in->bpc;
@@ -136,7 +140,10 @@ void filter_normalize( RawTilePtr in, vector<float>& max, vector<float>& min ) {
 
 
 // Hillshading function
-void filter_shade( RawTilePtr in, int h_angle, int v_angle ){
+void filter_shade( RawTilePtr& in, int h_angle, int v_angle ){
+
+  unshare( in );
+
 
   float o_x, o_y, o_z;
 
@@ -292,7 +299,10 @@ static void LAB2sRGB( unsigned char *in, unsigned char *out ){
 
 
 // Convert whole tile from CIELAB to sRGB
-void filter_LAB2sRGB( RawTilePtr in ){
+void filter_LAB2sRGB( RawTilePtr& in ){
+
+  unshare( in );
+
 
   unsigned long np = in->width * in->height * in->channels;
 
@@ -312,7 +322,10 @@ void filter_LAB2sRGB( RawTilePtr in ){
 
 
 // Colormap function
-void filter_cmap( RawTilePtr in, enum cmap_type cmap ){
+void filter_cmap( RawTilePtr& in, enum cmap_type cmap ){
+
+  unshare( in );
+
 
   float value;
   unsigned out_chan = 3;
@@ -394,7 +407,10 @@ void filter_cmap( RawTilePtr in, enum cmap_type cmap ){
 
 
 // Inversion function
-void filter_inv( RawTilePtr in ){
+void filter_inv( RawTilePtr& in ){
+
+  unshare( in );
+
   float* infptr;
   unsigned int np = in->dataLength * 8 / in->bpc;
 
@@ -411,7 +427,10 @@ void filter_inv( RawTilePtr in ){
 
 
 // Resize image using nearest neighbour interpolation
-void filter_interpolate_nearestneighbour( RawTilePtr in, unsigned int resampled_width, unsigned int resampled_height ){
+void filter_interpolate_nearestneighbour( RawTilePtr& in, unsigned int resampled_width, unsigned int resampled_height ){
+
+  unshare( in );
+
 
   // Pointer to input buffer
   unsigned char *input = (unsigned char*) in->data;
@@ -465,7 +484,10 @@ void filter_interpolate_nearestneighbour( RawTilePtr in, unsigned int resampled_
 
 // Resize image using bilinear interpolation
 //  - Floating point implementation which benchmarks about 2.5x slower than nearest neighbour
-void filter_interpolate_bilinear( RawTilePtr in, unsigned int resampled_width, unsigned int resampled_height ){
+void filter_interpolate_bilinear( RawTilePtr& in, unsigned int resampled_width, unsigned int resampled_height ){
+
+  unshare( in );
+
 
   // Pointer to input buffer
   unsigned char *input = (unsigned char*) in->data;
@@ -532,8 +554,225 @@ void filter_interpolate_bilinear( RawTilePtr in, unsigned int resampled_width, u
 
 
 
+// Return the index within a band of lines of a line of the whole image, limited to the band
+static inline unsigned int band_line( int line, unsigned int top, unsigned int lines ){
+  line -= (int) top;
+  if( line < 0 ) return 0;
+  if( line >= (int) lines ) return lines - 1;
+  return line;
+}
+
+
+
+// Resize a strip of an image using nearest neighbour interpolation
+void filter_interpolate_nearestneighbour( const RawTilePtr& in, unsigned int top, unsigned int height,
+					  RawTilePtr& out, unsigned int first, unsigned int resampled_height ){
+
+  unsigned char *input = (unsigned char*) in->data;
+  unsigned char *output = (unsigned char*) out->data;
+
+  int channels = in->channels;
+  unsigned int width = in->width;
+  unsigned int resampled_width = out->width;
+
+  // Calculate our scale over the whole image
+  float xscale = (float)width / (float)resampled_width;
+  float yscale = (float)height / (float)resampled_height;
+
+  for( unsigned int j=0; j<out->height; j++ ){
+
+    // Index of the input line within our band
+    unsigned int jj = band_line( (int) floorf((first+j)*yscale), top, in->height );
+
+    for( unsigned int i=0; i<resampled_width; i++ ){
+      unsigned int ii = (unsigned int) floorf(i*xscale);
+      unsigned int pyramid_index = (unsigned int) channels * ( ii + jj*width );
+      unsigned int resampled_index = (i + j*resampled_width)*channels;
+      for( int k=0; k<channels; k++ ){
+	output[resampled_index+k] = input[pyramid_index+k];
+      }
+    }
+  }
+}
+
+
+
+// Resize a strip of an image using bilinear interpolation
+void filter_interpolate_bilinear( const RawTilePtr& in, unsigned int top, unsigned int height,
+				  RawTilePtr& out, unsigned int first, unsigned int resampled_height ){
+
+  unsigned char *input = (unsigned char*) in->data;
+  unsigned char *output = (unsigned char*) out->data;
+
+  int channels = in->channels;
+  unsigned int width = in->width;
+  unsigned int resampled_width = out->width;
+
+  // Calculate our scale over the whole image
+  float xscale = (float)(width-1) / (float)resampled_width;
+  float yscale = (float)(height-1) / (float)resampled_height;
+
+  // Index for our output buffer
+  unsigned int resampled_index = 0;
+
+  for( unsigned int j=first; j<first+out->height; j++ ){
+
+    // Index to the current pyramid resolution's top left pixel
+    int jj = (int) floor( j*yscale );
+
+    // Calculate some weights - do this in the highest loop possible
+    float jscale = j*yscale;
+    float c = (float)(jj+1) - jscale;
+    float d = jscale - (float)jj;
+
+    // The two input lines within our band
+    unsigned int j1 = band_line( jj, top, in->height );
+    unsigned int j2 = band_line( jj+1, top, in->height );
+
+    for( unsigned int i=0; i<resampled_width; i++ ){
+
+      // Index to the current pyramid resolution's top left pixel
+      int ii = (int) floor( i*xscale );
+
+      // Calculate the indices of the 4 surrounding pixels
+      unsigned int p11, p12, p21, p22;
+      p11 = (unsigned int) ( channels * ( ii + j1*width ) );
+      p12 = (unsigned int) ( channels * ( ii + j2*width ) );
+      p21 = (unsigned int) ( channels * ( (ii+1) + j1*width ) );
+      p22 = (unsigned int) ( channels * ( (ii+1) + j2*width ) );
+
+      // Calculate the rest of our weights
+      float iscale = i*xscale;
+      float a = (float)(ii+1) - iscale;
+      float b = iscale - (float)ii;
+
+      for( int k=0; k<channels; k++ ){
+	float tx = input[p11+k]*a + input[p21+k]*b;
+	float ty = input[p12+k]*a + input[p22+k]*b;
+	unsigned char r = (unsigned char)( c*tx + d*ty );
+	output[resampled_index++] = r;
+      }
+    }
+  }
+}
+
+
+
+// Resize a strip of an image by area averaging
+//  - Separable: each input line is first resized horizontally into a float buffer, and lines are
+//    then summed, weighted by how much of each output line they cover
+void filter_interpolate_area( const RawTilePtr& in, unsigned int top, unsigned int height,
+			      RawTilePtr& out, unsigned int first, unsigned int resampled_height ){
+
+  unsigned char *input = (unsigned char*) in->data;
+  unsigned char *output = (unsigned char*) out->data;
+
+  int channels = in->channels;
+  unsigned int width = in->width;
+  unsigned int resampled_width = out->width;
+  unsigned int line = resampled_width * channels;
+
+  // Calculate our scale over the whole image
+  float xscale = (float)width / (float)resampled_width;
+  float yscale = (float)height / (float)resampled_height;
+
+  // The input columns covered by each output column and their weights, which sum to 1
+  vector<unsigned int> xstart( resampled_width ), xcount( resampled_width );
+  vector<float> xweights;
+  for( unsigned int i=0; i<resampled_width; i++ ){
+    float x0 = i*xscale;
+    float x1 = std::min( x0 + xscale, (float) width );
+    unsigned int ii = (unsigned int) floorf( x0 );
+    xstart[i] = ii;
+    xcount[i] = 0;
+    for( ; ii < width && (float)ii < x1; ii++ ){
+      float w = std::min( x1, (float)(ii+1) ) - std::max( x0, (float)ii );
+      if( w <= 0 ) continue;
+      xweights.push_back( w / (x1 - x0) );
+      xcount[i]++;
+    }
+    if( xcount[i] == 0 ){
+      xstart[i] = std::min( ii, width-1 );
+      xweights.push_back( 1.0 );
+      xcount[i] = 1;
+    }
+  }
+
+  // The current input line resized horizontally, and the sum for the current output line
+  vector<float> row( line ), sum( line );
+  int resized = -1;
+
+  for( unsigned int j=0; j<out->height; j++ ){
+
+    float y0 = (first+j)*yscale;
+    float y1 = std::min( y0 + yscale, (float) height );
+
+    std::fill( sum.begin(), sum.end(), 0.0f );
+    float total = 0.0;
+
+    for( unsigned int jj = (unsigned int) floorf( y0 ); jj < height && (float)jj < y1; jj++ ){
+
+      float wy = std::min( y1, (float)(jj+1) ) - std::max( y0, (float)jj );
+      if( wy <= 0 ) continue;
+
+      // Resize this input line unless we did so for the previous output line
+      if( (int) jj != resized ){
+	const unsigned char* src = &input[ band_line( jj, top, in->height ) * width * channels ];
+	const float* weight = &xweights[0];
+	for( unsigned int i=0; i<resampled_width; i++ ){
+	  const unsigned char* p = &src[ xstart[i] * channels ];
+	  for( int k=0; k<channels; k++ ){
+	    float v = 0.0;
+	    for( unsigned int n=0; n<xcount[i]; n++ ) v += weight[n] * p[n*channels + k];
+	    row[i*channels + k] = v;
+	  }
+	  weight += xcount[i];
+	}
+	resized = jj;
+      }
+
+      // Add it to our output line
+      float* s = &sum[0];
+      const float* r = &row[0];
+#pragma ivdep
+      for( unsigned int n=0; n<line; n++ ) s[n] += wy * r[n];
+      total += wy;
+    }
+
+    // Normalise, round and clip to 8 bit
+    float norm = ( total > 0 ) ? 1.0 / total : 0.0;
+    unsigned char* o = &output[ j * line ];
+#pragma ivdep
+    for( unsigned int n=0; n<line; n++ ){
+      float v = sum[n] * norm + 0.5f;
+      o[n] = (unsigned char) ( v > 255.0f ? 255.0f : v );
+    }
+  }
+}
+
+
+
+// Resize image by area averaging
+void filter_interpolate_area( RawTilePtr& in, unsigned int resampled_width, unsigned int resampled_height ){
+
+  RawTilePtr out( new RawTile( in->tileNum, in->resolution, in->hSequence, in->vSequence,
+			       resampled_width, resampled_height, in->channels, 8 ) );
+  out->dataLength = resampled_width * resampled_height * in->channels;
+  out->data = new unsigned char[out->dataLength];
+  out->sampleType = in->sampleType;
+
+  filter_interpolate_area( in, 0, in->height, out, 0, resampled_height );
+
+  in = out;
+}
+
+
+
 // Function to apply a contrast adjustment and clip to 8 bit
-void filter_contrast( RawTilePtr in, float c ){
+void filter_contrast( RawTilePtr& in, float c ){
+
+  unshare( in );
+
 
   unsigned int np = in->dataLength * 8 / in->bpc;
 
@@ -557,13 +796,16 @@ void filter_contrast( RawTilePtr in, float c ){
 
 
 // Gamma correction
-void filter_gamma( RawTilePtr in, float g ){
+void filter_gamma( RawTilePtr& in, float g ){
+
+  if( g == 1.0 ) return;
+
+  unshare( in );
+
 
   float* infptr;
   unsigned int np = in->dataLength * 8 / in->bpc;
 
-  if( g == 1.0 ) return;
-
   infptr = (float*)in->data;
 
   // Loop through our pixels for floating values 
@@ -577,11 +819,13 @@ void filter_gamma( RawTilePtr in, float g ){
 
 
 // Rotation function
-void filter_rotate( RawTilePtr in, float angle=0.0 ){
+void filter_rotate( RawTilePtr& in, float angle=0.0 ){
 
   // Currently implemented only for rectangular rotations
   if( (int)angle % 90 == 0 && (int)angle % 360 != 0 ){
 
+    unshare( in );
+
     // Intialize our counter
     unsigned int n = 0;
 
@@ -642,10 +886,12 @@ void filter_rotate( RawTilePtr in, float angle=0.0 ){
 // Convert colour to grayscale using the conversion formula:
 //   Luminance = 0.2126*R + 0.7152*G + 0.0722*B
 // Note that we don't linearize before converting
-void filter_greyscale( RawTilePtr rawtile ){
+void filter_greyscale( RawTilePtr& rawtile ){
 
   if( rawtile->bpc != 8 || rawtile->channels != 3 ) return;
 
+  unshare( rawtile );
+
   unsigned int np = rawtile->width * rawtile->height;
   unsigned char* buffer = new unsigned char[rawtile->width * rawtile->height];
 
@@ -671,7 +917,10 @@ void filter_greyscale( RawTilePtr rawtile ){
 
 
 // Apply twist or channel recombination to colour or multi-channel image
-void filter_twist( RawTilePtr rawtile, const vector< vector<float> >& matrix ){
+void filter_twist( RawTilePtr& rawtile, const vector< vector<float> >& matrix ){
+
+  unshare( rawtile );
+
 
   unsigned long np = rawtile->width * rawtile->height;
   unsigned long n = 0;
@@ -716,11 +965,13 @@ void filter_twist( RawTilePtr rawtile, const vector< vector<float> >& matrix ){
 
 // Flatten a multi-channel image to a given number of bands by simply stripping
 // away extra bands
-void filter_flatten( RawTilePtr in, int bands ){
+void filter_flatten( RawTilePtr& in, int bands ){
 
   // We cannot increase the number of channels
   if( bands >= in->channels ) return;
 
+  unshare( in );
+
   unsigned long np = in->width * in->height;
   unsigned long ni = 0;
   unsigned long no = 0;
@@ -741,7 +992,10 @@ void filter_flatten( RawTilePtr in, int bands ){
 
 
 // Flip image in horizontal or vertical direction (0=horizontal,1=vertical)
-void filter_flip( RawTilePtr in, int orientation ){
+void filter_flip( RawTilePtr& in, int orientation ){
+
+  unshare( in );
+
 
   unsigned char* buffer = new unsigned char[in->width * in->height * in->channels];
   unsigned long n = 0;
@@ -30,7 +30,7 @@
     @param min : vector of minima
     @param max : vector of maxima
 */
-void filter_normalize( RawTilePtr in, std::vector<float>& max, std::vector<float>& min );
+void filter_normalize( RawTilePtr& in, std::vector<float>& max, std::vector<float>& min );
 
 /// Function to apply colormap to gray images
 ///   based on the routine colormap.cpp in Imagin Raytracer by Olivier Ferrand
@@ -39,12 +39,12 @@ void filter_normalize( RawTilePtr in, std::vector<float>& max, std::vector<float
     @param cmap color map to apply.
 */
 enum cmap_type { HOT, COLD, JET, BLUE, GREEN, RED };
-void filter_cmap( RawTilePtr in, enum cmap_type cmap );
+void filter_cmap( RawTilePtr& in, enum cmap_type cmap );
 
 /// Function to invert colormaps
 /** @param in tile data to be adjusted
 */
-void filter_inv( RawTilePtr in );
+void filter_inv( RawTilePtr& in );
 
 
 /// Hillshading function to simulate raking light images
@@ -52,26 +52,26 @@ void filter_inv( RawTilePtr in );
     @param h_angle angle in the horizontal plane from  12 o'clock in degrees
     @param v_angle angle in the vertical plane in degrees. 0 is flat, 90 pointing directly down.
 */
-void filter_shade( RawTilePtr in, int h_angle, int v_angle );
+void filter_shade( RawTilePtr& in, int h_angle, int v_angle );
 
 
 /// Convert from CIELAB to sRGB colour space
 /** @param in tile data to be converted */
-void filter_LAB2sRGB( RawTilePtr in );
+void filter_LAB2sRGB( RawTilePtr& in );
 
 
 /// Function to apply a contrast adjustment and clip to 8 bit
 /** @param in tile data to be adjusted
     @param c contrast value
 */
-void filter_contrast( RawTilePtr in, float c );
+void filter_contrast( RawTilePtr& in, float c );
 
 
 /// Apply a gamma correction
 /** @param in tile input data
     @param g gamma
 */
-void filter_gamma( RawTilePtr in, float g );
+void filter_gamma( RawTilePtr& in, float g );
 
 
 /// Resize image using nearest neighbour interpolation
@@ -79,7 +79,7 @@ void filter_gamma( RawTilePtr in, float g );
     @param w target width
     @param h target height
 */
-void filter_interpolate_nearestneighbour( RawTilePtr in, unsigned int w, unsigned int h );
+void filter_interpolate_nearestneighbour( RawTilePtr& in, unsigned int w, unsigned int h );
 
 
 /// Resize image using bilinear interpolation
@@ -87,7 +87,55 @@ void filter_interpolate_nearestneighbour( RawTilePtr in, unsigned int w, unsigne
     @param w target width
     @param h target height
 */
-void filter_interpolate_bilinear( RawTilePtr in, unsigned int w, unsigned int h );
+void filter_interpolate_bilinear( RawTilePtr& in, unsigned int w, unsigned int h );
+
+
+/// Resize image by averaging the area of the input covered by each output pixel
+/** Unlike interpolation, every input pixel contributes, which avoids aliasing for large reductions
+    @param in tile input data
+    @param w target width
+    @param h target height
+*/
+void filter_interpolate_area( RawTilePtr& in, unsigned int w, unsigned int h );
+
+
+/// Resize a strip of an image using nearest neighbour interpolation
+/** Allows an image to be resized a strip at a time, holding only the input lines each strip needs
+    @param in lines of the input image, left unchanged
+    @param top index within the input image of the first line held
+    @param height height of the whole input image
+    @param out strip of the output image to fill, with its size, channels and buffer set
+    @param first index within the output image of the first line of the strip
+    @param h height of the whole output image
+*/
+void filter_interpolate_nearestneighbour( const RawTilePtr& in, unsigned int top, unsigned int height,
+					  RawTilePtr& out, unsigned int first, unsigned int h );
+
+
+/// Resize a strip of an image using bilinear interpolation
+/** Allows an image to be resized a strip at a time, holding only the input lines each strip needs
+    @param in lines of the input image, left unchanged
+    @param top index within the input image of the first line held
+    @param height height of the whole input image
+    @param out strip of the output image to fill, with its size, channels and buffer set
+    @param first index within the output image of the first line of the strip
+    @param h height of the whole output image
+*/
+void filter_interpolate_bilinear( const RawTilePtr& in, unsigned int top, unsigned int height,
+				  RawTilePtr& out, unsigned int first, unsigned int h );
+
+
+/// Resize a strip of an image by area averaging
+/** Allows an image to be resized a strip at a time, holding only the input lines each strip needs
+    @param in lines of the input image, left unchanged
+    @param top index within the input image of the first line held
+    @param height height of the whole input image
+    @param out strip of the output image to fill, with its size, channels and buffer set
+    @param first index within the output image of the first line of the strip
+    @param h height of the whole output image
+*/
+void filter_interpolate_area( const RawTilePtr& in, unsigned int top, unsigned int height,
+			      RawTilePtr& out, unsigned int first, unsigned int h );
 
 
 /// Rotate image - currently only by 90, 180 or 270 degrees, other values will do nothing
@@ -95,33 +143,33 @@ void filter_interpolate_bilinear( RawTilePtr in, unsigned int w, unsigned int h
     @param angle angle of rotation - currently only rotations by 90, 180 and 270 degrees
     are suported, for other values, no rotation will occur
 */
-void filter_rotate( RawTilePtr in, float angle );
+void filter_rotate( RawTilePtr& in, float angle );
 
 
 /// Convert image to grayscale
 /** @param in input image */
-void filter_greyscale( RawTilePtr in );
+void filter_greyscale( RawTilePtr& in );
 
 
 /// Apply a color twist
 /** @param in input image
     @param ctw 2D color twist matrix
 */
-void filter_twist( RawTilePtr in, const std::vector< std::vector<float> >& ctw );
+void filter_twist( RawTilePtr& in, const std::vector< std::vector<float> >& ctw );
 
 
 /// Extract bands
 /** @param in input image
     @param bands number of bands
 */
-void filter_flatten( RawTilePtr in, int bands );
+void filter_flatten( RawTilePtr& in, int bands );
 
 
 ///Flip image
 /** @param in input image
     @param o orientation (0=horizontal,1=vertical)
 */
-void filter_flip( RawTilePtr in, int o );
+void filter_flip( RawTilePtr& in, int o );
 
 
 #endif
@@ -25,6 +25,9 @@
 
 #include <fcgiapp.h>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
 
 
 /// Virtual base class for various writers
@@ -53,10 +56,15 @@ class Writer {
 
 };
 
+inline Writer::~Writer(){}
+
 
 
 /// FCGI Writer Class
-class FCGIWriter {
+/** Output is passed straight to the FCGI stream. A copy of the whole response is
+    only kept if requested, for storing in memcached.
+ */
+class FCGIWriter : public Writer {
 
  private:
 
@@ -64,25 +72,48 @@ class FCGIWriter {
   FCGX_Stream *out;
   static const unsigned int bufsize = 65536;
 
-  /// Add the message to our buffer
+  /// Whether to keep a copy of the response and the allocated size of our copy
+  bool keep;
+  size_t capacity;
+
+  /// Add the message to our buffer if we are keeping a copy
   void cpy2buf( const char* msg, size_t len ){
-    if( sz+len > bufsize ) buffer = (char*) realloc( buffer, sz+len );
-    if( buffer ){
-      memcpy( &buffer[sz], msg, len );
-      sz += len;
+    if( !keep ) return;
+    if( sz+len > capacity ){
+      size_t c = capacity ? capacity : bufsize;
+      while( c < sz+len ) c *= 2;
+      char* b = (char*) realloc( buffer, c );
+      // Give up on our copy rather than storing a truncated response
+      if( !b ){
+	free( buffer );
+	buffer = NULL;
+	sz = capacity = 0;
+	keep = false;
+	return;
+      }
+      buffer = b;
+      capacity = c;
     }
+    memcpy( &buffer[sz], msg, len );
+    sz += len;
   };
 
 
  public:
 
+  /// Copy of the response or NULL if we are not keeping one
   char* buffer;
   size_t sz;
 
   /// Constructor
-  FCGIWriter( FCGX_Stream* o ){
+  /** @param o FCGI output stream
+      @param k whether to keep a copy of the response in buffer
+   */
+  FCGIWriter( FCGX_Stream* o, bool k = false ){
     out = o;
-    buffer = (char*) malloc(bufsize);
+    keep = k;
+    capacity = 0;
+    buffer = NULL;
     sz = 0;
   };
 
@@ -98,8 +129,10 @@ class FCGIWriter {
     return FCGX_PutS( msg, out );
   }
   int printf( const char* msg ){
-    cpy2buf( msg, strlen(msg) );
-    return FCGX_FPrintF( out, msg );
+    // Write the message as it is, as it may contain '%' characters
+    size_t len = strlen( msg );
+    cpy2buf( msg, len );
+    return FCGX_PutStr( msg, len, out );
   };
   int flush(){
     return FCGX_FFlush( out );
@@ -110,7 +143,7 @@ class FCGIWriter {
 
 
 /// File Writer Class
-class FileWriter {
+class FileWriter : public Writer {
 
  private:
 
@@ -134,6 +167,37 @@ class FileWriter {
   };
 
 };
+
+
+
+/// HTTP Writer Class
+/** Collects the complete CGI style response, which is then sent by HTTPServer
+    with an HTTP status line and a Content-Length header
+ */
+class HTTPWriter : public Writer {
+
+ public:
+
+  std::string buffer;
+
+  int putStr( const char* msg, int len ){
+    buffer.append( msg, len );
+    return len;
+  };
+  int putS( const char* msg ){
+    buffer.append( msg );
+    return 0;
+  }
+  int printf( const char* msg ){
+    size_t len = strlen( msg );
+    buffer.append( msg, len );
+    return (int) len;
+  };
+  int flush(){
+    return 0;
+  };
+
+};
   
 
 
@@ -0,0 +1,191 @@
+// Tile cache contention benchmark
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/*  Measures the throughput of getObject() and insert() on the tile cache from 1 to 64
+    threads, both with a single shard, as the cache used to be, and with TILE_CACHE_SHARDS
+    shards. Each thread looks up tiles at random, 80% of the time from a hot fifth of the
+    tiles, and inserts those it misses. The cache holds half of the tiles, so that misses
+    also exercise eviction.
+
+    Build with "make cachebench" and run as:
+
+      cachebench [seconds per run] [max threads] [policy: clock or tinylfu]
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <chrono>
+
+#include "Cache.h"
+
+
+using namespace std;
+
+
+/// Number of distinct tiles looked up
+#define CACHEBENCH_TILES 65536
+
+/// Size in bytes accounted for each tile
+#define CACHEBENCH_TILE_SIZE TILE_CACHE_MEAN_TILE_SIZE
+
+/// Percentage of lookups that go to the hot fifth of the tiles
+#define CACHEBENCH_HOT_PERCENT 80
+
+
+
+/// Tile cache with the same accounting as TileCache, but any number of shards and no second tiers
+class BenchCache : public Cache<TileKey, RawTile> {
+
+ protected:
+
+  typedef Cache<TileKey, RawTile> BaseCacheType;
+
+  virtual size_t getRecordSize( const TileKey &key, const RawTilePtr val ) {
+    return val->dataLength + sizeof( RawTile );
+  }
+
+  virtual TileKey getIndex( const RawTilePtr r ) {
+    return TileKey( r->imageId ? r->imageId : TileKey::intern( r->filename ), r->resolution, r->tileNum,
+		    r->hSequence, r->vSequence, r->compressionType, r->quality );
+  }
+
+  virtual time_t getTimestamp( const RawTilePtr r ) {
+    return r->timestamp;
+  }
+
+ public:
+
+  BenchCache( size_t max, unsigned int shards, CachePolicy policy ) :
+    BaseCacheType( max, shards, policy, max / CACHEBENCH_TILE_SIZE ) {};
+
+  virtual float getMemorySize() {
+    return getSize() / (1024.0 * 1024.0);
+  }
+
+};
+
+
+
+/// Simple per-thread random number generator (xorshift)
+static inline uint32_t next( uint32_t& state ){
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+
+
+/// Run one measurement
+/** @return operations per second */
+static double run( const vector<RawTilePtr>& tiles, const vector<TileKey>& keys,
+		   unsigned int shards, CachePolicy policy, unsigned int threads, double seconds,
+		   double& hit_rate ){
+
+  // Room for half of the tiles
+  size_t max = (size_t) CACHEBENCH_TILES / 2 * ( CACHEBENCH_TILE_SIZE + sizeof( RawTile ) );
+  BenchCache cache( max, shards, policy );
+
+  // Start with the cache full
+  for( unsigned int i = 0; i < CACHEBENCH_TILES / 2; i++ ) cache.insert( tiles[i] );
+
+  atomic<bool> start( false ), stop( false );
+  atomic<unsigned long> operations( 0 ), hits( 0 );
+  vector<thread> workers;
+
+  for( unsigned int t = 0; t < threads; t++ ){
+    workers.push_back( thread( [&,t](){
+      uint32_t state = 2463534242u + 7919 * t;
+      unsigned long n = 0, h = 0;
+      while( !start.load() );
+      while( !stop.load( memory_order_relaxed ) ){
+	// Check for the end of the run every so often
+	for( int k = 0; k < 256; k++ ){
+	  uint32_t r = next( state );
+	  unsigned int i = ( r % 100 < CACHEBENCH_HOT_PERCENT ) ?
+	    ( r >> 8 ) % ( CACHEBENCH_TILES / 5 ) : ( r >> 8 ) % CACHEBENCH_TILES;
+	  if( cache.getObject( keys[i] ) ) h++;
+	  else cache.insert( tiles[i] );
+	  n++;
+	}
+      }
+      operations += n;
+      hits += h;
+    } ) );
+  }
+
+  chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+  start = true;
+  this_thread::sleep_for( chrono::duration<double>( seconds ) );
+  stop = true;
+  for( vector<thread>::iterator w = workers.begin(); w != workers.end(); ++w ) w->join();
+  double elapsed = chrono::duration<double>( chrono::steady_clock::now() - begin ).count();
+
+  hit_rate = operations ? (double) hits / operations : 0.0;
+  return operations / elapsed;
+}
+
+
+
+int main( int argc, char *argv[] ){
+
+  double seconds = ( argc > 1 ) ? atof( argv[1] ) : 1.0;
+  unsigned int max_threads = ( argc > 2 ) ? atoi( argv[2] ) : 64;
+  CachePolicy policy = ( argc > 3 && strcmp( argv[3], "tinylfu" ) == 0 ) ? CACHE_TINYLFU : CACHE_CLOCK;
+
+  if( seconds <= 0 || max_threads == 0 ){
+    fprintf( stderr, "Usage: %s [seconds per run] [max threads] [clock|tinylfu]\n", argv[0] );
+    return 1;
+  }
+
+  // The tiles only account for their size, so need no pixel data
+  string path = "/cachebench.tif";
+  uint32_t image = TileKey::intern( path );
+  vector<RawTilePtr> tiles;
+  vector<TileKey> keys;
+  for( unsigned int i = 0; i < CACHEBENCH_TILES; i++ ){
+    RawTilePtr tile( new RawTile( i, 0, 0, 0, 256, 256, 3, 8 ) );
+    tile->filename = path;
+    tile->imageId = image;
+    tile->dataLength = CACHEBENCH_TILE_SIZE;
+    tiles.push_back( tile );
+    keys.push_back( TileCache::getIndex( image, 0, i, 0, 0, UNCOMPRESSED, 0 ) );
+  }
+
+  printf( "%s policy, %u tiles, %u hardware threads, %.1fs per run\n\n",
+	  policy == CACHE_TINYLFU ? "tinylfu" : "clock", CACHEBENCH_TILES,
+	  thread::hardware_concurrency(), seconds );
+  printf( "%8s %16s %16s %8s %10s\n", "threads", "1 shard ops/s", "sharded ops/s", "speedup", "hit rate" );
+
+  for( unsigned int threads = 1; threads <= max_threads; threads *= 2 ){
+    double hit_rate;
+    double single = run( tiles, keys, 1, policy, threads, seconds, hit_rate );
+    double sharded = run( tiles, keys, TILE_CACHE_SHARDS, policy, threads, seconds, hit_rate );
+    printf( "%8u %16.0f %16.0f %7.2fx %9.1f%%\n", threads, single, sharded, sharded / single, hit_rate * 100.0 );
+  }
+
+  return 0;
+}
@@ -0,0 +1,272 @@
+// Tile cache eviction policy replay
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/*  Replays a sequence of tile requests against the tile cache with each eviction policy
+    (see CachePolicy) and reports the hit rates. Each request is looked up in the cache
+    and inserted if it is missed, as TileManager does. The cache is sharded and sized
+    in the same way as the server's for the same TILE_CACHE_SIZE.
+
+    Build with "make cachereplay" and run as:
+
+      cachereplay <cache size in MB> [trace file, or - for standard input]
+
+    The trace has one request per line, in either of two forms:
+
+      - a tile: "<image path> <resolution> <tile number> [<size in bytes>]", where the
+        path has no spaces and the size defaults to TILE_CACHE_MEAN_TILE_SIZE
+
+      - any line that contains an IIP query with FIF and JTL, such as a web server access
+        log, so that a log can be replayed directly with, for example:
+
+          zcat access.log.gz | cachereplay 64 -
+
+    Empty lines, lines starting with # and lines in neither form are skipped. Without a
+    trace, a synthetic one is replayed: a skewed working set of CACHEREPLAY_HOT tiles
+    that viewers keep coming back to, interleaved with a sequential export that reads
+    CACHEREPLAY_SCAN tiles once each. Only the working set can be hit, so the best
+    possible hit rate is CACHEREPLAY_HOT_PERCENT percent.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <vector>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include "Cache.h"
+#include "URL.h"
+
+
+using namespace std;
+
+
+/// Number of tiles in the synthetic working set
+#define CACHEREPLAY_HOT 400
+
+/// Number of tiles read by the synthetic export
+#define CACHEREPLAY_SCAN 200000
+
+/// Percentage of synthetic requests that go to the working set
+#define CACHEREPLAY_HOT_PERCENT 50
+
+
+
+/// Tile cache with the same accounting as TileCache, but no second tiers
+class ReplayCache : public Cache<TileKey, RawTile> {
+
+ protected:
+
+  typedef Cache<TileKey, RawTile> BaseCacheType;
+
+  virtual size_t getRecordSize( const TileKey &key, const RawTilePtr val ) {
+    return val->dataLength + val->filename.capacity() + sizeof( RawTile ) + sizeof( Entry );
+  }
+
+  virtual TileKey getIndex( const RawTilePtr r ) {
+    return TileKey( r->imageId, r->resolution, r->tileNum,
+		    r->hSequence, r->vSequence, r->compressionType, r->quality );
+  }
+
+  virtual time_t getTimestamp( const RawTilePtr r ) {
+    return r->timestamp;
+  }
+
+ public:
+
+  ReplayCache( size_t max, CachePolicy policy ) :
+    BaseCacheType( max, TileCache::shardsFor( max ), policy, max / TILE_CACHE_MEAN_TILE_SIZE ) {};
+
+  virtual float getMemorySize() {
+    return getSize() / (1024.0 * 1024.0);
+  }
+
+};
+
+
+
+/// A single tile request
+struct Request {
+  TileKey key;
+  size_t size;
+};
+
+
+
+/// Find the value of a query parameter in a line, ignoring the case of its name
+/** @return the value up to the next &, space or quote, or an empty string if there is none */
+static string parameter( const string& line, const string& lower, const char* name ){
+  string match = string( name ) + "=";
+  for( size_t n = lower.find( match ); n != string::npos; n = lower.find( match, n + 1 ) ){
+    // The name must start the query or follow a separator
+    if( n > 0 && lower[n-1] != '?' && lower[n-1] != '&' && !isspace( (unsigned char) lower[n-1] ) ) continue;
+    size_t start = n + match.length();
+    size_t end = line.find_first_of( "& \t\"", start );
+    return line.substr( start, end == string::npos ? string::npos : end - start );
+  }
+  return string();
+}
+
+
+
+/// Parse a trace line
+/** @return whether the line holds a request */
+static bool parse( const string& line, Request& request ){
+
+  if( line.empty() || line[0] == '#' ) return false;
+
+  string path;
+  int resolution, tile;
+  request.size = TILE_CACHE_MEAN_TILE_SIZE;
+
+  string lower = line;
+  transform( lower.begin(), lower.end(), lower.begin(), ::tolower );
+
+  string fif = parameter( line, lower, "fif" );
+  string jtl = parameter( line, lower, "jtl" );
+
+  if( !fif.empty() && !jtl.empty() ){
+    // An IIP query from a log
+    path = URL( fif ).decode();
+    if( sscanf( URL( jtl ).decode().c_str(), "%d,%d", &resolution, &tile ) != 2 ) return false;
+  }
+  else{
+    // A tile
+    istringstream fields( line );
+    if( !( fields >> path >> resolution >> tile ) ) return false;
+    size_t size;
+    if( fields >> size ) request.size = size;
+  }
+
+  if( path.empty() || resolution < 0 || tile < 0 ) return false;
+  request.key = TileCache::getIndex( TileKey::intern( path ), resolution, tile, 0, 0, JPEG, 0 );
+  return true;
+}
+
+
+
+/// Simple random number generator (xorshift)
+static inline uint32_t next( uint32_t& state ){
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+
+
+/// Make the synthetic trace
+static void synthesise( vector<Request>& requests ){
+
+  uint32_t hot = TileKey::intern( "/viewer.tif" );
+  uint32_t scan = TileKey::intern( "/export.tif" );
+  uint32_t state = 2463534242u;
+
+  for( unsigned int n = 0; n < CACHEREPLAY_SCAN; ){
+    Request request;
+    request.size = TILE_CACHE_MEAN_TILE_SIZE;
+    uint32_t r = next( state );
+    if( r % 100 < CACHEREPLAY_HOT_PERCENT ){
+      // Skewed towards the lowest tiles, as are the overviews viewers start from
+      unsigned int a = ( r >> 8 ) % CACHEREPLAY_HOT, b = ( r >> 16 ) % CACHEREPLAY_HOT;
+      request.key = TileCache::getIndex( hot, 0, min( a, b ), 0, 0, JPEG, 0 );
+    }
+    else request.key = TileCache::getIndex( scan, 0, n++, 0, 0, JPEG, 0 );
+    requests.push_back( request );
+  }
+}
+
+
+
+/// Replay the requests with one policy
+static void replay( const vector<Request>& requests, size_t max, CachePolicy policy, const char* name ){
+
+  ReplayCache cache( max, policy );
+  unsigned long hits = 0;
+  unsigned long long bytes = 0, hit_bytes = 0;
+
+  for( vector<Request>::const_iterator r = requests.begin(); r != requests.end(); ++r ){
+    bytes += r->size;
+    if( cache.getObject( r->key ) ){
+      hits++;
+      hit_bytes += r->size;
+      continue;
+    }
+    RawTilePtr tile( new RawTile( r->key.tile, r->key.resolution, 0, 0, 256, 256, 3, 8 ) );
+    tile->filename = TileKey::path( r->key.image );
+    tile->imageId = r->key.image;
+    tile->compressionType = JPEG;
+    tile->dataLength = r->size;
+    cache.insert( tile );
+  }
+
+  printf( "%-8s %12lu %12lu %9.3f %10.3f\n", name, (unsigned long) requests.size(), hits,
+	  requests.empty() ? 0.0 : (double) hits / requests.size(),
+	  bytes ? (double) hit_bytes / bytes : 0.0 );
+}
+
+
+
+int main( int argc, char *argv[] ){
+
+  double mb = ( argc > 1 ) ? atof( argv[1] ) : 0.0;
+
+  if( argc < 2 || argc > 3 || mb <= 0 ){
+    fprintf( stderr, "Usage: %s <cache size in MB> [trace file, or - for standard input]\n", argv[0] );
+    return 1;
+  }
+
+  vector<Request> requests;
+  unsigned long skipped = 0;
+
+  if( argc > 2 ){
+    ifstream file;
+    if( strcmp( argv[2], "-" ) != 0 ){
+      file.open( argv[2] );
+      if( !file ){
+	fprintf( stderr, "Unable to open trace %s\n", argv[2] );
+	return 1;
+      }
+    }
+    istream& in = file.is_open() ? static_cast<istream&>( file ) : cin;
+    string line;
+    Request request;
+    while( getline( in, line ) ){
+      if( parse( line, request ) ) requests.push_back( request );
+      else if( !line.empty() && line[0] != '#' ) skipped++;
+    }
+  }
+  else synthesise( requests );
+
+  size_t max = (size_t) ( mb * 1024.0 * 1024.0 );
+  printf( "%.1fMB cache in %u shards, %lu requests", mb, TileCache::shardsFor( max ), (unsigned long) requests.size() );
+  if( skipped ) printf( ", %lu lines skipped", skipped );
+  printf( "\n\n%-8s %12s %12s %9s %10s\n", "policy", "requests", "hits", "hit rate", "byte rate" );
+
+  replay( requests, max, CACHE_CLOCK, "clock" );
+  replay( requests, max, CACHE_TINYLFU, "tinylfu" );
+
+  return 0;
+}
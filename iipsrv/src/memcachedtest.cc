@@ -0,0 +1,276 @@
+// Memcached tile cache test
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/*  Starts a private memcached with "memcached -p <port>" and checks MemcachedTileCache
+    against it:
+
+      - tiles stored with insert() come back through getObjects() in a single mget,
+        in the order asked for and with the same contents, and missing tiles are empty
+
+      - values that are not the tile asked for are rejected by decode(): a value written
+        for another image whose path has the same hash, a value from another layout
+        version, a truncated value, and a tile older than its image
+
+    Build with "make memcachedtest" and run as:
+
+      memcachedtest [port]
+
+    The port defaults to MEMCACHEDTEST_PORT. The memcached binary is taken from the
+    MEMCACHED environment variable, or found on the PATH. Exits with 0 if all checks
+    pass, 1 if any fail, and 77, which automake treats as a skipped test, if memcached
+    cannot be started or iipsrv was built without libmemcached.
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <thread>
+
+#include "MemcachedTileCache.h"
+
+#if defined(HAVE_MEMCACHED) && !defined(WIN32)
+#include <signal.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#endif
+
+
+using namespace std;
+
+
+/// Default port for our memcached
+#define MEMCACHEDTEST_PORT 21211
+
+/// Time in milliseconds to wait for memcached to start or for tiles to be stored
+#define MEMCACHEDTEST_WAIT 5000
+
+/// Exit status for a test that cannot be run
+#define MEMCACHEDTEST_SKIP 77
+
+
+
+#if defined(HAVE_MEMCACHED) && !defined(WIN32)
+
+
+/// Number of checks that failed
+static unsigned int failures = 0;
+
+
+/// Report a check
+static void check( bool ok, const char* what ){
+  printf( "%s: %s\n", ok ? "PASS" : "FAIL", what );
+  if( !ok ) failures++;
+}
+
+
+
+/// Access to the memcached keys of MemcachedTileCache
+class MemcachedTileCacheTest {
+
+ public:
+
+  /// Return the memcached key of a tile
+  static string name( const TileKey& key ){
+    return MemcachedTileCache::name( TileKey::path( key.image ), key.resolution, key.tile,
+				     key.hSequence, key.vSequence, key.compression, key.quality );
+  }
+
+};
+
+
+
+/// Make a tile filled with a value
+static RawTilePtr tile( const string& path, int number, unsigned char fill, time_t timestamp ){
+  RawTilePtr t( new RawTile( number, 3, 0, 0, 256, 256, 3, 8 ) );
+  t->filename = path;
+  t->imageId = TileKey::intern( path );
+  t->compressionType = JPEG;
+  t->quality = 75;
+  t->timestamp = timestamp;
+  t->dataLength = 1000 + number;
+  t->data = new unsigned char[t->dataLength];
+  memset( t->data, fill, t->dataLength );
+  return t;
+}
+
+
+/// Return the key of a tile
+static TileKey key( const RawTilePtr& t ){
+  return TileKey( t->imageId, t->resolution, t->tileNum, t->hSequence,
+		  t->vSequence, t->compressionType, t->quality );
+}
+
+
+/// Whether a tile fetched is the same as the one stored
+static bool same( const RawTilePtr& a, const RawTilePtr& b ){
+  return a && b && a->tileNum == b->tileNum && a->resolution == b->resolution &&
+    a->compressionType == b->compressionType && a->quality == b->quality &&
+    a->width == b->width && a->height == b->height && a->channels == b->channels &&
+    a->bpc == b->bpc && a->timestamp == b->timestamp && a->filename == b->filename &&
+    a->dataLength == b->dataLength && memcmp( a->data, b->data, a->dataLength ) == 0;
+}
+
+
+/// Fetch a single tile
+static RawTilePtr fetch( MemcachedTileCache& cache, const TileKey& k, time_t timestamp ){
+  return cache.getObjects( vector<TileKey>( 1, k ), timestamp )[0];
+}
+
+
+/// Change the value stored for a tile directly in memcached
+/** @param edit function given the value, which it modifies in place
+    @return whether the value was read and written back
+ */
+template <class Edit> static bool rewrite( memcached_st* memc, const TileKey& k, Edit edit ){
+  string name = MemcachedTileCacheTest::name( k );
+  size_t length;
+  uint32_t flags;
+  memcached_return_t rc;
+  char* value = memcached_get( memc, name.data(), name.size(), &length, &flags, &rc );
+  if( !value ) return false;
+  string v( value, length );
+  free( value );
+  edit( v );
+  return memcached_set( memc, name.data(), name.size(), v.data(), v.size(), 0, 0 ) == MEMCACHED_SUCCESS;
+}
+
+
+
+int main( int argc, char *argv[] ){
+
+  unsigned int port = ( argc > 1 ) ? atoi( argv[1] ) : MEMCACHEDTEST_PORT;
+  if( port == 0 || port > 65535 ){
+    fprintf( stderr, "Usage: %s [port]\n", argv[0] );
+    return 1;
+  }
+
+  const char* binary = getenv( "MEMCACHED" ) ? getenv( "MEMCACHED" ) : "memcached";
+  char p[16];
+  snprintf( p, 16, "%u", port );
+
+  // Start our own memcached, listening only locally
+  pid_t pid = fork();
+  if( pid < 0 ){
+    perror( "fork" );
+    return MEMCACHEDTEST_SKIP;
+  }
+  if( pid == 0 ){
+    execlp( binary, binary, "-p", p, "-U", "0", "-l", "127.0.0.1", (char*) NULL );
+    _exit( 127 );
+  }
+
+  // A plain connection to check that memcached is up and to reach values directly
+  memcached_st* memc = memcached_create( NULL );
+  memcached_server_add( memc, "127.0.0.1", port );
+
+  bool up = false;
+  for( int n = 0; n < MEMCACHEDTEST_WAIT / 50 && !up; n++ ){
+    int status;
+    if( waitpid( pid, &status, WNOHANG ) == pid ) break;
+    up = ( memcached_set( memc, "memcachedtest", 13, "1", 1, 0, 0 ) == MEMCACHED_SUCCESS );
+    if( !up ) this_thread::sleep_for( chrono::milliseconds( 50 ) );
+  }
+
+  if( !up ){
+    fprintf( stderr, "Unable to start '%s -p %s'\n", binary, p );
+    memcached_free( memc );
+    kill( pid, SIGTERM );
+    waitpid( pid, NULL, 0 );
+    return MEMCACHEDTEST_SKIP;
+  }
+
+  {
+    MemcachedTileCache cache( string( "127.0.0.1:" ) + p, 60 );
+    check( cache.connected(), "connected" );
+
+    time_t timestamp = 1700000000;
+    vector<RawTilePtr> tiles;
+    for( int n = 0; n < 4; n++ ) tiles.push_back( tile( "/images/test.tif", n, 10 + n, timestamp ) );
+
+    // Stores are made in the background
+    for( size_t n = 0; n < tiles.size(); n++ ) cache.insert( tiles[n] );
+    for( int n = 0; n < MEMCACHEDTEST_WAIT / 10 && cache.getStores() < tiles.size(); n++ ){
+      this_thread::sleep_for( chrono::milliseconds( 10 ) );
+    }
+    check( cache.getStores() == tiles.size(), "insert stores every tile" );
+
+    // Ask in a different order to the one stored, with a tile that was never stored
+    RawTilePtr missing = tile( "/images/test.tif", 99, 0, timestamp );
+    vector<TileKey> keys;
+    keys.push_back( key( tiles[2] ) );
+    keys.push_back( key( missing ) );
+    keys.push_back( key( tiles[0] ) );
+    keys.push_back( key( tiles[3] ) );
+    keys.push_back( key( tiles[1] ) );
+    vector<RawTilePtr> found = cache.getObjects( keys, timestamp );
+    check( found.size() == keys.size(), "getObjects returns one result per key" );
+    check( same( found[0], tiles[2] ) && same( found[2], tiles[0] ) &&
+	   same( found[3], tiles[3] ) && same( found[4], tiles[1] ), "getObjects returns the tiles stored in order" );
+    check( !found[1], "getObjects returns nothing for a tile never stored" );
+    check( found[0] && found[0]->imageId == tiles[2]->imageId, "tiles fetched carry their image id" );
+    check( cache.getHits() == 4 && cache.getMisses() == 1, "hits and misses are counted" );
+
+    // Timestamp: the image has changed since the tile was stored
+    check( !fetch( cache, key( tiles[0] ), timestamp + 1 ), "decode rejects a tile older than its image" );
+    check( same( fetch( cache, key( tiles[0] ), timestamp ), tiles[0] ), "decode accepts a tile as new as its image" );
+
+    // Version: the layout version follows the magic number
+    bool written = rewrite( memc, key( tiles[1] ), []( string& v ){
+      uint32_t version;
+      memcpy( &version, &v[4], 4 );
+      version++;
+      memcpy( &v[4], &version, 4 );
+    } );
+    check( written && !fetch( cache, key( tiles[1] ), timestamp ), "decode rejects another layout version" );
+
+    // Collision: a different path of the same length under the same key, as if its hash matched.
+    // The path follows the header and is followed by the tile data
+    size_t path = tiles[2]->filename.size() + tiles[2]->dataLength;
+    written = rewrite( memc, key( tiles[2] ), [path]( string& v ){ v[v.size() - path + 1] ^= 1; } );
+    check( written && !fetch( cache, key( tiles[2] ), timestamp ), "decode rejects a tile of another image with the same key" );
+
+    // Truncation
+    written = rewrite( memc, key( tiles[3] ), []( string& v ){ v.resize( v.size() - 1 ); } );
+    check( written && !fetch( cache, key( tiles[3] ), timestamp ), "decode rejects a truncated value" );
+  }
+
+  memcached_free( memc );
+  kill( pid, SIGTERM );
+  waitpid( pid, NULL, 0 );
+
+  printf( "%s\n", failures ? "FAILED" : "All checks passed" );
+  return failures ? 1 : 0;
+}
+
+
+#else
+
+
+int main( int argc, char *argv[] ){
+  fprintf( stderr, "iipsrv was built without libmemcached\n" );
+  return MEMCACHEDTEST_SKIP;
+}
+
+
+#endif
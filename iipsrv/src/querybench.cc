@@ -0,0 +1,329 @@
+// Query parsing and command dispatch benchmark
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/*  Measures the time taken to split typical query strings into their commands and
+    arguments and to create the task for each command, in the way Main.cc and
+    Task::factory used to do it and in the way they do it now:
+
+      old: the query is split with Tokenizer into a list of string pairs, each command
+           is lower-cased into a copy and compared with each name in turn, and tasks
+           are allocated on the heap
+
+      new: the query is split in place into pointer and length pairs held in an Arena,
+           commands are matched by length and, for three letter names, as a single
+           packed integer, and tasks are allocated in the Arena
+
+    The task classes themselves would bring in the whole server, so each command is
+    stood in for by an empty task of the same shape. The image is not opened and the
+    tasks are not run, so only the overhead of handling the query is measured.
+
+    Build with "make querybench" and run as:
+
+      querybench [iterations]
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cctype>
+#include <string>
+#include <list>
+#include <utility>
+#include <algorithm>
+#include <chrono>
+
+#include "Arena.h"
+#include "Tokenizer.h"
+
+
+using namespace std;
+
+
+/// Default number of times each query is handled
+#define QUERYBENCH_ITERATIONS 1000000
+
+
+/// Where results are stored so that the work is not optimised away
+static volatile unsigned long sink;
+
+
+/// Typical queries from IIP, Zoomify, DeepZoom and IIIF clients
+static const char* queries[] = {
+  "FIF=/images/slides/specimen.tif&JTL=5,132",
+  "FIF=/images/slides/specimen.tif&SDS=0,90&CNT=1.0&QLT=85&WID=1024&HEI=768&RGN=0.1,0.2,0.3,0.4&CVT=jpeg",
+  "FIF=/images/slides/specimen.tif&obj=IIP,1.0&obj=Max-size&obj=Tile-size&obj=Resolution-number",
+  "Zoomify=/images/slides/specimen.tif/TileGroup0/4-3-7.jpg",
+  "DeepZoom=/images/slides/specimen.tif_files/14/12_9.jpg",
+  "IIIF=/images/slides/specimen.tif/2048,1024,512,512/256,/0/default.jpg",
+  NULL
+};
+
+
+/// Stand in for a command's task
+class BenchTask {
+ public:
+  virtual ~BenchTask() {};
+  virtual int id() = 0;
+  static void* operator new( size_t size ){ return ::operator new( size ); };
+  static void* operator new( size_t size, Arena& arena ){ return arena.allocate( size ); };
+  static void operator delete( void* p ){ ::operator delete( p ); };
+  static void operator delete( void*, Arena& ){};
+};
+
+template <int N> class Command : public BenchTask {
+ public:
+  int id(){ return N; };
+};
+
+
+
+/// Task::factory before: lower-case a copy of the command and compare it with each name
+static BenchTask* factory_old( const string& t ){
+
+  string type = t;
+  transform( type.begin(), type.end(), type.begin(), ::tolower );
+
+  if( type == "obj" ) return new Command<0>;
+  else if( type == "fif" ) return new Command<1>;
+  else if( type == "qlt" ) return new Command<2>;
+  else if( type == "sds" ) return new Command<3>;
+  else if( type == "minmax" ) return new Command<4>;
+  else if( type == "cnt" ) return new Command<5>;
+  else if( type == "gam" ) return new Command<6>;
+  else if( type == "wid" ) return new Command<7>;
+  else if( type == "hei" ) return new Command<8>;
+  else if( type == "rgn" ) return new Command<9>;
+  else if( type == "rot" ) return new Command<10>;
+  else if( type == "til" ) return new Command<11>;
+  else if( type == "jtl" ) return new Command<12>;
+  else if( type == "jtls" ) return new Command<13>;
+  else if( type == "icc" ) return new Command<14>;
+  else if( type == "cvt" ) return new Command<15>;
+  else if( type == "shd" ) return new Command<16>;
+  else if( type == "cmp" ) return new Command<17>;
+  else if( type == "inv" ) return new Command<18>;
+  else if( type == "zoomify" ) return new Command<19>;
+  else if( type == "spectra" ) return new Command<20>;
+  else if( type == "pfl" ) return new Command<21>;
+  else if( type == "lyr" ) return new Command<22>;
+  else if( type == "deepzoom" ) return new Command<23>;
+  else if( type == "ctw" ) return new Command<24>;
+  else if( type == "iiif" ) return new Command<25>;
+  else if( type == "stats" ) return new Command<26>;
+  else return NULL;
+}
+
+
+
+/// Case insensitive comparison with a lower case name, as in Task.cc
+static inline bool matches( const char* type, const char* name, size_t length ){
+  for( size_t i = 0; i < length; i++ ){
+    if( tolower( (unsigned char) type[i] ) != name[i] ) return false;
+  }
+  return true;
+}
+
+#define COMMAND3( a, b, c ) ( ((a) << 16) | ((b) << 8) | (c) )
+
+
+/// Task::factory now: switch on the length of the name and then on the name itself
+static BenchTask* factory_new( const char* type, size_t length, Arena& arena ){
+
+  switch( length ){
+
+  case 3:
+    switch( COMMAND3( tolower( (unsigned char) type[0] ),
+		      tolower( (unsigned char) type[1] ),
+		      tolower( (unsigned char) type[2] ) ) ){
+      case COMMAND3( 'o', 'b', 'j' ): return new (arena) Command<0>;
+      case COMMAND3( 'f', 'i', 'f' ): return new (arena) Command<1>;
+      case COMMAND3( 'q', 'l', 't' ): return new (arena) Command<2>;
+      case COMMAND3( 's', 'd', 's' ): return new (arena) Command<3>;
+      case COMMAND3( 'c', 'n', 't' ): return new (arena) Command<5>;
+      case COMMAND3( 'g', 'a', 'm' ): return new (arena) Command<6>;
+      case COMMAND3( 'w', 'i', 'd' ): return new (arena) Command<7>;
+      case COMMAND3( 'h', 'e', 'i' ): return new (arena) Command<8>;
+      case COMMAND3( 'r', 'g', 'n' ): return new (arena) Command<9>;
+      case COMMAND3( 'r', 'o', 't' ): return new (arena) Command<10>;
+      case COMMAND3( 't', 'i', 'l' ): return new (arena) Command<11>;
+      case COMMAND3( 'j', 't', 'l' ): return new (arena) Command<12>;
+      case COMMAND3( 'i', 'c', 'c' ): return new (arena) Command<14>;
+      case COMMAND3( 'c', 'v', 't' ): return new (arena) Command<15>;
+      case COMMAND3( 's', 'h', 'd' ): return new (arena) Command<16>;
+      case COMMAND3( 'c', 'm', 'p' ): return new (arena) Command<17>;
+      case COMMAND3( 'i', 'n', 'v' ): return new (arena) Command<18>;
+      case COMMAND3( 'p', 'f', 'l' ): return new (arena) Command<21>;
+      case COMMAND3( 'l', 'y', 'r' ): return new (arena) Command<22>;
+      case COMMAND3( 'c', 't', 'w' ): return new (arena) Command<24>;
+      default: return NULL;
+    }
+
+  case 4:
+    if( matches( type, "jtls", 4 ) ) return new (arena) Command<13>;
+    if( matches( type, "iiif", 4 ) ) return new (arena) Command<25>;
+    return NULL;
+
+  case 5:
+    if( matches( type, "stats", 5 ) ) return new (arena) Command<26>;
+    return NULL;
+
+  case 6:
+    if( matches( type, "minmax", 6 ) ) return new (arena) Command<4>;
+    return NULL;
+
+  case 7:
+    if( matches( type, "zoomify", 7 ) ) return new (arena) Command<19>;
+    if( matches( type, "spectra", 7 ) ) return new (arena) Command<20>;
+    return NULL;
+
+  case 8:
+    if( matches( type, "deepzoom", 8 ) ) return new (arena) Command<23>;
+    return NULL;
+
+  default:
+    return NULL;
+  }
+}
+
+
+
+/// Handle a query as Main.cc used to
+/** @return sum of the task ids and argument lengths, so that nothing is optimised away */
+static unsigned long handle_old( const string& request_string ){
+
+  unsigned long sum = 0;
+
+  list < pair<string,string> > requests;
+  list < pair<string,string> > :: const_iterator commands;
+
+  Tokenizer izer( request_string, "&" );
+  while( izer.hasMoreTokens() ){
+    pair <string,string> p;
+    string token = izer.nextToken();
+    int n = token.find_first_of( "=" );
+    p.first = token.substr( 0, n );
+    p.second = token.substr( n+1, token.length() );
+    if( p.first.length() && p.second.length() ) requests.push_back( p );
+  }
+
+  for( commands = requests.begin(); commands != requests.end(); commands++ ){
+    string command = (*commands).first;
+    string argument = (*commands).second;
+    BenchTask* task = factory_old( command );
+    if( task ){
+      sum += task->id() + argument.length();
+      delete task;
+    }
+  }
+
+  return sum;
+}
+
+
+
+/// Handle a query as Main.cc does now
+/** @return sum of the task ids and argument lengths, so that nothing is optimised away */
+static unsigned long handle_new( const string& request_string, Arena& arena ){
+
+  unsigned long sum = 0;
+
+  struct Pair {
+    const char* command;
+    size_t length;
+    const char* argument;
+    size_t argument_length;
+  };
+
+  const char* query = request_string.data();
+  const char* end = query + request_string.length();
+  Pair* pairs = static_cast<Pair*>( arena.allocate( ( count( query, end, '&' ) + 1 ) * sizeof(Pair) ) );
+  size_t requests = 0;
+
+  for( const char* p = query; p < end; ){
+    const char* next = static_cast<const char*>( memchr( p, '&', end - p ) );
+    if( !next ) next = end;
+    const char* eq = static_cast<const char*>( memchr( p, '=', next - p ) );
+    Pair& pair = pairs[requests];
+    pair.command = p;
+    pair.length = ( eq ? eq : next ) - p;
+    pair.argument = eq ? eq + 1 : p;
+    pair.argument_length = next - pair.argument;
+    if( pair.length && pair.argument_length ) requests++;
+    p = next + 1;
+  }
+
+  string argument;
+  for( size_t n = 0; n < requests; n++ ){
+    argument.assign( pairs[n].argument, pairs[n].argument_length );
+    BenchTask* task = factory_new( pairs[n].command, pairs[n].length, arena );
+    if( task ){
+      sum += task->id() + argument.length();
+      task->~BenchTask();
+    }
+  }
+
+  arena.reset();
+  return sum;
+}
+
+
+
+int main( int argc, char *argv[] ){
+
+  unsigned long iterations = ( argc > 1 ) ? strtoul( argv[1], NULL, 10 ) : QUERYBENCH_ITERATIONS;
+
+  if( iterations == 0 ){
+    fprintf( stderr, "Usage: %s [iterations]\n", argv[0] );
+    return 1;
+  }
+
+  printf( "%lu iterations per query\n\n", iterations );
+  printf( "%-48s %10s %10s %8s\n", "query", "old ns", "new ns", "speedup" );
+
+  Arena arena;
+
+  for( unsigned int q = 0; queries[q]; q++ ){
+
+    const string query = queries[q];
+
+    // Both must see the same commands and arguments
+    if( handle_old( query ) != handle_new( query, arena ) ){
+      fprintf( stderr, "Results differ for %s\n", queries[q] );
+      return 1;
+    }
+
+    unsigned long sum = 0;
+
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+    for( unsigned long i = 0; i < iterations; i++ ) sum += handle_old( query );
+    double old_ns = chrono::duration<double, nano>( chrono::steady_clock::now() - begin ).count() / iterations;
+
+    begin = chrono::steady_clock::now();
+    for( unsigned long i = 0; i < iterations; i++ ) sum += handle_new( query, arena );
+    double new_ns = chrono::duration<double, nano>( chrono::steady_clock::now() - begin ).count() / iterations;
+
+    string name = query.substr( 0, 45 ) + ( query.length() > 45 ? "..." : "" );
+    printf( "%-48s %10.1f %10.1f %7.2fx\n", name.c_str(), old_ns, new_ns, old_ns / new_ns );
+    sink = sum;
+  }
+
+  return 0;
+}
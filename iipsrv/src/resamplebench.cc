@@ -0,0 +1,139 @@
+// Resampling filter benchmark
+
+/*  IIP Image Server
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 3 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software Foundation,
+    Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+*/
+
+
+/*  Measures the time taken by the nearest neighbour, bilinear and area average filters
+    to reduce 8 bit RGB images of several sizes, as CVT and IIIF do for INTERPOLATION 0, 1
+    and 2, and how well each avoids aliasing. The input is made of one pixel wide black
+    and white stripes, which any reduction should turn into a flat grey of 127.5: the
+    deviation reported is the mean absolute difference of the output from this.
+
+    Build with "make resamplebench" and run as:
+
+      resamplebench [iterations]
+*/
+
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+
+#include "Transforms.h"
+
+
+using namespace std;
+
+
+/// Default number of times each reduction is timed
+#define RESAMPLEBENCH_ITERATIONS 5
+
+/// Number of channels of the input
+#define RESAMPLEBENCH_CHANNELS 3
+
+
+/// Reductions measured: input width and height, then output width and height
+static const unsigned int sizes[][4] = {
+  { 1024, 1024, 512, 512 },
+  { 2048, 2048, 512, 512 },
+  { 4096, 4096, 512, 512 },
+  { 8192, 8192, 500, 500 },
+  { 0, 0, 0, 0 }
+};
+
+
+/// The filters compared
+typedef void (*Filter)( RawTilePtr&, unsigned int, unsigned int );
+
+static const struct {
+  const char* name;
+  Filter filter;
+} filters[] = {
+  { "nearest", filter_interpolate_nearestneighbour },
+  { "bilinear", filter_interpolate_bilinear },
+  { "area", filter_interpolate_area },
+  { NULL, NULL }
+};
+
+
+
+/// Make a tile of vertical one pixel stripes, alternately black and white
+static RawTilePtr stripes( unsigned int width, unsigned int height ){
+  RawTilePtr tile( new RawTile( 0, 0, 0, 0, width, height, RESAMPLEBENCH_CHANNELS, 8 ) );
+  tile->dataLength = width * height * RESAMPLEBENCH_CHANNELS;
+  unsigned char* data = new unsigned char[tile->dataLength];
+  for( unsigned int j = 0; j < height; j++ ){
+    for( unsigned int i = 0; i < width; i++ ){
+      memset( &data[ (j*width + i) * RESAMPLEBENCH_CHANNELS ], ( i % 2 ) ? 255 : 0, RESAMPLEBENCH_CHANNELS );
+    }
+  }
+  tile->data = data;
+  return tile;
+}
+
+
+
+/// Mean absolute difference of a tile from flat grey
+static double deviation( const RawTilePtr& tile ){
+  const unsigned char* data = (const unsigned char*) tile->data;
+  double sum = 0.0;
+  for( int n = 0; n < tile->dataLength; n++ ) sum += fabs( data[n] - 127.5 );
+  return tile->dataLength ? sum / tile->dataLength : 0.0;
+}
+
+
+
+int main( int argc, char *argv[] ){
+
+  unsigned int iterations = ( argc > 1 ) ? atoi( argv[1] ) : RESAMPLEBENCH_ITERATIONS;
+
+  if( iterations == 0 ){
+    fprintf( stderr, "Usage: %s [iterations]\n", argv[0] );
+    return 1;
+  }
+
+  printf( "%u iterations, %d channels, times in ms\n\n", iterations, RESAMPLEBENCH_CHANNELS );
+  printf( "%-22s %-10s %10s %10s\n", "reduction", "filter", "time", "deviation" );
+
+  for( unsigned int s = 0; sizes[s][0]; s++ ){
+
+    RawTilePtr input = stripes( sizes[s][0], sizes[s][1] );
+    char reduction[64];
+    snprintf( reduction, 64, "%ux%u -> %ux%u", sizes[s][0], sizes[s][1], sizes[s][2], sizes[s][3] );
+
+    for( unsigned int f = 0; filters[f].name; f++ ){
+
+      double elapsed = 0.0, error = 0.0;
+
+      for( unsigned int n = 0; n < iterations; n++ ){
+	// The filters replace the tile they are given, so each needs its own copy
+	RawTilePtr tile( new RawTile( *input ) );
+	chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+	filters[f].filter( tile, sizes[s][2], sizes[s][3] );
+	elapsed += chrono::duration<double, milli>( chrono::steady_clock::now() - begin ).count();
+	error = deviation( tile );
+      }
+
+      printf( "%-22s %-10s %10.1f %10.1f\n", f ? "" : reduction, filters[f].name, elapsed / iterations, error );
+    }
+  }
+
+  return 0;
+}
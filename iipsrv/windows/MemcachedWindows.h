@@ -109,7 +109,7 @@ class Memcache {
       @param data pointer to the data to be stored
       @param length length of data to be stored
   */
-  void store( const std::string& key, void* data, unsigned int length ){
+  void store( const std::string& key, const void* data, unsigned int length ){
 
     if( !_connected ) return;
 